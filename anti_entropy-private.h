@@ -0,0 +1,78 @@
+/*
+ * File:   anti_entropy-private.h
+ *
+ * Define a estrutura da anti-entropia entre servidores.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _ANTI_ENTROPY_PRIVATE_H
+#define _ANTI_ENTROPY_PRIVATE_H
+
+#include <pthread.h>
+#include "entry.h"
+#include "remote_table.h"
+#include "anti_entropy.h"
+
+/* Intervalo (ms) entre rondas por omissão. */
+#define AENTROPY_INTERVAL 1000
+
+/*
+ * Folhas diferentes trocadas em cada ronda, no máximo: cada uma obriga o
+ * outro servidor a percorrer a sua tabela, e as restantes ficam para as
+ * rondas seguintes.
+ */
+#define AENTROPY_MAX_LEAVES 64
+
+/*
+ * Define a anti-entropia de um servidor.
+ *
+ * struct rtable_t **peers => os outros servidores
+ * int *connected => 1 se a ligação ao servidor i já foi feita
+ * int *views => a vista da árvore local comparada com o servidor i (o seu
+ *               índice no anel, ou MERKLE_ALL sem chaves repartidas)
+ * int self => a vista pedida aos outros servidores (o índice deste)
+ * int numPeers => quantos são
+ * int next => o servidor da próxima ronda
+ * long interval => intervalo (ms) entre rondas
+ * pthread_t thread => o fio das rondas
+ * pthread_mutex_t lock, pthread_cond_t wakeup => para acordar o fio quando
+ *                                               deve parar
+ * int stopping => 1 quando o fio deve terminar
+ */
+struct aentropy_t {
+    struct rtable_t **peers;
+    int *connected;
+    int *views;
+    int self;
+    int numPeers;
+    int next;
+    long interval;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int stopping;
+};
+
+/*
+ * Fio da anti-entropia (arg é o aentropy_t).
+ */
+void *aentropy_run(void *arg);
+
+/*
+ * Uma ronda com o servidor peer: junta em leaves (no máximo
+ * AENTROPY_MAX_LEAVES) as folhas que diferem entre a vista view da árvore
+ * de Merkle local e a vista remoteView da de peer, descendo a partir da
+ * raiz só pelos nós diferentes.
+ * Retorna o número de folhas ou -1 em caso de erro.
+ */
+int aentropy_diff(struct rtable_t *peer, int view, int remoteView, int *leaves);
+
+/*
+ * Troca com peer as entradas da folha leaf das mesmas vistas: escreve aqui
+ * as mais recentes de peer e envia-lhe as mais recentes daqui.
+ * Retorna o número de entradas trocadas ou -1 em caso de erro.
+ */
+int aentropy_exchange(struct rtable_t *peer, int view, int remoteView, int leaf);
+
+#endif
@@ -0,0 +1,389 @@
+/*
+ * File:   anti_entropy.c
+ *
+ * Anti-entropia entre servidores: um fio compara periodicamente a árvore de
+ * Merkle da tabela local com a de outro servidor, descendo da raiz só pelos
+ * nós cujos hashes diferem, e troca as entradas das folhas diferentes. As
+ * réplicas que perderam escritas (e.g. porque estavam em baixo) convergem
+ * assim sem depender da reparação feita nas leituras dos clientes.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <time.h>
+#include "utils.h"
+#include "data.h"
+#include "entry.h"
+#include "merkle.h"
+#include "hash_ring.h"
+#include "table_skel.h"
+#include "remote_table.h"
+#include "anti_entropy.h"
+#include "anti_entropy-private.h"
+
+/* Ordena os endereços */
+static int aentropy_compare_names(const void *a, const void *b) {
+
+    return strcmp(*(char * const *) a, *(char * const *) b);
+
+}
+
+/* Índice de name em names (ordenados), ou -1 */
+static int aentropy_index(char **names, int n, char *name) {
+
+    char **found = bsearch(&name, names, n, sizeof(char *), aentropy_compare_names);
+
+    return found ? (int) (found - names) : -1;
+
+}
+
+/*
+ * Mantém a árvore de Merkle da tabela e escolhe as vistas de ae: com as
+ * chaves repartidas, os índices no anel dos n servidores peers e de self.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int aentropy_views(struct aentropy_t *ae, char **peers, int n, char *self, int replicas) {
+
+    struct hring_t *ring = NULL;
+    char **names;
+    int i;
+
+    if(self == NULL || replicas <= 0 || replicas >= n + 1) {
+        ae->self = MERKLE_ALL;
+        for(i = 0; i < n; i++) {
+            ae->views[i] = MERKLE_ALL;
+        }
+        return table_skel_use_merkle(NULL, 0, 0);
+    }
+
+    // O índice de cada servidor no anel é a sua posição por ordem
+    // alfabética, igual em todos os servidores com a mesma lista
+    if((names = (char **) malloc(sizeof(char *) * (n + 1))) == NULL) {
+        ERROR("malloc names");
+        return -1;
+    }
+    memcpy(names, peers, sizeof(char *) * n);
+    names[n] = self;
+    qsort(names, n + 1, sizeof(char *), aentropy_compare_names);
+    for(i = 0; i < n; i++) {
+        if(strcmp(names[i], names[i + 1]) == 0) {
+            LOG_ERROR("anti_entropy: servidor repetido: %s", names[i]);
+            free(names);
+            return -1;
+        }
+    }
+    ae->self = aentropy_index(names, n + 1, self);
+    for(i = 0; i < n; i++) {
+        ae->views[i] = aentropy_index(names, n + 1, peers[i]);
+    }
+    if((ring = hring_create((const char **) names, n + 1, HRING_VNODES)) == NULL ||
+       table_skel_use_merkle(ring, replicas, ae->self) != 0) {
+        ERROR("hring_create or table_skel_use_merkle");
+        hring_destroy(ring);
+        free(names);
+        return -1;
+    }
+    free(names);
+    return 0;
+
+}
+
+/*
+ * Lança o fio da anti-entropia com os n servidores peers.
+ * Retorna NULL em caso de erro.
+ */
+struct aentropy_t *aentropy_start(char **peers, int n, char *self, int replicas, long interval) {
+
+    struct aentropy_t *ae;
+    pthread_condattr_t attr;
+    int i;
+
+    if(peers == NULL || n <= 0) {
+        ERROR("NULL peers or n <= 0");
+        return NULL;
+    }
+    if((ae = (struct aentropy_t *) calloc(1, sizeof(struct aentropy_t))) == NULL ||
+       (ae->peers = (struct rtable_t **) calloc(n, sizeof(struct rtable_t *))) == NULL ||
+       (ae->connected = (int *) calloc(n, sizeof(int))) == NULL ||
+       (ae->views = (int *) calloc(n, sizeof(int))) == NULL) {
+        ERROR("calloc ae");
+        if(ae) {
+            free(ae->connected);
+            free(ae->peers);
+        }
+        free(ae);
+        return NULL;
+    }
+    if(aentropy_views(ae, peers, n, self, replicas) != 0) {
+        ERROR("aentropy_views");
+        free(ae->views);
+        free(ae->connected);
+        free(ae->peers);
+        free(ae);
+        return NULL;
+    }
+    ae->numPeers = n;
+    ae->interval = interval > 0 ? interval : AENTROPY_INTERVAL;
+    for(i = 0; i < n; i++) {
+        if((ae->peers[i] = rtable_open(peers[i])) == NULL) {
+            LOG_ERROR("anti_entropy: endereco invalido: %s", peers[i]);
+            while(--i >= 0) {
+                rtable_disconnect(ae->peers[i]);
+            }
+            free(ae->views);
+            free(ae->connected);
+            free(ae->peers);
+            free(ae);
+            return NULL;
+        }
+    }
+
+    // Os prazos das esperas usam o relógio monótono
+    pthread_mutex_init(&ae->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ae->wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    if(pthread_create(&ae->thread, NULL, aentropy_run, ae) != 0) {
+        LOG_PERROR("pthread_create");
+        ae->thread = 0;
+        aentropy_stop(ae);
+        return NULL;
+    }
+    return ae;
+
+}
+
+/*
+ * Pára o fio (esperando pela ronda em curso) e liberta toda a memória.
+ */
+void aentropy_stop(struct aentropy_t *ae) {
+
+    int i;
+
+    if(ae == NULL) {
+        return;
+    }
+    if(ae->thread) {
+        pthread_mutex_lock(&ae->lock);
+        ae->stopping = 1;
+        pthread_cond_signal(&ae->wakeup);
+        pthread_mutex_unlock(&ae->lock);
+        pthread_join(ae->thread, NULL);
+    }
+    for(i = 0; i < ae->numPeers; i++) {
+        rtable_disconnect(ae->peers[i]);
+    }
+    pthread_mutex_destroy(&ae->lock);
+    pthread_cond_destroy(&ae->wakeup);
+    free(ae->views);
+    free(ae->connected);
+    free(ae->peers);
+    free(ae);
+
+}
+
+/*
+ * Fio da anti-entropia: uma ronda com um servidor de cada vez.
+ */
+void *aentropy_run(void *arg) {
+
+    struct aentropy_t *ae = (struct aentropy_t *) arg;
+    struct rtable_t *peer;
+    struct timespec until;
+    int leaves[AENTROPY_MAX_LEAVES], numLeaves, i, exchanged, result, index;
+
+    pthread_mutex_lock(&ae->lock);
+    while(!ae->stopping) {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += ae->interval / 1000;
+        until.tv_nsec += (ae->interval % 1000) * 1000000;
+        if(until.tv_nsec >= 1000000000) {
+            until.tv_sec ++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&ae->wakeup, &ae->lock, &until);
+        if(ae->stopping) {
+            break;
+        }
+        index = ae->next;
+        ae->next = (ae->next + 1) % ae->numPeers;
+        pthread_mutex_unlock(&ae->lock);
+
+        // Um servidor em baixo fica para a próxima volta
+        peer = ae->peers[index];
+        if(!ae->connected[index] && rtable_connect(peer) == 0) {
+            ae->connected[index] = 1;
+        }
+        if(ae->connected[index] && (numLeaves = aentropy_diff(peer, ae->views[index], ae->self, leaves)) > 0) {
+            exchanged = 0;
+            for(i = 0; i < numLeaves; i++) {
+                if((result = aentropy_exchange(peer, ae->views[index], ae->self, leaves[i])) == -1) {
+                    break;
+                }
+                exchanged += result;
+            }
+            LOG_INFO("anti_entropy: %d folhas diferentes, %d entradas trocadas", numLeaves, exchanged);
+        }
+
+        pthread_mutex_lock(&ae->lock);
+    }
+    pthread_mutex_unlock(&ae->lock);
+    return NULL;
+
+}
+
+/*
+ * Junta em leaves as folhas da vista view da árvore de Merkle que diferem
+ * das da vista remoteView de peer.
+ * Retorna o número de folhas ou -1 em caso de erro.
+ */
+int aentropy_diff(struct rtable_t *peer, int view, int remoteView, int *leaves) {
+
+    int nodes[MERKLE_FIRST_LEAF], numNodes = 1, numLeaves = 0, node, first, i;
+    struct data_t *remote, *local;
+
+    // Em profundidade: a pilha nunca tem mais que os nós internos
+    nodes[0] = 1;
+    while(numNodes > 0 && numLeaves < AENTROPY_MAX_LEAVES) {
+        node = nodes[--numNodes];
+        if((remote = rtable_get_merkle(peer, remoteView, node)) == NULL) {
+            return -1;
+        }
+        if((local = table_skel_get_merkle(view, node)) == NULL || local->datasize != remote->datasize) {
+            ERROR("table_skel_get_merkle");
+            data_destroy(remote);
+            data_destroy(local);
+            return -1;
+        }
+        first = merkle_first_child(node);
+        for(i = 0; i < local->datasize / 8; i++) {
+            if(merkle_hash_at(local, i) == merkle_hash_at(remote, i)) {
+                continue;
+            }
+            if(first + i < MERKLE_FIRST_LEAF) {
+                nodes[numNodes++] = first + i;
+            }
+            else if(numLeaves < AENTROPY_MAX_LEAVES) {
+                leaves[numLeaves++] = first + i;
+            }
+        }
+        data_destroy(remote);
+        data_destroy(local);
+    }
+    return numLeaves;
+
+}
+
+/* Ordena as entradas pela chave */
+static int aentropy_compare(const void *a, const void *b) {
+
+    return strcmp((*(struct entry_t * const *) a)->key, (*(struct entry_t * const *) b)->key);
+
+}
+
+/* 1 se a entrada é de uma chave apagada (não conta na árvore de Merkle) */
+static int aentropy_deleted(struct entry_t *entry) {
+
+    return entry->value->datasize == 0 ||
+           (entry->value->datasize == 1 && ((char *) entry->value->data)[0] == '0');
+
+}
+
+/* Número de entradas de um array terminado em NULL */
+static int aentropy_count(struct entry_t **entries) {
+
+    int count = 0;
+
+    while(entries[count]) {
+        count ++;
+    }
+    return count;
+
+}
+
+/*
+ * Troca com peer as entradas da folha leaf (das vistas view daqui e
+ * remoteView de peer, i.e. só as chaves que ambos guardam).
+ * Retorna o número de entradas trocadas ou -1 em caso de erro.
+ */
+int aentropy_exchange(struct rtable_t *peer, int view, int remoteView, int leaf) {
+
+    struct entry_t **remote, **local, **pull = NULL, **push = NULL;
+    int numRemote, numLocal, r = 0, l = 0, numPull = 0, numPush = 0, cmp, result = 0;
+
+    if((remote = rtable_get_merkle_entries(peer, remoteView, leaf)) == NULL) {
+        return -1;
+    }
+    if((local = table_skel_get_merkle_entries(view, leaf)) == NULL) {
+        entry_free_list(remote);
+        return -1;
+    }
+    numRemote = aentropy_count(remote);
+    numLocal = aentropy_count(local);
+    if((pull = (struct entry_t **) calloc(numRemote + 1, sizeof(struct entry_t *))) == NULL ||
+       (push = (struct entry_t **) calloc(numLocal + 1, sizeof(struct entry_t *))) == NULL) {
+        ERROR("calloc pull or push");
+        free(pull);
+        entry_free_list(remote);
+        entry_free_list(local);
+        return -1;
+    }
+
+    // Ordenadas, as duas listas percorrem-se juntas. Ganha o timestamp
+    // maior; uma chave apagada só de um lado não precisa de ir para o outro
+    qsort(remote, numRemote, sizeof(struct entry_t *), aentropy_compare);
+    qsort(local, numLocal, sizeof(struct entry_t *), aentropy_compare);
+    while(r < numRemote || l < numLocal) {
+        if(r == numRemote) {
+            cmp = 1;
+        }
+        else if(l == numLocal) {
+            cmp = -1;
+        }
+        else {
+            cmp = strcmp(remote[r]->key, local[l]->key);
+        }
+        if(cmp < 0) {
+            if(!aentropy_deleted(remote[r])) {
+                pull[numPull++] = remote[r];
+            }
+            r++;
+        }
+        else if(cmp > 0) {
+            if(!aentropy_deleted(local[l])) {
+                push[numPush++] = local[l];
+            }
+            l++;
+        }
+        else {
+            if(remote[r]->value->timestamp > local[l]->value->timestamp) {
+                pull[numPull++] = remote[r];
+            }
+            else if(local[l]->value->timestamp > remote[r]->value->timestamp) {
+                push[numPush++] = local[l];
+            }
+            r++;
+            l++;
+        }
+    }
+
+    if(numPull > 0 && table_skel_apply(pull) == -1) {
+        ERROR("table_skel_apply");
+        result = -1;
+    }
+    if(result != -1 && numPush > 0 && rtable_put_entries(peer, push) == -1) {
+        ERROR("rtable_put_entries");
+        result = -1;
+    }
+    if(result != -1) {
+        result = numPull + numPush;
+    }
+    free(pull);
+    free(push);
+    entry_free_list(remote);
+    entry_free_list(local);
+    return result;
+
+}
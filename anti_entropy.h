@@ -0,0 +1,29 @@
+#ifndef _ANTI_ENTROPY_H
+#define _ANTI_ENTROPY_H
+
+struct aentropy_t; /* Definida em anti_entropy-private.h */
+
+/*
+ * Lança o fio da anti-entropia do servidor: a cada interval milissegundos
+ * compara a árvore de Merkle da tabela local (ver table_skel_use_merkle())
+ * com a do próximo dos n servidores peers (endereços como em rtable_open(),
+ * à vez), descendo só pelos nós diferentes, e troca as entradas das folhas
+ * que diferem: as mais recentes do outro são escritas aqui e as mais
+ * recentes daqui são enviadas ao outro. Assim as réplicas convergem mesmo
+ * nas chaves que nenhum cliente volta a ler.
+ * Com as chaves repartidas pelos clientes (qtable_set_replicas(replicas),
+ * com 0 < replicas < n + 1), self é o endereço deste servidor e peers os
+ * dos outros, escritos como nas listas dos clientes, para se construir o
+ * mesmo anel: com cada servidor só se comparam e trocam as chaves que os
+ * dois guardam. Com self a NULL (ou replicas fora daquele intervalo) todos
+ * os servidores guardam todas as chaves.
+ * Retorna NULL em caso de erro.
+ */
+struct aentropy_t *aentropy_start(char **peers, int n, char *self, int replicas, long interval);
+
+/*
+ * Pára o fio (esperando pela ronda em curso) e liberta toda a memória.
+ */
+void aentropy_stop(struct aentropy_t *ae);
+
+#endif
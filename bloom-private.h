@@ -0,0 +1,45 @@
+/*
+ * File:   bloom-private.h
+ *
+ * Define a estrutura de um filtro de bloom.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _BLOOM_PRIVATE_H
+#define _BLOOM_PRIVATE_H
+
+#include <stdint.h>
+
+/*
+ * Define a estrutura de um filtro de bloom.
+ *
+ * int nbits => número de bits do filtro
+ * int nhashes => número de funções de hash (k)
+ * unsigned char *bits => o vector de bits
+ * unsigned char *counts => um contador por bit (NULL se o filtro não for de
+ *                          contagem); um contador saturado nunca decrementa
+ */
+struct bloom_t {
+    int nbits;
+    int nhashes;
+    unsigned char *bits;
+    unsigned char *counts;
+};
+
+/*
+ * Hash de 64 bits (FNV-1a) usado pelo filtro. As k posições são obtidas por
+ * double hashing com as duas metades deste valor.
+ */
+uint64_t bloom_hash(char *key);
+
+/*
+ * Variantes de bloom_add(), bloom_remove() e bloom_may_contain() para quem
+ * já calculou o bloom_hash() da chave (e.g., ao construir o filtro de uma
+ * SSTable).
+ */
+void bloom_add_hash(struct bloom_t *bloom, uint64_t h);
+void bloom_remove_hash(struct bloom_t *bloom, uint64_t h);
+int bloom_may_contain_hash(struct bloom_t *bloom, uint64_t h);
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * File:   bloom.c
+ *
+ * Implementação de um filtro de bloom, usado para responder a pesquisas de
+ * chaves inexistentes sem percorrer o índice principal.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <limits.h>
+#include "utils.h"
+#include "data.h"
+#include "bloom.h"
+#include "bloom-private.h"
+
+/*
+ * Cria um filtro de bloom dimensionado para n_keys chaves com bits_per_key
+ * bits por chave.
+ * Retorna NULL em caso de erro.
+ */
+struct bloom_t *bloom_create(int n_keys, int bits_per_key) {
+
+    struct bloom_t *bloom = NULL;
+
+    if(bits_per_key <= 0) {
+        bits_per_key = BLOOM_BITS_PER_KEY;
+    }
+    if((bloom = (struct bloom_t *) malloc(sizeof(struct bloom_t))) == NULL) {
+        ERROR("malloc bloom");
+        return NULL;
+    }
+
+    // Um mínimo de 64 bits evita uma taxa de falsos positivos absurda
+    // para filtros com muito poucas chaves.
+    bloom->nbits = (n_keys > 0 ? n_keys : 1) * bits_per_key;
+    if(bloom->nbits < 64) {
+        bloom->nbits = 64;
+    }
+    // k = ln(2) * bits por chave, arredondado e limitado a [1, 30]
+    bloom->nhashes = (int) (bits_per_key * 0.69);
+    if(bloom->nhashes < 1) {
+        bloom->nhashes = 1;
+    }
+    else if(bloom->nhashes > 30) {
+        bloom->nhashes = 30;
+    }
+
+    bloom->counts = NULL;
+    if((bloom->bits = (unsigned char *) calloc((bloom->nbits + 7) / 8, 1)) == NULL) {
+        ERROR("calloc bloom->bits");
+        free(bloom);
+        return NULL;
+    }
+    return bloom;
+
+}
+
+/*
+ * Como bloom_create(), mas o filtro guarda também um contador por bit e
+ * suporta bloom_remove() (usado para o índice de uma tabela mutável).
+ * Retorna NULL em caso de erro.
+ */
+struct bloom_t *bloom_create_counting(int n_keys, int bits_per_key) {
+
+    struct bloom_t *bloom = NULL;
+
+    if((bloom = bloom_create(n_keys, bits_per_key)) == NULL) {
+        return NULL;
+    }
+    if((bloom->counts = (unsigned char *) calloc(bloom->nbits, 1)) == NULL) {
+        ERROR("calloc bloom->counts");
+        bloom_destroy(bloom);
+        return NULL;
+    }
+    return bloom;
+
+}
+
+/*
+ * Liberta toda a memória do filtro.
+ */
+void bloom_destroy(struct bloom_t *bloom) {
+
+    if(bloom) {
+        free(bloom->bits);
+        free(bloom->counts);
+        free(bloom);
+    }
+
+}
+
+/*
+ * Adiciona a chave key ao filtro.
+ */
+void bloom_add(struct bloom_t *bloom, char *key) {
+
+    if(bloom == NULL || key == NULL) {
+        ERROR("NULL bloom or key");
+        return;
+    }
+    bloom_add_hash(bloom, bloom_hash(key));
+
+}
+
+/*
+ * Retira a chave key de um filtro criado por bloom_create_counting(). A
+ * chave tem de ter sido adicionada antes. Não faz nada noutros filtros.
+ */
+void bloom_remove(struct bloom_t *bloom, char *key) {
+
+    if(bloom == NULL || key == NULL) {
+        ERROR("NULL bloom or key");
+        return;
+    }
+    bloom_remove_hash(bloom, bloom_hash(key));
+
+}
+
+/*
+ * Retorna 0 se a chave key de certeza que não foi adicionada ao filtro e 1
+ * caso possa ter sido (ou em caso de erro).
+ */
+int bloom_may_contain(struct bloom_t *bloom, char *key) {
+
+    // Na dúvida nunca podemos dizer que a chave não existe
+    if(bloom == NULL || key == NULL) {
+        return 1;
+    }
+    return bloom_may_contain_hash(bloom, bloom_hash(key));
+
+}
+
+/*
+ * Serializa o filtro num bloco de dados (formato: nbits, nhashes, bits).
+ * Retorna NULL em caso de erro.
+ */
+struct data_t *bloom_to_data(struct bloom_t *bloom) {
+
+    struct data_t *data = NULL;
+    int nbytes;
+    uint32_t header[2];
+
+    if(bloom == NULL) {
+        ERROR("NULL bloom");
+        return NULL;
+    }
+
+    nbytes = (bloom->nbits + 7) / 8;
+    if((data = data_create(sizeof(header) + nbytes)) == NULL) {
+        ERROR("data_create");
+        return NULL;
+    }
+    header[0] = htonl((uint32_t) bloom->nbits);
+    header[1] = htonl((uint32_t) bloom->nhashes);
+    memcpy(data->data, header, sizeof(header));
+    memcpy((char *) data->data + sizeof(header), bloom->bits, nbytes);
+    return data;
+
+}
+
+/*
+ * Cria um filtro a partir de um bloco serializado por bloom_to_data().
+ * Retorna NULL em caso de erro.
+ */
+struct bloom_t *bloom_from_data(struct data_t *data) {
+
+    struct bloom_t *bloom = NULL;
+    uint32_t header[2];
+    int nbytes;
+
+    if(data == NULL || data->data == NULL || data->datasize < (int) sizeof(header)) {
+        ERROR("NULL ou data invalido");
+        return NULL;
+    }
+
+    memcpy(header, data->data, sizeof(header));
+    if((bloom = (struct bloom_t *) malloc(sizeof(struct bloom_t))) == NULL) {
+        ERROR("malloc bloom");
+        return NULL;
+    }
+    bloom->counts = NULL;
+    bloom->nbits = (int) ntohl(header[0]);
+    bloom->nhashes = (int) ntohl(header[1]);
+    nbytes = (bloom->nbits + 7) / 8;
+
+    // Um bloco truncado ou corrompido não pode ser usado
+    if(bloom->nbits <= 0 || bloom->nhashes <= 0 ||
+       data->datasize - (int) sizeof(header) != nbytes) {
+        ERROR("bloom corrompido");
+        free(bloom);
+        return NULL;
+    }
+    if((bloom->bits = (unsigned char *) malloc(nbytes)) == NULL) {
+        ERROR("malloc bloom->bits");
+        free(bloom);
+        return NULL;
+    }
+    memcpy(bloom->bits, (char *) data->data + sizeof(header), nbytes);
+    return bloom;
+
+}
+
+/*
+ * Hash de 64 bits (FNV-1a) usado pelo filtro. As k posições são obtidas por
+ * double hashing com as duas metades deste valor.
+ */
+uint64_t bloom_hash(char *key) {
+
+    uint64_t h = 14695981039346656037ULL;
+
+    while(*key) {
+        h ^= (unsigned char) *key;
+        h *= 1099511628211ULL;
+        key++;
+    }
+    // Mistura final para espalhar os bits altos pelos baixos
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+
+}
+
+/*
+ * Variantes de bloom_add(), bloom_remove() e bloom_may_contain() para quem
+ * já calculou o bloom_hash() da chave (e.g., ao construir o filtro de uma
+ * SSTable).
+ */
+void bloom_add_hash(struct bloom_t *bloom, uint64_t h) {
+
+    uint64_t delta = (h >> 32) | 1;
+    uint32_t bit;
+    int i;
+
+    for(i = 0; i < bloom->nhashes; i++) {
+        bit = (uint32_t) (h % (uint64_t) bloom->nbits);
+        bloom->bits[bit / 8] |= (unsigned char) (1 << (bit % 8));
+        if(bloom->counts && bloom->counts[bit] < UCHAR_MAX) {
+            bloom->counts[bit]++;
+        }
+        h += delta;
+    }
+
+}
+
+void bloom_remove_hash(struct bloom_t *bloom, uint64_t h) {
+
+    uint64_t delta = (h >> 32) | 1;
+    uint32_t bit;
+    int i;
+
+    if(bloom->counts == NULL) {
+        return;
+    }
+    for(i = 0; i < bloom->nhashes; i++) {
+        bit = (uint32_t) (h % (uint64_t) bloom->nbits);
+        // Um contador saturado já não sabe quantas chaves representa
+        if(bloom->counts[bit] > 0 && bloom->counts[bit] < UCHAR_MAX &&
+           --bloom->counts[bit] == 0) {
+            bloom->bits[bit / 8] &= (unsigned char) ~(1 << (bit % 8));
+        }
+        h += delta;
+    }
+
+}
+
+int bloom_may_contain_hash(struct bloom_t *bloom, uint64_t h) {
+
+    uint64_t delta = (h >> 32) | 1;
+    uint32_t bit;
+    int i;
+
+    if(bloom == NULL) {
+        return 1;
+    }
+    for(i = 0; i < bloom->nhashes; i++) {
+        bit = (uint32_t) (h % (uint64_t) bloom->nbits);
+        if((bloom->bits[bit / 8] & (1 << (bit % 8))) == 0) {
+            return 0;
+        }
+        h += delta;
+    }
+    return 1;
+
+}
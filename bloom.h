@@ -0,0 +1,59 @@
+#ifndef _BLOOM_H
+#define _BLOOM_H
+
+#include "data.h"
+
+/* Número de bits por chave usado por omissão (~1% de falsos positivos). */
+#define BLOOM_BITS_PER_KEY 10
+
+struct bloom_t; /* Definida em bloom-private.h */
+
+/*
+ * Cria um filtro de bloom dimensionado para n_keys chaves com bits_per_key
+ * bits por chave.
+ * Retorna NULL em caso de erro.
+ */
+struct bloom_t *bloom_create(int n_keys, int bits_per_key);
+
+/*
+ * Como bloom_create(), mas o filtro guarda também um contador por bit e
+ * suporta bloom_remove() (usado para o índice de uma tabela mutável).
+ * Retorna NULL em caso de erro.
+ */
+struct bloom_t *bloom_create_counting(int n_keys, int bits_per_key);
+
+/*
+ * Liberta toda a memória do filtro.
+ */
+void bloom_destroy(struct bloom_t *bloom);
+
+/*
+ * Adiciona a chave key ao filtro.
+ */
+void bloom_add(struct bloom_t *bloom, char *key);
+
+/*
+ * Retira a chave key de um filtro criado por bloom_create_counting(). A
+ * chave tem de ter sido adicionada antes. Não faz nada noutros filtros.
+ */
+void bloom_remove(struct bloom_t *bloom, char *key);
+
+/*
+ * Retorna 0 se a chave key de certeza que não foi adicionada ao filtro e 1
+ * caso possa ter sido (ou em caso de erro).
+ */
+int bloom_may_contain(struct bloom_t *bloom, char *key);
+
+/*
+ * Serializa o filtro num bloco de dados (formato: nbits, nhashes, bits).
+ * Retorna NULL em caso de erro.
+ */
+struct data_t *bloom_to_data(struct bloom_t *bloom);
+
+/*
+ * Cria um filtro a partir de um bloco serializado por bloom_to_data().
+ * Retorna NULL em caso de erro.
+ */
+struct bloom_t *bloom_from_data(struct data_t *data);
+
+#endif
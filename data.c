@@ -34,6 +34,7 @@ struct data_t *data_create(int size) {
             //Inicializar a zona de memória a 0's para não termos reads invalidos ;)
             memset(new_data->data,0,size);
             new_data->timestamp = 0;
+            new_data->expires = 0;
         }
     }
     //No caso da data ser NULL
@@ -45,6 +46,7 @@ struct data_t *data_create(int size) {
         memcpy(new_data->data, "0", 1);
 		new_data->datasize = 1;
 		new_data->timestamp = 0;
+		new_data->expires = 0;
     }
     else {
         ERROR("data_create");
@@ -75,6 +77,7 @@ struct data_t *data_create2(int datasize, void *data) {
         newData->datasize = datasize;
         newData->data = data;
         newData->timestamp = 0;
+        newData->expires = 0;
     }
     else {
         ERROR("malloc newData");
@@ -102,11 +105,13 @@ struct data_t *data_dup(struct data_t *data) {
                 data_destroy(dup);
             }
             dup->timestamp = data->timestamp;
+            dup->expires = data->expires;
         }
         else {
             //Este data->data = NULL então fazemos o mesmo para o dup.
             dup->data = NULL;
             dup->timestamp = data->timestamp;
+            dup->expires = data->expires;
         }
     }
     else {
@@ -127,3 +132,45 @@ void data_destroy(struct data_t *data) {
 		data = NULL;
     }
 }
+
+/*
+ * Resumo (FNV-1a de 64 bits) do conteúdo de data.
+ */
+uint64_t data_digest(struct data_t *data) {
+
+    uint64_t h = 14695981039346656037ULL;
+    const unsigned char *bytes = (const unsigned char *) "0";
+    int i, size = 1;
+
+    if(data && data->data && data->datasize > 0) {
+        bytes = data->data;
+        size = data->datasize;
+    }
+    for(i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+
+}
+
+/*
+ * Cria um data_t com o timestamp de data e o resumo do seu conteúdo (em
+ * hexadecimal, para ser igual em qualquer máquina).
+ * Retorna NULL em caso de erro.
+ */
+struct data_t *data_create_digest(struct data_t *data) {
+
+    struct data_t *digest;
+    char hex[DATA_DIGEST_SIZE + 1];
+
+    if(!(digest = data_create(DATA_DIGEST_SIZE))) {
+        ERROR("data_create");
+        return NULL;
+    }
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long) data_digest(data));
+    memcpy(digest->data, hex, DATA_DIGEST_SIZE);
+    digest->timestamp = data ? data->timestamp : 0;
+    return digest;
+
+}
@@ -1,12 +1,34 @@
 #ifndef _DATA_H
 #define _DATA_H
 
+#include <stdint.h>
+
 struct data_t {
 	int datasize;	/* Tamanho do bloco de dados do data */
 	void *data;	/* Conteúdo arbitrário */
 	long timestamp; /* Contador + o id do processo cliente */
+	long expires;	/* Instante (segundos desde a época) em que expira, 0 = nunca */
 };
 
+/*
+ * Timestamp reservado para marcar uma chave apagada que ainda tem de esconder
+ * versões mais antigas guardadas em disco (usado pelo motor LSM).
+ */
+#define TS_DELETED -1
+
+/*
+ * TOMBSTONE_TTL: Segundos que um valor apagado ("0") fica na tabela antes de
+ * poder ser recolhido pelo garbage collector (ou descartado pela compactação
+ * do motor LSM).
+ */
+#define TOMBSTONE_TTL 300
+
+/*
+ * Retorna 1 se o data tem um prazo (expires) e este já passou em now, ou 0
+ * caso contrário.
+ */
+#define data_expired(d, now) ((d)->expires > 0 && (d)->expires <= (now))
+
 /* 
  * Um construtor que cria o data_t e aloca a quantidade de memória requisitada
  * no parâmetro size para data.
@@ -29,4 +51,19 @@ struct data_t *data_dup(struct data_t *data);
  */
 void data_destroy(struct data_t *data);
 
+/*
+ * Resumo (FNV-1a de 64 bits) do conteúdo de data, para comparar valores
+ * sem os transmitir. Um data sem conteúdo tem o resumo de "0" (o marcador de
+ * chave inexistente).
+ */
+uint64_t data_digest(struct data_t *data);
+
+/*
+ * Cria um data_t com o timestamp de data (0 se data for NULL) e, como
+ * conteúdo, o seu resumo em DATA_DIGEST_SIZE dígitos hexadecimais: a
+ * resposta de uma leitura por resumo.
+ */
+#define DATA_DIGEST_SIZE 16
+struct data_t *data_create_digest(struct data_t *data);
+
 #endif
\ No newline at end of file
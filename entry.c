@@ -80,4 +80,52 @@ void entry_destroy(struct entry_t *entry) {
         free(entry);
     }
     
-}
\ No newline at end of file
+}
+
+/*
+ * Copia um array de entradas terminado em NULL (e as entradas).
+ * Em caso de erro, devolve NULL.
+ */
+struct entry_t **entry_dup_list(struct entry_t **entries) {
+
+    int counter = 0;
+    struct entry_t **newEntries = NULL;
+
+    if (entries) {
+        while (entries[counter]) {
+            counter ++;
+        }
+        if ((newEntries = (struct entry_t**) calloc(counter + 1, sizeof (struct entry_t*)))) {
+            for (counter = 0; entries[counter]; counter ++) {
+                if (!(newEntries[counter] = entry_dup(entries[counter]))) {
+                    entry_free_list(newEntries);
+                    return NULL;
+                }
+            }
+        }
+        else {
+            ERROR("malloc newEntries");
+        }
+    }
+    else {
+        ERROR("NULL entries");
+    }
+    return newEntries;
+
+}
+
+/*
+ * Liberta um array de entradas terminado em NULL e as suas entradas.
+ */
+void entry_free_list(struct entry_t **entries) {
+
+    int counter = 0;
+    if (entries) {
+        while (entries[counter]) {
+            entry_destroy(entries[counter]);
+            counter ++;
+        }
+    }
+    free(entries);
+
+}
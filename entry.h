@@ -24,5 +24,16 @@ struct entry_t *entry_dup(struct entry_t *entry);
  */
 void entry_destroy(struct entry_t *entry);
 
+/*
+ * Copia um array de entradas terminado em NULL (e as entradas).
+ * Em caso de erro, devolve NULL.
+ */
+struct entry_t **entry_dup_list(struct entry_t **entries);
+
+/*
+ * Liberta um array de entradas terminado em NULL e as suas entradas.
+ */
+void entry_free_list(struct entry_t **entries);
+
 #endif
 
@@ -0,0 +1,44 @@
+/*
+ * File:   hash_ring-private.h
+ *
+ * Define a estrutura de um anel de hashing consistente.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _HASH_RING_PRIVATE_H
+#define _HASH_RING_PRIVATE_H
+
+#include <stdint.h>
+
+/*
+ * Define um ponto do anel.
+ *
+ * uint64_t hash => posição no anel
+ * int server => o servidor a que pertence
+ */
+struct hring_point_t {
+    uint64_t hash;
+    int server;
+};
+
+/*
+ * Define a estrutura de um anel de hashing consistente.
+ *
+ * int numServers => número de servidores
+ * int numPoints => número de pontos (numServers * nós virtuais)
+ * struct hring_point_t *points => os pontos, ordenados por hash
+ */
+struct hring_t {
+    int numServers;
+    int numPoints;
+    struct hring_point_t *points;
+};
+
+/*
+ * Posição no anel da string s: FNV-1a de 64 bits seguido da mistura final
+ * do MurmurHash3 (o FNV sozinho deixa chaves parecidas muito próximas).
+ */
+uint64_t hring_hash(const char *s);
+
+#endif
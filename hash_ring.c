@@ -0,0 +1,183 @@
+/*
+ * File:   hash_ring.c
+ *
+ * Implementação de um anel de hashing consistente com nós virtuais, usado
+ * para repartir as chaves de uma quorum table pelos servidores.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include "utils.h"
+#include "hash_ring.h"
+#include "hash_ring-private.h"
+
+/* Ordena os pontos pela posição (e pelo servidor, num empate) */
+static int hring_compare(const void *a, const void *b) {
+
+    const struct hring_point_t *x = a, *y = b;
+
+    if(x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->server - y->server;
+
+}
+
+/*
+ * Cria o anel dos n servidores names com vnodes pontos por servidor.
+ * Retorna NULL em caso de erro.
+ */
+struct hring_t *hring_create(const char **names, int n, int vnodes) {
+
+    struct hring_t *ring;
+    char *point;
+    int i, v;
+
+    if(names == NULL || n <= 0 || vnodes <= 0) {
+        ERROR("NULL names or n <= 0 or vnodes <= 0");
+        return NULL;
+    }
+    if((ring = (struct hring_t *) malloc(sizeof(struct hring_t))) == NULL) {
+        ERROR("malloc ring");
+        return NULL;
+    }
+    ring->numServers = n;
+    ring->numPoints = n * vnodes;
+    if((ring->points = (struct hring_point_t *) malloc(sizeof(struct hring_point_t) * ring->numPoints)) == NULL) {
+        ERROR("malloc ring->points");
+        free(ring);
+        return NULL;
+    }
+
+    // O ponto v do servidor é a posição de "nome#v"
+    for(i = 0; i < n; i++) {
+        if((point = (char *) malloc(strlen(names[i]) + 12)) == NULL) {
+            ERROR("malloc point");
+            hring_destroy(ring);
+            return NULL;
+        }
+        for(v = 0; v < vnodes; v++) {
+            sprintf(point, "%s#%d", names[i], v);
+            ring->points[i * vnodes + v].hash = hring_hash(point);
+            ring->points[i * vnodes + v].server = i;
+        }
+        free(point);
+    }
+    qsort(ring->points, ring->numPoints, sizeof(struct hring_point_t), hring_compare);
+    return ring;
+
+}
+
+/*
+ * Liberta toda a memória do anel.
+ */
+void hring_destroy(struct hring_t *ring) {
+
+    if(ring) {
+        free(ring->points);
+        free(ring);
+    }
+
+}
+
+/* Primeiro ponto com posição >= à de key (o anel dá a volta no fim) */
+static int hring_first(struct hring_t *ring, char *key) {
+
+    int low = 0, high = ring->numPoints, middle;
+    uint64_t hash = hring_hash(key);
+
+    while(low < high) {
+        middle = low + (high - low) / 2;
+        if(ring->points[middle].hash < hash) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    return low;
+
+}
+
+/*
+ * Marca em replicas os r servidores responsáveis por key.
+ * Retorna quantos foram marcados ou -1 (erro).
+ */
+int hring_replicas(struct hring_t *ring, char *key, int r, int *replicas) {
+
+    int low, i, count = 0;
+
+    if(ring == NULL || key == NULL || replicas == NULL) {
+        ERROR("NULL ring or key or replicas");
+        return -1;
+    }
+    memset(replicas, 0, sizeof(int) * ring->numServers);
+    if(r > ring->numServers) {
+        r = ring->numServers;
+    }
+
+    // Os pontos seguintes de servidores que ainda não foram escolhidos
+    low = hring_first(ring, key);
+    for(i = 0; i < ring->numPoints && count < r; i++) {
+        struct hring_point_t *point = &ring->points[(low + i) % ring->numPoints];
+        if(!replicas[point->server]) {
+            replicas[point->server] = 1;
+            count ++;
+        }
+    }
+    return count;
+
+}
+
+/*
+ * 1 se os servidores a e b estão ambos entre os r responsáveis por key.
+ */
+int hring_shared(struct hring_t *ring, char *key, int r, int a, int b) {
+
+    int low, i, j, count = 0, server, foundA = 0, foundB = 0;
+
+    if(ring == NULL || key == NULL) {
+        return 0;
+    }
+    if(r > ring->numServers) {
+        r = ring->numServers;
+    }
+
+    // Como em hring_replicas(), mas um servidor já escolhido reconhece-se
+    // pelos pontos anteriores, para não precisar de memória
+    low = hring_first(ring, key);
+    for(i = 0; i < ring->numPoints && count < r; i++) {
+        server = ring->points[(low + i) % ring->numPoints].server;
+        for(j = 0; j < i; j++) {
+            if(ring->points[(low + j) % ring->numPoints].server == server) {
+                break;
+            }
+        }
+        if(j < i) {
+            continue;
+        }
+        count ++;
+        foundA |= server == a;
+        foundB |= server == b;
+    }
+    return foundA && foundB;
+
+}
+
+uint64_t hring_hash(const char *s) {
+
+    uint64_t hash = 14695981039346656037ULL;
+
+    while(*s) {
+        hash ^= (unsigned char) *s++;
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+
+}
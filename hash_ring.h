@@ -0,0 +1,39 @@
+#ifndef _HASH_RING_H
+#define _HASH_RING_H
+
+/* Pontos (nós virtuais) de cada servidor no anel, por omissão. */
+#define HRING_VNODES 128
+
+struct hring_t; /* Definida em hash_ring-private.h */
+
+/*
+ * Cria o anel de hashing consistente dos n servidores names (os endereços
+ * "ip:porto"), com vnodes pontos por servidor. A posição de cada ponto só
+ * depende do nome do servidor, pelo que clientes com os mesmos servidores
+ * constroem o mesmo anel (por qualquer ordem), e juntar ou retirar um
+ * servidor só muda de dono as chaves dos seus pontos.
+ * Retorna NULL em caso de erro.
+ */
+struct hring_t *hring_create(const char **names, int n, int vnodes);
+
+/*
+ * Liberta toda a memória do anel.
+ */
+void hring_destroy(struct hring_t *ring);
+
+/*
+ * Marca em replicas (um int por servidor, pela ordem de names) os r
+ * servidores responsáveis por key: os r primeiros servidores distintos a
+ * partir da posição da chave no anel. Os restantes ficam a 0.
+ * Retorna quantos servidores foram marcados (no máximo n) ou -1 (erro).
+ */
+int hring_replicas(struct hring_t *ring, char *key, int r, int *replicas);
+
+/*
+ * 1 se os servidores a e b (índices em names) estão ambos entre os r
+ * responsáveis por key, 0 se não. Não escreve em memória nenhuma, pelo que
+ * pode ser chamada por vários fios ao mesmo tempo.
+ */
+int hring_shared(struct hring_t *ring, char *key, int r, int a, int b);
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * File:   hinted_handoff-private.h
+ *
+ * Define a estrutura das pistas (hinted handoff) de um cliente.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _HINTED_HANDOFF_PRIVATE_H
+#define _HINTED_HANDOFF_PRIVATE_H
+
+#include <pthread.h>
+#include "entry.h"
+#include "remote_table.h"
+#include "hinted_handoff.h"
+
+/* Intervalo (ms) entre as tentativas de entrega das pistas. */
+#define HHANDOFF_INTERVAL 1000
+
+/* Entradas enviadas, no mínimo, em cada mensagem da entrega. */
+#define HHANDOFF_BATCH 64
+
+/*
+ * Define as pistas de um cliente. Cada servidor tem um ficheiro onde as
+ * pistas são acrescentadas (log) e, durante a entrega, outro (replay) com
+ * as que estão a ser entregues: só é apagado quando foram todas.
+ *
+ * struct rtable_t **servers => ligações próprias aos servidores, para a
+ *                              entrega não disputar as dos workers
+ * int *connected => 1 se a ligação ao servidor i já foi feita
+ * char **logPaths, **replayPaths => os dois ficheiros de cada servidor
+ * int *fds => o log aberto de cada servidor (-1 se não foi possível)
+ * int *pending => 1 se o servidor i tem pistas por entregar
+ * int numServers => quantos são
+ * pthread_t thread => o fio das entregas
+ * pthread_mutex_t lock => protege fds, pending e stopping
+ * pthread_cond_t wakeup => para acordar o fio quando deve parar
+ * int stopping => 1 quando o fio deve terminar
+ */
+struct hhandoff_t {
+    struct rtable_t **servers;
+    int *connected;
+    char **logPaths;
+    char **replayPaths;
+    int *fds;
+    int *pending;
+    int numServers;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int stopping;
+};
+
+/*
+ * Fio das entregas (arg é o hhandoff_t).
+ */
+void *hhandoff_run(void *arg);
+
+/*
+ * Entrega ao servidor server, em lotes de HHANDOFF_BATCH entradas (cada
+ * uma put-if-newer), as pistas guardadas até agora.
+ * Retorna o número de entradas entregues ou -1 em caso de erro (as pistas
+ * ficam para a próxima tentativa).
+ */
+int hhandoff_replay(struct hhandoff_t *hh, int server);
+
+#endif
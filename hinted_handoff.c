@@ -0,0 +1,370 @@
+/*
+ * File:   hinted_handoff.c
+ *
+ * Pistas (hinted handoff) de um cliente: uma escrita que um servidor falhou
+ * (porque estava em baixo ou não respondeu a tempo) fica guardada num
+ * ficheiro local só de acrescento e é-lhe entregue quando volta, em vez de
+ * ficar perdida nesse servidor até uma leitura a reparar.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <time.h>
+#include "utils.h"
+#include "data.h"
+#include "entry.h"
+#include "message.h"
+#include "remote_table.h"
+#include "hinted_handoff.h"
+#include "hinted_handoff-private.h"
+
+/* Caminho dir/hints-<endereço>.<ext>, com o endereço só em letras, dígitos,
+ * '.' e '-' */
+static char *hhandoff_path(const char *dir, const char *address, const char *ext) {
+
+    char *path, *c;
+    size_t size = strlen(dir) + strlen(address) + strlen(ext) + 9;
+
+    if((path = (char *) malloc(size)) == NULL) {
+        ERROR("malloc path");
+        return NULL;
+    }
+    snprintf(path, size, "%s/hints-", dir);
+    for(c = path + strlen(path); *address; address++) {
+        *c++ = (isalnum((unsigned char) *address) || *address == '.' || *address == '-') ? *address : '_';
+    }
+    sprintf(c, ".%s", ext);
+    return path;
+
+}
+
+/* 1 se o ficheiro path existe e não está vazio */
+static int hhandoff_has_data(const char *path) {
+
+    struct stat st;
+
+    return stat(path, &st) == 0 && st.st_size > 0;
+
+}
+
+/*
+ * Abre as pistas para os n servidores addresses na directoria dir.
+ * Retorna NULL em caso de erro.
+ */
+struct hhandoff_t *hhandoff_open(const char *dir, char **addresses, int n) {
+
+    struct hhandoff_t *hh;
+    pthread_condattr_t attr;
+    int i;
+
+    if(dir == NULL || addresses == NULL || n <= 0) {
+        ERROR("NULL dir, NULL addresses or n <= 0");
+        return NULL;
+    }
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        LOG_PERROR("mkdir hints");
+        return NULL;
+    }
+    if((hh = (struct hhandoff_t *) calloc(1, sizeof(struct hhandoff_t))) == NULL) {
+        ERROR("calloc hh");
+        return NULL;
+    }
+    if((hh->servers = (struct rtable_t **) calloc(n, sizeof(struct rtable_t *))) == NULL ||
+       (hh->connected = (int *) calloc(n, sizeof(int))) == NULL ||
+       (hh->logPaths = (char **) calloc(n, sizeof(char *))) == NULL ||
+       (hh->replayPaths = (char **) calloc(n, sizeof(char *))) == NULL ||
+       (hh->fds = (int *) malloc(n * sizeof(int))) == NULL ||
+       (hh->pending = (int *) calloc(n, sizeof(int))) == NULL) {
+        ERROR("calloc hh");
+        hhandoff_close(hh);
+        return NULL;
+    }
+    // Só a partir daqui é que hhandoff_close() percorre os servidores
+    for(i = 0; i < n; i++) {
+        hh->fds[i] = -1;
+    }
+    hh->numServers = n;
+    for(i = 0; i < n; i++) {
+        if((hh->servers[i] = rtable_open(addresses[i])) == NULL ||
+           (hh->logPaths[i] = hhandoff_path(dir, addresses[i], "log")) == NULL ||
+           (hh->replayPaths[i] = hhandoff_path(dir, addresses[i], "replay")) == NULL) {
+            LOG_ERROR("hinted_handoff: endereco invalido: %s", addresses[i]);
+            hhandoff_close(hh);
+            return NULL;
+        }
+        if((hh->fds[i] = open(hh->logPaths[i], O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+            LOG_PERROR("open hints");
+            hhandoff_close(hh);
+            return NULL;
+        }
+        // As pistas de uma execução anterior também são entregues
+        hh->pending[i] = hhandoff_has_data(hh->logPaths[i]) || access(hh->replayPaths[i], F_OK) == 0;
+    }
+
+    // Os prazos das esperas usam o relógio monótono
+    pthread_mutex_init(&hh->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hh->wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    if(pthread_create(&hh->thread, NULL, hhandoff_run, hh) != 0) {
+        LOG_PERROR("pthread_create");
+        hh->thread = 0;
+        hhandoff_close(hh);
+        return NULL;
+    }
+    return hh;
+
+}
+
+/*
+ * Guarda entries como pistas para o servidor server: um registo
+ * "OP_RT_PUT CT_ENTRIES ..." por linha.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int hhandoff_add(struct hhandoff_t *hh, int server, struct entry_t **entries) {
+
+    struct message_t msg;
+    char *line = NULL;
+    int size, result = 0;
+
+    if(hh == NULL || server < 0 || server >= hh->numServers || entries == NULL) {
+        ERROR("NULL hh, invalid server or NULL entries");
+        return -1;
+    }
+    if(entries[0] == NULL) {
+        return 0;
+    }
+    msg.opcode = OP_RT_PUT;
+    msg.c_type = CT_ENTRIES;
+    msg.content.entries = entries;
+    if((size = message_to_string(&msg, &line)) <= 0) {
+        ERROR("message_to_string");
+        free(line);
+        return -1;
+    }
+    // O registo vai todo num só write(), para não se misturar com outros
+    line[size] = '\n';
+
+    pthread_mutex_lock(&hh->lock);
+    if(hh->fds[server] == -1 || write(hh->fds[server], line, size + 1) != size + 1) {
+        LOG_ERROR("hinted_handoff: pista perdida para o servidor %d", server);
+        result = -1;
+    }
+    else {
+        hh->pending[server] = 1;
+    }
+    pthread_mutex_unlock(&hh->lock);
+    free(line);
+    return result;
+
+}
+
+/*
+ * Pára o fio (esperando pela entrega em curso) e liberta toda a memória.
+ */
+void hhandoff_close(struct hhandoff_t *hh) {
+
+    int i;
+
+    if(hh == NULL) {
+        return;
+    }
+    if(hh->thread) {
+        pthread_mutex_lock(&hh->lock);
+        hh->stopping = 1;
+        pthread_cond_signal(&hh->wakeup);
+        pthread_mutex_unlock(&hh->lock);
+        pthread_join(hh->thread, NULL);
+        pthread_mutex_destroy(&hh->lock);
+        pthread_cond_destroy(&hh->wakeup);
+    }
+    for(i = 0; i < hh->numServers; i++) {
+        if(hh->servers && hh->servers[i]) {
+            rtable_disconnect(hh->servers[i]);
+        }
+        if(hh->fds && hh->fds[i] != -1) {
+            close(hh->fds[i]);
+        }
+        if(hh->logPaths) {
+            free(hh->logPaths[i]);
+        }
+        if(hh->replayPaths) {
+            free(hh->replayPaths[i]);
+        }
+    }
+    free(hh->servers);
+    free(hh->connected);
+    free(hh->logPaths);
+    free(hh->replayPaths);
+    free(hh->fds);
+    free(hh->pending);
+    free(hh);
+
+}
+
+/*
+ * Fio das entregas: a cada HHANDOFF_INTERVAL tenta os servidores com
+ * pistas por entregar.
+ */
+void *hhandoff_run(void *arg) {
+
+    struct hhandoff_t *hh = (struct hhandoff_t *) arg;
+    struct timespec until;
+    int i, pending, delivered;
+
+    pthread_mutex_lock(&hh->lock);
+    while(!hh->stopping) {
+        clock_gettime(CLOCK_MONOTONIC, &until);
+        until.tv_sec += HHANDOFF_INTERVAL / 1000;
+        until.tv_nsec += (HHANDOFF_INTERVAL % 1000) * 1000000;
+        if(until.tv_nsec >= 1000000000) {
+            until.tv_sec ++;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&hh->wakeup, &hh->lock, &until);
+
+        for(i = 0; i < hh->numServers && !hh->stopping; i++) {
+            pending = hh->pending[i];
+            pthread_mutex_unlock(&hh->lock);
+
+            // Um servidor ainda em baixo fica para a próxima volta
+            if(pending && !hh->connected[i] && rtable_connect(hh->servers[i]) == 0) {
+                hh->connected[i] = 1;
+            }
+            if(pending && hh->connected[i] && rtable_available(hh->servers[i]) &&
+               (delivered = hhandoff_replay(hh, i)) > 0) {
+                LOG_INFO("hinted_handoff: %d entradas entregues ao servidor %d", delivered, i);
+            }
+
+            pthread_mutex_lock(&hh->lock);
+        }
+    }
+    pthread_mutex_unlock(&hh->lock);
+    return NULL;
+
+}
+
+/* Envia o lote batch (count entradas) e liberta as entradas */
+static int hhandoff_send(struct hhandoff_t *hh, int server, struct entry_t **batch, int count) {
+
+    int result, i;
+
+    batch[count] = NULL;
+    result = rtable_put_entries(hh->servers[server], batch);
+    for(i = 0; i < count; i++) {
+        entry_destroy(batch[i]);
+    }
+    return result;
+
+}
+
+/*
+ * Entrega ao servidor server as pistas guardadas até agora.
+ * Retorna o número de entradas entregues ou -1 em caso de erro.
+ */
+int hhandoff_replay(struct hhandoff_t *hh, int server) {
+
+    struct entry_t **batch = NULL, **grown;
+    struct message_t *msg;
+    FILE *file;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    int count = 0, size = 0, delivered = 0, result = 0, i;
+
+    // As pistas até agora passam para o ficheiro da entrega (se a anterior
+    // falhou, ainda lá estão as dela) e as novas vão para um log novo
+    pthread_mutex_lock(&hh->lock);
+    hh->pending[server] = 0;
+    if(access(hh->replayPaths[server], F_OK) != 0) {
+        if(!hhandoff_has_data(hh->logPaths[server])) {
+            pthread_mutex_unlock(&hh->lock);
+            return 0;
+        }
+        close(hh->fds[server]);
+        if(rename(hh->logPaths[server], hh->replayPaths[server]) == -1) {
+            LOG_PERROR("rename hints");
+            result = -1;
+        }
+        if((hh->fds[server] = open(hh->logPaths[server], O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+            LOG_PERROR("open hints");
+        }
+    }
+    if(result == -1) {
+        hh->pending[server] = 1;
+        pthread_mutex_unlock(&hh->lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&hh->lock);
+
+    if((file = fopen(hh->replayPaths[server], "r")) == NULL) {
+        LOG_PERROR("fopen hints");
+        result = -1;
+    }
+    while(result != -1 && (length = getline(&line, &capacity, file)) > 0) {
+        if(line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+        // Um registo incompleto (o cliente terminou a meio do write()) perde-se
+        if((msg = string_to_message(line)) == NULL || msg->c_type != CT_ENTRIES) {
+            LOG_WARN("hinted_handoff: pista corrompida em %s", hh->replayPaths[server]);
+            free_message(msg);
+            continue;
+        }
+        for(i = 0; msg->content.entries[i]; i++) {
+            if(count + 1 >= size) {
+                size = size ? size * 2 : HHANDOFF_BATCH * 2;
+                if((grown = (struct entry_t **) realloc(batch, size * sizeof(struct entry_t *))) == NULL) {
+                    ERROR("realloc batch");
+                    result = -1;
+                    break;
+                }
+                batch = grown;
+            }
+            batch[count++] = msg->content.entries[i];
+            msg->content.entries[i] = NULL;
+        }
+        // As entradas passaram para o lote: o que sobrar é libertado
+        for(; msg->content.entries[i]; i++) {
+            entry_destroy(msg->content.entries[i]);
+            msg->content.entries[i] = NULL;
+        }
+        free_message(msg);
+        if(result != -1 && count >= HHANDOFF_BATCH) {
+            if(hhandoff_send(hh, server, batch, count) == -1) {
+                result = -1;
+            }
+            delivered += count;
+            count = 0;
+        }
+    }
+    if(result != -1 && count > 0) {
+        if(hhandoff_send(hh, server, batch, count) == -1) {
+            result = -1;
+        }
+        delivered += count;
+        count = 0;
+    }
+    for(i = 0; i < count; i++) {
+        entry_destroy(batch[i]);
+    }
+    free(batch);
+    free(line);
+    if(file) {
+        fclose(file);
+    }
+
+    // Só quando foram todas entregues é que o ficheiro pode ir
+    if(result != -1) {
+        unlink(hh->replayPaths[server]);
+        return delivered;
+    }
+    LOG_WARN("hinted_handoff: entrega ao servidor %d por terminar", server);
+    pthread_mutex_lock(&hh->lock);
+    hh->pending[server] = 1;
+    pthread_mutex_unlock(&hh->lock);
+    return -1;
+
+}
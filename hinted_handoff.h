@@ -0,0 +1,32 @@
+#ifndef _HINTED_HANDOFF_H
+#define _HINTED_HANDOFF_H
+
+#include "entry.h"
+
+struct hhandoff_t; /* Definida em hinted_handoff-private.h */
+
+/*
+ * Abre as pistas (hinted handoff) de um cliente para os n servidores
+ * addresses (endereços como em rtable_open()): as escritas que um servidor
+ * falhou ficam num ficheiro só de acrescento por servidor, na directoria
+ * dir (criada se não existir), e um fio entrega-as em lotes quando a
+ * ligação a esse servidor volta. As pistas que ficaram de uma execução
+ * anterior com a mesma directoria também são entregues.
+ * Retorna NULL em caso de erro.
+ */
+struct hhandoff_t *hhandoff_open(const char *dir, char **addresses, int n);
+
+/*
+ * Guarda as entradas entries (array terminado em NULL, que continua a ser
+ * do chamador) como pistas para o servidor server.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int hhandoff_add(struct hhandoff_t *hh, int server, struct entry_t **entries);
+
+/*
+ * Pára o fio (esperando pela entrega em curso) e liberta toda a memória.
+ * As pistas por entregar continuam nos ficheiros.
+ */
+void hhandoff_close(struct hhandoff_t *hh);
+
+#endif
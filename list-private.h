@@ -20,11 +20,20 @@
  * struct node_t *prev => apontador para o nó anterior
  * struct node_t *next => apontador para o nó seguinte
  * struct entry_t *entry => apontador para conteúdo do nó
+ * int referenced => bit de referência do algoritmo CLOCK (1 se a entrada foi
+ *                   usada desde a última passagem do ponteiro de evicção);
+ *                   marcado por leituras em paralelo, só com acessos atómicos
+ * struct node_t *leafPrev, *leafNext => nós da mesma folha da árvore de
+ *                                       Merkle da tabela (só usados com
+ *                                       table_use_merkle())
  */
 struct node_t {
     struct node_t *prev;
     struct node_t *next;
     struct entry_t *entry;
+    int referenced;
+    struct node_t *leafPrev;
+    struct node_t *leafNext;
 };
 
 /*
@@ -51,6 +60,12 @@ struct node_t *node_create(struct entry_t *entry);
  */
 void node_destroy(struct node_t *node);
 
+/*
+ * Obtem o nó da lista com a chave key. Retorna a referência do nó na lista
+ * ou NULL se não existir.
+ */
+struct node_t *list_get_node(struct list_t *list, char *key);
+
 /*
  * Retorna todas as entries dessa lista.
  */
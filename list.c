@@ -300,6 +300,9 @@ struct node_t *node_create(struct entry_t *entry) {
         node->entry = entry;
         node->prev = NULL;
         node->next = NULL;
+        node->referenced = 0;
+        node->leafPrev = NULL;
+        node->leafNext = NULL;
     }
     else {
         ERROR("Malloc node or NULL entry");
@@ -308,6 +311,28 @@ struct node_t *node_create(struct entry_t *entry) {
 
 }
 
+/*
+ * Obtem o nó da lista com a chave key. Retorna a referência do nó na lista
+ * ou NULL se não existir.
+ */
+struct node_t *list_get_node(struct list_t *list, char *key) {
+
+    struct node_t *tempNode = NULL;
+
+    if(list && key) {
+        for(tempNode = list->head; tempNode; tempNode = tempNode->next) {
+            if(tempNode->entry && strcmp(tempNode->entry->key, key) == 0) {
+                break;
+            }
+        }
+    }
+    else {
+        ERROR("Lista ou key NULL");
+    }
+    return tempNode;
+
+}
+
 /*
  * Destroí o nó passado e desaloca toda a sua memória.
  */
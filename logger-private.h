@@ -0,0 +1,72 @@
+/*
+ * File:   logger-private.h
+ *
+ * Define o buffer circular de mensagens do logger.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _LOGGER_PRIVATE_H
+#define _LOGGER_PRIVATE_H
+
+#include <pthread.h>
+
+/* Posições do buffer circular (potência de 2) */
+#define LOG_SLOTS 1024
+
+/* Tamanho máximo de uma mensagem (as maiores são truncadas) */
+#define LOG_MESSAGE_SIZE 512
+
+/* Tempo (us) que o fio de escrita dorme quando não há mensagens */
+#define LOG_IDLE_USEC 5000
+
+/*
+ * Define uma posição do buffer.
+ *
+ * unsigned long sequence => número de sequência da posição: igual à volta
+ *                           em que está livre para o produtor, mais um
+ *                           quando tem uma mensagem pronta
+ * int level => nível da mensagem
+ * char text => mensagem formatada
+ */
+struct log_slot_t {
+    unsigned long sequence;
+    int level;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+/*
+ * Define o logger: um buffer circular com vários produtores (quem regista)
+ * e um consumidor (o fio de escrita), sem locks.
+ *
+ * struct log_slot_t slots => posições do buffer
+ * unsigned long tail => próxima posição a reservar por um produtor
+ * unsigned long head => próxima posição a escrever pelo consumidor
+ * unsigned long dropped => mensagens descartadas com o buffer cheio
+ * pthread_t thread => fio de escrita
+ * int running => 1 enquanto o fio de escrita está activo
+ * int stopping => pedido de paragem ao fio de escrita
+ */
+struct logger_t {
+    struct log_slot_t slots[LOG_SLOTS];
+    unsigned long tail;
+    unsigned long head;
+    unsigned long dropped;
+    pthread_t thread;
+    int running;
+    int stopping;
+};
+
+/*
+ * Ciclo do fio de escrita: escreve as mensagens prontas e dorme quando não
+ * há nenhuma.
+ */
+void *logger_run(void *arg);
+
+/*
+ * Escreve todas as mensagens prontas do buffer.
+ * Retorna o número de mensagens escritas.
+ */
+int logger_drain(void);
+
+#endif
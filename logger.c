@@ -0,0 +1,206 @@
+/*
+ * File:   logger.c
+ *
+ * Logger assíncrono: as mensagens são formatadas por quem regista e
+ * colocadas num buffer circular sem locks, de onde um fio próprio as
+ * escreve no stdout/stderr. Assim nenhum pedido espera por uma escrita no
+ * terminal (ou num pipe cheio).
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <stdarg.h>
+#include "utils.h"
+#include "logger.h"
+#include "logger-private.h"
+
+static struct logger_t logger;
+static pthread_once_t loggerOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * Escreve uma mensagem directamente no destino do seu nível.
+ */
+static void logger_output(int level, const char *text) {
+
+    FILE *out = level <= LOG_LEVEL_WARN ? stderr : stdout;
+
+    fputs(text, out);
+    fputc('\n', out);
+
+}
+
+/*
+ * Prepara o buffer e lança o fio de escrita (uma única vez, no primeiro
+ * registo). Se o fio não puder ser criado as mensagens são escritas
+ * directamente.
+ */
+static void logger_init(void) {
+
+    int i;
+
+    for(i = 0; i < LOG_SLOTS; i++) {
+        logger.slots[i].sequence = i;
+    }
+    if(pthread_create(&logger.thread, NULL, logger_run, NULL) != 0) {
+        return;
+    }
+    __atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+    atexit(logger_shutdown);
+
+}
+
+/*
+ * Escreve todas as mensagens prontas do buffer.
+ * Retorna o número de mensagens escritas.
+ */
+int logger_drain(void) {
+
+    struct log_slot_t *slot;
+    unsigned long dropped;
+    int written = 0;
+
+    for(;;) {
+        slot = &logger.slots[logger.head & (LOG_SLOTS - 1)];
+        if(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != logger.head + 1) {
+            break;
+        }
+        logger_output(slot->level, slot->text);
+        // Liberta a posição para a próxima volta
+        __atomic_store_n(&slot->sequence, logger.head + LOG_SLOTS, __ATOMIC_RELEASE);
+        logger.head++;
+        written++;
+    }
+
+    if((dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED)) > 0) {
+        fprintf(stderr, "logger: %lu mensagens descartadas (buffer cheio)\n", dropped);
+        written++;
+    }
+    if(written > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+
+}
+
+/*
+ * Ciclo do fio de escrita: escreve as mensagens prontas e dorme quando não
+ * há nenhuma.
+ */
+void *logger_run(void *arg) {
+
+    while(!__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE)) {
+        if(logger_drain() == 0) {
+            usleep(LOG_IDLE_USEC);
+        }
+    }
+    logger_drain();
+    return NULL;
+
+}
+
+/*
+ * Aplica o limite de LOG_RATE_LIMIT mensagens por segundo ao local do
+ * código. Os contadores são aproximados com vários fios, o que basta para
+ * não inundar o terminal.
+ * Retorna -1 se a mensagem deve ser descartada ou o número de mensagens
+ * suprimidas no segundo anterior (a reportar com esta).
+ */
+static int logger_admit(struct log_site_t *site) {
+
+    long now = (long) time(NULL);
+    int suppressed = 0;
+
+    if(__atomic_load_n(&site->second, __ATOMIC_RELAXED) != now) {
+        __atomic_store_n(&site->second, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+        suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    }
+    if(__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_RATE_LIMIT) {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return suppressed;
+
+}
+
+/*
+ * Formata a mensagem e coloca-a no buffer circular, de onde um fio próprio
+ * a escreve; quem regista nunca espera pela escrita nem por um lock. Se o
+ * buffer estiver cheio a mensagem é descartada (e contada).
+ */
+void logger_write(int level, struct log_site_t *site, const char *format, ...) {
+
+    struct log_slot_t *slot;
+    char text[LOG_MESSAGE_SIZE];
+    unsigned long pos, seq;
+    int suppressed, length;
+    va_list args;
+
+    if((suppressed = logger_admit(site)) == -1) {
+        return;
+    }
+    pthread_once(&loggerOnce, logger_init);
+
+    if(!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+        // Sem fio de escrita (ou já terminado): escreve directamente
+        va_start(args, format);
+        length = vsnprintf(text, sizeof(text), format, args);
+        va_end(args);
+        if(suppressed > 0 && length >= 0 && length < (int) sizeof(text)) {
+            snprintf(text + length, sizeof(text) - length, " (+%d suprimidas)", suppressed);
+        }
+        logger_output(level, text);
+        return;
+    }
+
+    // Reserva uma posição: está livre quando a sequência é igual à posição
+    pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+    for(;;) {
+        slot = &logger.slots[pos & (LOG_SLOTS - 1)];
+        seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if(seq == pos) {
+            if(__atomic_compare_exchange_n(&logger.tail, &pos, pos + 1, 0,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        }
+        else if((long) (seq - pos) < 0) {
+            // A posição ainda tem a mensagem da volta anterior: cheio
+            __atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else {
+            pos = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_start(args, format);
+    length = vsnprintf(slot->text, sizeof(slot->text), format, args);
+    va_end(args);
+    if(suppressed > 0 && length >= 0 && length < (int) sizeof(slot->text)) {
+        snprintf(slot->text + length, sizeof(slot->text) - length, " (+%d suprimidas)", suppressed);
+    }
+    slot->level = level;
+    // Publica a mensagem ao fio de escrita
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+}
+
+/*
+ * Escreve todas as mensagens pendentes e termina o fio de escrita; as
+ * mensagens seguintes são escritas directamente. É chamada automaticamente
+ * no exit().
+ */
+void logger_shutdown(void) {
+
+    if(!__atomic_exchange_n(&logger.running, 0, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    __atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(logger.thread, NULL);
+    // O que foi colocado no buffer depois da última passagem do fio
+    logger_drain();
+
+}
@@ -0,0 +1,92 @@
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Níveis das mensagens. ERROR e WARN vão para o stderr, INFO e DEBUG para o
+ * stdout.
+ */
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/*
+ * Nível máximo compilado: as mensagens acima dele desaparecem na compilação
+ * (nem os argumentos são avaliados). Compilar com -DLOG_LEVEL=LOG_LEVEL_DEBUG
+ * para ver cada pedido e cada registo do log.
+ */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+/* Mensagens por segundo aceites de cada local do código (as outras contam-se) */
+#define LOG_RATE_LIMIT 100
+
+/*
+ * Estado do limite de ritmo de um local do código (uma instância estática
+ * por chamada de LOG_*).
+ *
+ * long second => segundo a que se referem os contadores
+ * int count => mensagens deste local nesse segundo
+ * int suppressed => mensagens descartadas por excederem LOG_RATE_LIMIT
+ */
+struct log_site_t {
+    long second;
+    int count;
+    int suppressed;
+};
+
+/*
+ * Formata a mensagem e coloca-a no buffer circular, de onde um fio próprio
+ * a escreve; quem regista nunca espera pela escrita nem por um lock. Se o
+ * buffer estiver cheio a mensagem é descartada (e contada).
+ */
+void logger_write(int level, struct log_site_t *site, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+
+/*
+ * Escreve todas as mensagens pendentes e termina o fio de escrita; as
+ * mensagens seguintes são escritas directamente. É chamada automaticamente
+ * no exit().
+ */
+void logger_shutdown(void);
+
+/* Registar não altera errno, para quem regista um erro ainda o poder tratar */
+#define LOG_AT(level, ...) do { \
+        static struct log_site_t logSite; \
+        int logErrno = errno; \
+        logger_write(level, &logSite, __VA_ARGS__); \
+        errno = logErrno; \
+    } while(0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void) 0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
+
+/* Equivalente a perror(): a mensagem seguida da descrição de errno */
+#define LOG_PERROR(what) LOG_ERROR("%s: %s", what, strerror(errno))
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * File:   lsm_tree-private.h
+ *
+ * Define a estrutura de uma árvore LSM: uma memtable em memória, SSTables
+ * imutáveis ordenadas em disco (com índice de blocos e filtro de bloom) e
+ * níveis compactados em background.
+ *
+ * Formato de uma SSTable:
+ *   blocos de dados: [klen (com '\0')][key][timestamp][expires][deleted][datasize][data] ...
+ *                    (deleted: instante em que um valor "0" chegou a disco, 0 nos
+ *                    restantes)
+ *   índice: por bloco [klen][primeira key][offset][tamanho], seguido de
+ *           [klen][última key da tabela]
+ *   filtro de bloom serializado (bloom_to_data())
+ *   rodapé: struct sst_footer_t
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _LSM_TREE_PRIVATE_H
+#define _LSM_TREE_PRIVATE_H
+
+#include <stdint.h>
+#include "utils.h"
+#include "entry.h"
+#include "table.h"
+#include "bloom.h"
+
+#define LSM_MAX_LEVELS 7
+#define LSM_L0_TRIGGER 4                 /* ficheiros em L0 que disparam compactação */
+#define LSM_L0_STOP 12                   /* ficheiros em L0 que bloqueiam o flush */
+#define LSM_BLOCK_SIZE 4096              /* tamanho alvo de um bloco de dados */
+#define LSM_SST_SIZE (2 * 1024 * 1024)   /* tamanho alvo de uma SSTable */
+#define LSM_L1_SIZE (10 * 1024 * 1024)   /* tamanho máximo do nível 1 */
+#define LSM_LEVEL_MULTIPLIER 10          /* crescimento de cada nível seguinte */
+#define LSM_MEMTABLE_SIZE (4 * 1024 * 1024)
+#define LSM_ENTRY_OVERHEAD 64            /* custo aproximado de uma entrada na memtable */
+#define LSM_MAGIC 0x4c534d32             /* "LSM2" */
+/* SSTables que uma leitura pode ter de consultar (o flush mantém L0 abaixo de LSM_L0_STOP) */
+#define LSM_MAX_CANDIDATES (LSM_L0_STOP + LSM_MAX_LEVELS)
+#define LSM_PERMISSIONS 0666
+
+/*
+ * Rodapé de uma SSTable, escrito no fim do ficheiro.
+ */
+struct sst_footer_t {
+    int64_t index_offset;
+    int32_t index_size;
+    int32_t bloom_size;
+    int64_t bloom_offset;
+    int32_t num_entries;
+    int32_t num_blocks;
+    uint32_t magic;
+    uint32_t padding;
+};
+
+/*
+ * Entrada do índice de blocos (mantido em memória).
+ *
+ * char *first_key => primeira chave do bloco
+ * long offset => posição do bloco no ficheiro
+ * int size => tamanho do bloco em bytes
+ */
+struct sst_index_t {
+    char *first_key;
+    long offset;
+    int size;
+};
+
+/*
+ * Define uma SSTable aberta.
+ *
+ * long seq => número de sequência (maior = mais recente)
+ * char *name => nome do ficheiro
+ * int fd => descritor aberto para leitura
+ * long file_size => tamanho do ficheiro
+ * char *min_key, *max_key => intervalo de chaves guardado
+ * struct sst_index_t *index => índice dos num_blocks blocos
+ * struct bloom_t *bloom => filtro de bloom das chaves
+ * int refs => referências (a do nível e as das leituras em curso): a
+ *             SSTable só é fechada quando a última é largada
+ */
+struct sstable_t {
+    int refs;
+    long seq;
+    char *name;
+    int fd;
+    long file_size;
+    int num_entries;
+    char *min_key;
+    char *max_key;
+    int num_blocks;
+    struct sst_index_t *index;
+    struct bloom_t *bloom;
+};
+
+/*
+ * Um nível da árvore. Em L0 os ficheiros estão por ordem de criação e podem
+ * sobrepor-se; nos restantes níveis estão ordenados por min_key e não se
+ * sobrepõem.
+ */
+struct lsm_level_t {
+    int num_files;
+    int capacity;
+    long bytes;
+    struct sstable_t **files;
+};
+
+/*
+ * Define a estrutura de uma árvore LSM.
+ *
+ * char *name => prefixo dos ficheiros
+ * struct table_t *memtable => tabela em memória com as escritas recentes
+ * long memtable_bytes => tamanho aproximado da memtable
+ * long live_keys => chaves vivas nas SSTables (guardado no manifesto)
+ * long memtable_live => variação das chaves vivas devida à memtable
+ * long version => muda sempre que uma compactação retira ficheiros
+ * struct bloom_t *filter => filtro de contagem das chaves vivas (NULL até ao
+ *                           primeiro lsm_get_filter()), mantido pelas escritas
+ *                           e pela compactação
+ * int filter_keys => número de chaves para que o filtro foi dimensionado
+ * lock => protege os níveis, os contadores e as escritas na memtable (que só
+ *         é alterada pela thread do servidor); as leituras das SSTables são
+ *         feitas sem ele, com referências aos ficheiros
+ * work => sinaliza a thread de compactação
+ * done => sinaliza o fim de uma compactação (para flushes bloqueados)
+ */
+struct lsm_t {
+    char *name;
+    char *manifest_name;
+    struct table_t *memtable;
+    long memtable_bytes;
+    int hash_size;
+    long next_seq;
+    long live_keys;
+    long memtable_live;
+    long version;
+    struct bloom_t *filter;
+    int filter_keys;
+    struct lsm_level_t levels[LSM_MAX_LEVELS];
+    char *compact_pointer[LSM_MAX_LEVELS];
+    pthread_t compactor;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    bool quit;
+};
+
+/*
+ * Escritor de uma SSTable nova.
+ */
+struct sst_writer_t {
+    long seq;
+    char *name;
+    int fd;
+    long offset;
+    char *block;
+    int block_size;
+    int block_capacity;
+    struct sst_index_t *index;
+    int num_blocks;
+    int index_capacity;
+    uint64_t *hashes;
+    int num_entries;
+    int hashes_capacity;
+    char *last_key;
+};
+
+/*
+ * Iterador ordenado sobre uma fonte: um array de entries (a memtable) ou uma
+ * sequência ordenada de SSTables (um ficheiro de L0 ou um nível inteiro).
+ * long deleted => campo deleted da entrada corrente (0 na memtable)
+ * int rank => prioridade nas fusões (menor = mais recente)
+ */
+struct lsm_iter_t {
+    struct entry_t **entries;
+    int num_entries;
+    struct sstable_t **files;
+    int num_files;
+    int file;
+    int block;
+    char *buf;
+    int buf_size;
+    int buf_capacity;
+    int pos;
+    char *key;
+    struct data_t value;
+    long deleted;
+    int rank;
+    bool valid;
+};
+
+/*
+ * Função chamada para cada chave (a versão mais recente) numa fusão.
+ * Retorna 0 para continuar ou -1 para abortar.
+ */
+typedef int (*lsm_visit_t)(char *key, struct data_t *value, long deleted, void *arg);
+
+// SSTables
+struct sst_writer_t *sst_writer_create(struct lsm_t *lsm);
+int sst_writer_add(struct sst_writer_t *writer, char *key, struct data_t *value, long deleted);
+struct sstable_t *sst_writer_finish(struct sst_writer_t *writer);
+void sst_writer_abort(struct sst_writer_t *writer);
+struct sstable_t *sst_open(char *name, long seq);
+void sst_close(struct sstable_t *sst);
+void sst_ref(struct sstable_t *sst);
+void sst_unref(struct sstable_t *sst);
+int sst_get(struct sstable_t *sst, char *key, struct data_t **value);
+char *sst_name(struct lsm_t *lsm, long seq);
+// Níveis e manifesto
+int level_add(struct lsm_level_t *level, struct sstable_t *sst, bool sorted);
+void level_remove(struct lsm_level_t *level, struct sstable_t *sst);
+int lsm_write_manifest(struct lsm_t *lsm);
+int lsm_read_manifest(struct lsm_t *lsm);
+// Iteradores e fusão
+void lsm_iter_init(struct lsm_iter_t *iter, struct entry_t **entries, int num_entries,
+                   struct sstable_t **files, int num_files, int rank);
+void lsm_iter_next(struct lsm_iter_t *iter);
+void lsm_iter_free(struct lsm_iter_t *iter);
+int lsm_merge(struct lsm_iter_t *iters, int n, lsm_visit_t visit, void *arg);
+int lsm_scan(struct lsm_t *lsm, lsm_visit_t visit, void *arg);
+// Compactação
+void *compaction_thread_function(void *arg);
+int lsm_pick_compaction(struct lsm_t *lsm);
+int lsm_compact(struct lsm_t *lsm, int level);
+
+#endif
@@ -0,0 +1,1986 @@
+/*
+ * File:   lsm_tree.c
+ *
+ * Motor de armazenamento LSM: as escritas vão para uma memtable (uma
+ * table_t) que, quando cheia, é escrita numa SSTable imutável e ordenada do
+ * nível 0. Uma thread em background funde os ficheiros do nível i com os do
+ * nível i+1 (compactação por níveis), limitando o número de ficheiros que uma
+ * leitura tem de consultar.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include "utils.h"
+#include "data.h"
+#include "entry.h"
+#include "table.h"
+#include "table-private.h"
+#include "bloom.h"
+#include "bloom-private.h"
+#include "lsm_tree.h"
+#include "lsm_tree-private.h"
+
+/*
+ * Contexto usado pela compactação para escrever as SSTables de saída.
+ */
+struct compaction_ctx_t {
+    struct lsm_t *lsm;
+    struct sst_writer_t *writer;
+    struct sstable_t **outputs;
+    int num_outputs;
+    int capacity;
+    bool drop_deleted;
+    char **dropped;
+    int num_dropped;
+    int dropped_capacity;
+};
+
+/*
+ * Acumula as chaves vivas para lsm_get_keys().
+ */
+struct keys_ctx_t {
+    char **keys;
+    int num_keys;
+    int capacity;
+};
+
+/*
+ * Escreve exactamente size bytes. Retorna 0 (ok) ou -1 (erro).
+ */
+static int write_all(int fd, const void *buf, size_t size) {
+
+    const char *ptr = (const char *) buf;
+    ssize_t written;
+
+    while(size > 0) {
+        if((written = write(fd, ptr, size)) <= 0) {
+            if(written == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += written;
+        size -= written;
+    }
+    return 0;
+
+}
+
+/*
+ * Lê exactamente size bytes a partir de offset. Retorna 0 (ok) ou -1 (erro).
+ */
+static int pread_all(int fd, void *buf, size_t size, off_t offset) {
+
+    char *ptr = (char *) buf;
+    ssize_t nread;
+
+    while(size > 0) {
+        if((nread = pread(fd, ptr, size, offset)) <= 0) {
+            if(nread == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ptr += nread;
+        size -= nread;
+        offset += nread;
+    }
+    return 0;
+
+}
+
+/*
+ * Compara duas entries pela chave (para qsort).
+ */
+static int compare_entries(const void *a, const void *b) {
+
+    return strcmp((*(struct entry_t **) a)->key, (*(struct entry_t **) b)->key);
+
+}
+
+/*
+ * Compara duas SSTables pela menor chave (para qsort).
+ */
+static int compare_sstables(const void *a, const void *b) {
+
+    return strcmp((*(struct sstable_t **) a)->min_key, (*(struct sstable_t **) b)->min_key);
+
+}
+
+/*
+ * Retorna 1 se value é o valor "0" com que o quorum apaga uma chave.
+ */
+static int lsm_is_tombstone(struct data_t *value) {
+
+    return (value->datasize == 1 && memcmp(value->data, "0", 1) == 0);
+
+}
+
+/*
+ * Devolve as entries da tabela ordenadas por chave em *count.
+ * Retorna NULL em caso de erro.
+ */
+static struct entry_t **sorted_entries(struct table_t *table, int *count) {
+
+    struct entry_t **entries;
+
+    if((entries = table_get_entries(table)) == NULL) {
+        ERROR("table_get_entries");
+        return NULL;
+    }
+    *count = table_size(table);
+    qsort(entries, *count, sizeof(struct entry_t *), compare_entries);
+    return entries;
+
+}
+
+/*
+ * Escolhe as SSTables dos níveis 0 a maxLevel que podem ter key, da mais
+ * recente para a mais antiga (no máximo LSM_MAX_CANDIDATES).
+ * Tem de ser chamada com lsm->lock adquirido. Retorna o número de ficheiros.
+ */
+static int lsm_pick_files(struct lsm_t *lsm, char *key, int maxLevel, struct sstable_t **files) {
+
+    struct lsm_level_t *level;
+    int i, lo, hi, mid, n = 0;
+
+    // Em L0 os ficheiros sobrepõem-se: do mais recente para o mais antigo
+    level = &lsm->levels[0];
+    for(i = level->num_files - 1; i >= 0 && n < LSM_L0_STOP; i--) {
+        if(strcmp(key, level->files[i]->min_key) >= 0 && strcmp(key, level->files[i]->max_key) <= 0) {
+            files[n++] = level->files[i];
+        }
+    }
+
+    // Nos restantes níveis há no máximo um ficheiro que pode ter a chave
+    for(i = 1; i <= maxLevel; i++) {
+        level = &lsm->levels[i];
+        lo = 0;
+        hi = level->num_files - 1;
+        while(lo <= hi) {
+            mid = (lo + hi) / 2;
+            if(strcmp(key, level->files[mid]->min_key) < 0) {
+                hi = mid - 1;
+            }
+            else if(strcmp(key, level->files[mid]->max_key) > 0) {
+                lo = mid + 1;
+            }
+            else {
+                files[n++] = level->files[mid];
+                break;
+            }
+        }
+    }
+    return n;
+
+}
+
+/*
+ * Procura key nos n ficheiros, pela ordem dada. Em *value fica uma cópia da
+ * primeira versão encontrada.
+ * Retorna 1 (encontrada), 0 (não existe) ou -1 (erro).
+ */
+static int lsm_search_files(struct sstable_t **files, int n, char *key, struct data_t **value) {
+
+    int i, found = 0;
+
+    *value = NULL;
+    for(i = 0; i < n && found == 0; i++) {
+        found = sst_get(files[i], key, value);
+    }
+    return found;
+
+}
+
+/*
+ * Procura key nas SSTables. O lock só é usado para escolher e referenciar
+ * os ficheiros: as leituras são feitas sem ele. Em *version (se não for
+ * NULL) fica a versão dos níveis que foi consultada.
+ * Retorna 1 (encontrada), 0 (não existe) ou -1 (erro).
+ */
+static int lsm_get_files(struct lsm_t *lsm, char *key, struct data_t **value, long *version) {
+
+    struct sstable_t *files[LSM_MAX_CANDIDATES];
+    int i, n, found;
+
+    pthread_mutex_lock(&lsm->lock);
+    n = lsm_pick_files(lsm, key, LSM_MAX_LEVELS - 1, files);
+    for(i = 0; i < n; i++) {
+        sst_ref(files[i]);
+    }
+    if(version) {
+        *version = lsm->version;
+    }
+    pthread_mutex_unlock(&lsm->lock);
+
+    found = lsm_search_files(files, n, key, value);
+    for(i = 0; i < n; i++) {
+        sst_unref(files[i]);
+    }
+    return found;
+
+}
+
+/*
+ * Retorna 1 se key tem na memtable ou nos níveis 0 a maxLevel uma versão
+ * que esconde as dos níveis abaixo, ou 0 caso contrário.
+ * Tem de ser chamada com lsm->lock adquirido.
+ */
+static int lsm_superseded(struct lsm_t *lsm, char *key, int maxLevel) {
+
+    struct sstable_t *files[LSM_MAX_CANDIDATES];
+    struct data_t *data;
+    int found;
+
+    if((data = table_get(lsm->memtable, key)) == NULL) {
+        found = lsm_search_files(files, lsm_pick_files(lsm, key, maxLevel, files), key, &data);
+    }
+    else {
+        found = 1;
+    }
+    data_destroy(data);
+    return found != 0;
+
+}
+
+/*
+ * Escreve data na memtable e actualiza o número de chaves vivas. Com
+ * mustExist só escreve se key tiver uma versão viva.
+ * Devolve 0 (ok) ou -1 (erro ou, com mustExist, key not found).
+ */
+static int lsm_write(struct lsm_t *lsm, char *key, struct data_t *data, bool mustExist) {
+
+    struct sstable_t *files[LSM_MAX_CANDIDATES];
+    struct data_t *old;
+    long version = 0;
+    bool onDisk = false;
+    int wasLive, isLive, ret = 0;
+
+    // A versão anterior decide a variação do número de chaves vivas. A
+    // memtable só é alterada por esta thread; as SSTables são lidas sem lock
+    if((old = table_get(lsm->memtable, key)) == NULL) {
+        onDisk = true;
+        if(lsm_get_files(lsm, key, &old, &version) < 0) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    // Entretanto uma compactação pode ter descartado a versão encontrada
+    if(onDisk && version != lsm->version) {
+        data_destroy(old);
+        if(lsm_search_files(files, lsm_pick_files(lsm, key, LSM_MAX_LEVELS - 1, files), key, &old) < 0) {
+            pthread_mutex_unlock(&lsm->lock);
+            return -1;
+        }
+    }
+    wasLive = (old && old->timestamp != TS_DELETED);
+    data_destroy(old);
+
+    if(mustExist && !wasLive) {
+        ret = -1;
+    }
+    // Sob o lock, para a compactação ver a memtable e os contadores juntos
+    else if(table_put(lsm->memtable, key, data) != 0) {
+        ERROR("table_put");
+        ret = -1;
+    }
+    else {
+        isLive = (data->timestamp != TS_DELETED);
+        lsm->memtable_live += isLive - wasLive;
+        // O filtro de contagem acompanha as chaves vivas
+        if(lsm->filter && isLive != wasLive) {
+            if(isLive) {
+                bloom_add(lsm->filter, key);
+            }
+            else {
+                bloom_remove(lsm->filter, key);
+            }
+        }
+        // Contabilização aproximada: uma substituição conta como nova entrada
+        lsm->memtable_bytes += strlen(key) + 1 + data->datasize + LSM_ENTRY_OVERHEAD;
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return ret;
+
+}
+
+/*
+ * Calcula a variação das chaves vivas devida às entradas que já estão na
+ * memtable (recuperadas do log antes de lsm_open()).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int lsm_count_memtable(struct lsm_t *lsm) {
+
+    struct entry_t **entries;
+    struct data_t *old;
+    int i;
+
+    if((entries = table_get_entries(lsm->memtable)) == NULL) {
+        ERROR("table_get_entries");
+        return -1;
+    }
+    lsm->memtable_live = 0;
+    for(i = 0; entries[i]; i++) {
+        if(lsm_get_files(lsm, entries[i]->key, &old, NULL) < 0) {
+            table_free_entries(entries);
+            return -1;
+        }
+        lsm->memtable_live += (entries[i]->value->timestamp != TS_DELETED) -
+                              (old && old->timestamp != TS_DELETED);
+        data_destroy(old);
+    }
+    table_free_entries(entries);
+    return 0;
+
+}
+
+/*
+ * Conta as chaves vivas (só no arranque, com um manifesto sem contagem).
+ */
+static int count_visit(char *key, struct data_t *value, long deleted, void *arg) {
+
+    if(value->timestamp != TS_DELETED) {
+        (*(long *) arg)++;
+    }
+    return 0;
+
+}
+
+/*
+ * Abre (ou cria) uma árvore LSM cujos ficheiros usam o prefixo filename:
+ * o manifesto em filename+".lsm" e as SSTables em filename+".<seq>.sst".
+ * A tabela memtable passa a pertencer à árvore e é usada como memtable.
+ * Arranca também a thread de compactação em background.
+ * Retorna NULL em caso de erro.
+ */
+struct lsm_t *lsm_open(char *filename, struct table_t *memtable) {
+
+    struct lsm_t *lsm = NULL;
+    long total = 0;
+
+    if(filename == NULL || memtable == NULL) {
+        ERROR("NULL filename or memtable");
+        return NULL;
+    }
+
+    if((lsm = (struct lsm_t *) calloc(1, sizeof(struct lsm_t))) == NULL) {
+        ERROR("calloc lsm");
+        return NULL;
+    }
+    if((lsm->name = strdup(filename)) == NULL ||
+       (lsm->manifest_name = (char *) malloc(strlen(filename) + 5)) == NULL) {
+        ERROR("malloc names");
+        free(lsm->name);
+        free(lsm);
+        return NULL;
+    }
+    sprintf(lsm->manifest_name, "%s.lsm", filename);
+    lsm->memtable = memtable;
+    lsm->hash_size = memtable->hashSize;
+    lsm->next_seq = 1;
+    lsm->live_keys = -1;
+    // Até a thread de compactação arrancar não há nada a parar
+    lsm->quit = true;
+
+    if(pthread_mutex_init(&lsm->lock, NULL) != 0 || pthread_cond_init(&lsm->work, NULL) != 0 ||
+       pthread_cond_init(&lsm->done, NULL) != 0) {
+        ERROR("pthread init");
+        free(lsm->manifest_name);
+        free(lsm->name);
+        free(lsm);
+        return NULL;
+    }
+
+    // Recupera os níveis descritos no manifesto (se existir)
+    if(lsm_read_manifest(lsm) != 0) {
+        ERROR("lsm_read_manifest");
+        lsm->memtable = NULL;
+        lsm_close(lsm);
+        return NULL;
+    }
+
+    // O manifesto guarda as chaves vivas das SSTables; falta a memtable
+    // recuperada do log (e, num manifesto sem contagem, percorrer tudo)
+    if(lsm_count_memtable(lsm) != 0 || (lsm->live_keys < 0 && lsm_scan(lsm, count_visit, &total) != 0)) {
+        ERROR("contagem das chaves vivas");
+        lsm->memtable = NULL;
+        lsm_close(lsm);
+        return NULL;
+    }
+    if(lsm->live_keys < 0) {
+        lsm->live_keys = total - lsm->memtable_live;
+    }
+
+    lsm->quit = false;
+
+    if(pthread_create(&lsm->compactor, NULL, compaction_thread_function, lsm) != 0) {
+        ERROR("pthread_create compactor");
+        lsm->memtable = NULL;
+        lsm->quit = true;
+        lsm_close(lsm);
+        return NULL;
+    }
+    return lsm;
+
+}
+
+/*
+ * Liberta a árvore e, se remove_files, apaga o manifesto e as SSTables.
+ */
+static void lsm_free(struct lsm_t *lsm, bool remove_files) {
+
+    int level, i;
+    bool running;
+
+    if(lsm == NULL) {
+        return;
+    }
+
+    // Pára a thread de compactação (no fim de uma compactação em curso)
+    pthread_mutex_lock(&lsm->lock);
+    running = !lsm->quit;
+    lsm->quit = true;
+    pthread_cond_broadcast(&lsm->work);
+    pthread_cond_broadcast(&lsm->done);
+    pthread_mutex_unlock(&lsm->lock);
+    if(running) {
+        pthread_join(lsm->compactor, NULL);
+    }
+
+    for(level = 0; level < LSM_MAX_LEVELS; level++) {
+        for(i = 0; i < lsm->levels[level].num_files; i++) {
+            if(remove_files) {
+                unlink(lsm->levels[level].files[i]->name);
+            }
+            sst_close(lsm->levels[level].files[i]);
+        }
+        free(lsm->levels[level].files);
+        free(lsm->compact_pointer[level]);
+    }
+    if(remove_files) {
+        unlink(lsm->manifest_name);
+    }
+    if(lsm->memtable) {
+        table_destroy(lsm->memtable);
+    }
+    bloom_destroy(lsm->filter);
+    pthread_mutex_destroy(&lsm->lock);
+    pthread_cond_destroy(&lsm->work);
+    pthread_cond_destroy(&lsm->done);
+    free(lsm->manifest_name);
+    free(lsm->name);
+    free(lsm);
+
+}
+
+/*
+ * Pára a compactação e liberta toda a memória. Os ficheiros em disco são
+ * mantidos (a memtable que não foi escrita é recuperada do log).
+ */
+void lsm_close(struct lsm_t *lsm) {
+
+    lsm_free(lsm, false);
+
+}
+
+/*
+ * Como lsm_close(), mas apaga também o manifesto e todas as SSTables.
+ */
+void lsm_destroy(struct lsm_t *lsm) {
+
+    lsm_free(lsm, true);
+
+}
+
+/*
+ * Insere (ou substitui) key na memtable. Os dados são copiados.
+ * Devolve 0 (ok) ou -1 (out of memory).
+ */
+int lsm_put(struct lsm_t *lsm, char *key, struct data_t *data) {
+
+    if(lsm == NULL || key == NULL || data == NULL) {
+        ERROR("NULL lsm, key or data");
+        return -1;
+    }
+    return lsm_write(lsm, key, data, false);
+
+}
+
+/*
+ * Procura key na memtable e depois nas SSTables, da mais recente para a
+ * mais antiga. Devolve uma *CÓPIA* dos dados ou NULL se não existir.
+ */
+struct data_t *lsm_get(struct lsm_t *lsm, char *key) {
+
+    struct data_t *data = NULL;
+
+    if(lsm == NULL || key == NULL) {
+        ERROR("NULL lsm or key");
+        return NULL;
+    }
+
+    // A memtable tem sempre a versão mais recente
+    if((data = table_get(lsm->memtable, key)) == NULL) {
+        lsm_get_files(lsm, key, &data, NULL);
+    }
+
+    if(data && data->timestamp == TS_DELETED) {
+        data_destroy(data);
+        data = NULL;
+    }
+    return data;
+
+}
+
+/*
+ * Marca key como apagada. Devolve 0 (ok) ou -1 (key not found).
+ */
+int lsm_del(struct lsm_t *lsm, char *key) {
+
+    struct data_t *data;
+    int ret;
+
+    if(lsm == NULL || key == NULL) {
+        ERROR("NULL lsm or key");
+        return -1;
+    }
+
+    // A marca tem de esconder as versões antigas até à compactação final
+    if((data = data_create(0)) == NULL) {
+        ERROR("data_create");
+        return -1;
+    }
+    data->timestamp = TS_DELETED;
+    ret = lsm_write(lsm, key, data, true);
+    data_destroy(data);
+    return ret;
+
+}
+
+/*
+ * Devolve o número de chaves vivas, mantido pelas escritas, pelo flush e
+ * pela compactação. Como table_size(), conta os valores "0" e as chaves
+ * expiradas que ainda não foram removidas.
+ */
+int lsm_size(struct lsm_t *lsm) {
+
+    long count;
+
+    if(lsm == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&lsm->lock);
+    count = lsm->live_keys + lsm->memtable_live;
+    pthread_mutex_unlock(&lsm->lock);
+    return (int) count;
+
+}
+
+/*
+ * Copia as chaves vivas.
+ */
+static int keys_visit(char *key, struct data_t *value, long deleted, void *arg) {
+
+    struct keys_ctx_t *ctx = (struct keys_ctx_t *) arg;
+    char **tempKeys;
+
+    if(value->timestamp == TS_DELETED || data_expired(value, time(NULL))) {
+        return 0;
+    }
+    // Mantém sempre uma posição livre para o NULL final
+    if(ctx->num_keys + 1 >= ctx->capacity) {
+        if((tempKeys = (char **) realloc(ctx->keys, sizeof(char *) * ctx->capacity * 2)) == NULL) {
+            ERROR("realloc keys");
+            return -1;
+        }
+        ctx->keys = tempKeys;
+        ctx->capacity *= 2;
+    }
+    if((ctx->keys[ctx->num_keys] = strdup(key)) == NULL) {
+        ERROR("strdup key");
+        return -1;
+    }
+    ctx->num_keys++;
+    return 0;
+
+}
+
+/*
+ * Devolve um array de char * com a cópia de todas as keys vivas,
+ * ordenadas, e um último elemento a NULL.
+ */
+char **lsm_get_keys(struct lsm_t *lsm) {
+
+    struct keys_ctx_t ctx;
+
+    if(lsm == NULL) {
+        ERROR("NULL lsm");
+        return NULL;
+    }
+    ctx.num_keys = 0;
+    ctx.capacity = 16;
+    if((ctx.keys = (char **) malloc(sizeof(char *) * ctx.capacity)) == NULL) {
+        ERROR("malloc keys");
+        return NULL;
+    }
+    if(lsm_scan(lsm, keys_visit, &ctx) != 0) {
+        ctx.keys[ctx.num_keys] = NULL;
+        table_free_keys(ctx.keys);
+        return NULL;
+    }
+    ctx.keys[ctx.num_keys] = NULL;
+    return ctx.keys;
+
+}
+
+/*
+ * Acrescenta as chaves vivas ao filtro.
+ */
+static int filter_visit(char *key, struct data_t *value, long deleted, void *arg) {
+
+    if(value->timestamp != TS_DELETED) {
+        bloom_add((struct bloom_t *) arg, key);
+    }
+    return 0;
+
+}
+
+/*
+ * Constrói (percorrendo todos os níveis) um filtro de contagem com as chaves
+ * vivas, dimensionado para o dobro delas, e troca-o pelo actual. Não pode
+ * correr ao mesmo tempo que escritas.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int lsm_filter_build(struct lsm_t *lsm) {
+
+    struct bloom_t *filter, *oldFilter;
+    int numKeys = lsm_size(lsm) * 2;
+
+    if(numKeys < TABLE_FILTER_MIN_KEYS) {
+        numKeys = TABLE_FILTER_MIN_KEYS;
+    }
+    if((filter = bloom_create_counting(numKeys, BLOOM_BITS_PER_KEY)) == NULL) {
+        ERROR("bloom_create_counting");
+        return -1;
+    }
+    if(lsm_scan(lsm, filter_visit, filter) != 0) {
+        bloom_destroy(filter);
+        return -1;
+    }
+    // Uma chave que a compactação descartou entretanto fica como falso positivo
+    pthread_mutex_lock(&lsm->lock);
+    oldFilter = lsm->filter;
+    lsm->filter = filter;
+    lsm->filter_keys = numKeys;
+    pthread_mutex_unlock(&lsm->lock);
+    bloom_destroy(oldFilter);
+    return 0;
+
+}
+
+/*
+ * Devolve um filtro de bloom com todas as chaves vivas, serializado com
+ * bloom_to_data(). O filtro é construído no primeiro pedido e depois é
+ * mantido pelas escritas, pelo flush e pela compactação.
+ * Retorna NULL em caso de erro.
+ */
+struct data_t *lsm_get_filter(struct lsm_t *lsm) {
+
+    struct data_t *data;
+    bool built;
+
+    if(lsm == NULL) {
+        ERROR("NULL lsm");
+        return NULL;
+    }
+    pthread_mutex_lock(&lsm->lock);
+    built = (lsm->filter != NULL);
+    pthread_mutex_unlock(&lsm->lock);
+    if(!built && lsm_filter_build(lsm) != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    data = bloom_to_data(lsm->filter);
+    pthread_mutex_unlock(&lsm->lock);
+    return data;
+
+}
+
+/*
+ * Devolve a memtable corrente (e.g., para ser preenchida a partir do log).
+ */
+struct table_t *lsm_memtable(struct lsm_t *lsm) {
+
+    return (lsm ? lsm->memtable : NULL);
+
+}
+
+/*
+ * Retorna 1 se a memtable já ultrapassou LSM_MEMTABLE_SIZE bytes.
+ */
+int lsm_memtable_full(struct lsm_t *lsm) {
+
+    return (lsm && lsm->memtable_bytes >= LSM_MEMTABLE_SIZE);
+
+}
+
+/*
+ * Escreve a memtable numa nova SSTable do nível 0 e começa uma memtable
+ * vazia. Depois de retornar, o log que cobria a memtable pode ser rodado.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int lsm_flush(struct lsm_t *lsm) {
+
+    struct entry_t **entries;
+    struct sst_writer_t *writer;
+    struct sstable_t *sst;
+    struct table_t *newTable, *oldTable;
+    time_t now = time(NULL);
+    int i, count = 0;
+
+    if(lsm == NULL) {
+        ERROR("NULL lsm");
+        return -1;
+    }
+    if(table_size(lsm->memtable) <= 0) {
+        return 0;
+    }
+
+    if((entries = sorted_entries(lsm->memtable, &count)) == NULL) {
+        return -1;
+    }
+    if((writer = sst_writer_create(lsm)) == NULL) {
+        ERROR("sst_writer_create");
+        table_free_entries(entries);
+        return -1;
+    }
+    // As marcas de apagado também são escritas: escondem versões mais antigas.
+    // Um valor "0" leva o instante do flush, que nunca é anterior ao da
+    // remoção: o TOMBSTONE_TTL conta, no máximo, a mais
+    for(i = 0; i < count; i++) {
+        if(sst_writer_add(writer, entries[i]->key, entries[i]->value,
+                          lsm_is_tombstone(entries[i]->value) ? now : 0) != 0) {
+            ERROR("sst_writer_add");
+            sst_writer_abort(writer);
+            table_free_entries(entries);
+            return -1;
+        }
+    }
+    table_free_entries(entries);
+    if((sst = sst_writer_finish(writer)) == NULL) {
+        ERROR("sst_writer_finish");
+        return -1;
+    }
+
+    // Se não conseguirmos uma memtable nova mantemos a antiga, o que apenas
+    // duplica dados que vão ficar persistidos
+    if((newTable = table_create(lsm->hash_size)) == NULL) {
+        ERROR("table_create");
+    }
+
+    pthread_mutex_lock(&lsm->lock);
+    // Se a compactação não acompanha as escritas, esperamos por ela
+    while(lsm->levels[0].num_files >= LSM_L0_STOP && !lsm->quit) {
+        pthread_cond_signal(&lsm->work);
+        pthread_cond_wait(&lsm->done, &lsm->lock);
+    }
+    // As chaves vivas da memtable passam para as SSTables no mesmo manifesto
+    lsm->live_keys += lsm->memtable_live;
+    if(level_add(&lsm->levels[0], sst, false) != 0 || lsm_write_manifest(lsm) != 0) {
+        ERROR("level_add ou lsm_write_manifest");
+        lsm->live_keys -= lsm->memtable_live;
+        level_remove(&lsm->levels[0], sst);
+        pthread_mutex_unlock(&lsm->lock);
+        unlink(sst->name);
+        sst_close(sst);
+        if(newTable) {
+            table_destroy(newTable);
+        }
+        return -1;
+    }
+    lsm->memtable_live = 0;
+    // A compactação também consulta a memtable: é trocada sob o lock
+    oldTable = newTable ? lsm->memtable : NULL;
+    if(newTable) {
+        lsm->memtable = newTable;
+        lsm->memtable_bytes = 0;
+    }
+    pthread_cond_signal(&lsm->work);
+    pthread_mutex_unlock(&lsm->lock);
+
+    if(oldTable) {
+        table_destroy(oldTable);
+    }
+    // O filtro cresce com a árvore para manter os falsos positivos
+    if(lsm->filter && lsm_size(lsm) > lsm->filter_keys && lsm_filter_build(lsm) != 0) {
+        ERROR("lsm_filter_build");
+    }
+    return 0;
+
+}
+
+/*
+ * Funções auxiliares: SSTables.
+ */
+
+/*
+ * Devolve o nome do ficheiro da SSTable seq (alocado com malloc).
+ */
+char *sst_name(struct lsm_t *lsm, long seq) {
+
+    char *name;
+
+    if((name = (char *) malloc(strlen(lsm->name) + 32)) == NULL) {
+        ERROR("malloc name");
+        return NULL;
+    }
+    sprintf(name, "%s.%ld.sst", lsm->name, seq);
+    return name;
+
+}
+
+/*
+ * Cria um escritor para uma SSTable nova, com o próximo número de sequência.
+ * Não pode ser chamada com lsm->lock adquirido.
+ */
+struct sst_writer_t *sst_writer_create(struct lsm_t *lsm) {
+
+    struct sst_writer_t *writer;
+
+    if((writer = (struct sst_writer_t *) calloc(1, sizeof(struct sst_writer_t))) == NULL) {
+        ERROR("calloc writer");
+        return NULL;
+    }
+    pthread_mutex_lock(&lsm->lock);
+    writer->seq = lsm->next_seq++;
+    pthread_mutex_unlock(&lsm->lock);
+
+    if((writer->name = sst_name(lsm, writer->seq)) == NULL) {
+        free(writer);
+        return NULL;
+    }
+    if((writer->fd = open(writer->name, O_WRONLY | O_CREAT | O_TRUNC, LSM_PERMISSIONS)) == -1) {
+        LOG_PERROR("open sstable");
+        free(writer->name);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+
+}
+
+/*
+ * Escreve o bloco corrente e começa um novo.
+ */
+static int sst_writer_flush_block(struct sst_writer_t *writer) {
+
+    if(writer->block_size == 0) {
+        return 0;
+    }
+    if(write_all(writer->fd, writer->block, writer->block_size) != 0) {
+        ERROR("write block");
+        return -1;
+    }
+    writer->index[writer->num_blocks - 1].size = writer->block_size;
+    writer->offset += writer->block_size;
+    writer->block_size = 0;
+    return 0;
+
+}
+
+/*
+ * Acrescenta uma entrada à SSTable. As chaves têm de chegar por ordem
+ * crescente. Retorna 0 (ok) ou -1 (erro).
+ */
+int sst_writer_add(struct sst_writer_t *writer, char *key, struct data_t *value, long deleted) {
+
+    uint32_t keyLength = (uint32_t) strlen(key) + 1;
+    int64_t timestamp = value->timestamp;
+    int64_t expires = value->expires;
+    int64_t deletedAt = deleted;
+    int32_t datasize = value->datasize;
+    int recordSize = sizeof(keyLength) + keyLength + sizeof(timestamp) + sizeof(expires) + sizeof(deletedAt) +
+                     sizeof(datasize) + datasize;
+    char *ptr, *tempBlock;
+    void *tempArray;
+
+    if(writer->block_size > 0 && writer->block_size + recordSize > LSM_BLOCK_SIZE) {
+        if(sst_writer_flush_block(writer) != 0) {
+            return -1;
+        }
+    }
+
+    // A primeira chave de cada bloco vai para o índice
+    if(writer->block_size == 0) {
+        if(writer->num_blocks == writer->index_capacity) {
+            writer->index_capacity = writer->index_capacity ? writer->index_capacity * 2 : 16;
+            if((tempArray = realloc(writer->index, sizeof(struct sst_index_t) * writer->index_capacity)) == NULL) {
+                ERROR("realloc index");
+                return -1;
+            }
+            writer->index = (struct sst_index_t *) tempArray;
+        }
+        if((writer->index[writer->num_blocks].first_key = strdup(key)) == NULL) {
+            ERROR("strdup first_key");
+            return -1;
+        }
+        writer->index[writer->num_blocks].offset = writer->offset;
+        writer->index[writer->num_blocks].size = 0;
+        writer->num_blocks++;
+    }
+
+    if(writer->block_size + recordSize > writer->block_capacity) {
+        if((tempBlock = (char *) realloc(writer->block, writer->block_size + recordSize)) == NULL) {
+            ERROR("realloc block");
+            return -1;
+        }
+        writer->block = tempBlock;
+        writer->block_capacity = writer->block_size + recordSize;
+    }
+    ptr = writer->block + writer->block_size;
+    memcpy(ptr, &keyLength, sizeof(keyLength));
+    ptr += sizeof(keyLength);
+    memcpy(ptr, key, keyLength);
+    ptr += keyLength;
+    memcpy(ptr, &timestamp, sizeof(timestamp));
+    ptr += sizeof(timestamp);
+    memcpy(ptr, &expires, sizeof(expires));
+    ptr += sizeof(expires);
+    memcpy(ptr, &deletedAt, sizeof(deletedAt));
+    ptr += sizeof(deletedAt);
+    memcpy(ptr, &datasize, sizeof(datasize));
+    ptr += sizeof(datasize);
+    if(datasize > 0) {
+        memcpy(ptr, value->data, datasize);
+    }
+    writer->block_size += recordSize;
+
+    if(writer->num_entries == writer->hashes_capacity) {
+        writer->hashes_capacity = writer->hashes_capacity ? writer->hashes_capacity * 2 : 64;
+        if((tempArray = realloc(writer->hashes, sizeof(uint64_t) * writer->hashes_capacity)) == NULL) {
+            ERROR("realloc hashes");
+            return -1;
+        }
+        writer->hashes = (uint64_t *) tempArray;
+    }
+    writer->hashes[writer->num_entries++] = bloom_hash(key);
+
+    free(writer->last_key);
+    if((writer->last_key = strdup(key)) == NULL) {
+        ERROR("strdup last_key");
+        return -1;
+    }
+    return 0;
+
+}
+
+/*
+ * Liberta a memória do escritor (não mexe no ficheiro).
+ */
+static void sst_writer_free(struct sst_writer_t *writer) {
+
+    int i;
+
+    for(i = 0; i < writer->num_blocks; i++) {
+        free(writer->index[i].first_key);
+    }
+    free(writer->index);
+    free(writer->block);
+    free(writer->hashes);
+    free(writer->last_key);
+    free(writer->name);
+    free(writer);
+
+}
+
+/*
+ * Escreve o índice, o filtro e o rodapé, sincroniza o ficheiro e abre-o para
+ * leitura. Retorna NULL em caso de erro (o ficheiro é apagado).
+ */
+struct sstable_t *sst_writer_finish(struct sst_writer_t *writer) {
+
+    struct sst_footer_t footer;
+    struct bloom_t *bloom = NULL;
+    struct data_t *bloomData = NULL;
+    struct sstable_t *sst = NULL;
+    char *indexBuffer = NULL, *ptr;
+    int i, indexSize = 0;
+    uint32_t keyLength;
+    int64_t offset;
+    int32_t size;
+
+    if(writer->num_entries == 0 || sst_writer_flush_block(writer) != 0) {
+        sst_writer_abort(writer);
+        return NULL;
+    }
+
+    // Índice: primeira chave, offset e tamanho de cada bloco + última chave
+    for(i = 0; i < writer->num_blocks; i++) {
+        indexSize += sizeof(keyLength) + strlen(writer->index[i].first_key) + 1 + sizeof(offset) + sizeof(size);
+    }
+    indexSize += sizeof(keyLength) + strlen(writer->last_key) + 1;
+    if((ptr = indexBuffer = (char *) malloc(indexSize)) == NULL) {
+        ERROR("malloc indexBuffer");
+        sst_writer_abort(writer);
+        return NULL;
+    }
+    for(i = 0; i < writer->num_blocks; i++) {
+        keyLength = (uint32_t) strlen(writer->index[i].first_key) + 1;
+        offset = writer->index[i].offset;
+        size = writer->index[i].size;
+        memcpy(ptr, &keyLength, sizeof(keyLength));
+        ptr += sizeof(keyLength);
+        memcpy(ptr, writer->index[i].first_key, keyLength);
+        ptr += keyLength;
+        memcpy(ptr, &offset, sizeof(offset));
+        ptr += sizeof(offset);
+        memcpy(ptr, &size, sizeof(size));
+        ptr += sizeof(size);
+    }
+    keyLength = (uint32_t) strlen(writer->last_key) + 1;
+    memcpy(ptr, &keyLength, sizeof(keyLength));
+    ptr += sizeof(keyLength);
+    memcpy(ptr, writer->last_key, keyLength);
+
+    // Filtro de bloom de todas as chaves
+    if((bloom = bloom_create(writer->num_entries, BLOOM_BITS_PER_KEY)) == NULL) {
+        free(indexBuffer);
+        sst_writer_abort(writer);
+        return NULL;
+    }
+    for(i = 0; i < writer->num_entries; i++) {
+        bloom_add_hash(bloom, writer->hashes[i]);
+    }
+    bloomData = bloom_to_data(bloom);
+    bloom_destroy(bloom);
+    if(bloomData == NULL) {
+        free(indexBuffer);
+        sst_writer_abort(writer);
+        return NULL;
+    }
+
+    memset(&footer, 0, sizeof(footer));
+    footer.index_offset = writer->offset;
+    footer.index_size = indexSize;
+    footer.bloom_offset = writer->offset + indexSize;
+    footer.bloom_size = bloomData->datasize;
+    footer.num_entries = writer->num_entries;
+    footer.num_blocks = writer->num_blocks;
+    footer.magic = LSM_MAGIC;
+
+    if(write_all(writer->fd, indexBuffer, indexSize) != 0 ||
+       write_all(writer->fd, bloomData->data, bloomData->datasize) != 0 ||
+       write_all(writer->fd, &footer, sizeof(footer)) != 0 ||
+       fsync(writer->fd) != 0) {
+        ERROR("write/fsync sstable");
+        free(indexBuffer);
+        data_destroy(bloomData);
+        sst_writer_abort(writer);
+        return NULL;
+    }
+    free(indexBuffer);
+    data_destroy(bloomData);
+    close(writer->fd);
+
+    if((sst = sst_open(writer->name, writer->seq)) == NULL) {
+        ERROR("sst_open");
+        unlink(writer->name);
+    }
+    sst_writer_free(writer);
+    return sst;
+
+}
+
+/*
+ * Desiste da SSTable: fecha e apaga o ficheiro e liberta o escritor.
+ */
+void sst_writer_abort(struct sst_writer_t *writer) {
+
+    if(writer) {
+        close(writer->fd);
+        unlink(writer->name);
+        sst_writer_free(writer);
+    }
+
+}
+
+/*
+ * Abre uma SSTable e carrega para memória o índice e o filtro de bloom.
+ * Retorna NULL em caso de erro.
+ */
+struct sstable_t *sst_open(char *name, long seq) {
+
+    struct sstable_t *sst;
+    struct sst_footer_t footer;
+    struct data_t bloomData;
+    struct stat buf;
+    char *indexBuffer = NULL, *ptr, *end;
+    uint32_t keyLength;
+    int64_t offset;
+    int32_t size;
+    int i;
+
+    if((sst = (struct sstable_t *) calloc(1, sizeof(struct sstable_t))) == NULL) {
+        ERROR("calloc sst");
+        return NULL;
+    }
+    sst->seq = seq;
+    sst->refs = 1;
+    if((sst->name = strdup(name)) == NULL || (sst->fd = open(name, O_RDONLY)) == -1) {
+        LOG_PERROR("sst_open");
+        free(sst->name);
+        free(sst);
+        return NULL;
+    }
+    if(fstat(sst->fd, &buf) != 0 || buf.st_size < (off_t) sizeof(footer) ||
+       pread_all(sst->fd, &footer, sizeof(footer), buf.st_size - sizeof(footer)) != 0 ||
+       footer.magic != LSM_MAGIC || footer.num_blocks <= 0) {
+        ERROR("sstable corrompida");
+        sst_close(sst);
+        return NULL;
+    }
+    sst->file_size = buf.st_size;
+    sst->num_entries = footer.num_entries;
+
+    if((sst->index = (struct sst_index_t *) calloc(footer.num_blocks, sizeof(struct sst_index_t))) == NULL ||
+       (indexBuffer = (char *) malloc(footer.index_size)) == NULL ||
+       pread_all(sst->fd, indexBuffer, footer.index_size, footer.index_offset) != 0) {
+        ERROR("leitura do indice");
+        free(indexBuffer);
+        sst_close(sst);
+        return NULL;
+    }
+    sst->num_blocks = footer.num_blocks;
+
+    ptr = indexBuffer;
+    end = indexBuffer + footer.index_size;
+    for(i = 0; i <= sst->num_blocks; i++) {
+        if(ptr + sizeof(keyLength) > end) {
+            break;
+        }
+        memcpy(&keyLength, ptr, sizeof(keyLength));
+        ptr += sizeof(keyLength);
+        if(ptr + keyLength > end || ptr[keyLength - 1] != '\0') {
+            break;
+        }
+        // A última chave do índice é a maior chave da tabela
+        if(i == sst->num_blocks) {
+            sst->max_key = strdup(ptr);
+            break;
+        }
+        sst->index[i].first_key = strdup(ptr);
+        ptr += keyLength;
+        if(ptr + sizeof(offset) + sizeof(size) > end) {
+            break;
+        }
+        memcpy(&offset, ptr, sizeof(offset));
+        ptr += sizeof(offset);
+        memcpy(&size, ptr, sizeof(size));
+        ptr += sizeof(size);
+        sst->index[i].offset = offset;
+        sst->index[i].size = size;
+    }
+    free(indexBuffer);
+    if(sst->max_key == NULL || sst->index[0].first_key == NULL ||
+       (sst->min_key = strdup(sst->index[0].first_key)) == NULL) {
+        ERROR("indice corrompido");
+        sst_close(sst);
+        return NULL;
+    }
+
+    bloomData.datasize = footer.bloom_size;
+    bloomData.timestamp = 0;
+    if((bloomData.data = malloc(footer.bloom_size)) == NULL ||
+       pread_all(sst->fd, bloomData.data, footer.bloom_size, footer.bloom_offset) != 0 ||
+       (sst->bloom = bloom_from_data(&bloomData)) == NULL) {
+        ERROR("leitura do bloom");
+        free(bloomData.data);
+        sst_close(sst);
+        return NULL;
+    }
+    free(bloomData.data);
+    return sst;
+
+}
+
+/*
+ * Fecha a SSTable e liberta a memória (não apaga o ficheiro).
+ */
+void sst_close(struct sstable_t *sst) {
+
+    int i;
+
+    if(sst) {
+        if(sst->fd > 0) {
+            close(sst->fd);
+        }
+        if(sst->index) {
+            for(i = 0; i < sst->num_blocks; i++) {
+                free(sst->index[i].first_key);
+            }
+            free(sst->index);
+        }
+        bloom_destroy(sst->bloom);
+        free(sst->min_key);
+        free(sst->max_key);
+        free(sst->name);
+        free(sst);
+    }
+
+}
+
+/*
+ * Acrescenta uma referência à SSTable. Chamada com lsm->lock adquirido (o
+ * nível ainda tem a sua referência).
+ */
+void sst_ref(struct sstable_t *sst) {
+
+    __atomic_add_fetch(&sst->refs, 1, __ATOMIC_RELAXED);
+
+}
+
+/*
+ * Larga uma referência à SSTable e fecha-a se era a última.
+ */
+void sst_unref(struct sstable_t *sst) {
+
+    if(__atomic_sub_fetch(&sst->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        sst_close(sst);
+    }
+
+}
+
+/*
+ * Procura key na SSTable. Em *value fica uma cópia dos dados encontrados.
+ * Retorna 1 (encontrada), 0 (não existe) ou -1 (erro).
+ */
+int sst_get(struct sstable_t *sst, char *key, struct data_t **value) {
+
+    int lo, hi, mid, block = 0, pos = 0, cmp, ret = 0;
+    char *buf, *recordKey;
+    uint32_t keyLength;
+    int64_t timestamp, expires;
+    int32_t datasize;
+
+    *value = NULL;
+    if(strcmp(key, sst->min_key) < 0 || strcmp(key, sst->max_key) > 0 ||
+       !bloom_may_contain(sst->bloom, key)) {
+        return 0;
+    }
+
+    // Último bloco cuja primeira chave é <= key
+    lo = 0;
+    hi = sst->num_blocks - 1;
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(strcmp(sst->index[mid].first_key, key) <= 0) {
+            block = mid;
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+
+    if((buf = (char *) malloc(sst->index[block].size)) == NULL) {
+        ERROR("malloc block");
+        return -1;
+    }
+    if(pread_all(sst->fd, buf, sst->index[block].size, sst->index[block].offset) != 0) {
+        ERROR("pread block");
+        free(buf);
+        return -1;
+    }
+
+    while(pos < sst->index[block].size) {
+        memcpy(&keyLength, buf + pos, sizeof(keyLength));
+        recordKey = buf + pos + sizeof(keyLength);
+        pos += sizeof(keyLength) + keyLength;
+        memcpy(&timestamp, buf + pos, sizeof(timestamp));
+        pos += sizeof(timestamp);
+        memcpy(&expires, buf + pos, sizeof(expires));
+        pos += sizeof(expires) + sizeof(int64_t);
+        memcpy(&datasize, buf + pos, sizeof(datasize));
+        pos += sizeof(datasize);
+
+        if((cmp = strcmp(recordKey, key)) == 0) {
+            if((*value = data_create(datasize)) == NULL) {
+                ERROR("data_create");
+                ret = -1;
+            }
+            else {
+                if(datasize > 0) {
+                    memcpy((*value)->data, buf + pos, datasize);
+                }
+                (*value)->timestamp = timestamp;
+                (*value)->expires = expires;
+                ret = 1;
+            }
+            break;
+        }
+        else if(cmp > 0) {
+            // As chaves estão ordenadas, já passámos a posição
+            break;
+        }
+        pos += datasize;
+    }
+    free(buf);
+    return ret;
+
+}
+
+/*
+ * Funções auxiliares: níveis e manifesto.
+ */
+
+/*
+ * Acrescenta sst ao nível (ordenado por min_key se sorted).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int level_add(struct lsm_level_t *level, struct sstable_t *sst, bool sorted) {
+
+    struct sstable_t **tempFiles;
+
+    if(level->num_files == level->capacity) {
+        level->capacity = level->capacity ? level->capacity * 2 : 8;
+        if((tempFiles = (struct sstable_t **) realloc(level->files,
+                sizeof(struct sstable_t *) * level->capacity)) == NULL) {
+            ERROR("realloc files");
+            return -1;
+        }
+        level->files = tempFiles;
+    }
+    level->files[level->num_files++] = sst;
+    level->bytes += sst->file_size;
+    if(sorted) {
+        qsort(level->files, level->num_files, sizeof(struct sstable_t *), compare_sstables);
+    }
+    return 0;
+
+}
+
+/*
+ * Retira sst do nível (não fecha o ficheiro).
+ */
+void level_remove(struct lsm_level_t *level, struct sstable_t *sst) {
+
+    int i;
+
+    for(i = 0; i < level->num_files; i++) {
+        if(level->files[i] == sst) {
+            memmove(&level->files[i], &level->files[i + 1],
+                    sizeof(struct sstable_t *) * (level->num_files - i - 1));
+            level->num_files--;
+            level->bytes -= sst->file_size;
+            return;
+        }
+    }
+
+}
+
+/*
+ * Reescreve o manifesto (ficheiro temporário + rename, para ser atómico).
+ * Tem de ser chamada com lsm->lock adquirido.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int lsm_write_manifest(struct lsm_t *lsm) {
+
+    char *tempName;
+    FILE *file;
+    int level, i, ret = 0;
+
+    if((tempName = (char *) malloc(strlen(lsm->manifest_name) + 5)) == NULL) {
+        ERROR("malloc tempName");
+        return -1;
+    }
+    sprintf(tempName, "%s.tmp", lsm->manifest_name);
+    if((file = fopen(tempName, "w")) == NULL) {
+        LOG_PERROR("fopen manifest");
+        free(tempName);
+        return -1;
+    }
+    fprintf(file, "seq %ld\nlive %ld\n", lsm->next_seq, lsm->live_keys);
+    for(level = 0; level < LSM_MAX_LEVELS; level++) {
+        for(i = 0; i < lsm->levels[level].num_files; i++) {
+            fprintf(file, "%d %ld\n", level, lsm->levels[level].files[i]->seq);
+        }
+    }
+    if(fflush(file) != 0 || fsync(fileno(file)) != 0) {
+        ERROR("fflush/fsync manifest");
+        ret = -1;
+    }
+    fclose(file);
+    if(ret == 0 && rename(tempName, lsm->manifest_name) != 0) {
+        LOG_PERROR("rename manifest");
+        ret = -1;
+    }
+    free(tempName);
+    return ret;
+
+}
+
+/*
+ * Carrega os níveis descritos no manifesto. Um manifesto inexistente
+ * corresponde a uma árvore vazia.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int lsm_read_manifest(struct lsm_t *lsm) {
+
+    FILE *file;
+    struct sstable_t *sst;
+    char *name;
+    int level, ret = 0;
+    long seq;
+
+    if((file = fopen(lsm->manifest_name, "r")) == NULL) {
+        return (errno == ENOENT ? 0 : -1);
+    }
+    if(fscanf(file, "seq %ld\n", &lsm->next_seq) != 1) {
+        ERROR("manifesto corrompido");
+        fclose(file);
+        return -1;
+    }
+    // Um manifesto antigo não tem a contagem: lsm_open() percorre tudo
+    if(fscanf(file, "live %ld\n", &lsm->live_keys) != 1) {
+        lsm->live_keys = -1;
+    }
+    while(ret == 0 && fscanf(file, "%d %ld\n", &level, &seq) == 2) {
+        if(level < 0 || level >= LSM_MAX_LEVELS || (name = sst_name(lsm, seq)) == NULL) {
+            ERROR("manifesto corrompido");
+            ret = -1;
+        }
+        else {
+            if((sst = sst_open(name, seq)) == NULL ||
+               level_add(&lsm->levels[level], sst, level > 0) != 0) {
+                ERROR("sstable em falta");
+                sst_close(sst);
+                ret = -1;
+            }
+            free(name);
+        }
+    }
+    fclose(file);
+    return ret;
+
+}
+
+/*
+ * Funções auxiliares: iteradores e fusão.
+ */
+
+/*
+ * Inicia um iterador sobre entries (ordenadas) ou sobre files (ordenados
+ * e sem sobreposição) e posiciona-o na primeira chave.
+ */
+void lsm_iter_init(struct lsm_iter_t *iter, struct entry_t **entries, int num_entries,
+                   struct sstable_t **files, int num_files, int rank) {
+
+    memset(iter, 0, sizeof(struct lsm_iter_t));
+    iter->entries = entries;
+    iter->num_entries = num_entries;
+    iter->files = files;
+    iter->num_files = num_files;
+    iter->block = -1;
+    iter->pos = -1;
+    iter->rank = rank;
+    iter->valid = true;
+    lsm_iter_next(iter);
+
+}
+
+/*
+ * Avança o iterador para a chave seguinte (valid fica a false no fim).
+ */
+void lsm_iter_next(struct lsm_iter_t *iter) {
+
+    struct sstable_t *sst;
+    uint32_t keyLength;
+    int64_t timestamp, expires, deleted;
+    int32_t datasize;
+    char *tempBuf;
+
+    if(!iter->valid) {
+        return;
+    }
+
+    if(iter->files == NULL) {
+        iter->pos++;
+        if(iter->pos >= iter->num_entries) {
+            iter->valid = false;
+            return;
+        }
+        iter->key = iter->entries[iter->pos]->key;
+        iter->value = *iter->entries[iter->pos]->value;
+        return;
+    }
+
+    while(true) {
+        if(iter->buf && iter->pos >= 0 && iter->pos < iter->buf_size) {
+            memcpy(&keyLength, iter->buf + iter->pos, sizeof(keyLength));
+            iter->key = iter->buf + iter->pos + sizeof(keyLength);
+            iter->pos += sizeof(keyLength) + keyLength;
+            memcpy(&timestamp, iter->buf + iter->pos, sizeof(timestamp));
+            iter->pos += sizeof(timestamp);
+            memcpy(&expires, iter->buf + iter->pos, sizeof(expires));
+            iter->pos += sizeof(expires);
+            memcpy(&deleted, iter->buf + iter->pos, sizeof(deleted));
+            iter->pos += sizeof(deleted);
+            memcpy(&datasize, iter->buf + iter->pos, sizeof(datasize));
+            iter->pos += sizeof(datasize);
+            iter->value.timestamp = timestamp;
+            iter->value.expires = expires;
+            iter->deleted = deleted;
+            iter->value.datasize = datasize;
+            iter->value.data = iter->buf + iter->pos;
+            iter->pos += datasize;
+            return;
+        }
+
+        // Bloco seguinte, passando ao ficheiro seguinte se necessário
+        iter->block++;
+        if(iter->file >= iter->num_files) {
+            iter->valid = false;
+            return;
+        }
+        sst = iter->files[iter->file];
+        if(iter->block >= sst->num_blocks) {
+            iter->file++;
+            iter->block = -1;
+            iter->pos = -1;
+            continue;
+        }
+        if(sst->index[iter->block].size > iter->buf_capacity) {
+            if((tempBuf = (char *) realloc(iter->buf, sst->index[iter->block].size)) == NULL) {
+                ERROR("realloc buf");
+                iter->valid = false;
+                return;
+            }
+            iter->buf = tempBuf;
+            iter->buf_capacity = sst->index[iter->block].size;
+        }
+        if(pread_all(sst->fd, iter->buf, sst->index[iter->block].size, sst->index[iter->block].offset) != 0) {
+            ERROR("pread block");
+            iter->valid = false;
+            return;
+        }
+        iter->buf_size = sst->index[iter->block].size;
+        iter->pos = 0;
+    }
+
+}
+
+/*
+ * Liberta a memória usada pelo iterador.
+ */
+void lsm_iter_free(struct lsm_iter_t *iter) {
+
+    free(iter->buf);
+    iter->buf = NULL;
+
+}
+
+/*
+ * Funde n iteradores, chamando visit para cada chave com a versão da fonte
+ * de menor rank. Retorna 0 (ok) ou -1 (visit abortou).
+ */
+int lsm_merge(struct lsm_iter_t *iters, int n, lsm_visit_t visit, void *arg) {
+
+    int i, best, cmp;
+
+    while(true) {
+        best = -1;
+        for(i = 0; i < n; i++) {
+            if(!iters[i].valid) {
+                continue;
+            }
+            if(best < 0 || (cmp = strcmp(iters[i].key, iters[best].key)) < 0 ||
+               (cmp == 0 && iters[i].rank < iters[best].rank)) {
+                best = i;
+            }
+        }
+        if(best < 0) {
+            return 0;
+        }
+        if(visit(iters[best].key, &iters[best].value, iters[best].deleted, arg) != 0) {
+            return -1;
+        }
+        // As versões mais antigas da mesma chave são ignoradas
+        for(i = 0; i < n; i++) {
+            while(i != best && iters[i].valid && strcmp(iters[i].key, iters[best].key) == 0) {
+                lsm_iter_next(&iters[i]);
+            }
+        }
+        lsm_iter_next(&iters[best]);
+    }
+
+}
+
+/*
+ * Percorre por ordem todas as chaves (memtable e todos os níveis), passando
+ * a visit a versão mais recente de cada uma (incluindo marcas de apagado).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int lsm_scan(struct lsm_t *lsm, lsm_visit_t visit, void *arg) {
+
+    struct entry_t **entries;
+    struct lsm_iter_t *iters = NULL;
+    struct sstable_t **files = NULL;
+    int counts[LSM_MAX_LEVELS];
+    int i, level, n = 0, count = 0, rank = 0, numFiles = 0, ret;
+
+    if((entries = sorted_entries(lsm->memtable, &count)) == NULL) {
+        return -1;
+    }
+
+    // Sob o lock só se copiam e referenciam os ficheiros; a fusão (e as
+    // leituras) é feita sem ele
+    pthread_mutex_lock(&lsm->lock);
+    for(level = 0; level < LSM_MAX_LEVELS; level++) {
+        numFiles += lsm->levels[level].num_files;
+    }
+    if((files = (struct sstable_t **) malloc(sizeof(struct sstable_t *) * (numFiles + 1))) == NULL ||
+       (iters = (struct lsm_iter_t *) malloc(sizeof(struct lsm_iter_t) *
+            (1 + lsm->levels[0].num_files + LSM_MAX_LEVELS))) == NULL) {
+        ERROR("malloc iters");
+        pthread_mutex_unlock(&lsm->lock);
+        free(files);
+        table_free_entries(entries);
+        return -1;
+    }
+    numFiles = 0;
+    // Em L0 do mais recente para o mais antigo, nos outros níveis por ordem
+    for(i = lsm->levels[0].num_files - 1; i >= 0; i--) {
+        files[numFiles++] = lsm->levels[0].files[i];
+    }
+    counts[0] = numFiles;
+    for(level = 1; level < LSM_MAX_LEVELS; level++) {
+        for(i = 0; i < lsm->levels[level].num_files; i++) {
+            files[numFiles++] = lsm->levels[level].files[i];
+        }
+        counts[level] = lsm->levels[level].num_files;
+    }
+    for(i = 0; i < numFiles; i++) {
+        sst_ref(files[i]);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+
+    lsm_iter_init(&iters[n++], entries, count, NULL, 0, rank++);
+    for(i = 0; i < counts[0]; i++) {
+        lsm_iter_init(&iters[n++], NULL, 0, &files[i], 1, rank++);
+    }
+    for(level = 1, i = counts[0]; level < LSM_MAX_LEVELS; i += counts[level], level++) {
+        if(counts[level] > 0) {
+            lsm_iter_init(&iters[n++], NULL, 0, &files[i], counts[level], rank++);
+        }
+    }
+
+    ret = lsm_merge(iters, n, visit, arg);
+
+    for(i = 0; i < n; i++) {
+        lsm_iter_free(&iters[i]);
+    }
+    for(i = 0; i < numFiles; i++) {
+        sst_unref(files[i]);
+    }
+    free(iters);
+    free(files);
+    table_free_entries(entries);
+    return ret;
+
+}
+
+/*
+ * Funções auxiliares: compactação.
+ */
+
+/*
+ * Termina a SSTable de saída corrente (se existir) e junta-a às saídas.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int compaction_finish_output(struct compaction_ctx_t *ctx) {
+
+    struct sstable_t **tempOutputs;
+    struct sstable_t *sst;
+
+    if(ctx->writer == NULL) {
+        return 0;
+    }
+    if(ctx->num_outputs == ctx->capacity) {
+        ctx->capacity = ctx->capacity ? ctx->capacity * 2 : 4;
+        if((tempOutputs = (struct sstable_t **) realloc(ctx->outputs,
+                sizeof(struct sstable_t *) * ctx->capacity)) == NULL) {
+            ERROR("realloc outputs");
+            return -1;
+        }
+        ctx->outputs = tempOutputs;
+    }
+    sst = sst_writer_finish(ctx->writer);
+    ctx->writer = NULL;
+    if(sst == NULL) {
+        return -1;
+    }
+    ctx->outputs[ctx->num_outputs++] = sst;
+    return 0;
+
+}
+
+/*
+ * Guarda a chave de uma versão viva descartada pela compactação.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int compaction_drop(struct compaction_ctx_t *ctx, char *key) {
+
+    char **tempDropped;
+
+    if(ctx->num_dropped == ctx->dropped_capacity) {
+        ctx->dropped_capacity = ctx->dropped_capacity ? ctx->dropped_capacity * 2 : 16;
+        if((tempDropped = (char **) realloc(ctx->dropped, sizeof(char *) * ctx->dropped_capacity)) == NULL) {
+            ERROR("realloc dropped");
+            return -1;
+        }
+        ctx->dropped = tempDropped;
+    }
+    if((ctx->dropped[ctx->num_dropped] = strdup(key)) == NULL) {
+        ERROR("strdup key");
+        return -1;
+    }
+    ctx->num_dropped++;
+    return 0;
+
+}
+
+/*
+ * Escreve cada chave fundida nas SSTables de saída, mudando de ficheiro
+ * quando o corrente atinge LSM_SST_SIZE.
+ */
+static int compaction_visit(char *key, struct data_t *value, long deleted, void *arg) {
+
+    struct compaction_ctx_t *ctx = (struct compaction_ctx_t *) arg;
+    time_t now = time(NULL);
+
+    // No último nível já não há versões antigas para esconder. Um valor "0"
+    // ainda tem de ganhar às réplicas desactualizadas até passar o
+    // TOMBSTONE_TTL (como na fila de tombstones do motor em memória)
+    if(ctx->drop_deleted && (value->timestamp == TS_DELETED || data_expired(value, now) ||
+       (lsm_is_tombstone(value) && deleted > 0 && deleted + TOMBSTONE_TTL <= now))) {
+        // Uma versão viva descartada pode deixar de contar como chave viva
+        return (value->timestamp == TS_DELETED ? 0 : compaction_drop(ctx, key));
+    }
+
+    if(ctx->writer == NULL && (ctx->writer = sst_writer_create(ctx->lsm)) == NULL) {
+        return -1;
+    }
+    if(sst_writer_add(ctx->writer, key, value, deleted) != 0) {
+        return -1;
+    }
+
+    if(ctx->writer->offset + ctx->writer->block_size >= LSM_SST_SIZE) {
+        return compaction_finish_output(ctx);
+    }
+    return 0;
+
+}
+
+/*
+ * Thread de compactação: espera por trabalho e compacta um nível de cada vez.
+ */
+void *compaction_thread_function(void *arg) {
+
+    struct lsm_t *lsm = (struct lsm_t *) arg;
+    int level;
+
+    pthread_mutex_lock(&lsm->lock);
+    while(!lsm->quit) {
+        if((level = lsm_pick_compaction(lsm)) < 0) {
+            pthread_cond_wait(&lsm->work, &lsm->lock);
+            continue;
+        }
+        if(lsm_compact(lsm, level) != 0) {
+            // Evita repetir em ciclo uma compactação que está a falhar
+            ERROR("lsm_compact");
+            pthread_cond_broadcast(&lsm->done);
+            pthread_cond_wait(&lsm->work, &lsm->lock);
+            continue;
+        }
+        pthread_cond_broadcast(&lsm->done);
+    }
+    pthread_mutex_unlock(&lsm->lock);
+    return NULL;
+
+}
+
+/*
+ * Escolhe o nível a compactar: L0 quando tem LSM_L0_TRIGGER ficheiros, ou o
+ * primeiro nível que ultrapassa o seu tamanho máximo.
+ * Tem de ser chamada com lsm->lock adquirido. Retorna -1 se não houver nada.
+ */
+int lsm_pick_compaction(struct lsm_t *lsm) {
+
+    long limit = LSM_L1_SIZE;
+    int level;
+
+    if(lsm->levels[0].num_files >= LSM_L0_TRIGGER) {
+        return 0;
+    }
+    for(level = 1; level < LSM_MAX_LEVELS - 1; level++) {
+        if(lsm->levels[level].bytes > limit) {
+            return level;
+        }
+        limit *= LSM_LEVEL_MULTIPLIER;
+    }
+    return -1;
+
+}
+
+/*
+ * Funde ficheiros do nível level com os ficheiros sobrepostos de level+1.
+ * Chamada com lsm->lock adquirido; o lock é libertado durante a fusão (os
+ * ficheiros de entrada só são removidos por esta thread).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int lsm_compact(struct lsm_t *lsm, int level) {
+
+    struct lsm_level_t *upperLevel = &lsm->levels[level], *lowerLevel = &lsm->levels[level + 1];
+    struct sstable_t **upper = NULL, **lower = NULL;
+    struct lsm_iter_t *iters = NULL;
+    struct compaction_ctx_t ctx;
+    char *minKey, *maxKey;
+    int numUpper = 0, numLower = 0, numIters = 0, i, ret = 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.lsm = lsm;
+
+    if((upper = (struct sstable_t **) malloc(sizeof(struct sstable_t *) * (upperLevel->num_files + 1))) == NULL ||
+       (lower = (struct sstable_t **) malloc(sizeof(struct sstable_t *) * (lowerLevel->num_files + 1))) == NULL ||
+       (iters = (struct lsm_iter_t *) malloc(sizeof(struct lsm_iter_t) * (upperLevel->num_files + 1))) == NULL) {
+        ERROR("malloc");
+        free(upper);
+        free(lower);
+        return -1;
+    }
+
+    // Entradas do nível de cima: todo o L0, ou um ficheiro em round-robin
+    if(level == 0) {
+        for(i = 0; i < upperLevel->num_files; i++) {
+            upper[numUpper++] = upperLevel->files[i];
+        }
+    }
+    else {
+        upper[0] = upperLevel->files[0];
+        for(i = 0; i < upperLevel->num_files; i++) {
+            if(lsm->compact_pointer[level] == NULL ||
+               strcmp(upperLevel->files[i]->min_key, lsm->compact_pointer[level]) > 0) {
+                upper[0] = upperLevel->files[i];
+                break;
+            }
+        }
+        numUpper = 1;
+    }
+    minKey = upper[0]->min_key;
+    maxKey = upper[0]->max_key;
+    for(i = 1; i < numUpper; i++) {
+        if(strcmp(upper[i]->min_key, minKey) < 0) {
+            minKey = upper[i]->min_key;
+        }
+        if(strcmp(upper[i]->max_key, maxKey) > 0) {
+            maxKey = upper[i]->max_key;
+        }
+    }
+
+    // Entradas do nível de baixo: os ficheiros que se sobrepõem ao intervalo
+    for(i = 0; i < lowerLevel->num_files; i++) {
+        if(strcmp(lowerLevel->files[i]->max_key, minKey) >= 0 &&
+           strcmp(lowerLevel->files[i]->min_key, maxKey) <= 0) {
+            lower[numLower++] = lowerLevel->files[i];
+        }
+    }
+
+    // As marcas de apagado só podem desaparecer se não houver níveis abaixo
+    ctx.drop_deleted = true;
+    for(i = level + 2; i < LSM_MAX_LEVELS; i++) {
+        if(lsm->levels[i].num_files > 0) {
+            ctx.drop_deleted = false;
+        }
+    }
+
+    // Em L0 o ficheiro mais recente (o último) tem prioridade
+    for(i = numUpper - 1; i >= 0; i--) {
+        lsm_iter_init(&iters[numIters], NULL, 0, &upper[i], 1, numIters);
+        numIters++;
+    }
+    lsm_iter_init(&iters[numIters], NULL, 0, lower, numLower, numIters);
+    numIters++;
+
+    pthread_mutex_unlock(&lsm->lock);
+    if(lsm_merge(iters, numIters, compaction_visit, &ctx) != 0 || compaction_finish_output(&ctx) != 0) {
+        ret = -1;
+    }
+    for(i = 0; i < numIters; i++) {
+        lsm_iter_free(&iters[i]);
+    }
+    pthread_mutex_lock(&lsm->lock);
+
+    if(ret != 0) {
+        if(ctx.writer) {
+            sst_writer_abort(ctx.writer);
+        }
+        for(i = 0; i < ctx.num_outputs; i++) {
+            unlink(ctx.outputs[i]->name);
+            sst_close(ctx.outputs[i]);
+        }
+    }
+    else {
+        // Troca as entradas pelas saídas e só depois apaga os ficheiros antigos
+        for(i = 0; i < numUpper; i++) {
+            level_remove(upperLevel, upper[i]);
+        }
+        for(i = 0; i < numLower; i++) {
+            level_remove(lowerLevel, lower[i]);
+        }
+        for(i = 0; i < ctx.num_outputs; i++) {
+            level_add(lowerLevel, ctx.outputs[i], true);
+        }
+        // Uma chave descartada só deixa de estar viva se não tiver uma versão
+        // mais recente na memtable ou nos níveis de cima (uma escrita que a
+        // substituiu já a descontou)
+        for(i = 0; i < ctx.num_dropped; i++) {
+            if(!lsm_superseded(lsm, ctx.dropped[i], level)) {
+                lsm->live_keys--;
+                if(lsm->filter) {
+                    bloom_remove(lsm->filter, ctx.dropped[i]);
+                }
+            }
+        }
+        lsm->version++;
+        if(level > 0) {
+            free(lsm->compact_pointer[level]);
+            lsm->compact_pointer[level] = strdup(upper[0]->max_key);
+        }
+        if(lsm_write_manifest(lsm) != 0) {
+            ERROR("lsm_write_manifest");
+        }
+        // Uma leitura em curso pode ainda ter o ficheiro: fecha-o a última
+        for(i = 0; i < numUpper; i++) {
+            unlink(upper[i]->name);
+            sst_unref(upper[i]);
+        }
+        for(i = 0; i < numLower; i++) {
+            unlink(lower[i]->name);
+            sst_unref(lower[i]);
+        }
+    }
+
+    for(i = 0; i < ctx.num_dropped; i++) {
+        free(ctx.dropped[i]);
+    }
+    free(ctx.dropped);
+    free(ctx.outputs);
+    free(iters);
+    free(upper);
+    free(lower);
+    return ret;
+
+}
@@ -0,0 +1,84 @@
+#ifndef _LSM_TREE_H
+#define _LSM_TREE_H
+
+#include "data.h"
+#include "table.h"
+
+struct lsm_t; /* A definir em lsm_tree-private.h */
+
+/*
+ * Abre (ou cria) uma árvore LSM cujos ficheiros usam o prefixo filename:
+ * o manifesto em filename+".lsm" e as SSTables em filename+".<seq>.sst".
+ * A tabela memtable passa a pertencer à árvore e é usada como memtable.
+ * Arranca também a thread de compactação em background.
+ * Retorna NULL em caso de erro.
+ */
+struct lsm_t *lsm_open(char *filename, struct table_t *memtable);
+
+/*
+ * Pára a compactação e liberta toda a memória. Os ficheiros em disco são
+ * mantidos (a memtable que não foi escrita é recuperada do log).
+ */
+void lsm_close(struct lsm_t *lsm);
+
+/*
+ * Como lsm_close(), mas apaga também o manifesto e todas as SSTables.
+ */
+void lsm_destroy(struct lsm_t *lsm);
+
+/*
+ * Insere (ou substitui) key na memtable. Os dados são copiados.
+ * Devolve 0 (ok) ou -1 (out of memory).
+ */
+int lsm_put(struct lsm_t *lsm, char *key, struct data_t *data);
+
+/*
+ * Procura key na memtable e depois nas SSTables, da mais recente para a
+ * mais antiga. Devolve uma *CÓPIA* dos dados ou NULL se não existir.
+ */
+struct data_t *lsm_get(struct lsm_t *lsm, char *key);
+
+/*
+ * Marca key como apagada. Devolve 0 (ok) ou -1 (key not found).
+ */
+int lsm_del(struct lsm_t *lsm, char *key);
+
+/*
+ * Devolve o número de chaves vivas, mantido pelas escritas, pelo flush e
+ * pela compactação. Como table_size(), conta os valores "0" e as chaves
+ * expiradas que ainda não foram removidas.
+ */
+int lsm_size(struct lsm_t *lsm);
+
+/*
+ * Devolve um array de char * com a cópia de todas as keys vivas,
+ * ordenadas, e um último elemento a NULL.
+ */
+char **lsm_get_keys(struct lsm_t *lsm);
+
+/*
+ * Devolve um filtro de bloom com todas as chaves vivas, serializado com
+ * bloom_to_data(). O filtro é construído no primeiro pedido e depois é
+ * mantido pelas escritas, pelo flush e pela compactação.
+ * Retorna NULL em caso de erro.
+ */
+struct data_t *lsm_get_filter(struct lsm_t *lsm);
+
+/*
+ * Devolve a memtable corrente (e.g., para ser preenchida a partir do log).
+ */
+struct table_t *lsm_memtable(struct lsm_t *lsm);
+
+/*
+ * Retorna 1 se a memtable já ultrapassou LSM_MEMTABLE_SIZE bytes.
+ */
+int lsm_memtable_full(struct lsm_t *lsm);
+
+/*
+ * Escreve a memtable numa nova SSTable do nível 0 e começa uma memtable
+ * vazia. Depois de retornar, o log que cobria a memtable pode ser rodado.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int lsm_flush(struct lsm_t *lsm);
+
+#endif
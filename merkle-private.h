@@ -0,0 +1,46 @@
+/*
+ * File:   merkle-private.h
+ *
+ * Define a estrutura de uma árvore de Merkle.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _MERKLE_PRIVATE_H
+#define _MERKLE_PRIVATE_H
+
+#include <stdint.h>
+
+/*
+ * Define a estrutura de uma árvore de Merkle binária completa, guardada num
+ * array (como um heap).
+ *
+ * uint64_t *nodes => MERKLE_NODES hashes: nodes[1] é a raiz, os filhos de
+ *                    nodes[n] são nodes[2n] e nodes[2n+1] e as folhas são
+ *                    nodes[MERKLE_FIRST_LEAF..MERKLE_NODES-1]. Uma folha é o
+ *                    XOR dos hashes das suas entradas (para se poder tirar
+ *                    uma entrada sem ver as outras); um nó interno é o hash
+ *                    dos seus dois filhos.
+ * struct hring_t *ring => anel das chaves repartidas (NULL sem vistas, ver
+ *                         merkle_partition())
+ * int replicas => servidores de cada chave no anel
+ * int self => índice deste servidor no anel
+ * int numViews => número de servidores do anel
+ * uint64_t **views => para cada servidor v do anel, os MERKLE_NODES hashes
+ *                     da vista v, organizados como nodes (NULL em self)
+ */
+struct merkle_t {
+    uint64_t *nodes;
+    struct hring_t *ring;
+    int replicas;
+    int self;
+    int numViews;
+    uint64_t **views;
+};
+
+/*
+ * Mistura final do MurmurHash3 (espalha todos os bits de x).
+ */
+uint64_t merkle_mix(uint64_t x);
+
+#endif
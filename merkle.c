@@ -0,0 +1,250 @@
+/*
+ * File:   merkle.c
+ *
+ * Implementação de uma árvore de Merkle sobre as chaves de uma tabela,
+ * actualizada a cada escrita, para dois servidores descobrirem que partes
+ * das suas tabelas diferem trocando só alguns hashes.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include "utils.h"
+#include "data.h"
+#include "merkle.h"
+#include "merkle-private.h"
+#include "hash_ring.h"
+#include "hash_ring-private.h"
+
+/*
+ * Cria uma árvore de Merkle vazia (todos os hashes a 0).
+ * Retorna NULL em caso de erro.
+ */
+struct merkle_t *merkle_create() {
+
+    struct merkle_t *tree;
+
+    if((tree = (struct merkle_t *) malloc(sizeof(struct merkle_t))) == NULL) {
+        ERROR("malloc tree");
+        return NULL;
+    }
+    if((tree->nodes = (uint64_t *) calloc(MERKLE_NODES, sizeof(uint64_t))) == NULL) {
+        ERROR("calloc tree->nodes");
+        free(tree);
+        return NULL;
+    }
+    tree->ring = NULL;
+    tree->replicas = 0;
+    tree->self = -1;
+    tree->numViews = 0;
+    tree->views = NULL;
+    return tree;
+
+}
+
+/*
+ * Liberta toda a memória da árvore.
+ */
+void merkle_destroy(struct merkle_t *tree) {
+
+    int view;
+
+    if(tree) {
+        for(view = 0; view < tree->numViews; view++) {
+            free(tree->views[view]);
+        }
+        free(tree->views);
+        hring_destroy(tree->ring);
+        free(tree->nodes);
+        free(tree);
+    }
+
+}
+
+/*
+ * Devolve o número da folha onde fica key.
+ */
+int merkle_leaf(char *key) {
+
+    // Os bits de cima: os de baixo são usados no hash da entrada
+    return MERKLE_FIRST_LEAF + (int) (hring_hash(key) >> (64 - MERKLE_DEPTH));
+
+}
+
+/*
+ * Passa a manter as vistas dos outros servidores de ring.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int merkle_partition(struct merkle_t *tree, struct hring_t *ring, int replicas, int self) {
+
+    int view;
+
+    if(tree == NULL || ring == NULL || tree->ring || self < 0 || self >= ring->numServers) {
+        ERROR("NULL tree or ring, already partitioned or invalid self");
+        return -1;
+    }
+    if((tree->views = (uint64_t **) calloc(ring->numServers, sizeof(uint64_t *))) == NULL) {
+        ERROR("calloc tree->views");
+        return -1;
+    }
+    for(view = 0; view < ring->numServers; view++) {
+        if(view != self && (tree->views[view] = (uint64_t *) calloc(MERKLE_NODES, sizeof(uint64_t))) == NULL) {
+            ERROR("calloc view");
+            while(--view >= 0) {
+                free(tree->views[view]);
+            }
+            free(tree->views);
+            tree->views = NULL;
+            return -1;
+        }
+    }
+    tree->ring = ring;
+    tree->replicas = replicas;
+    tree->self = self;
+    tree->numViews = ring->numServers;
+    return 0;
+
+}
+
+/*
+ * 1 se key pertence à vista view, 0 se não.
+ */
+int merkle_in_view(struct merkle_t *tree, int view, char *key) {
+
+    if(view == MERKLE_ALL) {
+        return 1;
+    }
+    return tree->ring && view != tree->self &&
+           hring_shared(tree->ring, key, tree->replicas, tree->self, view);
+
+}
+
+/* Troca hash na folha leaf de nodes e refaz os nós até à raiz */
+static void merkle_update(uint64_t *nodes, int leaf, uint64_t hash) {
+
+    int node;
+
+    nodes[leaf] ^= hash;
+    for(node = leaf / 2; node >= 1; node /= 2) {
+        nodes[node] = merkle_mix(nodes[2 * node] ^ merkle_mix(nodes[2 * node + 1] + 1));
+    }
+
+}
+
+/*
+ * Junta à árvore, ou retira se já lá estava, a entrada (key, value).
+ */
+void merkle_toggle(struct merkle_t *tree, char *key, struct data_t *value) {
+
+    int leaf, view;
+    uint64_t hash;
+
+    if(tree == NULL || key == NULL || value == NULL) {
+        return;
+    }
+    // Um valor apagado é igual a não haver entrada
+    if(value->datasize == 0 || (value->datasize == 1 && ((char *) value->data)[0] == '0')) {
+        return;
+    }
+
+    // Duas escritas da mesma chave com o mesmo timestamp são a mesma
+    // escrita: chave e timestamp identificam o valor
+    hash = merkle_mix(hring_hash(key) ^ merkle_mix((uint64_t) value->timestamp + 1));
+    leaf = merkle_leaf(key);
+    merkle_update(tree->nodes, leaf, hash);
+
+    // Uma chave que este servidor não guarda não está em nenhuma vista
+    if(tree->ring && hring_shared(tree->ring, key, tree->replicas, tree->self, tree->self)) {
+        for(view = 0; view < tree->numViews; view++) {
+            if(merkle_in_view(tree, view, key)) {
+                merkle_update(tree->views[view], leaf, hash);
+            }
+        }
+    }
+
+}
+
+/*
+ * Número do primeiro dos descendentes de node devolvidos por
+ * merkle_get_hashes().
+ */
+int merkle_first_child(int node) {
+
+    int levels = 0;
+
+    while(levels < MERKLE_STEP && node < MERKLE_FIRST_LEAF) {
+        node *= 2;
+        levels ++;
+    }
+    return node;
+
+}
+
+/*
+ * Devolve os hashes dos descendentes de node MERKLE_STEP níveis abaixo (ou
+ * as folhas, se estiverem mais perto) na vista view, serializados.
+ * Em caso de erro, devolve NULL.
+ */
+struct data_t *merkle_get_hashes(struct merkle_t *tree, int view, int node) {
+
+    struct data_t *hashes;
+    unsigned char *out;
+    uint64_t *nodes;
+    int first, count, i, b;
+
+    if(tree == NULL || node < 1 || node >= MERKLE_FIRST_LEAF) {
+        ERROR("NULL tree or invalid node");
+        return NULL;
+    }
+    if(view == MERKLE_ALL) {
+        nodes = tree->nodes;
+    }
+    else if(view >= 0 && view < tree->numViews && tree->views[view]) {
+        nodes = tree->views[view];
+    }
+    else {
+        ERROR("invalid view");
+        return NULL;
+    }
+    first = merkle_first_child(node);
+    count = first / node;
+    if((hashes = data_create(count * 8)) == NULL) {
+        ERROR("data_create");
+        return NULL;
+    }
+    out = (unsigned char *) hashes->data;
+    for(i = 0; i < count; i++) {
+        for(b = 0; b < 8; b++) {
+            out[i * 8 + b] = (unsigned char) (nodes[first + i] >> (56 - 8 * b));
+        }
+    }
+    return hashes;
+
+}
+
+/*
+ * Lê o hash i dos serializados por merkle_get_hashes().
+ */
+uint64_t merkle_hash_at(struct data_t *hashes, int i) {
+
+    unsigned char *in = (unsigned char *) hashes->data + i * 8;
+    uint64_t hash = 0;
+    int b;
+
+    for(b = 0; b < 8; b++) {
+        hash = (hash << 8) | in[b];
+    }
+    return hash;
+
+}
+
+uint64_t merkle_mix(uint64_t x) {
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+
+}
@@ -0,0 +1,100 @@
+#ifndef _MERKLE_H
+#define _MERKLE_H
+
+#include <stdint.h>
+#include "data.h"
+
+/*
+ * Profundidade da árvore: 2^MERKLE_DEPTH folhas, cada uma com o hash das
+ * entradas cujas chaves lhe calham. Igual em todos os servidores, para as
+ * árvores poderem ser comparadas nó a nó.
+ */
+#define MERKLE_DEPTH 10
+
+/* Níveis que um pedido de um nó desce (os seus 2^MERKLE_STEP descendentes). */
+#define MERKLE_STEP 4
+
+/* Número da primeira folha (a raiz é o nó 1; os filhos de n são 2n e 2n+1). */
+#define MERKLE_FIRST_LEAF (1 << MERKLE_DEPTH)
+
+/* Os números dos nós válidos vão de 1 a MERKLE_NODES - 1. */
+#define MERKLE_NODES (2 << MERKLE_DEPTH)
+
+/* Vista da árvore inteira (ver merkle_partition()). */
+#define MERKLE_ALL (-1)
+
+/*
+ * Um pedido OP_RT_MERKLE leva num só inteiro o nó e a vista pedidos (com
+ * MERKLE_ALL fica só o número do nó).
+ */
+#define MERKLE_REQUEST(view, node) (((view) + 1) * MERKLE_NODES + (node))
+#define MERKLE_REQUEST_VIEW(request) ((request) / MERKLE_NODES - 1)
+#define MERKLE_REQUEST_NODE(request) ((request) % MERKLE_NODES)
+
+struct merkle_t; /* Definida em merkle-private.h */
+struct hring_t; /* Definida em hash_ring-private.h */
+
+/*
+ * Cria uma árvore de Merkle vazia (todos os hashes a 0).
+ * Retorna NULL em caso de erro.
+ */
+struct merkle_t *merkle_create();
+
+/*
+ * Liberta toda a memória da árvore.
+ */
+void merkle_destroy(struct merkle_t *tree);
+
+/*
+ * Devolve o número da folha onde fica key.
+ */
+int merkle_leaf(char *key);
+
+/*
+ * Com as chaves repartidas pelos servidores de ring, cada uma guardada por
+ * replicas deles (ver qtable_set_replicas()), passa a manter também, para
+ * cada outro servidor v do anel, a vista v: a árvore só das chaves que este
+ * servidor (self, o seu índice no anel) e v guardam ambos, a única parte das
+ * duas tabelas que deve ser igual. Deve ser chamada com a árvore ainda
+ * vazia e, se correr bem, o anel passa a pertencer à árvore.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int merkle_partition(struct merkle_t *tree, struct hring_t *ring, int replicas, int self);
+
+/*
+ * 1 se key pertence à vista view (ver merkle_partition()), 0 se não. Na
+ * vista MERKLE_ALL estão todas as chaves.
+ */
+int merkle_in_view(struct merkle_t *tree, int view, char *key);
+
+/*
+ * Junta à árvore, ou retira se já lá estava, a entrada (key, value):
+ * actualiza a sua folha e os hashes dos nós até à raiz, na árvore inteira e
+ * nas vistas a que key pertence. Para substituir um valor chama-se uma vez
+ * com o antigo e outra com o novo. Os valores apagados ("0") não contam,
+ * para que uma chave apagada e uma que não existe sejam iguais.
+ */
+void merkle_toggle(struct merkle_t *tree, char *key, struct data_t *value);
+
+/*
+ * Devolve os hashes dos descendentes de node MERKLE_STEP níveis abaixo (ou
+ * as folhas, se estiverem mais perto) na vista view, serializados com 8
+ * bytes cada por ordem dos nós (big-endian), a partir de
+ * merkle_first_child(node).
+ * Em caso de erro (e.g. node é uma folha ou a vista não existe), devolve
+ * NULL.
+ */
+struct data_t *merkle_get_hashes(struct merkle_t *tree, int view, int node);
+
+/*
+ * Número do primeiro dos descendentes de node devolvidos por
+ * merkle_get_hashes() (os restantes seguem-se-lhe).
+ */
+int merkle_first_child(int node);
+
+/*
+ * Lê o hash i dos serializados por merkle_get_hashes().
+ */
+uint64_t merkle_hash_at(struct data_t *hashes, int i);
+
+#endif
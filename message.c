@@ -25,6 +25,12 @@
  * CT_KEYS	keys		"OC 30 N KEY1 KEY2 ... KEYN"
  * CT_VALUE	value		"OC 40 DATA-BASE64"
  * CT_RESULT	result		"OC 50 RESULT"
+ * CT_NEWER	entry		"OC 70 TS KEY DATA-BASE64"
+ *
+ * Uma CT_ENTRY (ou CT_NEWER) cujo valor tem prazo leva ainda " EXPIRES" no
+ * fim (segundos desde a época, em decimal). Uma CT_NEWER é uma entrada que
+ * o servidor só escreve se o seu timestamp TS não for menor que o do valor
+ * guardado (put-if-newer).
  *
  * DATA-BASE64 corresponde a um bloco de dados binários no formato
  * BASE64. Para isso recomenda-se o uso da biblioteca disponível
@@ -36,7 +42,8 @@ int message_to_string(struct message_t *msg, char **msg_str) {
 		// Tamanho minimo da string: OPCODE_SIZE + C_TYPE_SIZE + 2 (espaços) + tamanho dados a enviar em string
 		switch (msg->c_type) {
 			case CT_ENTRY:
-				if((messageLength = entry_to_string(msg->opcode, msg->content.entry, msg_str)) == -1) {
+			case CT_NEWER:
+				if((messageLength = entry_to_string(msg->opcode, msg->c_type, msg->content.entry, msg_str)) == -1) {
 					ERROR("entry_to_string");
 				}
 				break;
@@ -50,6 +57,11 @@ int message_to_string(struct message_t *msg, char **msg_str) {
 					ERROR("keys_to_string");
 				}
 				break;
+			case CT_ENTRIES:
+				if((messageLength = entries_to_string(msg->opcode, msg->content.entries, msg_str)) == -1) {
+					ERROR("entries_to_string");
+				}
+				break;
 			case CT_VALUE:
 				if((messageLength = value_to_string(msg->opcode, msg->content.value, msg_str)) == -1) {
 					ERROR("value_to_string");
@@ -91,6 +103,7 @@ struct message_t *string_to_message(char *msg_str) {
 				tempStr += 6;
 				switch (message->c_type) {
 					case CT_ENTRY:
+					case CT_NEWER:
 						if(!(message->content.entry = string_to_entry(tempStr))) {
 							ERROR("string_to_entry");
 							free(message);
@@ -111,6 +124,13 @@ struct message_t *string_to_message(char *msg_str) {
 							message = NULL;
 						}
 						break;
+					case CT_ENTRIES:
+						if(!(message->content.entries = string_to_entries(tempStr))) {
+							ERROR("string_to_entries");
+							free(message);
+							message = NULL;
+						}
+						break;
 					case CT_VALUE:
 						if(!(message->content.value = string_to_value(tempStr))) {
 							ERROR("string_to_value");
@@ -175,7 +195,11 @@ void free_message(struct message_t *message) {
 				}
 				free(message->content.keys);
 				break;
+			case CT_ENTRIES:
+				entry_free_list(message->content.entries);
+				break;
 			case CT_ENTRY:
+			case CT_NEWER:
 				if(message->content.entry) {
 					entry_destroy(message->content.entry);
 				}
@@ -199,10 +223,11 @@ void free_message(struct message_t *message) {
 /*
  * Converte um struct entry_t numa mensagem com o seguinte formato:
  *	"OPCODE C_TYPE key DATA-BASE64"
+ *	(c_type é CT_ENTRY ou CT_NEWER)
  *	Imprime a mensagem para o **msg_str passado.
  *	Retorna o tamanho da string impressa ou -1 em caso de erro.
  */
-int entry_to_string(short opcode, struct entry_t *entry, char **msg_str) {
+int entry_to_string(short opcode, short c_type, struct entry_t *entry, char **msg_str) {
 	int messageLength = 6;
 	char *tempString, *ts;
 	size_t encodedSize;
@@ -219,9 +244,16 @@ int entry_to_string(short opcode, struct entry_t *entry, char **msg_str) {
 		free(tempString);
 		return -1;
 	}
+	// O prazo (opcional) vai no fim, em segundos desde a época
+	if(entry->value->expires > 0) {
+		messageLength += EXPIRES_MAX_DIGITS + 1;
+	}
 	// Finalmente, criamos a string.
 	if(encodedSize > 0 && (*msg_str = (char*)malloc(messageLength + strlen(ts) + 1))) {
-		sprintf(*msg_str, "%hd %hd %s %s %s", opcode, (short)CT_ENTRY, ts, entry->key, tempString);
+		sprintf(*msg_str, "%hd %hd %s %s %s", opcode, c_type, ts, entry->key, tempString);
+		if(entry->value->expires > 0) {
+			sprintf(*msg_str + strlen(*msg_str), " %ld", entry->value->expires);
+		}
 		//printf("A enviar: %s\n", *msg_str);
 		free(tempString);
 		free(ts);
@@ -428,6 +460,68 @@ int timestamp_to_string(short opcode, long timestamp, char **msg_str) {
 	return (int)strlen(*msg_str);
 }
 
+/*
+ * Converte um array de entradas (terminado em NULL) numa mensagem com o
+ * seguinte formato:
+ *	"OPCODE C_TYPE N TS1 KEY1 DATA1 EXPIRES1 ... TSN KEYN DATAN EXPIRESN"
+ *	Imprime a mensagem para o **msg_str passado.
+ *	Retorna o tamanho da string impressa ou -1 em caso de erro.
+ */
+int entries_to_string(short opcode, struct entry_t **entries, char **msg_str) {
+	int counter, numEntries = 0, messageLength = 7 + EXPIRES_MAX_DIGITS; /* "OC CT N" */
+	char **fields, *encoded, *ts;
+	size_t encodedSize;
+	
+	if(!entries) {
+		ERROR("NULL entries");
+		return -1;
+	}
+	while(entries[numEntries]) {
+		numEntries ++;
+	}
+	if(!(fields = (char**)calloc(numEntries + 1, sizeof(char*)))) {
+		ERROR("malloc");
+		return -1;
+	}
+	// Cada entrada fica " TS KEY DATA EXPIRES"
+	for(counter = 0; counter < numEntries && messageLength != -1; counter ++) {
+		encoded = ts = NULL;
+		if(entries[counter]->value->datasize > 0) {
+			base64_encode_alloc(entries[counter]->value->data, entries[counter]->value->datasize, &encoded);
+		} else {
+			encoded = strdup("-");
+		}
+		encode_timestamp(entries[counter]->value->timestamp, &encodedSize, &ts);
+		if(encoded && ts && (fields[counter] = malloc(strlen(ts) + strlen(entries[counter]->key) +
+													  strlen(encoded) + EXPIRES_MAX_DIGITS + 5))) {
+			sprintf(fields[counter], " %s %s %s %ld", ts, entries[counter]->key, encoded,
+					entries[counter]->value->expires);
+			messageLength += strlen(fields[counter]);
+		} else {
+			ERROR("base64_encode_alloc ou malloc");
+			messageLength = -1;
+		}
+		free(encoded);
+		free(ts);
+	}
+	
+	if(messageLength != -1 && (*msg_str = malloc(messageLength + 1))) {
+		sprintf(*msg_str, "%hd %hd %d", opcode, (short)CT_ENTRIES, numEntries);
+		for(counter = 0; counter < numEntries; counter ++) {
+			strcat(*msg_str, fields[counter]);
+		}
+		messageLength = (int)strlen(*msg_str);
+	} else if(messageLength != -1) {
+		ERROR("malloc");
+		messageLength = -1;
+	}
+	for(counter = 0; counter < numEntries; counter ++) {
+		free(fields[counter]);
+	}
+	free(fields);
+	return messageLength;
+}
+
 void encode_timestamp(long timestamp, size_t *encoded_size, char **out_string) {
 	int numDigits;
 	char *ts = NULL;
@@ -463,11 +557,13 @@ struct entry_t *string_to_entry(char *msg_str) {
 	char *key = NULL, *encodedString = NULL, *decodedString = NULL, *restOfTheString = NULL, *ts = NULL, *decodedTs;
 	size_t decodedSize, tsSize;
 	struct entry_t *entry = NULL;
+	long expires = 0;
 	
 	if((key = (char*)malloc(strlen(msg_str))) && (encodedString = (char*)malloc(strlen(msg_str))) &&
 	   (ts = (char*)malloc(strlen(msg_str)))) {
 		//printf("mensagem: %s\n", msg_str);
-		if(sscanf(msg_str, "%s %s %s", ts, key, encodedString) == 2) {
+		// O quarto campo (prazo) é opcional
+		if(sscanf(msg_str, "%s %s %s %ld", ts, key, encodedString, &expires) == 2) {
 			// é um del, encodedString = 0?
 			isDel = 1;
 			decodedSize = 0;
@@ -482,6 +578,7 @@ struct entry_t *string_to_entry(char *msg_str) {
 				ERROR("entry_create ou data_create2");
 			} else {
 				entry->value->timestamp = atol(decodedTs);
+				entry->value->expires = expires;
 			}
 			free(decodedTs);
 		} else {
@@ -588,12 +685,73 @@ char **string_to_keys(char *msg_str) {
 	return keys;
 }
 
+/*
+ * Converte uma string "N TS1 KEY1 DATA1 EXPIRES1 ..." num array de entradas
+ * terminado em NULL.
+ *	Retorna NULL em caso de erro.
+ */
+struct entry_t **string_to_entries(char *msg_str) {
+	int numEntries, counter, field;
+	char *workString, *restOfTheString, *fields[4], *key, *decodedString, *decodedTs;
+	size_t decodedSize, tsSize;
+	struct entry_t **entries = NULL;
+	
+	if(sscanf(msg_str, "%d", &numEntries) != 1 || numEntries < 0) {
+		ERROR("sscanf");
+		return NULL;
+	}
+	if(!(workString = strdup(msg_str)) ||
+	   !(entries = (struct entry_t**)calloc(numEntries + 1, sizeof(struct entry_t*)))) {
+		ERROR("malloc");
+		free(workString);
+		return NULL;
+	}
+	strtok_r(workString, " ", &restOfTheString); // N
+	for(counter = 0; counter < numEntries; counter ++) {
+		for(field = 0; field < 4; field ++) {
+			if(!(fields[field] = strtok_r(NULL, " ", &restOfTheString))) {
+				break;
+			}
+		}
+		decodedString = NULL;
+		decodedSize = 0;
+		if(field < 4 || !base64_decode_alloc(fields[0], strlen(fields[0]), &decodedTs, &tsSize)) {
+			LOG_ERROR("string_to_entries: entrada %d invalida", counter);
+			break;
+		}
+		decodedTs[tsSize] = '\0';
+		if((strcmp(fields[2], "-") == 0 ||
+			base64_decode_alloc(fields[2], strlen(fields[2]), &decodedString, &decodedSize)) &&
+		   (key = strdup(fields[1]))) {
+			if((entries[counter] = entry_create(key, data_create2((int)decodedSize, decodedString)))) {
+				entries[counter]->value->timestamp = atol(decodedTs);
+				entries[counter]->value->expires = atol(fields[3]);
+			} else {
+				ERROR("entry_create ou data_create2");
+			}
+		} else {
+			ERROR("base64_decode_alloc ou strdup");
+			free(decodedString);
+		}
+		free(decodedTs);
+		if(!entries[counter]) {
+			break;
+		}
+	}
+	free(workString);
+	if(counter < numEntries) {
+		entry_free_list(entries);
+		entries = NULL;
+	}
+	return entries;
+}
+
 /*
  * Converte uma string num struct data_t
  *	Retorna o data_t se correu tudo bem ou NULL em caso de erro.
  */
 struct data_t *string_to_value(char *msg_str) {
-	char *decodedString = NULL, *encoded, *workString;
+	char *decodedString = NULL, *encoded, *workString, *restOfTheString;
 	size_t decodedSize;
 	struct data_t *value = NULL;
 	
@@ -604,7 +762,8 @@ struct data_t *string_to_value(char *msg_str) {
 	
 	//printf("Data: %s\n", msg_str);
 	
-	encoded = strtok(workString, " ");
+	// strtok_r: as respostas dos varios servidores sao convertidas em paralelo
+	encoded = strtok_r(workString, " ", &restOfTheString);
 	//printf("encoded: %s\n", encoded);
 	if(encoded) {
 		if(!(value = data_create(0))) {
@@ -626,7 +785,12 @@ struct data_t *string_to_value(char *msg_str) {
 		return NULL;
 	}
 	
-	encoded = strtok(NULL, " \0");
+	if(!(encoded = strtok_r(NULL, " \0", &restOfTheString))) {
+		ERROR("strtok_r");
+		data_destroy(value);
+		free(workString);
+		return NULL;
+	}
 	//printf("Decoding: %s\n", encoded);
 	base64_decode_alloc(encoded, strlen(encoded), &decodedString, &decodedSize);
 
@@ -9,6 +9,9 @@
 #define OPCODE_SIZE 2
 #define C_TYPE_SIZE 2
 
+/* Número máximo de digitos do prazo (expires) de uma entrada */
+#define EXPIRES_MAX_DIGITS 20
+
 /* Define códigos para os possíveis conteúdos da mensagem */
 #define CT_ENTRY  10
 #define CT_KEY    20
@@ -16,6 +19,8 @@
 #define CT_VALUE  40
 #define CT_RESULT 50
 #define CT_TIMESTAMP 60
+#define CT_NEWER  70
+#define CT_ENTRIES 80
 
 /* 
  * Estrutura que representa uma mensagem genérica a ser transmitida.
@@ -29,6 +34,7 @@ struct message_t {
 		struct entry_t *entry;
 		char *key;
 		char **keys;
+		struct entry_t **entries;
 		struct data_t *value;
 		int result;
 		long timestamp;
@@ -45,6 +51,16 @@ struct message_t {
  * CT_KEYS	keys		"OC 30 N KEY1 KEY2 ... KEYN"
  * CT_VALUE	value		"OC 40 DATA-BASE64"
  * CT_RESULT	result		"OC 50 RESULT"
+ * CT_NEWER	entry		"OC 70 TS KEY DATA-BASE64"
+ * CT_ENTRIES	entries		"OC 80 N TS1 KEY1 DATA1 EXPIRES1 ... TSN KEYN DATAN EXPIRESN"
+ *
+ * Uma CT_ENTRY (ou CT_NEWER) cujo valor tem prazo leva ainda " EXPIRES" no
+ * fim (segundos desde a época, em decimal). Uma CT_NEWER é uma entrada que
+ * o servidor só escreve se o seu timestamp TS não for menor que o do valor
+ * guardado (put-if-newer).
+ * Uma CT_ENTRIES leva um lote de entradas (array terminado em NULL), cada
+ * uma escrita como uma CT_NEWER; EXPIRES é sempre enviado (0 sem prazo) e
+ * um valor vazio é enviado como "-".
  *
  * DATA-BASE64 corresponde a um bloco de dados binários no formato
  * BASE64. Para isso recomenda-se o uso da biblioteca disponível
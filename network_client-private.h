@@ -10,11 +10,237 @@
 #ifndef NETWORK_CLIENT_PRIVATE_H
 #define	NETWORK_CLIENT_PRIVATE_H
 
+#include <stdint.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include "network_client.h"
+
+/* Prazo para estabelecer uma ligação, em milissegundos */
+#define NETWORK_CONNECT_TIMEOUT 1000
+
+/* Limites da espera entre tentativas de ligação falhadas, em milissegundos */
+#define NETWORK_BACKOFF_MIN 100
+#define NETWORK_BACKOFF_MAX 5000
+
+/* Período das verificações do fio de vigilância, em milissegundos */
+#define NETWORK_HEALTH_PERIOD 1000
+
+/* Bytes movidos por cada splice() de network_sync() (tamanho do pipe) */
+#define NETWORK_SYNC_CHUNK (1024 * 1024)
+
+/* Segundos sem tráfego até o keepalive testar uma ligação TCP */
+#define NETWORK_KEEPALIVE_IDLE 10
+
+struct shm_channel_t; /* Definida em shm_ring-private.h */
+
+/*
+ * Define uma ligação do conjunto. Um lugar ocupado sem descritor é uma
+ * ligação a ser estabelecida.
+ *
+ * int fd => o descritor do socket (-1 se fechada)
+ * struct shm_channel_t *shm => canal de memória partilhada (NULL sem ele)
+ * int busy => 1 se está a ser usada por um pedido
+ */
+struct nconn_t {
+    int fd;
+    struct shm_channel_t *shm;
+    int busy;
+};
+
+/*
+ * Define o conjunto de ligações de uma tabela remota.
+ *
+ * struct nconn_t conns => as ligações
+ * long backoff => espera actual entre tentativas (0 com o servidor a responder)
+ * long nextAttempt => instante (network_now()) a partir do qual se pode tentar ligar
+ * unsigned int seed => semente do sorteio das esperas
+ * pthread_mutex_t lock => protege o conjunto
+ * pthread_cond_t released => sinalizada quando uma ligação é devolvida
+ * pthread_cond_t wakeup => acorda o fio de vigilância
+ * pthread_t health => o fio de vigilância
+ * int stopping => 1 quando o conjunto vai ser destruído
+ */
+struct npool_t {
+    struct nconn_t conns[NETWORK_POOL_SIZE];
+    long backoff;
+    long nextAttempt;
+    unsigned int seed;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    pthread_cond_t wakeup;
+    pthread_t health;
+    int stopping;
+};
+
+/*
+ * Retorna o tempo actual em milissegundos (relógio monótono).
+ */
+long network_now(void);
+
+/*
+ * Cria o conjunto de ligações (todas fechadas) da tabela remota rtable e
+ * lança o fio que o vigia.
+ * Retorna NULL em caso de erro.
+ */
+struct npool_t *network_pool_create(struct rtable_t *rtable);
+
+/*
+ * Obtém uma ligação livre ao servidor de rtable: uma já aberta, ou uma
+ * nova se houver lugar e o servidor não estiver em backoff. Com todas as
+ * ligações ocupadas espera (até deadline) que uma seja devolvida.
+ * Retorna NULL se não houver ligação (sem esperar, se o servidor estiver em
+ * baixo).
+ */
+struct nconn_t *network_acquire(struct rtable_t *rtable, long deadline);
+
+/*
+ * Devolve ao conjunto a ligação conn, obtida com network_acquire(). Se o
+ * pedido falhou (ok == 0) a ligação é fechada, com as restantes paradas,
+ * que provavelmente falharam da mesma maneira (e.g. o servidor reiniciou).
+ */
+void network_release(struct rtable_t *rtable, struct nconn_t *conn, int ok);
+
+/*
+ * Indica se error (o errno de um pedido falhado) mostra uma ligação
+ * quebrada, caso em que vale a pena repetir o pedido numa ligação nova.
+ * Retorna 1 (sim) ou 0 (não, e.g. prazo esgotado).
+ */
+int network_broken(int error);
+
+/*
+ * Fecha a ligação conn (e o seu canal de memória partilhada).
+ */
+void network_discard(struct nconn_t *conn);
+
+/*
+ * Regista uma tentativa de ligação falhada: a próxima só é feita depois de
+ * uma espera que duplica a cada falha (entre NETWORK_BACKOFF_MIN e
+ * NETWORK_BACKOFF_MAX), sorteada entre metade e a totalidade desse valor
+ * para os clientes não voltarem todos ao mesmo tempo.
+ * Chamada com o lock do conjunto.
+ */
+void network_backoff(struct rtable_t *rtable);
+
+/*
+ * Regista uma ligação conseguida, terminando o backoff.
+ * Chamada com o lock do conjunto.
+ */
+void network_recovered(struct rtable_t *rtable);
+
+/*
+ * Fio que vigia o conjunto de ligações de uma tabela remota (arg): a cada
+ * NETWORK_HEALTH_PERIOD fecha as ligações paradas que o servidor perdeu e,
+ * sem nenhuma aberta, volta a ligar-se (respeitando o backoff) para o
+ * próximo pedido não ter de esperar pelo connect.
+ */
+void *network_health(void *arg);
+
+/*
+ * Abre a ligação conn ao servidor de rtable (pelo transporte da tabela),
+ * desistindo em deadline.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_open(struct rtable_t *rtable, struct nconn_t *conn, long deadline);
+
+/*
+ * Liga-se (sem bloquear além de deadline) a um dos endereços do servidor
+ * TCP de rtable. O socket fica não bloqueante, sem o algoritmo de Nagle (um
+ * pedido é enviado de uma vez e espera-se logo pela resposta) e com
+ * keepalive, para um servidor inacessível ser detectado numa ligação
+ * parada.
+ * Retorna o descritor do socket ou -1 (erro).
+ */
+int network_connect_tcp(struct rtable_t *rtable, long deadline);
+
+/*
+ * Liga-se ao socket Unix rtable->ip de um servidor na mesma máquina. O
+ * socket fica não bloqueante.
+ * Retorna o descritor do socket ou -1 (erro).
+ */
+int network_connect_local(struct rtable_t *rtable, long deadline);
+
+/*
+ * Pede ao servidor a passagem da ligação conn para memória partilhada e
+ * mapeia o canal recebido (o memfd e os dois eventfd chegam com a
+ * confirmação).
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_shm_connect(struct nconn_t *conn, long deadline);
+
+/*
+ * Espera (até deadline) por um dos eventos events no socket fd.
+ * Retorna 0 (OK) ou -1 (prazo esgotado ou erro).
+ */
+int network_wait(int fd, short events, long deadline);
+
+/*
+ * Preenche o cabeçalho de um pedido com size bytes: o tamanho, marcado com
+ * NETWORK_DEADLINE, e os milissegundos que faltam até deadline, para o
+ * servidor não fazer o trabalho se a resposta já chegar tarde.
+ * Retorna 0 (OK) ou -1 (o prazo já passou).
+ */
+int network_header(uint32_t header[2], int size, long deadline);
+
+/*
+ * Envia os count buffers de iov pelo socket fd, esperando (até deadline)
+ * se o socket estiver cheio. Sem SIGPIPE: um servidor que fechou a ligação
+ * é só um erro.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_send_all(int fd, struct iovec *iov, int count, long deadline);
+
+/*
+ * Lê exactamente size bytes do socket fd (uma resposta grande, e.g. um
+ * filtro de chaves, pode chegar em vários segmentos), esperando por eles
+ * até deadline.
+ * Retorna size ou -1 em caso de erro.
+ */
+int network_read_all(int fd, char *buffer, int size, long deadline);
+
+/*
+ * Envia um pedido (size bytes de buffer, precedidos do tamanho) pelo
+ * socket da ligação conn e espera (até deadline) pela resposta.
+ * Retorna a mensagem obtida como resposta ou NULL em caso de erro.
+ */
+struct message_t *network_exchange(struct nconn_t *conn, char *buffer, int size, long deadline);
+
+/*
+ * Copia size bytes do socket fd para o ficheiro file, através do pipe fds
+ * (os dados não passam pela memória do processo), esperando por eles no
+ * máximo timeout milissegundos de cada vez.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_splice(int fd, int fds[2], int file, long size, int timeout);
+
+/*
+ * Espera (até deadline) que o servidor acorde o cliente (no eventfd do
+ * cliente). O socket é vigiado ao mesmo tempo: se o servidor terminar deixa
+ * de haver quem o acorde.
+ * Retorna 0 (OK) ou -1 (o servidor fechou a ligação ou prazo esgotado).
+ */
+int network_shm_wait(struct nconn_t *conn, long deadline);
+
+/*
+ * Escreve size bytes de buffer no canal de memória partilhada, esperando
+ * (até deadline) por espaço se o servidor estiver atrasado.
+ * Retorna size ou -1 em caso de erro.
+ */
+int network_shm_write_all(struct nconn_t *conn, char *buffer, int size, long deadline);
+
+/*
+ * Lê exactamente size bytes do canal de memória partilhada: primeiro com
+ * espera activa (SHM_SPIN voltas), depois a dormir no eventfd (até
+ * deadline).
+ * Retorna size ou -1 em caso de erro.
+ */
+int network_shm_read_all(struct nconn_t *conn, char *buffer, int size, long deadline);
+
 /*
- * Esta função repete os mesmo passos de comunicação que a função
- * network_send_receive. Em caso de falha em algum destes passos retorna NULL.
- * Em caso de sucesso descodifica e retorna a mensagem.
+ * Envia um pedido (size bytes de buffer) pelo canal de memória partilhada
+ * da ligação conn, no mesmo formato que no socket, e espera (até deadline)
+ * pela resposta.
+ * Retorna a mensagem obtida como resposta ou NULL em caso de erro.
  */
-struct message_t *retry(int fd, char *buffer, int size);
+struct message_t *network_shm_send_receive(struct nconn_t *conn, char *buffer, int size, long deadline);
 
-#endif
\ No newline at end of file
+#endif
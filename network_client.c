@@ -5,12 +5,22 @@
  * string_to_buffer, enviá-la ao servidor e esperar pela resposta. Todos os
  * mecanismos de tolerância a falhas, são concretizados neste módulo.
  *
+ * Cada tabela remota tem um conjunto de ligações abertas ao seu servidor
+ * (partilhadas pelos fios que usam a tabela), vigiadas por um fio próprio
+ * que fecha as que o servidor perdeu e volta a ligar-se em segundo plano,
+ * com espera exponencial entre tentativas. Nenhum pedido dorme à espera de
+ * um servidor em baixo: falha logo, ou no fim do seu prazo.
+ *
  * Author: sd001 > Bruno Neves, n.º 31614
  *               > Vasco Orey,  n.º 32550
  *
  * Created on 18 de Outubro de 2011, 19:56
  */
 
+#define _GNU_SOURCE /* splice() */
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include "utils.h"
 #include "table.h"
 #include "table-private.h"
@@ -20,6 +30,9 @@
 #include "remote_table-private.h"
 #include "network_client.h"
 #include "network_client-private.h"
+#include "network_server.h"
+#include "shm_ring.h"
+#include "shm_ring-private.h"
 
 /*
  * Esta função deve:
@@ -29,55 +42,36 @@
  * - guardar toda a informação necessária (e.g., descritor do socket) na
  *   estrutura rtable
  * - retornar 0 (OK) ou -1 (erro)
+ * Mesmo sem ligação, o conjunto de ligações fica criado e continua a tentar
+ * ligar-se em segundo plano.
  */
 int network_connect(struct rtable_t *rtable) {
-	
+
+    struct nconn_t *conn;
+
     //verifica se rtable aponta para NULL
     if(rtable == NULL) {
         ERROR("network_client: NULL rtable");
         return -1;
     }
-	
-    struct addrinfo hints, *serverInfo, *anAddress;
-    int returnValue;
-    	
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;            // IPv4 ou IPv6
-    hints.ai_socktype = SOCK_STREAM;
-	
-    if((returnValue = getaddrinfo(rtable->ip, rtable->porto, &hints, &serverInfo)) != 0) {
-        fprintf(stderr, "network_client: getaddrinfo > %s\n", gai_strerror(returnValue));
-        return 1;
-    }
-	
-    for(anAddress = serverInfo; anAddress; anAddress = anAddress->ai_next) {
-        if((rtable->socket = socket(anAddress->ai_family,
-                                    anAddress->ai_socktype,
-                                    anAddress->ai_protocol)) == -1) {
-            ERROR("network_client: socket");
-            continue;
-        }
-		
-        if(connect(rtable->socket, anAddress->ai_addr, anAddress->ai_addrlen) == -1) {
-            close(rtable->socket);
-            //ERROR("network_client: connect");
-            continue;
-        }
-		
-        break;  //conseguida a ligação sai do ciclo
+
+    if(rtable->pool == NULL && network_pool_create(rtable) == NULL) {
+        return -1;
     }
-	
-    //verifica se a ligação é válida e
-    if(!anAddress) {
-        //fprintf(stderr, "network_client: failed to connect\n");
-		freeaddrinfo(serverInfo);
+
+    //um pedido explícito de ligação não espera pelo fim do backoff
+    pthread_mutex_lock(&rtable->pool->lock);
+    rtable->pool->nextAttempt = 0;
+    pthread_mutex_unlock(&rtable->pool->lock);
+
+    if((conn = network_acquire(rtable, network_now() + NETWORK_CONNECT_TIMEOUT)) == NULL) {
         return -1;
     }
-    freeaddrinfo(serverInfo);
+    network_release(rtable, conn, 1);
 
     //em caso de sucesso
     return 0;
-	
+
 }
 
 /*
@@ -86,173 +80,1003 @@ int network_connect(struct rtable_t *rtable) {
  * - enviar a mensagem msg ao servidor
  * - receber uma resposta do servidor
  * - retornar a mensagem obtida como resposta ou NULL em caso de erro
+ * O pedido tem rtable->timeout milissegundos para ter resposta. Se a
+ * ligação usada estava quebrada (e.g. o servidor reiniciou), é repetido uma
+ * vez numa ligação nova, se ainda houver prazo; um servidor que só demorou
+ * não é incomodado outra vez.
  */
 struct message_t *network_send_receive(struct rtable_t *rtable, struct message_t *msg) {
-	
+
     //verifica se remote ou msg apontam para NULL
-    if(rtable == NULL || msg == NULL) {
+    if(rtable == NULL || msg == NULL || rtable->pool == NULL) {
         return NULL;
     }
-	
-    char *buffer;           //envia a mensagem inicial codificada
-    int bufferSize;         //guarda o tamanho inicial do buffer
-    char *bufferReceived = NULL;   //envia a mensagem codificada
-    int bufferReceivedSize; //guarda o tamanho do buffer
-    uint32_t convertedSize; //guarda o tamanho do buffer convertido
-    struct message_t *rsp;  //a mensagem com a resposta do servidor
-	
+
+    char *buffer;                   //a mensagem codificada
+    int bufferSize;                 //o tamanho do buffer
+    long deadline;                  //o fim do prazo do pedido
+    struct nconn_t *conn;           //a ligação usada
+    struct message_t *rsp = NULL;   //a mensagem com a resposta do servidor
+    int attempt;
+
     //codifica a mensagem e verifica se a operação foi bem sucedida
     if((bufferSize = message_to_string(msg, &buffer)) <= 0) {
         ERROR("network_client: message_tostring");
         return NULL;
     }
-	
-	//printf("enviar: %s\n", buffer);
-	
-    //converte o tamanho do buffer para ser enviado
-    convertedSize = htonl(bufferSize);
-    bool falhou = false;    //regista uma falha de envio
-	
-    //envia o tamanho do buffer a ser enviado
-    if((write(rtable->socket, &convertedSize, sizeof(uint32_t))) != sizeof(uint32_t)) {
-        ERROR("network_client: send bufferSize > retry...");
-        falhou = true;
+
+    deadline = network_now() + rtable->timeout;
+    for(attempt = 0; attempt < 2 && rsp == NULL; attempt++) {
+        //sem ligação (servidor em baixo, em backoff ou prazo esgotado)
+        if((conn = network_acquire(rtable, deadline)) == NULL) {
+            break;
+        }
+        if(conn->shm) {
+            rsp = network_shm_send_receive(conn, buffer, bufferSize, deadline);
+        }
+        else {
+            rsp = network_exchange(conn, buffer, bufferSize, deadline);
+        }
+        network_release(rtable, conn, rsp != NULL);
+        if(rsp == NULL && (!network_broken(errno) || network_now() >= deadline)) {
+            break;
+        }
+    }
+
+    //liberta memória e retorna a resposta
+    free(buffer);
+    return rsp;
+
+}
+
+/*
+ * Indica se error (o errno de um pedido falhado) mostra uma ligação
+ * quebrada: o servidor fechou-a (EOF, ECONNRESET) ou já não a aceita
+ * (EPIPE).
+ * Retorna 1 (sim) ou 0 (não, e.g. ETIMEDOUT).
+ */
+int network_broken(int error) {
+
+    return error == ECONNRESET || error == EPIPE;
+
+}
+
+/*
+ * Indica se o servidor de rtable está disponível: há uma ligação aberta ou
+ * a última tentativa de ligação não falhou (em backoff, é o fio de
+ * vigilância que volta a tentar).
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int network_available(struct rtable_t *rtable) {
+
+    struct npool_t *pool;
+    int i, available;
+
+    if(rtable == NULL || (pool = rtable->pool) == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&pool->lock);
+    available = pool->backoff == 0;
+    for(i = 0; i < NETWORK_POOL_SIZE && !available; i++) {
+        available = pool->conns[i].fd != -1;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return available;
+
+}
+
+/*
+ * A função network_close deve fechar a ligação estabelecida por
+ * network_connect(). Se network_connect() alocou memória, a função
+ * network_close() deve libertar essa memória.
+ */
+int network_close(struct rtable_t *rtable) {
+
+    struct npool_t *pool;
+    int i;
+
+    //verifica se remote aponta NULL
+    if(rtable == NULL) {
+        return -1;
+    }
+    if((pool = rtable->pool) == NULL) {
+        return 0;
+    }
+
+    //pára o fio de vigilância antes de fechar as ligações
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->health, NULL);
+
+    for(i = 0; i < NETWORK_POOL_SIZE; i++) {
+        network_discard(&pool->conns[i]);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->released);
+    pthread_cond_destroy(&pool->wakeup);
+    free(pool);
+    rtable->pool = NULL;
+
+    //em caso de sucesso
+    return 0;
+
+}
+
+/*
+ * Pede ao servidor de rtable, numa ligação própria, o seu estado
+ * (OP_RT_SYNC) e escreve o checkpoint em ckp_fd e o log em log_fd, com
+ * splice() do socket para os ficheiros.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_sync(struct rtable_t *rtable, int ckp_fd, int log_fd) {
+
+    struct nconn_t conn;
+    struct message_t msg, *rsp;
+    unsigned char *in;
+    long ckpSize = 0, logSize = 0, deadline;
+    char *buffer;
+    int bufferSize, fds[2], b, ret = -1;
+
+    if(rtable == NULL) {
+        ERROR("network_client: NULL rtable");
+        return -1;
+    }
+
+    //o envio de ficheiros não passa pela memória partilhada: fica o socket
+    memset(&conn, 0, sizeof(conn));
+    deadline = network_now() + rtable->timeout;
+    if(rtable->transport == RTABLE_TCP) {
+        conn.fd = network_connect_tcp(rtable, deadline);
     }
     else {
-        //envia o buffer
-        if((write(rtable->socket, buffer, bufferSize)) != bufferSize) {
-            ERROR("network_client: send buffer > retry...");
-            falhou = true;
+        conn.fd = network_connect_local(rtable, deadline);
+    }
+    if(conn.fd == -1) {
+        return -1;
+    }
+
+    msg.opcode = OP_RT_SYNC;
+    msg.c_type = CT_RESULT;
+    msg.content.result = 0;
+    if((bufferSize = message_to_string(&msg, &buffer)) <= 0) {
+        ERROR("network_client: message_tostring");
+        close(conn.fd);
+        return -1;
+    }
+    rsp = network_exchange(&conn, buffer, bufferSize, deadline);
+    free(buffer);
+    if(rsp == NULL || rsp->opcode != OP_RT_SYNC + 1 || rsp->c_type != CT_VALUE ||
+       rsp->content.value == NULL || rsp->content.value->datasize != 16) {
+        ERROR("network_client: resposta invalida a OP_RT_SYNC");
+        if(rsp) {
+            free_message(rsp);
         }
-        else {
-            //caso não tenha falhado prepara a recepção
-            if(read(rtable->socket, &convertedSize, sizeof(uint32_t)) != sizeof(uint32_t)) {
-                ERROR("network_client: recv buffer > retry...");
-                falhou = true;
+        close(conn.fd);
+        return -1;
+    }
+    in = (unsigned char *) rsp->content.value->data;
+    for(b = 0; b < 8; b++) {
+        ckpSize = (ckpSize << 8) | in[b];
+        logSize = (logSize << 8) | in[8 + b];
+    }
+    free_message(rsp);
+
+    //os dois ficheiros seguem a resposta, um a seguir ao outro
+    if(pipe2(fds, O_CLOEXEC) == -1) {
+        LOG_PERROR("network_client: pipe2");
+        close(conn.fd);
+        return -1;
+    }
+    fcntl(fds[1], F_SETPIPE_SZ, NETWORK_SYNC_CHUNK);
+    if(network_splice(conn.fd, fds, ckp_fd, ckpSize, rtable->timeout) == 0 &&
+       network_splice(conn.fd, fds, log_fd, logSize, rtable->timeout) == 0) {
+        LOG_INFO("network_client: estado copiado (checkpoint %ld bytes, log %ld bytes)", ckpSize, logSize);
+        ret = 0;
+    }
+    close(fds[0]);
+    close(fds[1]);
+    close(conn.fd);
+    return ret;
+
+}
+
+/*
+ * Retorna o tempo actual em milissegundos (relógio monótono).
+ */
+long network_now(void) {
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+
+}
+
+/*
+ * Converte o instante deadline (de network_now()) para as esperas nas
+ * variáveis de condição do conjunto de ligações.
+ */
+static void network_timespec(struct timespec *until, long deadline) {
+
+    until->tv_sec = deadline / 1000L;
+    until->tv_nsec = (deadline % 1000L) * 1000000L;
+
+}
+
+/*
+ * Cria o conjunto de ligações (todas fechadas) da tabela remota rtable e
+ * lança o fio que o vigia.
+ * Retorna NULL em caso de erro.
+ */
+struct npool_t *network_pool_create(struct rtable_t *rtable) {
+
+    struct npool_t *pool;
+    pthread_condattr_t attr;
+    int i;
+
+    if((pool = (struct npool_t *) calloc(1, sizeof(struct npool_t))) == NULL) {
+        ERROR("network_client: calloc pool");
+        return NULL;
+    }
+    for(i = 0; i < NETWORK_POOL_SIZE; i++) {
+        pool->conns[i].fd = -1;
+    }
+    pool->seed = (unsigned int) (network_now() ^ getpid());
+
+    //as esperas são contadas no relógio monótono, como os prazos
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->released, &attr);
+    pthread_cond_init(&pool->wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+
+    //o fio encontra o conjunto em rtable->pool
+    rtable->pool = pool;
+    if(pthread_create(&pool->health, NULL, network_health, rtable) != 0) {
+        ERROR("network_client: pthread_create health");
+        rtable->pool = NULL;
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->released);
+        pthread_cond_destroy(&pool->wakeup);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+
+}
+
+/*
+ * Obtém uma ligação livre ao servidor de rtable: uma já aberta, ou uma
+ * nova se houver lugar e o servidor não estiver em backoff. Com todas as
+ * ligações ocupadas espera (até deadline) que uma seja devolvida.
+ * Retorna NULL se não houver ligação (sem esperar, se o servidor estiver em
+ * baixo).
+ */
+struct nconn_t *network_acquire(struct rtable_t *rtable, long deadline) {
+
+    struct npool_t *pool = rtable->pool;
+    struct nconn_t *conn, *closed;
+    struct timespec until;
+    long start;
+    int i, busy, error;
+
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        closed = NULL;
+        busy = 0;
+        for(i = 0; i < NETWORK_POOL_SIZE; i++) {
+            conn = &pool->conns[i];
+            if(conn->busy) {
+                busy++;
+            }
+            else if(conn->fd != -1) {
+                conn->busy = 1;
+                pthread_mutex_unlock(&pool->lock);
+                return conn;
+            }
+            else if(closed == NULL) {
+                closed = conn;
+            }
+        }
+
+        if(closed && network_now() >= pool->nextAttempt) {
+            //sem prazo nem se tenta: a falha não diria nada do servidor
+            if((start = network_now()) >= deadline) {
+                pthread_mutex_unlock(&pool->lock);
+                return NULL;
+            }
+            //reserva o lugar e liga-se sem o lock
+            closed->busy = 1;
+            pthread_mutex_unlock(&pool->lock);
+            if(network_open(rtable, closed, deadline) == 0) {
+                pthread_mutex_lock(&pool->lock);
+                network_recovered(rtable);
+                pthread_mutex_unlock(&pool->lock);
+                return closed;
+            }
+            error = errno;
+            pthread_mutex_lock(&pool->lock);
+            closed->busy = 0;
+            //esgotar um prazo mais curto que o de uma ligação é culpa do
+            //prazo do pedido, não do servidor
+            if(error != ETIMEDOUT || deadline - start >= NETWORK_CONNECT_TIMEOUT) {
+                network_backoff(rtable);
+            }
+            pthread_cond_broadcast(&pool->released);
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+
+        //nenhuma ligação em uso que possa vir a ser devolvida
+        if(busy == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        network_timespec(&until, deadline);
+        if(pthread_cond_timedwait(&pool->released, &pool->lock, &until) == ETIMEDOUT) {
+            pthread_mutex_unlock(&pool->lock);
+            LOG_WARN("network_client: sem ligação livre para %s", rtable->ip);
+            return NULL;
+        }
+    }
+
+}
+
+/*
+ * Devolve ao conjunto a ligação conn, obtida com network_acquire(). Se o
+ * pedido falhou (ok == 0) a ligação é fechada, com as restantes paradas,
+ * que provavelmente falharam da mesma maneira (e.g. o servidor reiniciou).
+ */
+void network_release(struct rtable_t *rtable, struct nconn_t *conn, int ok) {
+
+    struct npool_t *pool = rtable->pool;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    if(!ok) {
+        network_discard(conn);
+        for(i = 0; i < NETWORK_POOL_SIZE; i++) {
+            if(!pool->conns[i].busy) {
+                network_discard(&pool->conns[i]);
+            }
+        }
+    }
+    conn->busy = 0;
+    pthread_cond_signal(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+
+}
+
+/*
+ * Fecha a ligação conn (e o seu canal de memória partilhada).
+ */
+void network_discard(struct nconn_t *conn) {
+
+    shm_channel_destroy(conn->shm);
+    conn->shm = NULL;
+    if(conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+
+}
+
+/*
+ * Regista uma tentativa de ligação falhada: a próxima só é feita depois de
+ * uma espera que duplica a cada falha (entre NETWORK_BACKOFF_MIN e
+ * NETWORK_BACKOFF_MAX), sorteada entre metade e a totalidade desse valor
+ * para os clientes não voltarem todos ao mesmo tempo.
+ * Chamada com o lock do conjunto.
+ */
+void network_backoff(struct rtable_t *rtable) {
+
+    struct npool_t *pool = rtable->pool;
+
+    if(pool->backoff == 0) {
+        LOG_WARN("network_client: servidor %s%s%s indisponível", rtable->ip,
+                 rtable->porto ? ":" : "", rtable->porto ? rtable->porto : "");
+        pool->backoff = NETWORK_BACKOFF_MIN;
+    }
+    else if((pool->backoff *= 2) > NETWORK_BACKOFF_MAX) {
+        pool->backoff = NETWORK_BACKOFF_MAX;
+    }
+    pool->nextAttempt = network_now() + pool->backoff / 2 +
+                        rand_r(&pool->seed) % (pool->backoff / 2 + 1);
+
+}
+
+/*
+ * Regista uma ligação conseguida, terminando o backoff.
+ * Chamada com o lock do conjunto.
+ */
+void network_recovered(struct rtable_t *rtable) {
+
+    if(rtable->pool->backoff != 0) {
+        LOG_INFO("network_client: ligação a %s%s%s restabelecida", rtable->ip,
+                 rtable->porto ? ":" : "", rtable->porto ? rtable->porto : "");
+        rtable->pool->backoff = 0;
+    }
+
+}
+
+/*
+ * Verifica se a ligação parada conn continua aberta: numa ligação sem
+ * pedidos o servidor nada envia, pelo que qualquer evento no socket é o
+ * seu fim (ou um erro detectado pelo keepalive).
+ * Retorna 1 se está aberta ou 0 se não.
+ */
+static int network_alive(struct nconn_t *conn) {
+
+    struct pollfd pfd;
+
+    pfd.fd = conn->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+
+}
+
+/*
+ * Fio que vigia o conjunto de ligações de uma tabela remota (arg): a cada
+ * NETWORK_HEALTH_PERIOD fecha as ligações paradas que o servidor perdeu e,
+ * sem nenhuma aberta, volta a ligar-se (respeitando o backoff) para o
+ * próximo pedido não ter de esperar pelo connect.
+ */
+void *network_health(void *arg) {
+
+    struct rtable_t *rtable = (struct rtable_t *) arg;
+    struct npool_t *pool;
+    struct nconn_t *conn;
+    struct timespec until;
+    int i, open, retVal;
+
+    pool = rtable->pool;
+    pthread_mutex_lock(&pool->lock);
+    while(!pool->stopping) {
+        network_timespec(&until, network_now() + NETWORK_HEALTH_PERIOD);
+        pthread_cond_timedwait(&pool->wakeup, &pool->lock, &until);
+        if(pool->stopping) {
+            break;
+        }
+
+        open = 0;
+        for(i = 0; i < NETWORK_POOL_SIZE; i++) {
+            conn = &pool->conns[i];
+            if(!conn->busy && conn->fd != -1 && !network_alive(conn)) {
+                LOG_INFO("network_client: ligação a %s fechada pelo servidor", rtable->ip);
+                network_discard(conn);
+            }
+            if(conn->busy || conn->fd != -1) {
+                open++;
+            }
+        }
+
+        if(open == 0 && network_now() >= pool->nextAttempt) {
+            conn = &pool->conns[0];
+            conn->busy = 1;
+            pthread_mutex_unlock(&pool->lock);
+            retVal = network_open(rtable, conn, network_now() + NETWORK_CONNECT_TIMEOUT);
+            pthread_mutex_lock(&pool->lock);
+            conn->busy = 0;
+            if(retVal == 0) {
+                network_recovered(rtable);
+                pthread_cond_signal(&pool->released);
             }
             else {
-                bufferReceivedSize = ntohl(convertedSize);
-				
-                //aloca memória para o buffer a ser recebido
-                if((bufferReceived = (char *) malloc(bufferReceivedSize + 1)) == NULL) {
-                    free(buffer);
-                    ERROR("network_client: NULL bufferReceived");
-                    return NULL;
-                }
-			
-                //recebe o buffer
-                if(read(rtable->socket, bufferReceived, bufferReceivedSize) != bufferReceivedSize) {
-                    free(buffer);
-                    free(bufferReceived);
-                    perror("network_client: recv bufferReceived > retry...");
-                    falhou = true;
-                }
-                bufferReceived[bufferReceivedSize] = '\0';
+                network_backoff(rtable);
             }
         }
     }
-	
-    //caso o envio ou recpção da mensagem tenha falhado
-    if(falhou) {
-        sleep(RETRY_TIME);
-        rsp = retry(rtable->socket, buffer, bufferSize);
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+
+}
+
+/*
+ * Abre a ligação conn ao servidor de rtable (pelo transporte da tabela),
+ * desistindo em deadline.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_open(struct rtable_t *rtable, struct nconn_t *conn, long deadline) {
+
+    if(rtable->transport == RTABLE_TCP) {
+        conn->fd = network_connect_tcp(rtable, deadline);
     }
     else {
-        //descodifica a mensagem e verifica-a
-		//printf("Decoding: %s\n", bufferReceived);
-        if((rsp = string_to_message(bufferReceived)) == NULL) {
-            ERROR("network_client: string_to_message");
+        conn->fd = network_connect_local(rtable, deadline);
+    }
+    if(conn->fd == -1) {
+        return -1;
+    }
+    if(rtable->transport == RTABLE_SHM && network_shm_connect(conn, deadline) == -1) {
+        network_discard(conn);
+        return -1;
+    }
+    return 0;
+
+}
+
+/*
+ * Liga-se (sem bloquear além de deadline) a um dos endereços do servidor
+ * TCP de rtable. O socket fica não bloqueante, sem o algoritmo de Nagle (um
+ * pedido é enviado de uma vez e espera-se logo pela resposta) e com
+ * keepalive, para um servidor inacessível ser detectado numa ligação
+ * parada.
+ * Retorna o descritor do socket ou -1 (erro).
+ */
+int network_connect_tcp(struct rtable_t *rtable, long deadline) {
+
+    struct addrinfo hints, *serverInfo, *anAddress;
+    int returnValue, fd = -1, error, on = 1;
+    int idle = NETWORK_KEEPALIVE_IDLE, interval = 1, count = 3;
+    socklen_t length;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;            // IPv4 ou IPv6
+    hints.ai_socktype = SOCK_STREAM;
+
+    if((returnValue = getaddrinfo(rtable->ip, rtable->porto, &hints, &serverInfo)) != 0) {
+        LOG_ERROR("network_client: getaddrinfo > %s", gai_strerror(returnValue));
+        return -1;
+    }
+
+    for(anAddress = serverInfo; anAddress; anAddress = anAddress->ai_next) {
+        if((fd = socket(anAddress->ai_family, anAddress->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        anAddress->ai_protocol)) == -1) {
+            ERROR("network_client: socket");
+            continue;
         }
+
+        if(connect(fd, anAddress->ai_addr, anAddress->ai_addrlen) == -1) {
+            length = sizeof(error);
+            if(errno != EINPROGRESS || network_wait(fd, POLLOUT, deadline) == -1 ||
+               getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+                close(fd);
+                fd = -1;
+                continue;
+            }
+        }
+
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+        break;  //conseguida a ligação sai do ciclo
     }
-	
-    //liberta memória e retorna a resposta
-	if(buffer) {
-		free(buffer);
-	}
-	if(bufferReceived) {
-		free(bufferReceived);
-	}
-    return rsp;
-	
+    freeaddrinfo(serverInfo);
+    return fd;
+
+}
+
+/*
+ * Liga-se ao socket Unix rtable->ip de um servidor na mesma máquina. O
+ * socket fica não bloqueante.
+ * Retorna o descritor do socket ou -1 (erro).
+ */
+int network_connect_local(struct rtable_t *rtable, long deadline) {
+
+    struct sockaddr_un address;
+    int fd;
+
+    if(strlen(rtable->ip) >= sizeof(address.sun_path)) {
+        ERROR("network_client: path too long");
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, rtable->ip);
+
+    if((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        ERROR("network_client: socket");
+        return -1;
+    }
+    //com a fila de ligações do servidor cheia o connect não bloqueante falha
+    //com EAGAIN: espera por espaço até ao fim do prazo
+    while(connect(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        if(errno != EAGAIN || network_now() >= deadline) {
+            if(errno == EAGAIN) {
+                errno = ETIMEDOUT;
+            }
+            close(fd);
+            return -1;
+        }
+        usleep(1000);
+    }
+    return fd;
+
+}
+
+/*
+ * Pede ao servidor a passagem da ligação conn para memória partilhada e
+ * mapeia o canal recebido (o memfd e os dois eventfd chegam com a
+ * confirmação).
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_shm_connect(struct nconn_t *conn, long deadline) {
+
+    union {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    uint32_t header = htonl(SHM_UPGRADE);
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[3];
+
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    if(network_send_all(conn->fd, &iov, 1, deadline) == -1) {
+        ERROR("network_client: send shm upgrade");
+        return -1;
+    }
+
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    if(network_wait(conn->fd, POLLIN, deadline) == -1 ||
+       recvmsg(conn->fd, &msg, MSG_CMSG_CLOEXEC) != sizeof(header) || ntohl(header) != SHM_UPGRADE) {
+        ERROR("network_client: recv shm upgrade");
+        return -1;
+    }
+    if((cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+       cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        ERROR("network_client: no shm descriptors");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    if((conn->shm = shm_channel_attach(fds[0], fds[1], fds[2])) == NULL) {
+        return -1;
+    }
+    return 0;
+
+}
+
+/*
+ * Espera (até deadline) por um dos eventos events no socket fd.
+ * Retorna 0 (OK) ou -1 (prazo esgotado ou erro).
+ */
+int network_wait(int fd, short events, long deadline) {
+
+    struct pollfd pfd;
+    long timeout;
+    int ready;
+
+    pfd.fd = fd;
+    pfd.events = events;
+    do {
+        if((timeout = deadline - network_now()) <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        pfd.revents = 0;
+    } while((ready = poll(&pfd, 1, (int) timeout)) == 0 || (ready == -1 && errno == EINTR));
+    return ready == -1 ? -1 : 0;
+
+}
+
+/*
+ * Preenche o cabeçalho de um pedido com size bytes: o tamanho, marcado com
+ * NETWORK_DEADLINE, e os milissegundos que faltam até deadline, para o
+ * servidor não fazer o trabalho se a resposta já chegar tarde.
+ * Retorna 0 (OK) ou -1 (o prazo já passou).
+ */
+int network_header(uint32_t header[2], int size, long deadline) {
+
+    long budget;
+
+    if((budget = deadline - network_now()) <= 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    header[0] = htonl((uint32_t) size | NETWORK_DEADLINE);
+    header[1] = htonl((uint32_t) budget);
+    return 0;
+
+}
+
+/*
+ * Envia os count buffers de iov pelo socket fd, esperando (até deadline)
+ * se o socket estiver cheio. Sem SIGPIPE: um servidor que fechou a ligação
+ * é só um erro.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_send_all(int fd, struct iovec *iov, int count, long deadline) {
+
+    struct msghdr msg;
+    ssize_t numBytes;
+
+    memset(&msg, 0, sizeof(msg));
+    while(count > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        if((numBytes = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if((errno != EAGAIN && errno != EWOULDBLOCK) || network_wait(fd, POLLOUT, deadline) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        //avança pelos buffers já enviados
+        while(count > 0 && numBytes >= (ssize_t) iov->iov_len) {
+            numBytes -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char *) iov->iov_base + numBytes;
+            iov->iov_len -= numBytes;
+        }
+    }
+    return 0;
+
 }
 
 /*
- * Esta função repete os mesmo passos de comunicação que a função
- * network_send_receive. Em caso de falha em algum destes passos retorna NULL.
- * Em caso de sucesso descodifica e retorna a mensagem.
+ * Lê exactamente size bytes do socket fd (uma resposta grande, e.g. um
+ * filtro de chaves, pode chegar em vários segmentos), esperando por eles
+ * até deadline.
+ * Retorna size ou -1 em caso de erro.
  */
-struct message_t *retry(int fd, char *buffer, int size) {
-	
-    int bufferSize = size;  //guarda o tamanho do buffer
-    uint32_t convertedSize; //guarda o tamanho do buffer convertido para
-    struct message_t *rsp;  //a mensagem com a resposta do servidor
-	char *bufferReceived;
-    
-    //converte o tamanho do buffer para ser enviado
-    convertedSize = htonl(bufferSize);
-	
-    //envia o tamanho do buffer a ser enviado
-    if(write(fd, &convertedSize, sizeof(uint32_t)) != sizeof(uint32_t)) {
-        ERROR("network_client: resend bufferSize");
+int network_read_all(int fd, char *buffer, int size, long deadline) {
+
+    int total = 0, numBytes;
+
+    while(total < size) {
+        if((numBytes = (int) recv(fd, buffer + total, size - total, 0)) > 0) {
+            total += numBytes;
+        }
+        else if(numBytes == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            if(network_wait(fd, POLLIN, deadline) == -1) {
+                return -1;
+            }
+        }
+        else if(errno != EINTR) {
+            return -1;
+        }
+    }
+    return total;
+
+}
+
+/*
+ * Envia um pedido (size bytes de buffer, precedidos do tamanho) pelo
+ * socket da ligação conn e espera (até deadline) pela resposta.
+ * Retorna a mensagem obtida como resposta ou NULL em caso de erro.
+ */
+struct message_t *network_exchange(struct nconn_t *conn, char *buffer, int size, long deadline) {
+
+    uint32_t header[2], convertedSize;
+    struct iovec iov[2];
+    struct message_t *rsp;
+    char *bufferReceived;
+
+    //o cabeçalho (com o prazo) e a mensagem seguem juntos, numa só chamada
+    if(network_header(header, size, deadline) == -1) {
         return NULL;
     }
-	
-    //envia o buffer
-    if(write(fd, buffer, bufferSize) != bufferSize) {
-        ERROR("network_client: resend buffer");
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = buffer;
+    iov[1].iov_len = size;
+    if(network_send_all(conn->fd, iov, 2, deadline) == -1) {
+        LOG_PERROR("network_client: send");
         return NULL;
     }
-	
-    //caso não tenha falhado prepara a recepção
-    if(read(fd, &convertedSize, sizeof(uint32_t)) != sizeof(uint32_t)) {
-        ERROR("network_client: rerecv buffer");
+
+    if(network_read_all(conn->fd, (char *) &convertedSize, sizeof(uint32_t), deadline) == -1) {
+        LOG_PERROR("network_client: recv size");
         return NULL;
     }
-	
-    bufferSize = ntohl(convertedSize);
-	
+    size = ntohl(convertedSize);
+
     //aloca memória para o buffer a ser recebido
-    if((bufferReceived = (char *) malloc(bufferSize)) == NULL) {
-        ERROR("network_client: NULL buffer");
+    if((bufferReceived = (char *) malloc(size + 1)) == NULL) {
+        ERROR("network_client: NULL bufferReceived");
         return NULL;
     }
-	
-    //recebe o buffer
-    if(read(fd, bufferReceived, bufferSize) != bufferSize) {
-        ERROR("network_client: rerecv buffer");
+    if(network_read_all(conn->fd, bufferReceived, size, deadline) == -1) {
+        LOG_PERROR("network_client: recv bufferReceived");
+        free(bufferReceived);
         return NULL;
     }
-	
+    bufferReceived[size] = '\0';
+
     //descodifica a mensagem e verifica-a
     if((rsp = string_to_message(bufferReceived)) == NULL) {
         ERROR("network_client: string_to_message");
-        return NULL;
     }
-	
-	free(bufferReceived);
+    free(bufferReceived);
     return rsp;
-	
+
 }
 
 /*
- * A função network_close deve fechar a ligação estabelecida por
- * network_connect(). Se network_connect() alocou memória, a função
- * network_close() deve libertar essa memória.
+ * Copia size bytes do socket fd para o ficheiro file, através do pipe fds
+ * (os dados não passam pela memória do processo), esperando por eles no
+ * máximo timeout milissegundos de cada vez.
+ * Retorna 0 (OK) ou -1 (erro).
  */
-int network_close(struct rtable_t *rtable) {
-	
-    //verifica se remote aponta NULL
-    if(rtable == NULL) {
-        return -1;
+int network_splice(int fd, int fds[2], int file, long size, int timeout) {
+
+    ssize_t numBytes, written;
+
+    while(size > 0) {
+        numBytes = splice(fd, NULL, fds[1], NULL, size < NETWORK_SYNC_CHUNK ? size : NETWORK_SYNC_CHUNK,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(numBytes == 0) {
+            ERROR("network_client: o servidor fechou a ligacao");
+            return -1;
+        }
+        if(numBytes == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            //sem dados há timeout milissegundos, o servidor parou
+            if((errno != EAGAIN && errno != EWOULDBLOCK) ||
+               network_wait(fd, POLLIN, network_now() + timeout) == -1) {
+                LOG_PERROR("network_client: splice socket");
+                return -1;
+            }
+            continue;
+        }
+        size -= numBytes;
+
+        //o pipe fica vazio antes do próximo bloco
+        while(numBytes > 0) {
+            if((written = splice(fds[0], NULL, file, NULL, numBytes, SPLICE_F_MOVE)) <= 0) {
+                if(written == -1 && errno == EINTR) {
+                    continue;
+                }
+                LOG_PERROR("network_client: splice file");
+                return -1;
+            }
+            numBytes -= written;
+        }
     }
+    return 0;
+
+}
+
+/*
+ * Espera (até deadline) que o servidor acorde o cliente (no eventfd do
+ * cliente). O socket é vigiado ao mesmo tempo: se o servidor terminar deixa
+ * de haver quem o acorde.
+ * Retorna 0 (OK) ou -1 (o servidor fechou a ligação ou prazo esgotado).
+ */
+int network_shm_wait(struct nconn_t *conn, long deadline) {
+
+    struct pollfd fds[2];
+    long timeout;
+    int ready;
 
-    //verifica se a ligação é fechada sem erros
-    if((close(rtable->socket)) == -1) {
-        ERROR("network_client: close");
+    fds[0].fd = conn->shm->clientEvent;
+    fds[0].events = POLLIN;
+    fds[1].fd = conn->fd;
+    fds[1].events = POLLIN;
+    do {
+        if((timeout = deadline - network_now()) <= 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        fds[0].revents = fds[1].revents = 0;
+    } while((ready = poll(fds, 2, (int) timeout)) == 0 || (ready == -1 && errno == EINTR));
+    if(ready == -1) {
         return -1;
     }
-    
-    //em caso de sucesso
+    if(fds[1].revents) {
+        errno = ECONNRESET;
+        return -1;
+    }
+    shm_event_clear(conn->shm->clientEvent);
     return 0;
-	
+
+}
+
+/*
+ * Escreve size bytes de buffer no canal de memória partilhada, esperando
+ * (até deadline) por espaço se o servidor estiver atrasado.
+ * Retorna size ou -1 em caso de erro.
+ */
+int network_shm_write_all(struct nconn_t *conn, char *buffer, int size, long deadline) {
+
+    struct shm_ring_t *requests = &conn->shm->region->requests;
+    int total = 0, numBytes;
+
+    while(total < size) {
+        if((numBytes = shm_ring_write(requests, buffer + total, size - total)) > 0) {
+            total += numBytes;
+            shm_ring_produced(requests, conn->shm->serverEvent);
+        }
+        else if(shm_ring_wait(requests) && network_shm_wait(conn, deadline) == -1) {
+            return -1;
+        }
+    }
+    return total;
+
+}
+
+/*
+ * Lê exactamente size bytes do canal de memória partilhada: primeiro com
+ * espera activa (SHM_SPIN voltas), depois a dormir no eventfd (até
+ * deadline).
+ * Retorna size ou -1 em caso de erro.
+ */
+int network_shm_read_all(struct nconn_t *conn, char *buffer, int size, long deadline) {
+
+    struct shm_ring_t *replies = &conn->shm->region->replies;
+    int total = 0, numBytes;
+
+    while(total < size) {
+        if((numBytes = shm_ring_read(replies, buffer + total, size - total)) > 0) {
+            total += numBytes;
+            shm_ring_consumed(replies, conn->shm->serverEvent);
+        }
+        else if(!shm_ring_poll(replies, SHM_SPIN) && shm_ring_sleep(replies) &&
+                network_shm_wait(conn, deadline) == -1) {
+            return -1;
+        }
+    }
+    return total;
+
+}
+
+/*
+ * Envia um pedido (size bytes de buffer) pelo canal de memória partilhada
+ * da ligação conn, no mesmo formato que no socket, e espera (até deadline)
+ * pela resposta.
+ * Retorna a mensagem obtida como resposta ou NULL em caso de erro.
+ */
+struct message_t *network_shm_send_receive(struct nconn_t *conn, char *buffer, int size, long deadline) {
+
+    uint32_t header[2], convertedSize;
+    struct message_t *rsp;
+    char *bufferReceived;
+
+    if(network_header(header, size, deadline) == -1) {
+        return NULL;
+    }
+    if(network_shm_write_all(conn, (char *) header, sizeof(header), deadline) == -1 ||
+       network_shm_write_all(conn, buffer, size, deadline) == -1) {
+        ERROR("network_client: shm send");
+        return NULL;
+    }
+    if(network_shm_read_all(conn, (char *) &convertedSize, sizeof(uint32_t), deadline) == -1) {
+        ERROR("network_client: shm recv");
+        return NULL;
+    }
+    size = ntohl(convertedSize);
+
+    if((bufferReceived = (char *) malloc(size + 1)) == NULL) {
+        ERROR("network_client: NULL bufferReceived");
+        return NULL;
+    }
+    if(network_shm_read_all(conn, bufferReceived, size, deadline) == -1) {
+        ERROR("network_client: shm recv");
+        free(bufferReceived);
+        return NULL;
+    }
+    bufferReceived[size] = '\0';
+
+    if((rsp = string_to_message(bufferReceived)) == NULL) {
+        ERROR("network_client: string_to_message");
+    }
+    free(bufferReceived);
+    return rsp;
+
 }
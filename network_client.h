@@ -4,7 +4,11 @@
 #include "remote_table.h"
 #include "message.h"
 
-#define RETRY_TIME 5 /* seconds */
+/* Número máximo de ligações abertas a cada servidor */
+#define NETWORK_POOL_SIZE 4
+
+/* Prazo por omissão de cada pedido, em milissegundos */
+#define NETWORK_TIMEOUT 5000
 
 /* 
  * Esta função deve:
@@ -26,6 +30,23 @@ int network_connect(struct rtable_t *rtable);
  */
 struct message_t *network_send_receive(struct rtable_t *rtable, struct message_t *msg);
 
+/*
+ * Indica se o servidor de rtable está disponível: há uma ligação aberta ou
+ * a última tentativa de ligação não falhou (em backoff, é o fio de
+ * vigilância que volta a tentar).
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int network_available(struct rtable_t *rtable);
+
+/*
+ * Pede ao servidor de rtable, numa ligação própria, o seu estado
+ * (OP_RT_SYNC) e escreve o checkpoint em ckp_fd e o log em log_fd, com
+ * splice() do socket para os ficheiros. Pelo socket Unix com endereços
+ * shm:, que não servem para o envio de ficheiros.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int network_sync(struct rtable_t *rtable, int ckp_fd, int log_fd);
+
 /* 
  * A função network_close deve fechar a ligação estabelecida por
  * network_connect(). Se network_connect() alocou memória, a função
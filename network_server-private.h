@@ -0,0 +1,338 @@
+/*
+ * File:   network_server-private.h
+ *
+ * Define o estado do reactor do servidor e de cada ligação.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _NETWORK_SERVER_PRIVATE_H
+#define _NETWORK_SERVER_PRIVATE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Número máximo de eventos tratados por cada chamada a epoll_wait() */
+#define NETWORK_MAX_EVENTS 256
+
+/* Tamanho máximo aceite para uma mensagem (protege contra lixo na ligação) */
+#define NETWORK_MAX_MESSAGE (64 * 1024 * 1024)
+
+/* Espaço livre mínimo no buffer de entrada antes de cada leitura do socket */
+#define NETWORK_READ_SIZE 16384
+
+/* Número máximo de respostas enviadas por cada writev() */
+#define NETWORK_MAX_IOV 64
+
+/*
+ * Backend io_uring: posições do anel de submissão e grupo de buffers onde o
+ * kernel coloca os dados recebidos (NETWORK_URING_BUFFERS de
+ * NETWORK_READ_SIZE bytes, partilhados por todas as ligações do reactor).
+ */
+#define NETWORK_URING_ENTRIES 512
+#define NETWORK_URING_GROUP 0
+#define NETWORK_URING_BUFFERS 256
+
+/*
+ * Operação de uma conclusão do io_uring, nos 3 bits baixos de user_data (o
+ * resto é o endereço da ligação).
+ */
+#define URING_OP_ACCEPT 1
+#define URING_OP_RECV 2
+#define URING_OP_SEND 3
+#define URING_OP_TIMEOUT 4
+#define URING_OP_CANCEL 5
+#define URING_OP_POLL 6
+#define URING_OP_MASK 7
+
+/*
+ * Controlo de fluxo: com mais de NETWORK_HIGH_WATERMARK bytes de respostas
+ * por enviar a ligação deixa de ser lida (o cliente não está a ler e a
+ * janela TCP acaba por fechar); volta a ser lida quando baixar de
+ * NETWORK_LOW_WATERMARK.
+ */
+#define NETWORK_HIGH_WATERMARK (1024 * 1024)
+#define NETWORK_LOW_WATERMARK (256 * 1024)
+
+/*
+ * Define um buffer circular de bytes.
+ *
+ * char *data => memória do buffer
+ * int capacity => tamanho alocado de data
+ * int head => posição do primeiro byte por tratar
+ * int size => número de bytes por tratar
+ */
+struct ring_t {
+    char *data;
+    int capacity;
+    int head;
+    int size;
+};
+
+/*
+ * Define um ficheiro a enviar a seguir a uma resposta (ver
+ * network_server_sendfile()).
+ *
+ * int fd => o ficheiro (fechado depois de enviado)
+ * off_t offset => posição do próximo byte a enviar
+ * long left => bytes que faltam enviar
+ * struct nfile_t *next => próximo ficheiro da mesma resposta
+ */
+struct nfile_t {
+    int fd;
+    off_t offset;
+    long left;
+    struct nfile_t *next;
+};
+
+/*
+ * Define uma resposta por enviar.
+ *
+ * uint32_t header => tamanho da resposta (network byte order)
+ * char *data => conteúdo da resposta (alocado pelo handler)
+ * int size => tamanho de data
+ * struct nfile_t *files => ficheiros enviados a seguir a data (NULL sem eles)
+ */
+struct reply_t {
+    uint32_t header;
+    char *data;
+    int size;
+    struct nfile_t *files;
+};
+
+/*
+ * Define o estado de uma ligação.
+ *
+ * int fd => o socket da ligação
+ * struct ring_t in => bytes lidos do socket e ainda não tratados
+ * struct reply_t *out => buffer circular das respostas por enviar
+ * int outHead => posição da primeira resposta por enviar
+ * int outCount => número de respostas por enviar
+ * int outSlots => tamanho alocado de out
+ * int outOffset => bytes da primeira resposta (tamanho incluído) já enviados
+ * long outBytes => total de bytes por enviar
+ * int paused => 1 enquanto a ligação não é lida (ver NETWORK_HIGH_WATERMARK)
+ * long receivedAt => instante (network_server_now()) em que chegaram os
+ *                    pedidos completos em in (0 se não há nenhum)
+ *
+ * Apenas com io_uring:
+ * struct iovec *iov => respostas do envio em curso (NETWORK_MAX_IOV * 2)
+ * uint32_t *headers => cópias dos tamanhos das respostas do envio em curso
+ *                      (NETWORK_MAX_IOV), que não mudam de sítio se out
+ *                      crescer antes de o kernel as ler
+ * int recvArmed => 1 enquanto há uma recepção multishot activa
+ * int sending => 1 enquanto há um envio em curso
+ * int closing => 1 depois de a ligação começar a ser fechada
+ * int inflight => operações submetidas e ainda não concluídas
+ *
+ * Apenas nas ligações locais (socket Unix):
+ * int local => 1 se a ligação pode passar para memória partilhada
+ * int upgrade => 1 quando o cliente pediu a memória partilhada
+ * struct shm_channel_t *shm => canal de memória partilhada (NULL sem ele)
+ *
+ * struct connection_t *prev, *next => vizinhos na lista de ligações abertas
+ */
+struct connection_t {
+    int fd;
+    struct ring_t in;
+    struct reply_t *out;
+    int outHead;
+    int outCount;
+    int outSlots;
+    int outOffset;
+    long outBytes;
+    int paused;
+    long receivedAt;
+    struct iovec *iov;
+    uint32_t *headers;
+    int recvArmed;
+    int sending;
+    int closing;
+    int inflight;
+    int local;
+    int upgrade;
+    struct shm_channel_t *shm;
+    struct connection_t *prev;
+    struct connection_t *next;
+};
+
+/*
+ * Define o reactor.
+ *
+ * int listenFd => socket de escuta
+ * int epollFd => descritor epoll onde estão o socket de escuta e as ligações
+ * int numConnections => número de ligações abertas
+ * struct connection_t *connections => lista das ligações abertas
+ * struct uring_t *ring => io_uring usado em vez do epoll (NULL sem ele)
+ * char *path => caminho do socket Unix de escuta (NULL para TCP)
+ */
+struct nserver_t {
+    int listenFd;
+    int epollFd;
+    int numConnections;
+    struct connection_t *connections;
+    struct uring_t *ring;
+    char *path;
+};
+
+/*
+ * Aceita todas as ligações pendentes (o socket de escuta é edge-triggered).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_server_accept(struct nserver_t *server);
+
+/*
+ * Trata um evento da ligação: com edge-triggered é preciso esgotar o socket
+ * em ambos os sentidos, e uma ligação parada volta a ser lida logo que as
+ * respostas pendentes baixem de NETWORK_LOW_WATERMARK.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_serve(struct connection_t *conn, nserver_handler_f handler);
+
+/*
+ * Lê tudo o que está disponível na ligação e trata cada mensagem completa,
+ * excepto enquanto a ligação estiver parada por ter demasiadas respostas
+ * por enviar.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_read(struct connection_t *conn, nserver_handler_f handler);
+
+/*
+ * Trata as mensagens completas que estão no buffer de entrada da ligação.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_process(struct connection_t *conn, nserver_handler_f handler);
+
+/*
+ * Acrescenta reply (size bytes) às respostas pendentes da ligação, que passa
+ * a ser dona da memória.
+ * Retorna 0 (ok) ou -1 (erro, reply não é libertada).
+ */
+int network_server_queue(struct connection_t *conn, char *reply, int size);
+
+/*
+ * Envia o que a ligação tem pendente até o socket deixar de aceitar dados:
+ * o tamanho e o conteúdo de várias respostas seguem num só writev().
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_flush(struct connection_t *conn);
+
+/*
+ * Preenche iov (com espaço para NETWORK_MAX_IOV * 2 posições) com o que
+ * falta enviar das primeiras respostas pendentes da ligação, parando numa
+ * resposta com ficheiros (seguem depois dela, com sendfile()). Com headers
+ * (espaço para NETWORK_MAX_IOV) os tamanhos das respostas são copiados para
+ * lá e iov aponta para as cópias, para um envio que continue depois de out
+ * poder ser realocado (network_server_queue()).
+ * Retorna o número de posições usadas.
+ */
+int network_server_iov(struct connection_t *conn, struct iovec *iov, uint32_t *headers);
+
+/*
+ * Retira das respostas pendentes os numBytes que acabaram de ser enviados.
+ * Uma resposta com ficheiros fica à cabeça até eles serem enviados.
+ */
+void network_server_sent(struct connection_t *conn, int numBytes);
+
+/*
+ * Indica se a primeira resposta pendente já foi enviada e só faltam os
+ * ficheiros que a seguem.
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int network_server_files_ready(struct connection_t *conn);
+
+/*
+ * Envia com sendfile() (o socket tem de estar não bloqueante) os ficheiros
+ * da primeira resposta pendente, retirando-a quando acabarem.
+ * Retorna 1 (enviados), 0 (o socket encheu) ou -1 (a ligação deve ser
+ * fechada).
+ */
+int network_server_send_files(struct connection_t *conn);
+
+/*
+ * Retira e liberta a primeira resposta pendente, fechando os ficheiros que
+ * ainda tiver.
+ */
+void network_server_pop(struct connection_t *conn);
+
+/*
+ * Retira a ligação do reactor, fecha o socket e liberta o estado.
+ */
+void network_server_close(struct nserver_t *server, struct connection_t *conn);
+
+/*
+ * Garante que o buffer tem capacidade para pelo menos capacity bytes.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ring_reserve(struct ring_t *ring, int capacity);
+
+/*
+ * Acrescenta ao fim do buffer count bytes de src, aumentando-o se preciso.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ring_append(struct ring_t *ring, char *src, int count);
+
+/*
+ * Copia para dest count bytes do buffer, a partir de offset bytes do início,
+ * sem os retirar do buffer.
+ */
+void ring_peek(struct ring_t *ring, int offset, char *dest, int count);
+
+/*
+ * Ciclo do reactor com io_uring: aceita ligações e recebe dados com
+ * operações multishot (os dados chegam nos buffers registados) e envia as
+ * respostas com writev submetidos no mesmo anel, entrando no kernel uma vez
+ * por cada lote de conclusões.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_uring_run(struct nserver_t *server, nserver_handler_f handler,
+                      nserver_tick_f tick, volatile int *running);
+
+/*
+ * Submete uma recepção multishot para a ligação.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_uring_recv(struct nserver_t *server, struct connection_t *conn);
+
+/*
+ * Submete o envio das respostas pendentes da ligação, se não houver já um
+ * em curso.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_uring_send(struct nserver_t *server, struct connection_t *conn);
+
+/*
+ * Começa a fechar a ligação (as operações em curso terminam com erro) e
+ * liberta-a quando já não houver nenhuma.
+ */
+void network_uring_release(struct nserver_t *server, struct connection_t *conn);
+
+/*
+ * Passa a ligação local para memória partilhada: cria o canal, envia ao
+ * cliente os seus descritores e passa a esperar pelos pedidos no eventfd.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_shm_accept(struct nserver_t *server, struct connection_t *conn,
+                       nserver_handler_f handler);
+
+/*
+ * Trata um evento de uma ligação em memória partilhada: lê os pedidos do
+ * buffer partilhado, trata-os e escreve lá as respostas, até não haver mais
+ * pedidos (e o cliente ter sido avisado de que o servidor vai dormir).
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_shm_serve(struct connection_t *conn, nserver_handler_f handler);
+
+/*
+ * Escreve no buffer partilhado as respostas pendentes, até ele encher.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_shm_flush(struct connection_t *conn);
+
+/*
+ * Retira a ligação em memória partilhada do reactor e liberta o canal.
+ */
+void network_shm_close(struct nserver_t *server, struct connection_t *conn);
+
+#endif
@@ -0,0 +1,946 @@
+/*
+ * File:   network_server.c
+ *
+ * Reactor do servidor: um único descritor epoll (edge-triggered) com o socket
+ * de escuta e todas as ligações, cada uma com o seu estado de leitura e de
+ * escrita, pelo que não há limite fixo de clientes nem espera activa. Cada
+ * ligação lê para um buffer circular, de onde são retiradas as mensagens
+ * completas, e envia as respostas pendentes com writev().
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include "utils.h"
+#include "network_server.h"
+#include "network_server-private.h"
+#include "uring.h"
+#include "shm_ring.h"
+
+/*
+ * Ficheiros juntos pelo handler à resposta que está a preparar (ver
+ * network_server_sendfile()), e se o pode fazer: cada reactor tem o seu fio.
+ */
+static __thread struct nfile_t *network_files = NULL;
+static __thread int network_files_allowed = 0;
+
+/*
+ * Fecha e liberta a lista de ficheiros files.
+ */
+static void network_server_free_files(struct nfile_t *files) {
+
+    struct nfile_t *next;
+
+    for(; files; files = next) {
+        next = files->next;
+        close(files->fd);
+        free(files);
+    }
+
+}
+
+/*
+ * Põe o socket fd (já com bind) à escuta e cria o reactor à volta dele
+ * (flags como em network_server_create()).
+ * Retorna NULL em caso de erro (fd é fechado).
+ */
+static struct nserver_t *network_server_init(int fd, int flags) {
+
+    struct epoll_event event;
+    struct nserver_t *server;
+
+    if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || listen(fd, SOMAXCONN) == -1) {
+        LOG_PERROR("listen");
+        close(fd);
+        return NULL;
+    }
+
+    if((server = (struct nserver_t *) malloc(sizeof(struct nserver_t))) == NULL) {
+        ERROR("malloc server");
+        close(fd);
+        return NULL;
+    }
+    server->listenFd = fd;
+    server->numConnections = 0;
+    server->connections = NULL;
+    if((server->epollFd = epoll_create1(0)) == -1) {
+        LOG_PERROR("epoll_create1");
+        close(fd);
+        free(server);
+        return NULL;
+    }
+
+    // O socket de escuta é identificado por data.ptr == NULL
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if(epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        LOG_PERROR("epoll_ctl listen");
+        close(server->epollFd);
+        close(fd);
+        free(server);
+        return NULL;
+    }
+
+    // Sem io_uring (kernel antigo ou desactivado) fica o epoll
+    server->ring = NULL;
+    server->path = NULL;
+    if(flags & NETWORK_URING) {
+        if((server->ring = uring_create(NETWORK_URING_ENTRIES)) == NULL ||
+           uring_register_buffers(server->ring, NETWORK_URING_GROUP, NETWORK_URING_BUFFERS, NETWORK_READ_SIZE) == -1) {
+            LOG_WARN("server: io_uring indisponivel, a usar epoll");
+            uring_destroy(server->ring);
+            server->ring = NULL;
+        }
+    }
+    return server;
+
+}
+
+/*
+ * Cria o socket de escuta no porto port (IPv4 ou IPv6) e o reactor. flags
+ * combina NETWORK_SHARED (SO_REUSEPORT, para vários reactores, um por fio,
+ * escutarem o mesmo porto e o kernel repartir as ligações entre eles) e
+ * NETWORK_URING (io_uring em vez de epoll, se o kernel o permitir).
+ * Retorna NULL em caso de erro.
+ */
+struct nserver_t *network_server_create(char *port, int flags) {
+
+    struct addrinfo hints, *serverInfo, *anAddress;
+    int retVal, yes = 1, fd = -1;
+
+    if(port == NULL) {
+        ERROR("NULL port");
+        return NULL;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE; // Use current IP
+
+    if((retVal = getaddrinfo(NULL, port, &hints, &serverInfo)) != 0) {
+        LOG_ERROR("getaddrinfo: %s", gai_strerror(retVal));
+        return NULL;
+    }
+
+    for(anAddress = serverInfo; anAddress; anAddress = anAddress->ai_next) {
+        if((fd = socket(anAddress->ai_family, anAddress->ai_socktype, anAddress->ai_protocol)) == -1) {
+            LOG_PERROR("server: socket");
+            continue;
+        }
+        if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+            LOG_PERROR("setsockopt");
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if((flags & NETWORK_SHARED) && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            LOG_PERROR("setsockopt SO_REUSEPORT");
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        if(bind(fd, anAddress->ai_addr, anAddress->ai_addrlen) == -1) {
+            LOG_PERROR("server: bind");
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        // Se chegamos aqui conseguimos fazer um bind com sucesso.
+        break;
+    }
+    freeaddrinfo(serverInfo);
+
+    if(fd == -1) {
+        LOG_ERROR("server: failed to bind");
+        return NULL;
+    }
+    return network_server_init(fd, flags);
+
+}
+
+/*
+ * Cria o reactor para clientes na mesma máquina, a escutar no socket Unix
+ * path (um ficheiro antigo com o mesmo nome é apagado). Os clientes podem
+ * depois passar a ligação para memória partilhada (endereço "shm:path").
+ * Retorna NULL em caso de erro.
+ */
+struct nserver_t *network_server_create_local(char *path) {
+
+    struct sockaddr_un address;
+    struct nserver_t *server;
+    int fd;
+
+    if(path == NULL || strlen(path) >= sizeof(address.sun_path)) {
+        ERROR("NULL or too long path");
+        return NULL;
+    }
+    if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        LOG_PERROR("server: socket");
+        return NULL;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    // Um socket deixado por um servidor anterior impediria o bind
+    unlink(path);
+    if(bind(fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        LOG_PERROR("server: bind");
+        close(fd);
+        return NULL;
+    }
+
+    // O io_uring não trata a memória partilhada: fica o epoll
+    if((server = network_server_init(fd, 0)) == NULL) {
+        unlink(path);
+        return NULL;
+    }
+    if((server->path = strdup(path)) == NULL) {
+        ERROR("strdup path");
+        network_server_destroy(server);
+        unlink(path);
+        return NULL;
+    }
+    return server;
+
+}
+
+/*
+ * Anula os eventos, de entre os count de events, da ligação conn (que acabou
+ * de ser fechada).
+ */
+static void network_server_forget(struct epoll_event *events, int count, struct connection_t *conn) {
+
+    int i;
+
+    for(i = 0; i < count; i++) {
+        if(events[i].data.ptr == conn) {
+            events[i].events = 0;
+        }
+    }
+
+}
+
+/*
+ * Atende ligações até *running passar a 0: cada mensagem (4 bytes de
+ * tamanho, em network byte order, seguidos do conteúdo) é passada a handler
+ * e a resposta é enviada no mesmo formato. tick é chamado entre pedidos, no
+ * máximo uma vez por NETWORK_TICK_MS.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_server_run(struct nserver_t *server, nserver_handler_f handler,
+                       nserver_tick_f tick, volatile int *running) {
+
+    struct epoll_event events[NETWORK_MAX_EVENTS];
+    struct connection_t *conn;
+    long lastTick = 0, timeout;
+    int numEvents, i;
+
+    if(server == NULL || handler == NULL || running == NULL) {
+        ERROR("NULL server, handler or running");
+        return -1;
+    }
+    if(server->ring) {
+        return network_uring_run(server, handler, tick, running);
+    }
+
+    while(*running) {
+        // Sem pedidos o processo dorme até ao próximo tick
+        if((timeout = NETWORK_TICK_MS - (network_server_now() - lastTick)) < 0) {
+            timeout = 0;
+        }
+        if((numEvents = epoll_wait(server->epollFd, events, NETWORK_MAX_EVENTS, (int) timeout)) == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            LOG_PERROR("epoll_wait");
+            return -1;
+        }
+
+        for(i = 0; i < numEvents; i++) {
+            if(events[i].events == 0) {
+                continue;
+            }
+            if((conn = (struct connection_t *) events[i].data.ptr) == NULL) {
+                network_server_accept(server);
+                continue;
+            }
+            if((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+               network_server_serve(conn, handler) == -1 ||
+               (conn->upgrade && network_shm_accept(server, conn, handler) == -1)) {
+                network_server_close(server, conn);
+                // Uma ligação em memória partilhada tem dois descritores no
+                // epoll: os outros eventos dela neste lote já não valem
+                network_server_forget(events + i + 1, numEvents - i - 1, conn);
+            }
+        }
+
+        // O tick corre no máximo uma vez por NETWORK_TICK_MS, por muitos
+        // que sejam os lotes de eventos
+        if(tick && network_server_now() - lastTick >= NETWORK_TICK_MS) {
+            tick();
+            lastTick = network_server_now();
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * Aceita todas as ligações pendentes (o socket de escuta é edge-triggered).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_server_accept(struct nserver_t *server) {
+
+    struct sockaddr_storage connectorAddress;
+    socklen_t socketSize;
+    struct epoll_event event;
+    struct connection_t *conn;
+    int fd, yes = 1;
+
+    while(1) {
+        socketSize = sizeof(connectorAddress);
+        if((fd = accept(server->listenFd, (struct sockaddr *) &connectorAddress, &socketSize)) == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            LOG_PERROR("accept");
+            return -1;
+        }
+
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        // As respostas são escritas de uma vez, o Nagle só atrasaria
+        if(server->path == NULL) {
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+
+        if((conn = (struct connection_t *) calloc(1, sizeof(struct connection_t))) == NULL) {
+            ERROR("calloc connection");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->local = (server->path != NULL);
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if(epoll_ctl(server->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            LOG_PERROR("epoll_ctl connection");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        conn->next = server->connections;
+        if(server->connections) {
+            server->connections->prev = conn;
+        }
+        server->connections = conn;
+        server->numConnections++;
+        LOG_INFO("A ligação foi estabelecida com sucesso. (%d)", server->numConnections);
+    }
+
+}
+
+/*
+ * Trata um evento da ligação: com edge-triggered é preciso esgotar o socket
+ * em ambos os sentidos, e uma ligação parada volta a ser lida logo que as
+ * respostas pendentes baixem de NETWORK_LOW_WATERMARK (pode não chegar outro
+ * evento se o socket aceitar tudo de uma vez).
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_serve(struct connection_t *conn, nserver_handler_f handler) {
+
+    if(conn->shm) {
+        return network_shm_serve(conn, handler);
+    }
+    while(1) {
+        if(network_server_flush(conn) == -1) {
+            return -1;
+        }
+        if(conn->paused && conn->outBytes > NETWORK_LOW_WATERMARK) {
+            // O socket está cheio: continua no próximo EPOLLOUT
+            return 0;
+        }
+        if(network_server_read(conn, handler) == -1) {
+            return -1;
+        }
+        if(!conn->paused) {
+            return network_server_flush(conn);
+        }
+    }
+
+}
+
+/*
+ * Lê tudo o que está disponível na ligação e trata cada mensagem completa,
+ * excepto enquanto a ligação estiver parada por ter demasiadas respostas
+ * por enviar.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_read(struct connection_t *conn, nserver_handler_f handler) {
+
+    struct iovec iov[2];
+    struct ring_t *in = &conn->in;
+    int numBytes, tail, iovCount;
+
+    if(conn->paused && conn->outBytes <= NETWORK_LOW_WATERMARK) {
+        conn->paused = 0;
+    }
+    // O que ficou por tratar enquanto a ligação esteve parada
+    if(network_server_process(conn, handler) == -1) {
+        return -1;
+    }
+
+    while(!conn->paused && !conn->upgrade) {
+        if(in->capacity - in->size < NETWORK_READ_SIZE &&
+           ring_reserve(in, in->size + NETWORK_READ_SIZE) == -1) {
+            return -1;
+        }
+
+        // O espaço livre pode estar dividido pelo fim e início do buffer
+        tail = (in->head + in->size) % in->capacity;
+        iov[0].iov_base = in->data + tail;
+        if(tail >= in->head) {
+            iov[0].iov_len = in->capacity - tail;
+            iov[1].iov_base = in->data;
+            iov[1].iov_len = in->head;
+            iovCount = (in->head > 0 ? 2 : 1);
+        }
+        else {
+            iov[0].iov_len = in->head - tail;
+            iovCount = 1;
+        }
+
+        if((numBytes = (int) readv(conn->fd, iov, iovCount)) == 0) {
+            // O cliente fechou a ligação
+            return -1;
+        }
+        if(numBytes == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        in->size += numBytes;
+
+        if(network_server_process(conn, handler) == -1) {
+            return -1;
+        }
+    }
+    // Parada: o resto fica no socket até as respostas serem enviadas
+    return 0;
+
+}
+
+/*
+ * Retorna o tempo actual em milissegundos (relógio monótono), a escala dos
+ * prazos passados ao handler.
+ */
+long network_server_now(void) {
+
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+
+}
+
+/*
+ * Trata as mensagens completas que estão no buffer de entrada da ligação.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_process(struct connection_t *conn, nserver_handler_f handler) {
+
+    struct ring_t *in = &conn->in;
+    struct reply_t *last;
+    struct nfile_t *file;
+    uint32_t header, budget;
+    char *request, *reply;
+    int size, headerSize, replySize;
+    long deadline;
+
+    // Os prazos contam a partir da chegada dos bytes (chamada logo a seguir)
+    if(in->size > 0 && conn->receivedAt == 0) {
+        conn->receivedAt = network_server_now();
+    }
+    while(!conn->paused && !conn->upgrade && in->size >= (int) sizeof(header)) {
+        ring_peek(in, 0, (char *) &header, sizeof(header));
+        header = ntohl(header);
+        size = (int) (header & ~NETWORK_DEADLINE);
+        headerSize = (header & NETWORK_DEADLINE) ? 2 * sizeof(uint32_t) : sizeof(uint32_t);
+        if(header == SHM_UPGRADE && conn->local && conn->shm == NULL) {
+            // O resto da ligação passa para memória partilhada (no reactor)
+            in->head = (in->head + sizeof(header)) % in->capacity;
+            in->size -= sizeof(header);
+            if(in->size == 0) {
+                conn->receivedAt = 0;
+            }
+            conn->upgrade = 1;
+            return 0;
+        }
+        if(size <= 0 || size > NETWORK_MAX_MESSAGE) {
+            ERROR("tamanho de mensagem invalido");
+            return -1;
+        }
+        if(in->size < headerSize + size) {
+            // Mensagem incompleta: garante espaço para o resto. O prazo conta
+            // a partir da chegada do resto; senão, com um cliente que envia
+            // pedidos sem parar, in nunca esvaziava e o instante nunca mudava
+            conn->receivedAt = 0;
+            return ring_reserve(in, headerSize + size);
+        }
+
+        deadline = 0;
+        if(header & NETWORK_DEADLINE) {
+            ring_peek(in, sizeof(header), (char *) &budget, sizeof(budget));
+            deadline = conn->receivedAt + ntohl(budget);
+        }
+        if((request = (char *) malloc(size + 1)) == NULL) {
+            ERROR("malloc request");
+            return -1;
+        }
+        ring_peek(in, headerSize, request, size);
+        request[size] = '\0';
+        in->head = (in->head + headerSize + size) % in->capacity;
+        in->size -= headerSize + size;
+        if(in->size == 0) {
+            in->head = 0;
+            conn->receivedAt = 0;
+        }
+
+        reply = NULL;
+        network_files_allowed = (conn->shm == NULL);
+        replySize = handler(request, size, deadline, &reply);
+        network_files_allowed = 0;
+        free(request);
+        if(replySize <= 0 || network_server_queue(conn, reply, replySize) == -1) {
+            free(reply);
+            network_server_free_files(network_files);
+            network_files = NULL;
+            return -1;
+        }
+        if(network_files) {
+            // Os ficheiros seguem a resposta acabada de pôr na fila
+            last = &conn->out[(conn->outHead + conn->outCount - 1) % conn->outSlots];
+            last->files = network_files;
+            for(file = network_files; file; file = file->next) {
+                conn->outBytes += file->left;
+            }
+            network_files = NULL;
+        }
+        if(conn->outBytes > NETWORK_HIGH_WATERMARK) {
+            conn->paused = 1;
+        }
+    }
+    if(!conn->paused && !conn->upgrade) {
+        conn->receivedAt = 0;
+    }
+    return 0;
+
+}
+
+/*
+ * Acrescenta reply (size bytes) às respostas pendentes da ligação, que passa
+ * a ser dona da memória.
+ * Retorna 0 (ok) ou -1 (erro, reply não é libertada).
+ */
+int network_server_queue(struct connection_t *conn, char *reply, int size) {
+
+    struct reply_t *tempOut;
+    int slots, i;
+
+    if(conn->outCount == conn->outSlots) {
+        // Cresce para o dobro, passando as respostas para o início
+        slots = (conn->outSlots > 0 ? conn->outSlots * 2 : 16);
+        if((tempOut = (struct reply_t *) malloc(slots * sizeof(struct reply_t))) == NULL) {
+            ERROR("malloc out");
+            return -1;
+        }
+        for(i = 0; i < conn->outCount; i++) {
+            tempOut[i] = conn->out[(conn->outHead + i) % conn->outSlots];
+        }
+        free(conn->out);
+        conn->out = tempOut;
+        conn->outSlots = slots;
+        conn->outHead = 0;
+    }
+
+    i = (conn->outHead + conn->outCount) % conn->outSlots;
+    conn->out[i].header = htonl(size);
+    conn->out[i].data = reply;
+    conn->out[i].size = size;
+    conn->out[i].files = NULL;
+    conn->outCount++;
+    conn->outBytes += sizeof(uint32_t) + size;
+    return 0;
+
+}
+
+/*
+ * Só pode ser chamada pelo handler, durante o tratamento de um pedido: a
+ * seguir à resposta que está a preparar são enviados pela ligação os size
+ * bytes do ficheiro fd a partir de offset, com sendfile(). O reactor fica
+ * com fd, mesmo em caso de erro, e fecha-o depois do envio.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_server_sendfile(int fd, long offset, long size) {
+
+    struct nfile_t *file, **tail;
+
+    if(!network_files_allowed || fd < 0 || offset < 0 || size < 0) {
+        ERROR("sendfile fora do handler ou argumentos invalidos");
+        if(fd >= 0) {
+            close(fd);
+        }
+        // A resposta não pode seguir só com parte dos ficheiros
+        network_server_free_files(network_files);
+        network_files = NULL;
+        return -1;
+    }
+    if(size == 0) {
+        close(fd);
+        return 0;
+    }
+    if((file = (struct nfile_t *) malloc(sizeof(struct nfile_t))) == NULL) {
+        ERROR("malloc file");
+        close(fd);
+        network_server_free_files(network_files);
+        network_files = NULL;
+        return -1;
+    }
+    file->fd = fd;
+    file->offset = (off_t) offset;
+    file->left = size;
+    file->next = NULL;
+    for(tail = &network_files; *tail; tail = &(*tail)->next);
+    *tail = file;
+    return 0;
+
+}
+
+/*
+ * Envia o que a ligação tem pendente até o socket deixar de aceitar dados:
+ * o tamanho e o conteúdo de várias respostas seguem num só writev(), os
+ * ficheiros que seguem uma resposta com sendfile().
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_server_flush(struct connection_t *conn) {
+
+    struct iovec iov[NETWORK_MAX_IOV * 2];
+    int numBytes, iovCount, result;
+
+    while(conn->outCount > 0) {
+        if(network_server_files_ready(conn)) {
+            if((result = network_server_send_files(conn)) != 1) {
+                // Cheio (0): o resto segue quando chegar o próximo EPOLLOUT
+                return result;
+            }
+            continue;
+        }
+        iovCount = network_server_iov(conn, iov, NULL);
+        if((numBytes = (int) writev(conn->fd, iov, iovCount)) == -1) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                // O resto segue quando chegar o próximo EPOLLOUT
+                return 0;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            LOG_PERROR("writev");
+            return -1;
+        }
+        network_server_sent(conn, numBytes);
+    }
+    return 0;
+
+}
+
+/*
+ * Preenche iov (com espaço para NETWORK_MAX_IOV * 2 posições) com o que
+ * falta enviar das primeiras respostas pendentes da ligação.
+ * Retorna o número de posições usadas.
+ */
+int network_server_iov(struct connection_t *conn, struct iovec *iov, uint32_t *headers) {
+
+    struct reply_t *reply;
+    uint32_t *header;
+    int iovCount = 0, offset = conn->outOffset, i;
+
+    for(i = 0; i < conn->outCount && i < NETWORK_MAX_IOV; i++) {
+        reply = &conn->out[(conn->outHead + i) % conn->outSlots];
+        header = &reply->header;
+        if(headers) {
+            headers[i] = reply->header;
+            header = &headers[i];
+        }
+        // Só a primeira resposta pode ter sido enviada em parte
+        if(offset < (int) sizeof(reply->header)) {
+            iov[iovCount].iov_base = (char *) header + offset;
+            iov[iovCount].iov_len = sizeof(reply->header) - offset;
+            iovCount++;
+            offset = 0;
+        }
+        else {
+            offset -= sizeof(reply->header);
+        }
+        iov[iovCount].iov_base = reply->data + offset;
+        iov[iovCount].iov_len = reply->size - offset;
+        iovCount++;
+        offset = 0;
+        if(reply->files) {
+            break;
+        }
+    }
+    return iovCount;
+
+}
+
+/*
+ * Retira das respostas pendentes os numBytes que acabaram de ser enviados.
+ */
+void network_server_sent(struct connection_t *conn, int numBytes) {
+
+    struct reply_t *reply;
+    int left;
+
+    conn->outBytes -= numBytes;
+    while(numBytes > 0) {
+        reply = &conn->out[conn->outHead];
+        left = sizeof(reply->header) + reply->size - conn->outOffset;
+        // Com ficheiros, o envio parou no fim da resposta (ver network_server_iov())
+        if(numBytes < left || reply->files) {
+            conn->outOffset += numBytes;
+            return;
+        }
+        numBytes -= left;
+        network_server_pop(conn);
+    }
+
+}
+
+/*
+ * Indica se a primeira resposta pendente já foi enviada e só faltam os
+ * ficheiros que a seguem.
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int network_server_files_ready(struct connection_t *conn) {
+
+    struct reply_t *reply;
+
+    if(conn->outCount == 0) {
+        return 0;
+    }
+    reply = &conn->out[conn->outHead];
+    return reply->files != NULL && conn->outOffset == (int) sizeof(reply->header) + reply->size;
+
+}
+
+/*
+ * Envia com sendfile() (o socket tem de estar não bloqueante) os ficheiros
+ * da primeira resposta pendente, retirando-a quando acabarem.
+ * Retorna 1 (enviados), 0 (o socket encheu) ou -1 (a ligação deve ser
+ * fechada).
+ */
+int network_server_send_files(struct connection_t *conn) {
+
+    struct reply_t *reply = &conn->out[conn->outHead];
+    struct nfile_t *file;
+    ssize_t numBytes;
+
+    while((file = reply->files) != NULL) {
+        while(file->left > 0) {
+            if((numBytes = sendfile(conn->fd, file->fd, &file->offset, file->left)) == -1) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return 0;
+                }
+                if(errno == EINTR) {
+                    continue;
+                }
+                LOG_PERROR("sendfile");
+                return -1;
+            }
+            if(numBytes == 0) {
+                // O ficheiro ficou mais curto: o cliente já não recebe o combinado
+                ERROR("sendfile: fim do ficheiro antes do previsto");
+                return -1;
+            }
+            file->left -= numBytes;
+            conn->outBytes -= numBytes;
+        }
+        reply->files = file->next;
+        close(file->fd);
+        free(file);
+    }
+    network_server_pop(conn);
+    return 1;
+
+}
+
+/*
+ * Retira e liberta a primeira resposta pendente, fechando os ficheiros que
+ * ainda tiver.
+ */
+void network_server_pop(struct connection_t *conn) {
+
+    struct reply_t *reply = &conn->out[conn->outHead];
+
+    free(reply->data);
+    network_server_free_files(reply->files);
+    conn->outHead = (conn->outHead + 1) % conn->outSlots;
+    conn->outCount--;
+    conn->outOffset = 0;
+    if(conn->outCount == 0) {
+        conn->outHead = 0;
+    }
+
+}
+
+/*
+ * Retira a ligação do reactor, fecha o socket e liberta o estado.
+ */
+void network_server_close(struct nserver_t *server, struct connection_t *conn) {
+
+    LOG_INFO("A fechar ligação %d", conn->fd);
+    if(conn->shm) {
+        network_shm_close(server, conn);
+    }
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    if(conn->prev) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        server->connections = conn->next;
+    }
+    if(conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    while(conn->outCount > 0) {
+        network_server_pop(conn);
+    }
+    free(conn->out);
+    free(conn->in.data);
+    free(conn->iov);
+    free(conn->headers);
+    free(conn);
+    server->numConnections--;
+
+}
+
+/*
+ * Fecha todas as ligações e o socket de escuta e liberta a memória.
+ */
+void network_server_destroy(struct nserver_t *server) {
+
+    if(server) {
+        // Primeiro o io_uring, que cancela as operações sobre as ligações;
+        // o kernel liberta-o mais tarde, pelo que o socket de escuta é
+        // desligado já para o porto ficar livre
+        if(server->ring) {
+            shutdown(server->listenFd, SHUT_RDWR);
+            uring_destroy(server->ring);
+        }
+        while(server->connections) {
+            network_server_close(server, server->connections);
+        }
+        close(server->epollFd);
+        close(server->listenFd);
+        if(server->path) {
+            unlink(server->path);
+            free(server->path);
+        }
+        free(server);
+    }
+
+}
+
+/*
+ * Garante que o buffer tem capacidade para pelo menos capacity bytes.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ring_reserve(struct ring_t *ring, int capacity) {
+
+    char *tempData;
+    int newCapacity;
+
+    if(capacity <= ring->capacity) {
+        return 0;
+    }
+    newCapacity = (ring->capacity > 0 ? ring->capacity : NETWORK_READ_SIZE);
+    while(newCapacity < capacity) {
+        newCapacity *= 2;
+    }
+    if((tempData = (char *) malloc(newCapacity)) == NULL) {
+        ERROR("malloc ring");
+        return -1;
+    }
+    // Os bytes por tratar passam para o início do novo buffer
+    ring_peek(ring, 0, tempData, ring->size);
+    free(ring->data);
+    ring->data = tempData;
+    ring->capacity = newCapacity;
+    ring->head = 0;
+    return 0;
+
+}
+
+/*
+ * Acrescenta ao fim do buffer count bytes de src, aumentando-o se preciso.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ring_append(struct ring_t *ring, char *src, int count) {
+
+    int tail, first;
+
+    if(ring_reserve(ring, ring->size + count) == -1) {
+        return -1;
+    }
+    tail = (ring->head + ring->size) % ring->capacity;
+    first = ring->capacity - tail;
+    if(first >= count) {
+        memcpy(ring->data + tail, src, count);
+    }
+    else {
+        memcpy(ring->data + tail, src, first);
+        memcpy(ring->data, src + first, count - first);
+    }
+    ring->size += count;
+    return 0;
+
+}
+
+/*
+ * Copia para dest count bytes do buffer, a partir de offset bytes do início,
+ * sem os retirar do buffer.
+ */
+void ring_peek(struct ring_t *ring, int offset, char *dest, int count) {
+
+    int start, first;
+
+    if(count <= 0) {
+        return;
+    }
+    start = (ring->head + offset) % ring->capacity;
+    first = ring->capacity - start;
+    if(first >= count) {
+        memcpy(dest, ring->data + start, count);
+    }
+    else {
+        memcpy(dest, ring->data + start, first);
+        memcpy(dest + first, ring->data, count - first);
+    }
+
+}
@@ -0,0 +1,86 @@
+#ifndef _NETWORK_SERVER_H
+#define _NETWORK_SERVER_H
+
+/* Tempo máximo (ms) que o servidor fica bloqueado sem chamar o tick */
+#define NETWORK_TICK_MS 1000
+
+/* Opções de network_server_create() */
+#define NETWORK_SHARED 1 /* Vários reactores no mesmo porto (SO_REUSEPORT) */
+#define NETWORK_URING 2 /* io_uring em vez de epoll, se disponível */
+
+/*
+ * Com este bit no tamanho de uma mensagem, o cabeçalho tem mais 4 bytes (em
+ * network byte order): os milissegundos que o cliente ainda espera pela
+ * resposta. O tamanho propriamente dito fica nos restantes bits.
+ */
+#define NETWORK_DEADLINE 0x80000000u
+
+struct nserver_t; /* Definida em network_server-private.h */
+
+/*
+ * Trata um pedido completo (request, com size bytes e terminado em '\0') e
+ * coloca em *reply uma resposta alocada com malloc(). deadline é o instante
+ * (network_server_now()) em que o cliente desiste da resposta, ou 0 se o
+ * pedido não tem prazo.
+ * Retorna o tamanho da resposta ou -1 em caso de erro (a ligação é fechada).
+ */
+typedef int (*nserver_handler_f)(char *request, int size, long deadline, char **reply);
+
+/*
+ * Chamada entre pedidos e, sem pedidos, pelo menos a cada NETWORK_TICK_MS
+ * (e.g., para os temporizadores e o garbage collector).
+ */
+typedef void (*nserver_tick_f)(void);
+
+/*
+ * Cria o socket de escuta no porto port (IPv4 ou IPv6) e o reactor. flags
+ * combina NETWORK_SHARED (SO_REUSEPORT, para vários reactores, um por fio,
+ * escutarem o mesmo porto e o kernel repartir as ligações entre eles) e
+ * NETWORK_URING (io_uring em vez de epoll, se o kernel o permitir).
+ * Retorna NULL em caso de erro.
+ */
+struct nserver_t *network_server_create(char *port, int flags);
+
+/*
+ * Cria o reactor para clientes na mesma máquina, a escutar no socket Unix
+ * path (um ficheiro antigo com o mesmo nome é apagado). Os clientes podem
+ * depois passar a ligação para memória partilhada (endereço "shm:path").
+ * Retorna NULL em caso de erro.
+ */
+struct nserver_t *network_server_create_local(char *path);
+
+/*
+ * Atende ligações até *running passar a 0: cada mensagem (4 bytes de
+ * tamanho, em network byte order, e o prazo se tiver NETWORK_DEADLINE,
+ * seguidos do conteúdo) é passada a handler e a resposta é enviada no mesmo
+ * formato, sem prazo. tick é chamado entre pedidos, no máximo uma vez por
+ * NETWORK_TICK_MS.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_server_run(struct nserver_t *server, nserver_handler_f handler,
+                       nserver_tick_f tick, volatile int *running);
+
+/*
+ * Só pode ser chamada pelo handler, durante o tratamento de um pedido: a
+ * seguir à resposta que está a preparar são enviados pela ligação os size
+ * bytes do ficheiro fd a partir de offset, com sendfile() (sem passarem
+ * pela memória do processo). O reactor fica com fd, mesmo em caso de erro,
+ * e fecha-o depois do envio. Um erro anula também os ficheiros já juntos à
+ * mesma resposta. Não disponível nas ligações em memória partilhada.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_server_sendfile(int fd, long offset, long size);
+
+/*
+ * Retorna o tempo actual em milissegundos (relógio monótono), a escala dos
+ * prazos passados ao handler.
+ */
+long network_server_now(void);
+
+/*
+ * Fecha todas as ligações e o socket de escuta (apagando o socket Unix) e
+ * liberta a memória.
+ */
+void network_server_destroy(struct nserver_t *server);
+
+#endif
@@ -0,0 +1,201 @@
+/*
+ * File:   network_shm.c
+ *
+ * Ligações em memória partilhada do reactor local: um cliente ligado pelo
+ * socket Unix pede a passagem para memória partilhada e, a partir daí, os
+ * pedidos e as respostas passam pelos buffers do canal (shm_ring.c); o
+ * socket fica só para detectar o fim do cliente.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include "utils.h"
+#include "network_server.h"
+#include "network_server-private.h"
+#include "shm_ring.h"
+#include "shm_ring-private.h"
+
+/*
+ * Envia ao cliente a confirmação (um cabeçalho SHM_UPGRADE) com o
+ * memfd e os dois eventfd do canal.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int network_shm_send_fds(int fd, int memfd, struct shm_channel_t *channel) {
+
+    union {
+        char buffer[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    uint32_t header = htonl(SHM_UPGRADE);
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int fds[3];
+
+    iov.iov_base = &header;
+    iov.iov_len = sizeof(header);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    fds[0] = memfd;
+    fds[1] = channel->serverEvent;
+    fds[2] = channel->clientEvent;
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // O socket está vazio (o cliente espera por esta resposta): não bloqueia
+    while(sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(header)) {
+        if(errno != EINTR) {
+            LOG_PERROR("sendmsg shm");
+            return -1;
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * Passa a ligação local para memória partilhada: cria o canal, envia ao
+ * cliente os seus descritores e passa a esperar pelos pedidos no eventfd.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_shm_accept(struct nserver_t *server, struct connection_t *conn,
+                       nserver_handler_f handler) {
+
+    struct epoll_event event;
+    int memfd, retVal;
+
+    conn->upgrade = 0;
+    if(conn->outCount > 0) {
+        ERROR("respostas pendentes no pedido de memoria partilhada");
+        return -1;
+    }
+    if((conn->shm = shm_channel_create(&memfd)) == NULL) {
+        return -1;
+    }
+    retVal = network_shm_send_fds(conn->fd, memfd, conn->shm);
+    close(memfd);
+    if(retVal == -1) {
+        return -1;
+    }
+
+    // O eventfd é mais um descritor da mesma ligação no epoll
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = conn;
+    if(epoll_ctl(server->epollFd, EPOLL_CTL_ADD, conn->shm->serverEvent, &event) == -1) {
+        LOG_PERROR("epoll_ctl shm");
+        return -1;
+    }
+    LOG_INFO("Ligação %d passou para memória partilhada", conn->fd);
+    // Pedidos escritos antes do registo no epoll
+    return network_shm_serve(conn, handler);
+
+}
+
+/*
+ * Trata um evento de uma ligação em memória partilhada: lê os pedidos do
+ * buffer partilhado, trata-os e escreve lá as respostas, até não haver mais
+ * pedidos (e o cliente ter sido avisado de que o servidor vai dormir).
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_shm_serve(struct connection_t *conn, nserver_handler_f handler) {
+
+    struct shm_ring_t *requests = &conn->shm->region->requests;
+    char chunk[NETWORK_READ_SIZE];
+    int numBytes;
+
+    shm_event_clear(conn->shm->serverEvent);
+    // O cliente não escreve no socket: dados ou EOF são o fim da ligação
+    if(recv(conn->fd, chunk, 1, MSG_PEEK | MSG_DONTWAIT) != -1 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return -1;
+    }
+    while(1) {
+        if(network_shm_flush(conn) == -1) {
+            return -1;
+        }
+        if(conn->paused) {
+            if(conn->outBytes > NETWORK_LOW_WATERMARK) {
+                // O buffer das respostas está cheio: o cliente acorda-nos
+                return 0;
+            }
+            conn->paused = 0;
+        }
+        if(network_server_process(conn, handler) == -1) {
+            return -1;
+        }
+        if(conn->paused) {
+            continue;
+        }
+
+        if((numBytes = shm_ring_read(requests, chunk, sizeof(chunk))) > 0) {
+            shm_ring_consumed(requests, conn->shm->clientEvent);
+            if(ring_append(&conn->in, chunk, numBytes) == -1) {
+                return -1;
+            }
+            continue;
+        }
+        // Sem pedidos: espera activamente um pouco (o cliente costuma enviar
+        // o seguinte logo a seguir) e depois dorme no epoll, excepto se
+        // entretanto chegou um
+        if(network_shm_flush(conn) == -1) {
+            return -1;
+        }
+        if(!shm_ring_poll(requests, SHM_SPIN) && shm_ring_sleep(requests)) {
+            return 0;
+        }
+    }
+
+}
+
+/*
+ * Escreve no buffer partilhado as respostas pendentes, até ele encher.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+int network_shm_flush(struct connection_t *conn) {
+
+    struct shm_ring_t *replies = &conn->shm->region->replies;
+    struct iovec iov[NETWORK_MAX_IOV * 2];
+    int iovCount, numBytes, written, i;
+
+    while(conn->outCount > 0) {
+        iovCount = network_server_iov(conn, iov, NULL);
+        numBytes = 0;
+        for(i = 0; i < iovCount; i++) {
+            written = shm_ring_write(replies, (char *) iov[i].iov_base, (int) iov[i].iov_len);
+            numBytes += written;
+            if(written < (int) iov[i].iov_len) {
+                break;
+            }
+        }
+        if(numBytes > 0) {
+            network_server_sent(conn, numBytes);
+            shm_ring_produced(replies, conn->shm->clientEvent);
+        }
+        if(i < iovCount && shm_ring_wait(replies)) {
+            // Cheio: o cliente acorda-nos quando ler
+            return 0;
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * Retira a ligação em memória partilhada do reactor e liberta o canal.
+ */
+void network_shm_close(struct nserver_t *server, struct connection_t *conn) {
+
+    epoll_ctl(server->epollFd, EPOLL_CTL_DEL, conn->shm->serverEvent, NULL);
+    shm_channel_destroy(conn->shm);
+    conn->shm = NULL;
+
+}
@@ -0,0 +1,407 @@
+/*
+ * File:   network_uring.c
+ *
+ * Backend io_uring do reactor do servidor: o mesmo tratamento das ligações
+ * de network_server.c, mas com aceitação e recepção multishot, buffers de
+ * recepção registados no kernel e uma única entrada no kernel por lote de
+ * operações.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <netinet/tcp.h>
+#include <poll.h>
+#include "utils.h"
+#include "network_server.h"
+#include "network_server-private.h"
+#include "uring.h"
+
+/*
+ * Devolve uma posição de submissão livre, submetendo as já preparadas se o
+ * anel estiver cheio.
+ */
+static struct io_uring_sqe *network_uring_sqe(struct nserver_t *server) {
+
+    struct io_uring_sqe *sqe;
+
+    if((sqe = uring_get_sqe(server->ring)) == NULL) {
+        uring_submit(server->ring, 0);
+        sqe = uring_get_sqe(server->ring);
+    }
+    return sqe;
+
+}
+
+/*
+ * Submete a aceitação multishot de ligações no socket de escuta.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int network_uring_accept(struct nserver_t *server) {
+
+    struct io_uring_sqe *sqe;
+
+    if((sqe = network_uring_sqe(server)) == NULL) {
+        ERROR("no sqe");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->listenFd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_OP_ACCEPT;
+    return 0;
+
+}
+
+/*
+ * Submete o temporizador que garante uma volta do ciclo (e o tick) pelo
+ * menos a cada NETWORK_TICK_MS.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+static int network_uring_timeout(struct nserver_t *server, struct __kernel_timespec *ts) {
+
+    struct io_uring_sqe *sqe;
+
+    if((sqe = network_uring_sqe(server)) == NULL) {
+        ERROR("no sqe");
+        return -1;
+    }
+    ts->tv_sec = NETWORK_TICK_MS / 1000;
+    ts->tv_nsec = (NETWORK_TICK_MS % 1000) * 1000000L;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long) ts;
+    sqe->len = 1;
+    sqe->user_data = URING_OP_TIMEOUT;
+    return 0;
+
+}
+
+/*
+ * Regista uma nova ligação aceite e começa a receber os seus dados.
+ */
+static void network_uring_connection(struct nserver_t *server, int fd) {
+
+    struct connection_t *conn;
+    int yes = 1;
+
+    // As respostas são escritas de uma vez, o Nagle só atrasaria
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+    if((conn = (struct connection_t *) calloc(1, sizeof(struct connection_t))) == NULL) {
+        ERROR("calloc connection");
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->next = server->connections;
+    if(server->connections) {
+        server->connections->prev = conn;
+    }
+    server->connections = conn;
+    server->numConnections++;
+    LOG_INFO("A ligação foi estabelecida com sucesso. (%d)", server->numConnections);
+
+    if(network_uring_recv(server, conn) == -1) {
+        network_uring_release(server, conn);
+    }
+
+}
+
+/*
+ * Submete uma recepção multishot para a ligação.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_uring_recv(struct nserver_t *server, struct connection_t *conn) {
+
+    struct io_uring_sqe *sqe;
+
+    if((sqe = network_uring_sqe(server)) == NULL) {
+        ERROR("no sqe");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = NETWORK_URING_GROUP;
+    sqe->user_data = (unsigned long) conn | URING_OP_RECV;
+    conn->recvArmed = 1;
+    conn->inflight++;
+    return 0;
+
+}
+
+/*
+ * Cancela a recepção multishot de uma ligação parada por ter demasiadas
+ * respostas por enviar.
+ */
+static void network_uring_stop_recv(struct nserver_t *server, struct connection_t *conn) {
+
+    struct io_uring_sqe *sqe;
+
+    if((sqe = network_uring_sqe(server)) != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long) conn | URING_OP_RECV;
+        sqe->user_data = URING_OP_CANCEL;
+    }
+
+}
+
+/*
+ * Submete o envio das respostas pendentes da ligação, se não houver já um
+ * em curso. Os ficheiros que seguem uma resposta são enviados com
+ * sendfile() quando o socket tiver espaço (IORING_OP_POLL_ADD).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_uring_send(struct nserver_t *server, struct connection_t *conn) {
+
+    struct io_uring_sqe *sqe;
+
+    if(conn->sending || conn->outCount == 0) {
+        return 0;
+    }
+    if(network_server_files_ready(conn)) {
+        if((sqe = network_uring_sqe(server)) == NULL) {
+            ERROR("no sqe");
+            return -1;
+        }
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = conn->fd;
+        sqe->poll32_events = POLLOUT;
+        sqe->user_data = (unsigned long) conn | URING_OP_POLL;
+        conn->sending = 1;
+        conn->inflight++;
+        return 0;
+    }
+    if(conn->iov == NULL &&
+       ((conn->iov = (struct iovec *) malloc(NETWORK_MAX_IOV * 2 * sizeof(struct iovec))) == NULL ||
+        (conn->headers = (uint32_t *) malloc(NETWORK_MAX_IOV * sizeof(uint32_t))) == NULL)) {
+        ERROR("malloc iov or headers");
+        free(conn->iov);
+        conn->iov = NULL;
+        return -1;
+    }
+    if((sqe = network_uring_sqe(server)) == NULL) {
+        ERROR("no sqe");
+        return -1;
+    }
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = conn->fd;
+    sqe->addr = (unsigned long) conn->iov;
+    // O kernel pode ler o iov já depois de novas respostas realocarem out
+    sqe->len = network_server_iov(conn, conn->iov, conn->headers);
+    sqe->user_data = (unsigned long) conn | URING_OP_SEND;
+    conn->sending = 1;
+    conn->inflight++;
+    return 0;
+
+}
+
+/*
+ * Começa a fechar a ligação (as operações em curso terminam com erro) e
+ * liberta-a quando já não houver nenhuma.
+ */
+void network_uring_release(struct nserver_t *server, struct connection_t *conn) {
+
+    if(!conn->closing) {
+        conn->closing = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    if(conn->inflight == 0) {
+        network_server_close(server, conn);
+    }
+
+}
+
+/*
+ * Trata as mensagens completas da ligação e submete as respostas, parando
+ * a recepção se ficarem demasiadas por enviar.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+static int network_uring_process(struct nserver_t *server, struct connection_t *conn,
+                                 nserver_handler_f handler) {
+
+    if(network_server_process(conn, handler) == -1 || network_uring_send(server, conn) == -1) {
+        return -1;
+    }
+    if(conn->paused && conn->recvArmed) {
+        network_uring_stop_recv(server, conn);
+    }
+    return 0;
+
+}
+
+/*
+ * Trata a conclusão de uma recepção: os dados são copiados do buffer
+ * registado para o buffer da ligação e o buffer volta ao kernel.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+static int network_uring_received(struct nserver_t *server, struct connection_t *conn,
+                                  struct io_uring_cqe *cqe, nserver_handler_f handler) {
+
+    int bid, retVal = 0;
+
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recvArmed = 0;
+        conn->inflight--;
+    }
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if(cqe->res > 0 && !conn->closing) {
+            retVal = ring_append(&conn->in, uring_buffer(server->ring, bid), cqe->res);
+        }
+        uring_recycle_buffer(server->ring, bid);
+    }
+
+    if(conn->closing || retVal == -1) {
+        return -1;
+    }
+    if(cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        // O cliente fechou a ligação (ou erro na recepção)
+        return -1;
+    }
+    if(cqe->res > 0 && network_uring_process(server, conn, handler) == -1) {
+        return -1;
+    }
+    // Sem buffers livres (ENOBUFS) a recepção termina: volta a ser pedida
+    if(!conn->recvArmed && !conn->paused) {
+        return network_uring_recv(server, conn);
+    }
+    return 0;
+
+}
+
+/*
+ * Envia os ficheiros que seguem a primeira resposta, com o socket (que o
+ * io_uring usa bloqueante) não bloqueante só durante o sendfile().
+ * Retorna 0 (ok, enviados ou o socket encheu) ou -1 (a ligação deve ser
+ * fechada).
+ */
+static int network_uring_send_files(struct connection_t *conn) {
+
+    int flags, result;
+
+    if((flags = fcntl(conn->fd, F_GETFL)) == -1 || fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        LOG_PERROR("fcntl");
+        return -1;
+    }
+    result = network_server_send_files(conn);
+    fcntl(conn->fd, F_SETFL, flags);
+    return result == -1 ? -1 : 0;
+
+}
+
+/*
+ * Trata a conclusão de um envio (ou de a espera por espaço para os
+ * ficheiros de uma resposta): retira o que foi enviado e continua com o
+ * resto, retomando a leitura de uma ligação parada.
+ * Retorna 0 (ok) ou -1 (a ligação deve ser fechada).
+ */
+static int network_uring_sent(struct nserver_t *server, struct connection_t *conn,
+                              struct io_uring_cqe *cqe, nserver_handler_f handler) {
+
+    conn->sending = 0;
+    conn->inflight--;
+    if(conn->closing || cqe->res < 0) {
+        return -1;
+    }
+    if((cqe->user_data & URING_OP_MASK) == URING_OP_POLL) {
+        if(network_uring_send_files(conn) == -1) {
+            return -1;
+        }
+    }
+    else {
+        network_server_sent(conn, cqe->res);
+    }
+
+    if(conn->paused && conn->outBytes <= NETWORK_LOW_WATERMARK) {
+        conn->paused = 0;
+        // O que ficou por tratar enquanto a ligação esteve parada
+        if(network_uring_process(server, conn, handler) == -1) {
+            return -1;
+        }
+        if(!conn->paused && !conn->recvArmed && network_uring_recv(server, conn) == -1) {
+            return -1;
+        }
+    }
+    return network_uring_send(server, conn);
+
+}
+
+/*
+ * Ciclo do reactor com io_uring: aceita ligações e recebe dados com
+ * operações multishot (os dados chegam nos buffers registados) e envia as
+ * respostas com writev submetidos no mesmo anel, entrando no kernel uma vez
+ * por cada lote de conclusões.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int network_uring_run(struct nserver_t *server, nserver_handler_f handler,
+                      nserver_tick_f tick, volatile int *running) {
+
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    struct connection_t *conn;
+    long lastTick = 0;
+
+    if(network_uring_accept(server) == -1 || network_uring_timeout(server, &ts) == -1) {
+        return -1;
+    }
+
+    while(*running) {
+        // Submete o que foi preparado e dorme até haver conclusões
+        if(uring_submit(server->ring, 1) == -1 && errno != EINTR) {
+            LOG_PERROR("io_uring_enter");
+            return -1;
+        }
+
+        while((cqe = uring_peek_cqe(server->ring)) != NULL) {
+            conn = (struct connection_t *) (unsigned long) (cqe->user_data & ~(unsigned long long) URING_OP_MASK);
+            switch(cqe->user_data & URING_OP_MASK) {
+                case URING_OP_ACCEPT:
+                    if(cqe->res >= 0) {
+                        network_uring_connection(server, cqe->res);
+                    }
+                    else if(cqe->res == -EINVAL) {
+                        // Kernel sem accept multishot
+                        ERROR("io_uring accept");
+                        uring_cqe_seen(server->ring);
+                        return -1;
+                    }
+                    if(!(cqe->flags & IORING_CQE_F_MORE) && network_uring_accept(server) == -1) {
+                        uring_cqe_seen(server->ring);
+                        return -1;
+                    }
+                    break;
+                case URING_OP_RECV:
+                    if(network_uring_received(server, conn, cqe, handler) == -1) {
+                        network_uring_release(server, conn);
+                    }
+                    break;
+                case URING_OP_SEND:
+                case URING_OP_POLL:
+                    if(network_uring_sent(server, conn, cqe, handler) == -1) {
+                        network_uring_release(server, conn);
+                    }
+                    break;
+                case URING_OP_TIMEOUT:
+                    if(network_uring_timeout(server, &ts) == -1) {
+                        uring_cqe_seen(server->ring);
+                        return -1;
+                    }
+                    break;
+                default:
+                    break;
+            }
+            uring_cqe_seen(server->ring);
+        }
+
+        // O tick corre no máximo uma vez por NETWORK_TICK_MS, por muitos
+        // que sejam os lotes de eventos
+        if(tick && network_server_now() - lastTick >= NETWORK_TICK_MS) {
+            tick();
+            lastTick = network_server_now();
+        }
+    }
+    return 0;
+
+}
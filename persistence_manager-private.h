@@ -11,11 +11,16 @@
 #define _PERSISTENCE_MANAGER_PRIVATE_H
 
 #include <stdio.h>
+#include <pthread.h>
 #include "message.h"
 #include "table-private.h"
+#include "uring.h"
 
 #define PERMISSIONS 0666
 
+/* Posies do io_uring do log (uma escrita e o respectivo fsync) */
+#define PMANAGER_URING_ENTRIES 8
+
 /*
  * Define a estrutura de um gestor de persistência.
  *
@@ -29,9 +34,26 @@
  * int log_fd => descritor do ficheiro log
  *
  * int create_flags => flag do tipo de escrita
+ * int mode => modo de escrita dos logs (MODE_ASYNC, MODE_FSYNC ou MODE_DSYNC)
+ * struct uring_t *ring => io_uring usado nas escritas do log (NULL sem ele)
  *
  * int max_log_size => tamanho máximo do logfile
  * int current_log_size => tamanho corrente do logfile
+ *
+ * int keep_deleted => se 1, um "del" do log insere uma marca de apagado
+ *                     (TS_DELETED) em vez de remover a chave da tabela
+ *
+ * Group commit (apenas depois de pmanager_group_commit()):
+ * int group_commit => se 1, pmanager_log() apenas acumula os registos e
+ *                     pmanager_sync() escreve-os em lote
+ * pthread_mutex_t lock => protege os campos seguintes e o log_fd
+ * pthread_cond_t flushed => sinalizada no fim de cada escrita em lote
+ * char *pending => registos (tamanho + mensagem) ainda por escrever
+ * int pending_size, pending_capacity => bytes ocupados e alocados em pending
+ * long appended => nmero de registos acumulados desde o incio
+ * long durable => nmero de registos j escritos no ficheiro
+ * long lost => ltimo registo de um lote cuja escrita falhou
+ * int flushing => 1 enquanto um fio est a escrever um lote
  */
 struct pmanager_t {
 	char *ckp_name;
@@ -44,9 +66,24 @@ struct pmanager_t {
 	int log_fd;
 
 	int create_flags;
+	int mode;
+	struct uring_t *ring;
 
 	int max_log_size;
 	int current_log_size;
+
+	int keep_deleted;
+
+	int group_commit;
+	pthread_mutex_t lock;
+	pthread_cond_t flushed;
+	char *pending;
+	int pending_size;
+	int pending_capacity;
+	long appended;
+	long durable;
+	long lost;
+	int flushing;
 };
 
 /*
@@ -62,12 +99,27 @@ int table_fill(int fd, struct table_t *table);
 /*
  * Percorre o ficheiro log linha a linha.
  */
-int execute_log(int fd, struct table_t *table);
+int execute_log(int fd, struct table_t *table, int keep_deleted);
 
 /*
  * Interpreta cada linha do ficheiro log
  */
-int run_line(char *line, struct table_t *table);
+int run_line(char *line, struct table_t *table, int keep_deleted);
+
+/*
+ * Escreve size bytes de buf no fim do log e sincroniza-o de acordo com o
+ * modo: com io_uring a escrita e o fsync/fdatasync seguem ligados numa s
+ * submisso, sem ele  um s write() no log aberto com O_DSYNC/O_SYNC.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_write_log(struct pmanager_t *pmanager, int fd, char *buf, int size);
+
+/*
+ * Acrescenta um registo (tamanho + msg) ao lote pendente. Chamada com o
+ * lock do pmanager.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_append(struct pmanager_t *pmanager, char *msg, int size);
 
 int recover_from_ckp_log(struct pmanager_t *pmanager, struct table_t *table);
 
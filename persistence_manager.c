@@ -16,6 +16,7 @@
 #include "utils.h"
 #include "table.h"
 #include "remote_table.h"
+#include "uring.h"
 
 /* 
  * Cria um gestor de persistência que armazena logs em filename+".log" e o
@@ -31,6 +32,16 @@ struct pmanager_t *pmanager_create(char *filename, int logsize, int mode) {
 	if(filename && logsize > 0 && (ret = (struct pmanager_t *)malloc(sizeof(struct pmanager_t)))) {
 		if(mode >= 0 && mode <= 2) {
 			ret->max_log_size = logsize;
+			ret->keep_deleted = 0;
+			ret->mode = mode;
+			ret->ring = NULL;
+			ret->group_commit = 0;
+			ret->pending = NULL;
+			ret->pending_size = ret->pending_capacity = 0;
+			ret->appended = ret->durable = ret->lost = 0;
+			ret->flushing = 0;
+			pthread_mutex_init(&ret->lock, NULL);
+			pthread_cond_init(&ret->flushed, NULL);
 			ret->stt_fd = -1;
 			ret->ckp_fd = -1;
 			ret->log_fd = -1;
@@ -117,6 +128,14 @@ int pmanager_destroy(struct pmanager_t *pmanager) {
 		if(pmanager->log_name) {
 			free(pmanager->log_name);
 		}
+		// O que ainda está no lote pendente vai para o log antes da marca final
+		if(pmanager_sync(pmanager) != 0) {
+			ERROR("pmanager_sync");
+		}
+		free(pmanager->pending);
+		uring_destroy(pmanager->ring);
+		pthread_mutex_destroy(&pmanager->lock);
+		pthread_cond_destroy(&pmanager->flushed);
 		if(pmanager->log_fd > 0) {
 			if(write(pmanager->log_fd, &fileOk, sizeof(int)) != sizeof(int)) {
 				ERROR("write");
@@ -136,6 +155,8 @@ int pmanager_destroy(struct pmanager_t *pmanager) {
  */
 int pmanager_destroy_clear(struct pmanager_t *pmanager) {
 	if(pmanager) {
+		// Os ficheiros vão ser apagados, o lote pendente já não interessa
+		pmanager->group_commit = 0;
 		if(pmanager->ckp_name) {
 			if(pmanager->ckp_fd > 0) {
 				close(pmanager->ckp_fd);
@@ -193,10 +214,16 @@ int pmanager_have_data(struct pmanager_t *pmanager) {
  * escrita no log).
  */
 int pmanager_log(struct pmanager_t *pmanager, char *msg) {
-	int size, zero = 0;
+	int size, zero = 0, ret = -1, flags;
+	char *record;
 	if(pmanager && msg) {
+		if(pmanager->group_commit) {
+			pthread_mutex_lock(&pmanager->lock);
+		}
 		// Vamos verificar se é preciso de criar um novo .log...
-		if(pmanager->log_fd == -1 && (pmanager->log_fd = open(pmanager->log_name, pmanager->create_flags, PERMISSIONS)) != -1) {
+		// Com io_uring a sincronização é feita pelo fsync ligado a cada escrita
+		flags = pmanager->ring ? pmanager->create_flags & ~(O_DSYNC | O_SYNC) : pmanager->create_flags;
+		if(pmanager->log_fd == -1 && (pmanager->log_fd = open(pmanager->log_name, flags, PERMISSIONS)) != -1) {
 			pmanager->current_log_size = 0;
 			lseek(pmanager->log_fd, pmanager->max_log_size - 1, SEEK_SET);
 			if(write(pmanager->log_fd, &zero, 1) != 1) {
@@ -212,23 +239,266 @@ int pmanager_log(struct pmanager_t *pmanager, char *msg) {
 		}
 		size = (int)strlen(msg);
 		if((pmanager->current_log_size + sizeof(size) + strlen(msg) + 1) < pmanager->max_log_size) {
-			printf("A escrever: %s\n", msg);
-			if(write(pmanager->log_fd, &size, sizeof(size)) == sizeof(size) && 
-			   write(pmanager->log_fd, msg, size) == size) {
-				pmanager->current_log_size += sizeof(int) + strlen(msg) + 1;
-				return 0;
+			LOG_DEBUG("A escrever: %s", msg);
+			if(pmanager->group_commit) {
+				// Fica no lote pendente até ao próximo pmanager_sync()
+				if(pmanager_append(pmanager, msg, size) == 0) {
+					pmanager->current_log_size += sizeof(int) + strlen(msg) + 1;
+					ret = 0;
+				}
+			} else if((record = (char*)malloc(sizeof(size) + size))) {
+				// Tamanho e mensagem seguem numa só escrita (e sincronização)
+				memcpy(record, &size, sizeof(size));
+				memcpy(record + sizeof(size), msg, size);
+				if(pmanager_write_log(pmanager, pmanager->log_fd, record, sizeof(size) + size) == 0) {
+					pmanager->current_log_size += sizeof(int) + strlen(msg) + 1;
+					ret = 0;
+				} else {
+					ERROR("write - esqueceu-se de fazer table-fill?");
+				}
+				free(record);
 			} else {
-				ERROR("write - esqueceu-se de fazer table-fill?");
+				ERROR("malloc record");
 			}
 		} else {
 			ERROR("max log size has been reached");
 		}
+		if(pmanager->group_commit) {
+			pthread_mutex_unlock(&pmanager->lock);
+		}
 	} else {
 		ERROR("pmanager or msg NULL");
 	}
+	return ret;
+}
+
+/*
+ * Escreve size bytes de buf no fim do log e sincroniza-o de acordo com o
+ * modo: com io_uring a escrita e o fsync/fdatasync seguem ligados numa só
+ * submissão, sem ele é um só write() no log aberto com O_DSYNC/O_SYNC.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_write_log(struct pmanager_t *pmanager, int fd, char *buf, int size) {
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	int written, numBytes, expected, ret = 0;
+	
+	if(!pmanager->ring) {
+		for(written = 0; written < size; written += numBytes) {
+			if((numBytes = (int)write(fd, buf + written, size - written)) <= 0) {
+				if(numBytes == -1 && errno == EINTR) {
+					numBytes = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+		return 0;
+	}
+	
+	// Escrita na posição corrente (off = -1) seguida do fsync, só se a
+	// escrita correr bem (IOSQE_IO_LINK)
+	sqe = uring_get_sqe(pmanager->ring);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = size;
+	sqe->off = (unsigned long long)-1;
+	expected = 1;
+	if(pmanager->mode != MODE_ASYNC) {
+		sqe->flags = IOSQE_IO_LINK;
+		sqe = uring_get_sqe(pmanager->ring);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = fd;
+		sqe->fsync_flags = (pmanager->mode == MODE_DSYNC ? IORING_FSYNC_DATASYNC : 0);
+		sqe->user_data = 1;
+		expected = 2;
+	}
+	if(uring_submit(pmanager->ring, expected) == -1) {
+		LOG_PERROR("io_uring_enter");
+		return -1;
+	}
+	while(expected > 0) {
+		if(!(cqe = uring_peek_cqe(pmanager->ring))) {
+			uring_submit(pmanager->ring, 1);
+			continue;
+		}
+		// A primeira conclusão é a da escrita, a segunda a do fsync
+		if(cqe->res < 0 || (cqe->user_data == 0 && cqe->res != size)) {
+			ret = -1;
+		}
+		uring_cqe_seen(pmanager->ring);
+		expected--;
+	}
+	return ret;
+}
+
+/*
+ * Passa a escrever o log através de um io_uring: cada escrita segue ligada
+ * ao respectivo fsync/fdatasync (conforme o modo) numa só chamada ao kernel.
+ * Retorna 0 (ok) ou -1 se o io_uring não estiver disponível (o log continua
+ * a ser escrito com write()).
+ */
+int pmanager_use_uring(struct pmanager_t *pmanager) {
+	if(pmanager && !pmanager->ring && (pmanager->ring = uring_create(PMANAGER_URING_ENTRIES))) {
+		// Um log já aberto foi aberto com O_DSYNC/O_SYNC: é reaberto sem eles
+		if(pmanager->log_fd > 0) {
+			close(pmanager->log_fd);
+			if((pmanager->log_fd = open(pmanager->log_name, O_WRONLY)) == -1) {
+				ERROR("open log");
+			} else {
+				lseek(pmanager->log_fd, pmanager->current_log_size, SEEK_SET);
+			}
+		}
+		return 0;
+	}
 	return -1;
 }
 
+/*
+ * Acrescenta um registo (tamanho + msg) ao lote pendente. Chamada com o
+ * lock do pmanager.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_append(struct pmanager_t *pmanager, char *msg, int size) {
+	int needed = pmanager->pending_size + sizeof(size) + size;
+	char *tempBuf;
+	
+	if(needed > pmanager->pending_capacity) {
+		if(!(tempBuf = (char*)realloc(pmanager->pending, needed * 2))) {
+			ERROR("realloc pending");
+			return -1;
+		}
+		pmanager->pending = tempBuf;
+		pmanager->pending_capacity = needed * 2;
+	}
+	memcpy(pmanager->pending + pmanager->pending_size, &size, sizeof(size));
+	memcpy(pmanager->pending + pmanager->pending_size + sizeof(size), msg, size);
+	pmanager->pending_size = needed;
+	pmanager->appended ++;
+	return 0;
+}
+
+/*
+ * Activa o group commit: pmanager_log() passa apenas a acumular os registos
+ * em memória e pmanager_sync() escreve de uma só vez (e com uma única
+ * sincronização do disco) tudo o que foi acumulado por vários fios.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_group_commit(struct pmanager_t *pmanager) {
+	if(pmanager) {
+		pmanager->group_commit = 1;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Espera até que todos os registos passados a pmanager_log() antes desta
+ * chamada estejam escritos no ficheiro de log. Sem group commit não faz nada.
+ * Retorna 0 (ok) ou -1 em caso de erro na escrita.
+ *
+ * O primeiro fio a chegar sem haver uma escrita em curso passa a líder: leva
+ * o lote pendente inteiro e escreve-o com uma só escrita e uma só
+ * sincronização (ver pmanager_write_log()). Os restantes
+ * esperam pelo fim dessa escrita, enquanto os seus registos se acumulam no
+ * lote seguinte.
+ */
+int pmanager_sync(struct pmanager_t *pmanager) {
+	long target, batchSeq;
+	char *batch;
+	int batchSize, fd, ok, ret = 0;
+	
+	if(!pmanager) {
+		return -1;
+	}
+	if(!pmanager->group_commit) {
+		return 0;
+	}
+	pthread_mutex_lock(&pmanager->lock);
+	target = pmanager->appended;
+	while(pmanager->durable < target) {
+		if(pmanager->flushing) {
+			pthread_cond_wait(&pmanager->flushed, &pmanager->lock);
+			continue;
+		}
+		batch = pmanager->pending;
+		batchSize = pmanager->pending_size;
+		batchSeq = pmanager->appended;
+		fd = pmanager->log_fd;
+		pmanager->pending = NULL;
+		pmanager->pending_size = pmanager->pending_capacity = 0;
+		pmanager->flushing = 1;
+		pthread_mutex_unlock(&pmanager->lock);
+		
+		ok = (pmanager_write_log(pmanager, fd, batch, batchSize) == 0);
+		if(!ok) {
+			ERROR("write batch");
+		}
+		free(batch);
+		
+		pthread_mutex_lock(&pmanager->lock);
+		if(!ok) {
+			pmanager->lost = batchSeq;
+		}
+		pmanager->durable = batchSeq;
+		pmanager->flushing = 0;
+		pthread_cond_broadcast(&pmanager->flushed);
+	}
+	if(target > 0 && target <= pmanager->lost) {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&pmanager->lock);
+	return ret;
+}
+
+/*
+ * Abre (só para leitura) o checkpoint e o log correntes, para serem
+ * copiados para outro servidor. O log só conta até ao fim do último registo
+ * completo: o resto do ficheiro pré-alocado são zeros.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_snapshot(struct pmanager_t *pmanager, int *ckp_fd, long *ckp_size, int *log_fd, long *log_size) {
+	int size;
+	long fileSize;
+	
+	if(!pmanager || !ckp_fd || !ckp_size || !log_fd || !log_size) {
+		ERROR("NULL pmanager or arguments");
+		return -1;
+	}
+	// Com group commit, o lote pendente tem de estar no ficheiro
+	if(pmanager_sync(pmanager) != 0) {
+		ERROR("pmanager_sync");
+		return -1;
+	}
+	*ckp_size = *log_size = 0;
+	if((*ckp_fd = open(pmanager->ckp_name, O_RDONLY)) != -1) {
+		*ckp_size = file_size(*ckp_fd);
+	}
+	if((*log_fd = open(pmanager->log_name, O_RDONLY)) != -1) {
+		fileSize = file_size(*log_fd);
+		// Registos [tamanho][mensagem] até a um tamanho 0 (espaço
+		// pré-alocado) ou -2 (marca de fim)
+		while(*log_size + (long)sizeof(size) <= fileSize &&
+		      pread(*log_fd, &size, sizeof(size), *log_size) == sizeof(size) &&
+		      size > 0 && *log_size + (long)sizeof(size) + size <= fileSize) {
+			*log_size += sizeof(size) + size;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Define se, ao recuperar o log, um "del" deve deixar na tabela uma marca de
+ * apagado (timestamp TS_DELETED) em vez de remover a chave. Usado quando a
+ * tabela recuperada é apenas a parte mais recente do estado (motor LSM).
+ */
+void pmanager_keep_deleted(struct pmanager_t *pmanager, int keep_deleted) {
+	if(pmanager) {
+		pmanager->keep_deleted = keep_deleted;
+	}
+}
+
 /* 
  * Cria um ficheiro filename+".stt" com o estado de table. Retorna
  * o tamanho do ficheiro criado ou -1 em caso de erro.
@@ -271,9 +541,13 @@ int pmanager_store_table(struct pmanager_t *pmanager, struct table_t *table) {
 					ERROR("encode_timestamp");
 					ret = -1;
 				} else if((encoded_size = (int)base64_encode_alloc(entries[counter]->value->data, entries[counter]->value->datasize, &data)) > 0) {
-					stringSize = (int)strlen(entries[counter]->key) + (int)strlen(data) + (int)strlen(encodedTs) + 3;
+					stringSize = (int)strlen(entries[counter]->key) + (int)strlen(data) + (int)strlen(encodedTs) + 4 + EXPIRES_MAX_DIGITS;
 					if((string_to_print = (char*)malloc(stringSize))) {
 						sprintf(string_to_print, "%s %s %s", encodedTs, entries[counter]->key, data);
+						// O prazo (opcional) vai no fim, em decimal
+						if(entries[counter]->value->expires > 0) {
+							sprintf(string_to_print + strlen(string_to_print), " %ld", entries[counter]->value->expires);
+						}
 						stringSize = (int)strlen(string_to_print);
 						if(write(pmanager->stt_fd, &stringSize, sizeof(stringSize)) == sizeof(stringSize) &&
 						   write(pmanager->stt_fd, string_to_print, strlen(string_to_print)) == strlen(string_to_print)) {
@@ -321,6 +595,17 @@ int pmanager_store_table(struct pmanager_t *pmanager, struct table_t *table) {
 int pmanager_rotate_log(struct pmanager_t *pmanager) {
 	
 	if(pmanager) {
+		if(pmanager->group_commit) {
+			// Um lote a meio da escrita ainda usa o log actual
+			pthread_mutex_lock(&pmanager->lock);
+			while(pmanager->flushing) {
+				pthread_cond_wait(&pmanager->flushed, &pmanager->lock);
+			}
+			// O lote pendente já está no estado guardado no .stt
+			pmanager->pending_size = 0;
+			pmanager->durable = pmanager->appended;
+			pthread_cond_broadcast(&pmanager->flushed);
+		}
 		// Apaga o ficheiro .log
 		if(pmanager->log_fd > 0) {
 			close(pmanager->log_fd);
@@ -332,6 +617,9 @@ int pmanager_rotate_log(struct pmanager_t *pmanager) {
 		remove(pmanager->ckp_name);
 		// Rename .stt para .ckp
 		rename(pmanager->stt_name, pmanager->ckp_name);
+		if(pmanager->group_commit) {
+			pthread_mutex_unlock(&pmanager->lock);
+		}
 	}
 	
 	return 0;
@@ -344,7 +632,7 @@ int pmanager_rotate_log(struct pmanager_t *pmanager) {
 int table_fill(int fd, struct table_t *table) {
 	int size, ok = 1, ret = 0, encodedSize, fileOk = 0;
 	size_t decodedSize;
-	char *string, *keyString, *encodedData, *decodedData, *rest, *encodedTs = NULL, *decodedTs = NULL;
+	char *string, *keyString, *encodedData, *decodedData, *rest, *encodedTs = NULL, *decodedTs = NULL, *expiresString;
 	struct data_t *data;
 	
 	// Se o stt foi apenas criado?
@@ -361,7 +649,8 @@ int table_fill(int fd, struct table_t *table) {
 					if(read(fd, string, size) == size) {
 						string[size] = '\0';
 						if((encodedTs = strdup(strtok_r(string, " \0", &rest))) && (keyString = strdup(strtok_r(NULL, " ", &rest))) && 
-						   (encodedData = strdup(strtok_r(NULL, "\0", &rest)))) {
+						   (encodedData = strdup(strtok_r(NULL, " ", &rest)))) {
+							expiresString = strtok_r(NULL, " ", &rest);
 							if(encodedData) {
 								encodedSize = (int)strlen(encodedData);
 							} else {
@@ -373,6 +662,7 @@ int table_fill(int fd, struct table_t *table) {
 									if(base64_decode_alloc(encodedTs, strlen(encodedTs), &decodedTs, &decodedSize)) {
 										decodedTs[decodedSize] = '\0';
 										data->timestamp = atol(decodedTs);
+										data->expires = (expiresString ? atol(expiresString) : 0);
 										if(table_put(table, keyString, data) == -1) {
 											ERROR("table_put");
 											ok = 0;
@@ -425,7 +715,7 @@ int table_fill(int fd, struct table_t *table) {
 				if(!fileOk) {
 					ret = -2;
 				} else {
-					printf("encontrei o -2\n");
+					LOG_DEBUG("encontrei o -2");
 				}
 			}
 		}
@@ -447,9 +737,9 @@ int pmanager_fill_state(struct pmanager_t *pmanager, struct table_t *table) {
 	if(pmanager && table) {
 		if((pmanager->stt_fd = open(pmanager->stt_name, O_RDONLY)) != -1) {
 			// Existe um ficheiro .stt, iremos recuperar os dados a partir de esse e passa-lo para .ckp, apaga os .log e .ckp se existirem, pois como houve falha não temos garantia que estão OK.
-			printf("Existe um .stt, vamos recuperar o estado nele contido.\n");
+			LOG_INFO("Existe um .stt, vamos recuperar o estado nele contido.");
 			if((val = table_fill(pmanager->stt_fd, table)) == -2) {
-				printf(".stt nao tinha dados... Vamos usar o .log e .skp e ver se conseguimos recuperar algo...\n");
+				LOG_INFO(".stt nao tinha dados... Vamos usar o .log e .skp e ver se conseguimos recuperar algo...");
 				struct table_t *newTable = table_create(table->hashSize);
 				//table_destroy(table);
 				table = newTable;
@@ -474,7 +764,7 @@ int recover_from_ckp_log(struct pmanager_t *pmanager, struct table_t *table) {
 	int ret = -1, val;
 	struct table_t *newTable;
 	if((pmanager->ckp_fd = open(pmanager->ckp_name, O_RDONLY)) != -1) {
-		printf("Existe um .ckp, vamos recuperar o estado nele contido.\n");
+		LOG_INFO("Existe um .ckp, vamos recuperar o estado nele contido.");
 		if((val = table_fill(pmanager->ckp_fd, table)) == -1) {
 			ERROR("table-fill error. A tabela pode não estar correcta!");
 		} else if(val == -2) {
@@ -487,8 +777,8 @@ int recover_from_ckp_log(struct pmanager_t *pmanager, struct table_t *table) {
 		}
 	}
 	if((pmanager->log_fd > 0 && pmanager->current_log_size > 0) || (pmanager->log_fd = open(pmanager->log_name, O_RDONLY)) != -1) {
-		printf("Vamos recuperar do .log\n");
-		if(execute_log(pmanager->log_fd, table) < 0) {
+		LOG_INFO("Vamos recuperar do .log");
+		if(execute_log(pmanager->log_fd, table, pmanager->keep_deleted) < 0) {
 			ERROR("execute-log error. A tabela pode não estar correcta!");
 			newTable = table_create(table->hashSize);
 			//table_destroy(table);
@@ -503,7 +793,7 @@ int recover_from_ckp_log(struct pmanager_t *pmanager, struct table_t *table) {
 /*
  * Percorre o ficheiro log linha a linha.
  */
-int execute_log(int fd, struct table_t *table) {
+int execute_log(int fd, struct table_t *table, int keep_deleted) {
 	int size, ok = 1, ret = 0, fileOk = 0;
 	char *logString;
 	if(table) {
@@ -514,7 +804,7 @@ int execute_log(int fd, struct table_t *table) {
 				} else if((logString = (char*)malloc(size + 1))) {
 					if(read(fd, logString, size) == size) {
 						logString[size] = '\0';
-						if(run_line(logString, table) == -1) {
+						if(run_line(logString, table, keep_deleted) == -1) {
 							ERROR("bad message");
 						}
 						free(logString);
@@ -534,7 +824,7 @@ int execute_log(int fd, struct table_t *table) {
 				if(!fileOk) {
 					ret = -1;
 				} else {
-					printf("Encontrei o -2\n");
+					LOG_DEBUG("Encontrei o -2");
 				}
 			}
 		}
@@ -549,10 +839,10 @@ int execute_log(int fd, struct table_t *table) {
 /*
  * Interpreta cada linha do ficheiro log
  */
-int run_line(char *line, struct table_t *table) {
+int run_line(char *line, struct table_t *table, int keep_deleted) {
 	int retVal = 0;
 	size_t decodedSize;
-	char *key = NULL, *encodedData = NULL, *op = NULL, *dup = NULL, *decodedData = NULL, *encodedTs = NULL, *decodedTs = NULL;
+	char *key = NULL, *encodedData = NULL, *op = NULL, *dup = NULL, *decodedData = NULL, *encodedTs = NULL, *decodedTs = NULL, *expiresString;
 	struct data_t *data = NULL;
 	
 	if(line && strlen(line) > 0) {
@@ -560,14 +850,26 @@ int run_line(char *line, struct table_t *table) {
 			op = strdup(strtok(dup, " \0"));
 			if(op && strcmp(op, "del") == 0) {
 				if((key = strtok(NULL, " \0"))) {
-					retVal = table_del(table, key);
+					if(keep_deleted) {
+						// A chave pode estar apenas em disco, tem de ficar a marca
+						if((data = data_create(0))) {
+							data->timestamp = TS_DELETED;
+							retVal = table_put(table, key, data);
+						} else {
+							ERROR("data_create");
+							retVal = -1;
+						}
+					} else {
+						retVal = table_del(table, key);
+					}
+					// key aponta para dentro de dup, não pode ser libertada
+					key = NULL;
 				} else {
 					ERROR("log corrompido!");
 					retVal = -1;
 				}
-				free(op);
 			} else if(op && strcmp(op, "put") == 0) {
-				printf("A recuperar: %s\n", line);
+				LOG_DEBUG("A recuperar: %s", line);
 				if((encodedTs = strdup(strtok(NULL, " \0"))) && 
 				   (key = strdup(strtok(NULL, " \0"))) && 
 				   (encodedData = strdup(strtok(NULL, " \0")))) {
@@ -575,8 +877,12 @@ int run_line(char *line, struct table_t *table) {
 						if((data = data_create2((int)decodedSize, decodedData))) {
 							if((base64_decode_alloc(encodedTs, strlen(encodedTs), &decodedTs, &decodedSize))) {
 								decodedTs[decodedSize] = '\0';
-								printf("Timestamp recuperado: %ld\n", atol(decodedTs));
+								LOG_DEBUG("Timestamp recuperado: %ld", atol(decodedTs));
 								data->timestamp = atol(decodedTs);
+								// O prazo (opcional) é o último campo da linha
+								if((expiresString = strtok(NULL, " \0"))) {
+									data->expires = atol(expiresString);
+								}
 								retVal = table_put(table, key, data);
 							} else {
 								ERROR("base64_decode_alloc: timestamp");
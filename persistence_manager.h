@@ -46,6 +46,46 @@ int pmanager_have_data(struct pmanager_t *pmanager);
  */
 int pmanager_log(struct pmanager_t *pmanager, char *msg);
 
+/*
+ * Passa a escrever o log atravs de um io_uring: cada escrita segue ligada
+ * ao respectivo fsync/fdatasync (conforme o modo) numa s chamada ao kernel.
+ * Retorna 0 (ok) ou -1 se o io_uring no estiver disponvel (o log continua
+ * a ser escrito com write()).
+ */
+int pmanager_use_uring(struct pmanager_t *pmanager);
+
+/*
+ * Activa o group commit: pmanager_log() passa apenas a acumular os registos
+ * em memria e pmanager_sync() escreve de uma s vez (e com uma nica
+ * sincronizao do disco) tudo o que foi acumulado por vrios fios.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_group_commit(struct pmanager_t *pmanager);
+
+/*
+ * Espera at que todos os registos passados a pmanager_log() antes desta
+ * chamada estejam escritos no ficheiro de log. Sem group commit no faz nada.
+ * Retorna 0 (ok) ou -1 em caso de erro na escrita.
+ */
+int pmanager_sync(struct pmanager_t *pmanager);
+
+/*
+ * Define se, ao recuperar o log, um "del" deve deixar na tabela uma marca de
+ * apagado (timestamp TS_DELETED) em vez de remover a chave. Usado quando a
+ * tabela recuperada  apenas a parte mais recente do estado (motor LSM).
+ */
+void pmanager_keep_deleted(struct pmanager_t *pmanager, int keep_deleted);
+
+/*
+ * Abre (s para leitura) o checkpoint e o log correntes, para serem
+ * copiados para outro servidor: em *ckp_fd e *ckp_size o .ckp, em *log_fd
+ * e *log_size o log, este s at ao fim do ltimo registo completo (o
+ * ficheiro est pr-alocado). Um ficheiro que no existe fica com -1 e
+ * tamanho 0. Deve ser chamada sem escritas em curso na tabela.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int pmanager_snapshot(struct pmanager_t *pmanager, int *ckp_fd, long *ckp_size, int *log_fd, long *log_size);
+
 /* 
  * Cria um ficheiro filename+".stt" com o estado de table. Retorna
  * o tamanho do ficheiro criado ou -1 em caso de erro.
@@ -13,19 +13,100 @@
 #include "table-private.h"
 #include "persistence_manager.h"
 #include "persistence_manager-private.h"
+#include "lsm_tree.h"
+#include "timing_wheel.h"
+
+/*
+ * Define um elemento da fila de tombstones (chaves apagadas por um put do
+ * valor "0"), ordenada pelo instante em que expiram.
+ *
+ * char *key => cópia da chave apagada
+ * long timestamp => timestamp do valor "0" que marcou a chave como apagada
+ * time_t expires => instante a partir do qual a entrada pode ser removida
+ * struct tombstone_t *next => próximo tombstone (expira mais tarde)
+ */
+struct tombstone_t {
+    char *key;
+    long timestamp;
+    time_t expires;
+    struct tombstone_t *next;
+};
 
 /*
  * Define a estrutura de persistent_table.
  *
  * struct table_t *table => apontador para a tabela que vai manter todos os dados
+ *                           (NULL com o motor LSM, a memtable pertence à lsm)
  * struct pmanager_t *pmanager => apontador para o persistence manager
+ * int engine => motor de armazenamento (ENGINE_MEMORY ou ENGINE_LSM)
+ * struct lsm_t *lsm => árvore LSM usada com ENGINE_LSM
+ * struct tombstone_t *tombHead => tombstone mais antigo (o próximo a expirar)
+ * struct tombstone_t *tombTail => tombstone mais recente
+ * int numTombstones => número de tombstones na fila
+ * struct twheel_t *wheel => temporizadores das chaves com prazo
  */
 struct ptable_t {
     struct table_t *table;
     struct pmanager_t *pmanager;
+    int engine;
+    struct lsm_t *lsm;
+    struct tombstone_t *tombHead;
+    struct tombstone_t *tombTail;
+    int numTombstones;
+    struct twheel_t *wheel;
 };
 
+/*
+ * Percorre toda a tabela e remove os valores apagados ("0"). Usada apenas no
+ * arranque, para os valores recuperados do log/checkpoint.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
 int ptable_collect_garbage(struct ptable_t *ptable);
 
+/*
+ * Remove os valores apagados cujos tombstones já expiraram, parando ao fim de
+ * budget_usec microsegundos para não atrasar o atendimento de pedidos.
+ * Retorna o número de entradas removidas ou -1 em caso de erro.
+ */
+int ptable_collect_tombstones(struct ptable_t *ptable, long budget_usec);
+
+/*
+ * Indica se há tombstones já expirados para ptable_collect_tombstones(); não
+ * altera a tabela, basta um trinco de leitura.
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int ptable_tombstones_due(struct ptable_t *ptable);
+
+/*
+ * Acrescenta ao fim da fila um tombstone para key com o timestamp dado.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_add_tombstone(struct ptable_t *ptable, char *key, long timestamp);
+
+/*
+ * Liberta todos os tombstones da fila.
+ */
+void ptable_free_tombstones(struct ptable_t *ptable);
+
+/*
+ * Remove as chaves cujo prazo passou, avançando a roda de temporizadores
+ * até ao instante actual.
+ * Retorna o número de chaves removidas ou -1 em caso de erro.
+ */
+int ptable_expire_keys(struct ptable_t *ptable);
+
+/*
+ * Indica se ptable_expire_keys() teria chaves a remover; não altera a
+ * tabela, basta um trinco de leitura.
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int ptable_expire_due(struct ptable_t *ptable);
+
+/*
+ * Regista na roda de temporizadores todas as chaves com prazo de table.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_schedule_table(struct ptable_t *ptable, struct table_t *table);
+
 #endif
 
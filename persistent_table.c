@@ -25,11 +25,28 @@
  */
 struct ptable_t *ptable_open(struct table_t *table, struct pmanager_t *pmanager) {
 
+    return ptable_open_engine(table, pmanager, ENGINE_MEMORY, NULL);
+
+}
+
+/*
+ * Como ptable_open(), escolhendo o motor de armazenamento. Com ENGINE_LSM a
+ * tabela passa a ser a memtable de uma árvore LSM cujos ficheiros usam o
+ * prefixo filename; o log do pmanager serve de write-ahead log da memtable.
+ * Retorna a tabela persistente criada ou NULL em caso de erro.
+ */
+struct ptable_t *ptable_open_engine(struct table_t *table, struct pmanager_t *pmanager,
+                                    int engine, char *filename) {
+
     //varifica a validade dos parâmetros
     if(table == NULL && pmanager == NULL) {
         ERROR("persistent_table: NULL table or NULL pmanager");
         return NULL;
     }
+    if(engine == ENGINE_LSM && filename == NULL) {
+        ERROR("persistent_table: NULL filename");
+        return NULL;
+    }
 
     //aloca memória e cria a nova tabela persistente
     struct ptable_t *ptable;
@@ -40,6 +57,21 @@ struct ptable_t *ptable_open(struct table_t *table, struct pmanager_t *pmanager)
     
     ptable->table = table;
     ptable->pmanager = pmanager;
+    ptable->engine = engine;
+    ptable->lsm = NULL;
+    ptable->tombHead = NULL;
+    ptable->tombTail = NULL;
+    ptable->numTombstones = 0;
+    if((ptable->wheel = twheel_create(time(NULL))) == NULL) {
+        ERROR("persistent_table: twheel_create");
+        free(ptable);
+        return NULL;
+    }
+
+    //no motor LSM um "del" do log tem de esconder as versões em disco
+    if(engine == ENGINE_LSM) {
+        pmanager_keep_deleted(pmanager, 1);
+    }
 
     //verifica se existem dados no log e caso existam, actualiza a tabela
     if(pmanager_have_data(ptable->pmanager)) {
@@ -49,18 +81,33 @@ struct ptable_t *ptable_open(struct table_t *table, struct pmanager_t *pmanager)
             ERROR("persistent_table: pmanager_fill_state");
         }
 
-        //cria um ficheiro temporário com o estado da tabela
-        if(pmanager_store_table(ptable->pmanager, ptable->table) < 0) {
-            ERROR("persistent_table: pmanager_store_table");
-            return NULL;
+        //as chaves recuperadas com prazo voltam a ter temporizador
+        if(ptable_schedule_table(ptable, ptable->table) != 0) {
+            ERROR("persistent_table: ptable_schedule_table");
         }
 
-        //cria um ficheiro temporário com o estado da tabela
-        if(pmanager_rotate_log(ptable->pmanager) != 0) {
-            ERROR("persistent_table: pmanager_rotate_log");
+    }
+
+    if(engine == ENGINE_LSM) {
+        //a tabela recuperada do log passa a ser a memtable
+        if((ptable->lsm = lsm_open(filename, table)) == NULL) {
+            ERROR("persistent_table: lsm_open");
+            twheel_destroy(ptable->wheel);
+            free(ptable);
             return NULL;
         }
+        ptable->table = NULL;
+    }
 
+    //guarda o estado recuperado e limpa o log
+    if(pmanager_have_data(ptable->pmanager) && ptable_checkpoint(ptable) != 0) {
+        ERROR("persistent_table: ptable_checkpoint");
+        //com o motor LSM o log continua a ter os dados da memtable
+        if(engine != ENGINE_LSM) {
+            twheel_destroy(ptable->wheel);
+            free(ptable);
+            return NULL;
+        }
     }
 
     //em caso de sucesso
@@ -74,8 +121,15 @@ struct ptable_t *ptable_open(struct table_t *table, struct pmanager_t *pmanager)
  */
 void ptable_close(struct ptable_t *table) {
     if(table) {
-        //destroi a tabela
-        table_destroy(table->table);
+        //destroi a tabela (no motor LSM a memtable pertence à lsm)
+        if(table->engine == ENGINE_LSM) {
+            lsm_close(table->lsm);
+        }
+        else {
+            table_destroy(table->table);
+        }
+        ptable_free_tombstones(table);
+        twheel_destroy(table->wheel);
 
         //destroi o gestor de persistência
         pmanager_destroy(table->pmanager);
@@ -91,8 +145,15 @@ void ptable_close(struct ptable_t *table) {
 void ptable_destroy(struct ptable_t *table) {
 
     if(table) {
-        //destroi a tabela
-        table_destroy(table->table);
+        //destroi a tabela e, no motor LSM, apaga as SSTables
+        if(table->engine == ENGINE_LSM) {
+            lsm_destroy(table->lsm);
+        }
+        else {
+            table_destroy(table->table);
+        }
+        ptable_free_tombstones(table);
+        twheel_destroy(table->wheel);
 
         //destroi o gestor de persistência e limpa os ficheiros
 	pmanager_destroy_clear(table->pmanager);
@@ -121,11 +182,23 @@ int ptable_put(struct ptable_t *table, char *key, struct data_t *data) {
     }
     
     //insere a entrada na tabela
-    if(table_put(table->table, key, data) != 0) {
+    if((table->engine == ENGINE_LSM ? lsm_put(table->lsm, key, data) : table_put(table->table, key, data)) != 0) {
         ERROR("persistent_table: table_put auxKey, auxData");
         return -1;
     }
 
+    //uma chave com prazo é removida quando o temporizador disparar
+    if(data->expires > 0 && twheel_add(table->wheel, key, data->expires) != 0) {
+        ERROR("persistent_table: twheel_add");
+    }
+
+    //um valor "0" marca a chave como apagada: fica na fila até expirar
+    if(table->engine == ENGINE_MEMORY && data->datasize == 1 && memcmp(data->data, "0", 1) == 0) {
+        if(ptable_add_tombstone(table, key, data->timestamp) != 0) {
+            ERROR("persistent_table: ptable_add_tombstone");
+        }
+    }
+
     //prepara a mensagem
     char *encodedData;
     int encodedSize;
@@ -151,13 +224,16 @@ int ptable_put(struct ptable_t *table, char *key, struct data_t *data) {
 	ts[encodedTsSize] = '\0';
 	encodedData[encodedSize] = '\0';
 
-    char *msg = NULL; //formato: "put TS-BASE64 key DATA-BASE64"
-    if((msg = (char *) malloc(sizeof(char) * (7 + strlen(key) + encodedSize + encodedTsSize))) == NULL) {
+    char *msg = NULL; //formato: "put TS-BASE64 key DATA-BASE64 [EXPIRES]"
+    if((msg = (char *) malloc(sizeof(char) * (8 + strlen(key) + encodedSize + encodedTsSize + EXPIRES_MAX_DIGITS))) == NULL) {
         ERROR("persistent_table: malloc msg");
         return -1;
     }
 
     sprintf(msg, "put %s %s %s", ts, key, encodedData);
+    if(data->expires > 0) {
+        sprintf(msg + strlen(msg), " %ld", data->expires);
+    }
 
 	//printf("Log: %s -> %d\n", msg, (int)strlen(msg));
 	if(PRINT_LATENCIES) {
@@ -167,21 +243,19 @@ int ptable_put(struct ptable_t *table, char *key, struct data_t *data) {
     if((pmanager_log(table->pmanager, msg)) < 0) {
         //ERROR("persistent_table: pmanager_log");
 
-        //cria um ficheiro temporário com o estado da tabela
-        if(pmanager_store_table(table->pmanager, table->table) < 0) {
-            ERROR("persistent_table: pmanager_store_table");
-            return -1;
-        }
-
-        //cria um ficheiro temporário com o estado da tabela
-        if(pmanager_rotate_log(table->pmanager) != 0) {
-            ERROR("persistent_table: pmanager_rotate_log");
+        //guarda o estado da tabela e limpa o log
+        if(ptable_checkpoint(table) != 0) {
+            ERROR("persistent_table: ptable_checkpoint");
             return -1;
         }
 	if((pmanager_log(table->pmanager, msg)) < 0) {
         	free(msg);
        		return -1;
 	}
+    }
+    //a memtable cheia passa para disco (a entrada já está no log)
+    if(table->engine == ENGINE_LSM && lsm_memtable_full(table->lsm) && ptable_checkpoint(table) != 0) {
+        ERROR("persistent_table: ptable_checkpoint");
     }
 	if(PRINT_LATENCIES) {
 		gettimeofday(&end, NULL);
@@ -198,7 +272,7 @@ int ptable_put(struct ptable_t *table, char *key, struct data_t *data) {
 		}
 		
 		//printf("(╯°□°）╯︵ ┻━┻\n");
-		printf("*** Time elapsed: %ld us.\n", usecDiff);
+		LOG_INFO("*** Time elapsed: %ld us.", usecDiff);
 	}
 
     //em caso de sucesso
@@ -209,6 +283,32 @@ int ptable_put(struct ptable_t *table, char *key, struct data_t *data) {
 
 }
 
+/*
+ * Como ptable_put(), mas só escreve se data não for mais antiga (timestamp
+ * menor) que o valor guardado de key. Quem chama garante que ninguém mexe
+ * na tabela entre a comparação e a escrita.
+ * Devolve o timestamp que fica guardado (o de data, ou o do valor mais
+ * recente que já lá estava) ou -1 (erro).
+ */
+long ptable_put_if_newer(struct ptable_t *table, char *key, struct data_t *data) {
+
+    long current;
+
+    if(table == NULL || key == NULL || data == NULL) {
+        ERROR("persistent_table: NULL table or key or data");
+        return -1;
+    }
+    if((current = ptable_get_ts(table, key)) < 0) {
+        return -1;
+    }
+    //uma escrita mais antiga perde para a guardada e não chega ao log
+    if(current > data->timestamp) {
+        return current;
+    }
+    return ptable_put(table, key, data) == 0 ? data->timestamp : -1;
+
+}
+
 /*
  * Função para obter um elemento da tabela.
  * O argumento key indica a key da entrada da tabela. A função
@@ -225,7 +325,20 @@ struct data_t *ptable_get(struct ptable_t *table, char *key) {
         return NULL;
     }
 
-    return table_get(table->table, key);
+    struct data_t *data;
+    if(table->engine == ENGINE_LSM) {
+        data = lsm_get(table->lsm, key);
+    }
+    else {
+        data = table_get(table->table, key);
+    }
+
+    //uma chave expirada cujo temporizador ainda não disparou não existe
+    if(data && data_expired(data, time(NULL))) {
+        data_destroy(data);
+        data = NULL;
+    }
+    return data;
 
 }
 
@@ -242,8 +355,8 @@ int ptable_del(struct ptable_t *table, char *key) {
         return -1;
     }
 
-    //insere a entrada na tabela
-    if(table_del(table->table, key) != 0) {
+    //remove a entrada da tabela
+    if((table->engine == ENGINE_LSM ? lsm_del(table->lsm, key) : table_del(table->table, key)) != 0) {
         ERROR("persistent_table: table_del");
         return -1;
     }
@@ -259,15 +372,9 @@ int ptable_del(struct ptable_t *table, char *key) {
 
     //regista a operação no log
     if((pmanager_log(table->pmanager, msg)) < 0) {
-        //cria um ficheiro temporário com o estado da tabela
-        if(pmanager_store_table(table->pmanager, table->table) < 0) {
-            ERROR("persistent_table: pmanager_store_table");
-            return -1;
-        }
-
-        //cria um ficheiro temporário com o estado da tabela
-        if(pmanager_rotate_log(table->pmanager) != 0) {
-            ERROR("persistent_table: pmanager_rotate_log");
+        //guarda o estado da tabela e limpa o log
+        if(ptable_checkpoint(table) != 0) {
+            ERROR("persistent_table: ptable_checkpoint");
             return -1;
         }
 	if((pmanager_log(table->pmanager, msg)) < 0) {
@@ -288,6 +395,9 @@ int ptable_del(struct ptable_t *table, char *key) {
 int ptable_size(struct ptable_t *table) {
 	
     if(table) {
+        if(table->engine == ENGINE_LSM) {
+            return lsm_size(table->lsm);
+        }
         return table_size(table->table);
     }
 
@@ -302,6 +412,9 @@ int ptable_size(struct ptable_t *table) {
  */
 char **ptable_get_keys(struct ptable_t *table) {
     if(table) {
+        if(table->engine == ENGINE_LSM) {
+            return lsm_get_keys(table->lsm);
+        }
         return table_get_keys(table->table);
     }
 
@@ -334,7 +447,16 @@ long ptable_get_ts(struct ptable_t *ptable, char *key) {
 
     // Procura a entrada na ptabela
     long ts;
-    if((ts = table_get_ts(ptable->table, key)) < 0) {
+    struct data_t *data;
+    if(ptable->engine == ENGINE_LSM) {
+        data = lsm_get(ptable->lsm, key);
+        ts = (data ? data->timestamp : 0);
+        data_destroy(data);
+    }
+    else {
+        ts = table_get_ts(ptable->table, key);
+    }
+    if(ts < 0) {
         ERROR("table_get_ts");
         return ts;
     }
@@ -345,10 +467,143 @@ long ptable_get_ts(struct ptable_t *ptable, char *key) {
 
 }
 
+/*
+ * Devolve o filtro de bloom das chaves da tabela serializado, para os
+ * clientes evitarem pedidos de chaves inexistentes.
+ * Em caso de erro devolve NULL.
+ */
+struct data_t *ptable_get_filter(struct ptable_t *ptable) {
+
+    if(ptable == NULL) {
+        ERROR("NULL ptable");
+        return NULL;
+    }
+    if(ptable->engine == ENGINE_LSM) {
+        return lsm_get_filter(ptable->lsm);
+    }
+    return table_get_filter(ptable->table);
+
+}
+
+/*
+ * Passa a manter a árvore de Merkle das entradas (só com ENGINE_MEMORY).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_use_merkle(struct ptable_t *ptable, struct hring_t *ring, int replicas, int self) {
+
+    if(ptable == NULL || ptable->engine != ENGINE_MEMORY) {
+        ERROR("NULL ptable or engine without merkle");
+        return -1;
+    }
+    return table_use_merkle(ptable->table, ring, replicas, self);
+
+}
+
+/*
+ * Devolve os hashes dos descendentes do nó node da vista view da árvore de
+ * Merkle. Em caso de erro devolve NULL.
+ */
+struct data_t *ptable_get_merkle(struct ptable_t *ptable, int view, int node) {
+
+    if(ptable == NULL || ptable->engine != ENGINE_MEMORY) {
+        ERROR("NULL ptable or engine without merkle");
+        return NULL;
+    }
+    return table_get_merkle(ptable->table, view, node);
+
+}
+
+/*
+ * Devolve cópias das entradas da folha leaf da vista view da árvore de
+ * Merkle. Em caso de erro devolve NULL.
+ */
+struct entry_t **ptable_get_merkle_entries(struct ptable_t *ptable, int view, int leaf) {
+
+    if(ptable == NULL || ptable->engine != ENGINE_MEMORY) {
+        ERROR("NULL ptable or engine without merkle");
+        return NULL;
+    }
+    return table_get_merkle_entries(ptable->table, view, leaf);
+
+}
+
+/*
+ * Persiste o estado corrente e limpa o log: um checkpoint completo da tabela
+ * (ENGINE_MEMORY) ou a escrita da memtable numa SSTable (ENGINE_LSM).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_checkpoint(struct ptable_t *ptable) {
+
+    if(ptable == NULL) {
+        ERROR("NULL ptable");
+        return -1;
+    }
+
+    if(ptable->engine == ENGINE_LSM) {
+        //a memtable passa para uma SSTable, o log deixa de ser necessário
+        if(lsm_flush(ptable->lsm) != 0) {
+            ERROR("persistent_table: lsm_flush");
+            return -1;
+        }
+    }
+    //cria um ficheiro temporário com o estado da tabela
+    else if(pmanager_store_table(ptable->pmanager, ptable->table) < 0) {
+        ERROR("persistent_table: pmanager_store_table");
+        return -1;
+    }
+
+    //passa o ficheiro temporário a checkpoint e limpa o log
+    if(pmanager_rotate_log(ptable->pmanager) != 0) {
+        ERROR("persistent_table: pmanager_rotate_log");
+        return -1;
+    }
+    return 0;
+
+}
+
+/*
+ * Espera que as operações já feitas sobre a tabela estejam no log (com o
+ * group commit do pmanager; caso contrário já estão).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_sync(struct ptable_t *ptable) {
+
+    if(ptable == NULL) {
+        ERROR("NULL ptable");
+        return -1;
+    }
+    return pmanager_sync(ptable->pmanager);
+
+}
+
+/*
+ * Abre o checkpoint e o log da tabela para serem copiados para outro
+ * servidor (só com ENGINE_MEMORY).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_snapshot(struct ptable_t *ptable, int *ckp_fd, long *ckp_size, int *log_fd, long *log_size) {
+
+    if(ptable == NULL || ptable->engine != ENGINE_MEMORY) {
+        ERROR("NULL ptable or engine without snapshot");
+        return -1;
+    }
+    return pmanager_snapshot(ptable->pmanager, ckp_fd, ckp_size, log_fd, log_size);
+
+}
+
+/*
+ * Percorre toda a tabela e remove os valores apagados ("0"). Usada apenas no
+ * arranque, para os valores recuperados do log/checkpoint.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
 int ptable_collect_garbage(struct ptable_t *ptable) {
 	if(!ptable) {
 		return -1;
 	}
+	// No motor LSM os valores apagados são descartados pela compactação
+	if(ptable->engine == ENGINE_LSM) {
+		return 0;
+	}
 	struct table_t *table = ptable->table;
 	struct node_t *node = NULL, *nextNode;
 	int currentList = 0, element = 0, max = 0;
@@ -359,7 +614,7 @@ int ptable_collect_garbage(struct ptable_t *ptable) {
 		while(node && element < max) {
 			nextNode = node->next;
 			if(memcmp(node->entry->value->data, "0", 1) == 0 && node->entry->value->datasize == 1) {
-				printf("Deleting key: %s\n", node->entry->key);
+				LOG_DEBUG("Deleting key: %s", node->entry->key);
 				table_del(table, node->entry->key);
 			}
 			element ++;
@@ -367,4 +622,219 @@ int ptable_collect_garbage(struct ptable_t *ptable) {
 		}
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Remove os valores apagados cujos tombstones já expiraram, parando ao fim de
+ * budget_usec microsegundos para não atrasar o atendimento de pedidos.
+ * Retorna o número de entradas removidas ou -1 em caso de erro.
+ */
+int ptable_collect_tombstones(struct ptable_t *ptable, long budget_usec) {
+
+    if(ptable == NULL) {
+        ERROR("NULL ptable");
+        return -1;
+    }
+
+    struct tombstone_t *tomb;
+    struct data_t *data;
+    struct timeval start, now;
+    time_t currentTime = time(NULL);
+    int collected = 0;
+
+    gettimeofday(&start, NULL);
+    //a fila está ordenada por expiração: basta olhar para a cabeça
+    while((tomb = ptable->tombHead) && tomb->expires <= currentTime) {
+        //a chave só é removida se ainda tiver o mesmo valor apagado
+        if((data = table_get(ptable->table, tomb->key))) {
+            if(data->timestamp == tomb->timestamp && data->datasize == 1 &&
+               memcmp(data->data, "0", 1) == 0) {
+                table_del(ptable->table, tomb->key);
+                collected ++;
+            }
+            data_destroy(data);
+        }
+
+        ptable->tombHead = tomb->next;
+        if(!ptable->tombHead) {
+            ptable->tombTail = NULL;
+        }
+        ptable->numTombstones --;
+        free(tomb->key);
+        free(tomb);
+
+        gettimeofday(&now, NULL);
+        if((now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec) >= budget_usec) {
+            break;
+        }
+    }
+    return collected;
+
+}
+
+/*
+ * Indica se há tombstones já expirados para ptable_collect_tombstones().
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int ptable_tombstones_due(struct ptable_t *ptable) {
+
+    //a fila está ordenada por expiração: basta olhar para a cabeça
+    return ptable && ptable->tombHead && ptable->tombHead->expires <= time(NULL);
+
+}
+
+/*
+ * Acrescenta ao fim da fila um tombstone para key com o timestamp dado.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_add_tombstone(struct ptable_t *ptable, char *key, long timestamp) {
+
+    struct tombstone_t *tomb;
+
+    if(ptable == NULL || key == NULL) {
+        ERROR("NULL ptable or key");
+        return -1;
+    }
+    if((tomb = (struct tombstone_t *) malloc(sizeof(struct tombstone_t))) == NULL) {
+        ERROR("malloc tombstone");
+        return -1;
+    }
+    if((tomb->key = strdup(key)) == NULL) {
+        ERROR("strdup key");
+        free(tomb);
+        return -1;
+    }
+    tomb->timestamp = timestamp;
+    //o TTL é fixo, logo inserir no fim mantém a fila ordenada
+    tomb->expires = time(NULL) + TOMBSTONE_TTL;
+    tomb->next = NULL;
+
+    if(ptable->tombTail) {
+        ptable->tombTail->next = tomb;
+    }
+    else {
+        ptable->tombHead = tomb;
+    }
+    ptable->tombTail = tomb;
+    ptable->numTombstones ++;
+    return 0;
+
+}
+
+/*
+ * Liberta todos os tombstones da fila.
+ */
+void ptable_free_tombstones(struct ptable_t *ptable) {
+
+    struct tombstone_t *tomb, *next;
+
+    if(ptable) {
+        for(tomb = ptable->tombHead; tomb; tomb = next) {
+            next = tomb->next;
+            free(tomb->key);
+            free(tomb);
+        }
+        ptable->tombHead = NULL;
+        ptable->tombTail = NULL;
+        ptable->numTombstones = 0;
+    }
+
+}
+
+/*
+ * Argumento de ptable_expire_key(): a tabela e o número de chaves removidas.
+ */
+struct expire_ctx_t {
+    struct ptable_t *ptable;
+    int expired;
+};
+
+/*
+ * Chamada pela roda de temporizadores: remove key se o valor actual ainda é
+ * o que tinha o prazo expires (um put posterior pode tê-lo substituído).
+ */
+static void ptable_expire_key(char *key, long expires, void *arg) {
+
+    struct expire_ctx_t *ctx = (struct expire_ctx_t *) arg;
+    struct ptable_t *ptable = ctx->ptable;
+    struct data_t *data;
+
+    if(ptable->engine == ENGINE_LSM) {
+        data = lsm_get(ptable->lsm, key);
+    }
+    else {
+        data = table_get(ptable->table, key);
+    }
+    if(data && data->expires == expires) {
+        if(ptable_del(ptable, key) != 0) {
+            ERROR("persistent_table: ptable_del");
+        }
+        else {
+            ctx->expired ++;
+        }
+    }
+    data_destroy(data);
+
+}
+
+/*
+ * Remove as chaves cujo prazo passou, avançando a roda de temporizadores
+ * até ao instante actual.
+ * Retorna o número de chaves removidas ou -1 em caso de erro.
+ */
+int ptable_expire_keys(struct ptable_t *ptable) {
+
+    struct expire_ctx_t ctx;
+
+    if(ptable == NULL) {
+        ERROR("NULL ptable");
+        return -1;
+    }
+
+    ctx.ptable = ptable;
+    ctx.expired = 0;
+    if(twheel_advance(ptable->wheel, time(NULL), ptable_expire_key, &ctx) < 0) {
+        ERROR("persistent_table: twheel_advance");
+        return -1;
+    }
+    return ctx.expired;
+
+}
+
+/*
+ * Indica se ptable_expire_keys() teria chaves a remover.
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int ptable_expire_due(struct ptable_t *ptable) {
+
+    return ptable && twheel_due(ptable->wheel, time(NULL)) == 1;
+
+}
+
+/*
+ * Regista na roda de temporizadores todas as chaves com prazo de table.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_schedule_table(struct ptable_t *ptable, struct table_t *table) {
+
+    struct entry_t **entries;
+    int i, ret = 0;
+
+    if(ptable == NULL || table == NULL) {
+        ERROR("NULL ptable or table");
+        return -1;
+    }
+    if((entries = table_get_entries(table)) == NULL) {
+        ERROR("table_get_entries");
+        return -1;
+    }
+    for(i = 0; entries[i]; i++) {
+        if(entries[i]->value->expires > 0 &&
+           twheel_add(ptable->wheel, entries[i]->key, entries[i]->value->expires) != 0) {
+            ret = -1;
+        }
+    }
+    table_free_entries(entries);
+    return ret;
+
+}
@@ -6,6 +6,9 @@
 #include "persistence_manager.h"
 #include "persistent_table-private.h"
 
+#define ENGINE_MEMORY 0 /* Toda a tabela em memória, checkpoints completos */
+#define ENGINE_LSM 1    /* Memtable + SSTables em disco (árvore LSM) */
+
 /* 
  * Abre o acesso a uma tabela persistente, passando como parâmetro a tabela
  * a ser mantida em memória e o gestor de persistência a ser usado para manter
@@ -14,6 +17,15 @@
  */
 struct ptable_t *ptable_open(struct table_t *table, struct pmanager_t *pmanager);
 
+/*
+ * Como ptable_open(), escolhendo o motor de armazenamento. Com ENGINE_LSM a
+ * tabela passa a ser a memtable de uma árvore LSM cujos ficheiros usam o
+ * prefixo filename; o log do pmanager serve de write-ahead log da memtable.
+ * Retorna a tabela persistente criada ou NULL em caso de erro.
+ */
+struct ptable_t *ptable_open_engine(struct table_t *table, struct pmanager_t *pmanager,
+                                    int engine, char *filename);
+
 /* 
  * Fecha o acesso a esta tabela persistente. Todas as operações em table
  * devem falhar apos um close.
@@ -34,6 +46,14 @@ void ptable_destroy(struct ptable_t *table);
  */
 int ptable_put(struct ptable_t *table, char *key, struct data_t *data);
 
+/*
+ * Como ptable_put(), mas só escreve se data não for mais antiga (timestamp
+ * menor) que o valor guardado de key (put-if-newer). Quem chama garante que
+ * a comparação e a escrita são atómicas.
+ * Devolve o timestamp que fica guardado ou -1 (erro).
+ */
+long ptable_put_if_newer(struct ptable_t *table, char *key, struct data_t *data);
+
 /* 
  * Função para obter um elemento da tabela.
  * O argumento key indica a key da entrada da tabela. A função
@@ -77,5 +97,54 @@ void ptable_free_keys(char **keys);
  */
 long ptable_get_ts(struct ptable_t *ptable, char *key);
 
+/*
+ * Devolve o filtro de bloom das chaves da tabela serializado, para os
+ * clientes evitarem pedidos de chaves inexistentes.
+ * Em caso de erro devolve NULL.
+ */
+struct data_t *ptable_get_filter(struct ptable_t *ptable);
+
+/*
+ * Passa a manter a árvore de Merkle das entradas (ver table_use_merkle()),
+ * para a anti-entropia entre servidores. Só com ENGINE_MEMORY: com
+ * ENGINE_LSM a tabela em memória é só a memtable.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_use_merkle(struct ptable_t *ptable, struct hring_t *ring, int replicas, int self);
+
+/*
+ * Devolve os hashes dos descendentes do nó node da vista view da árvore de
+ * Merkle (ver table_get_merkle()). Em caso de erro devolve NULL.
+ */
+struct data_t *ptable_get_merkle(struct ptable_t *ptable, int view, int node);
+
+/*
+ * Devolve cópias das entradas da folha leaf da vista view da árvore de
+ * Merkle (ver table_get_merkle_entries()). Em caso de erro devolve NULL.
+ */
+struct entry_t **ptable_get_merkle_entries(struct ptable_t *ptable, int view, int leaf);
+
+/*
+ * Persiste o estado corrente e limpa o log: um checkpoint completo da tabela
+ * (ENGINE_MEMORY) ou a escrita da memtable numa SSTable (ENGINE_LSM).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_checkpoint(struct ptable_t *ptable);
+
+/*
+ * Espera que as operações já feitas sobre a tabela estejam no log (com o
+ * group commit do pmanager; caso contrário já estão).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_sync(struct ptable_t *ptable);
+
+/*
+ * Abre o checkpoint e o log da tabela para serem copiados para outro
+ * servidor (ver pmanager_snapshot()). Só com ENGINE_MEMORY: com ENGINE_LSM
+ * o estado está sobretudo nas SSTables.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int ptable_snapshot(struct ptable_t *ptable, int *ckp_fd, long *ckp_size, int *log_fd, long *log_size);
+
 
 #endif
\ No newline at end of file
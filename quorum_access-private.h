@@ -12,45 +12,132 @@
 #include "utils.h"
 #include "quorum_access.h"
 #include "remote_table.h"
+#include "hinted_handoff.h"
+#include <semaphore.h>
+
+// Prazo de cada operacao (ms): depois disso as respostas que faltam ja nao
+// sao esperadas
+#define QA_TIMEOUT 5000
+// Posicoes do anel de tarefas de cada servidor (potencia de 2)
+#define QA_RING_SLOTS 1024
+// Marca as posicoes das respostas depois de quem espera as ter recolhido
+#define QA_CLOSED ((struct quorum_op_t *) 1)
+// Peso (1/2^QA_LATENCY_SHIFT) de cada pedido na media do tempo de resposta
+#define QA_LATENCY_SHIFT 3
+// Tempo de resposta (us) assumido para um servidor antes de haver medidas:
+// ponto de partida da media e atraso do hedge enquanto nao ha percentil
+#define QA_LATENCY_INITIAL 1000
+// Respostas recentes guardadas de cada servidor, para o percentil
+#define QA_LATENCY_SAMPLES 64
+// Uma leitura e enviada aos restantes servidores (hedge) quando a maioria
+// escolhida demora mais do que este percentil dos seus tempos de resposta...
+#define QA_HEDGE_PERCENTILE 95
+// ...que cada worker recalcula a cada QA_HEDGE_REFRESH respostas
+#define QA_HEDGE_REFRESH 16
+
+// Estatisticas de um servidor, para escolher a quem enviar as leituras. So
+// o worker do servidor as escreve (menos outstanding); os clientes lêem-nas.
+struct qa_stats_t {
+	long latency; // media movel (us) do tempo de resposta
+	int outstanding; // tarefas colocadas no anel ainda sem resposta
+	long hedge_after; // percentil QA_HEDGE_PERCENTILE (us) das ultimas
+	                  // respostas (QA_LATENCY_INITIAL ate haver amostras)
+	long samples[QA_LATENCY_SAMPLES]; // ultimas respostas (us)
+	unsigned long n_samples; // respostas registadas
+};
 
 struct quorum_access_t {
 	pthread_t *pool;
 	struct rtable_t **tables;
 	int n_threads;
+	struct qa_stats_t *stats; // de cada servidor
+	struct hhandoff_t *hints; // onde ficam as escritas falhadas (NULL se
+	                          // nao sao guardadas)
+};
+
+// Operacao de quorum em curso. Os workers entregam-lhe as respostas
+// directamente (sem locks): cada um escreve so na posicao do seu servidor.
+struct qa_op_t {
+	int pending; // respostas que ainda faltam a quem espera (pode ficar < 0)
+	int failures; // servidores que nao vao responder
+	int max_failures; // com mais falhas do que estas o quorum e impossivel
+	int refs; // quem espera e cada tarefa ainda por entregar
+	struct quorum_op_t **replies; // resposta de cada servidor (NULL se nao
+	                              // chegou, QA_CLOSED se ja nao e aceite)
+	sem_t done; // assinalado a cada resposta ou falha entregue
 };
 
 struct task_t {
 	struct quorum_op_t *task;
-	struct task_t *next;
-	int id;
+	struct qa_op_t *op; // a operacao a que pertence
+	long deadline; // qa_now() a partir do qual a tarefa ja nao interessa
 };
 
-struct qa_table_t {
-	struct rtable_t *table;
-	int id;
+// Posicao do anel: livre para o produtor quando sequence e igual a posicao,
+// pronta para o worker quando e a posicao + 1
+struct qa_slot_t {
+	unsigned long sequence;
+	struct task_t *task;
+};
+
+// Anel das tarefas de um servidor: varios fios cliente colocam, so o worker
+// desse servidor retira (cada servidor recebe exactamente uma copia)
+struct qa_ring_t {
+	unsigned long tail; // proxima posicao a reservar (produtores)
+	unsigned long head; // proxima posicao a retirar (worker)
+	sem_t ready; // uma unidade por tarefa colocada (e uma para terminar)
+	struct qa_slot_t slots[QA_RING_SLOTS];
 };
 
-struct connection_t {
-	pthread_t self;
+struct qa_table_t {
 	struct rtable_t *table;
+	int id;
 };
 
+// Tempo actual em ms (relogio monotono), a escala dos prazos
+long qa_now();
+// Tempo actual em us (relogio monotono), para medir as respostas
+long qa_now_usec();
+// Junta usec as estatisticas do servidor server (so o seu worker o faz)
+void qa_record_latency(int server, long usec);
+// Custo de enviar um pedido ao servidor: media do tempo de resposta vezes
+// os pedidos que ja la estao (mais este)
+long qa_score(int server);
+// Escolhe em chosen os expected servidores de targets (todos, se NULL) com
+// menor custo para uma leitura (com o sender de um QA_GET_DIGEST). Retorna
+// o atraso do hedge em us, ou -1 (chosen fica vazio) se nao ha servidores
+// disponiveis que cheguem
+long qa_choose_primaries(struct quorum_op_t *request, const int *targets, int expected, int *chosen);
+// Envia a tarefa do servidor server (falhando-a na operacao se nao der)
+void qa_dispatch(struct quorum_op_t *request, struct qa_op_t *op, int server, long deadline);
+// 1 se quem espera por op ja tem respostas suficientes ou nao as pode ter
+bool qa_op_finished(struct qa_op_t *op);
+// Guarda como pistas para o servidor server as entradas entries
+void qa_hint_entries(int server, struct entry_t **entries);
+// Guarda como pistas as entradas do pedido de escrita op, que o servidor
+// op->sender falhou (os outros pedidos sao ignorados)
+void qa_hint(struct quorum_op_t *op);
+// Copia de entry, antes de a rtable a libertar, se ha pistas (NULL se nao)
+struct entry_t *qa_hint_keep(struct entry_t *entry);
+// Liberta a copia kept, guardando-a antes como pista se nao foi escrita
+void qa_hint_release(int server, struct entry_t *kept, bool written);
 // qa_table_t
 struct qa_table_t *qa_table(struct rtable_t *table, int id);
 // Funções threads
 void init_thread_pool(pthread_t *pool, int n_threads, void *(*tfunc)(void*));
 void *worker_thread_function(void *arg);
-void *handle_dc(sig_t sig);
+// Operacoes em curso
+struct qa_op_t *qa_op_create(int n, int targets, int expected_replies);
+void qa_op_release(struct qa_op_t *op);
 // Queue
-void queue_init();
+int queue_init(int n);
 void queue_destroy();
-void queue_add_task(struct task_t *task);
-struct task_t *queue_get_task();
-void add_completed_task(struct task_t *task);
-struct task_t *get_completed_task();
-void clear_completed_tasks();
-void clear_tasks();
+int queue_add_task(int server, struct task_t *task);
+struct task_t *queue_get_task(int server);
+void add_completed_task(struct task_t *task, bool ok);
 // Task
-struct task_t *task_create(struct quorum_op_t *op);
-void task_destroy(struct task_t *tasks);
+struct task_t *task_create(struct quorum_op_t *op, struct qa_op_t *owner, int sender, long deadline);
+void task_destroy(struct task_t *task);
+void task_free_request(struct quorum_op_t *op);
+void task_free_content(struct quorum_op_t *op);
 #endif
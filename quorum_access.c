@@ -6,6 +6,8 @@
 //  Copyright (c) 2011 Vasco Orey. All rights reserved.
 //
 
+#define _GNU_SOURCE /* sem_clockwait() */
+#include <sched.h>
 #include "quorum_access.h"
 #include "quorum_access-private.h"
 #include "remote_table-private.h"
@@ -14,27 +16,17 @@
 
 static int request_id = 0;
 static struct quorum_access_t *shared_quorum = NULL;
-/**/
-static pthread_mutex_t queue_lock;
-static pthread_mutex_t done_lock;
-static pthread_mutex_t check_quit;
-static pthread_mutex_t connections_lock;
-/**/
-static pthread_cond_t done_not_empty;
-static pthread_cond_t queue_not_empty;
 // Shared stuff
-static struct task_t *queue_head = NULL;
-static struct task_t *done = NULL;
+static struct qa_ring_t *queues = NULL;
 static bool quit_and_cleanup = false;
-static struct connection_t *connections = NULL;
 
 /* Essa funcao deve criar as threads e as filas de comunicacao para que o
  * cliente invoque operações em um conjunto de tabelas em servidores
  * remotos. Recebe como parametro um array de rtable de tamanho n.
  * Retorna 0 (OK) ou -1 (erro). */
 int init_quorum_access(struct rtable_t **rtable, int n) {
-	int ret = -1, i;
-	
+	int i, ret = -1;
+
 	if(!shared_quorum) {
 		if(!(shared_quorum = malloc(sizeof(struct quorum_access_t)))) {
 			ERROR("malloc");
@@ -42,132 +34,359 @@ int init_quorum_access(struct rtable_t **rtable, int n) {
 			ERROR("malloc");
 			free(shared_quorum);
 			shared_quorum = NULL;
+		} else if(!(shared_quorum->stats = calloc(n, sizeof(struct qa_stats_t)))) {
+			ERROR("malloc");
+			free(shared_quorum->pool);
+			free(shared_quorum);
+			shared_quorum = NULL;
+		} else if(queue_init(n) == -1) {
+			free(shared_quorum->stats);
+			free(shared_quorum->pool);
+			free(shared_quorum);
+			shared_quorum = NULL;
 		} else {
-			if(!(connections = malloc(sizeof(struct connection_t) * n))) {
-				ERROR("malloc");
-				free(shared_quorum->pool);
-				free(shared_quorum);
-				shared_quorum = NULL;
-			} else {
-				for(i = 0; i < n; i ++) {
-					connections[i].table = NULL;
-					connections[i].self = 0;
-				}
-				shared_quorum->tables = rtable;
-				shared_quorum->n_threads = n;
-				init_thread_pool(shared_quorum->pool, n, worker_thread_function);
-				ret = 0;
+			quit_and_cleanup = false;
+			shared_quorum->tables = rtable;
+			shared_quorum->n_threads = n;
+			shared_quorum->hints = NULL;
+			for(i = 0; i < n; i++) {
+				shared_quorum->stats[i].latency = QA_LATENCY_INITIAL;
+				shared_quorum->stats[i].hedge_after = QA_LATENCY_INITIAL;
 			}
+			init_thread_pool(shared_quorum->pool, n, worker_thread_function);
+			ret = 0;
 		}
 	} else {
 		ERROR("init_quorum_access: already called.");
 	}
-	
+
 	return ret;
 }
 
 /* Funcao que envia uma requisicao a um conjunto de servidores e devolve
  * um array com o numero esperado de respostas.
  * O parametro request e uma representacao do pedido enquanto
- * expected_replies <= n representa a quantidade de respostas a ser 
+ * expected_replies <= n representa a quantidade de respostas a ser
  * esperadas antes da funcao retornar.
  * Note que os campos id e sender da request serão preenchidos dentro da
  * funcao. O array retornado é um array com n posicoes (0 … n-1) sendo a
- * posicao i correspondente a um apontador para a resposta do servidor 
+ * posicao i correspondente a um apontador para a resposta do servidor
  * i, ou NULL caso a resposta desse servidor não tenha sido recebida.
  * Este array deve ter pelo menos expected_replies posicoes != NULL.
+ * Pode ser chamada por varios fios ao mesmo tempo: cada operacao espera
+ * pelas suas respostas.
  */
 struct quorum_op_t **quorum_access(struct quorum_op_t *request, int expected_replies) {
-	int i, replies = 0;
-	struct task_t *task = NULL, *completed_task;
-	struct quorum_op_t **ret = malloc(sizeof(struct quorum_op_t*) * shared_quorum->n_threads);
-	
-	if(!ret) {
+	return quorum_access_to(request, NULL, expected_replies);
+}
+
+/* Como quorum_access(), mas so para os servidores i com targets[i] != 0
+ * (todos com targets NULL): os outros nao recebem tarefa nem contam para o
+ * quorum.
+ * Uma leitura (OP_RT_GET, OP_RT_GETTS ou QA_GET_DIGEST) vai primeiro so
+ * para a maioria com menor custo (ver qa_score()); os restantes servidores
+ * so a recebem (hedge) se essa maioria falhar ou demorar mais do que o
+ * percentil QA_HEDGE_PERCENTILE dos seus tempos de resposta.
+ */
+struct quorum_op_t **quorum_access_to(struct quorum_op_t *request, const int *targets,
+                                      int expected_replies) {
+	int i, got = 0, n = shared_quorum->n_threads, n_targets = n, *sent;
+	long deadline = qa_now() + QA_TIMEOUT, hedge = -1, until_usec;
+	struct timespec until;
+	struct qa_op_t *op;
+	struct quorum_op_t **ret;
+
+	if(!(ret = calloc(n, sizeof(struct quorum_op_t *)))) {
 		ERROR("malloc");
 		return NULL;
 	}
-	
-	request_id ++;
-	request->id = request_id;
-	
-	clear_completed_tasks();
-	for(i = 0; i < shared_quorum->n_threads; i++) {
-		// Publicar a tarefa n vezes
-		task = task_create(request);
-		//task->task->sender = i;
-		//printf("adding a new task -> %d\n", request_id);
-		queue_add_task(task);
-		// Init as n possiveis respostas a NULL
-		ret[i] = NULL;
-	}
-	//printf("Expected replies: %d\n", expected_replies);
-	while(replies < expected_replies) {
-		//printf("Checking for a completed task...\n");
-		completed_task = get_completed_task();
-		if(completed_task) {
-			//printf("Got one!\n");
-			// O que fazer se a task_t que encontramos é invalida? (id != request_id)?
-			if(completed_task->task->id == request_id) {
-				ret[completed_task->task->sender] = completed_task->task;
-				//printf("Tarefa %d: %d\n", completed_tasks->task->sender, completed_tasks->task->content.result);
-				replies ++;
-				//printf("Got reply no: %d\n", replies);
-			} else {
-				// Por enquanto deitamos fora uma task invalida...
-				//printf("Tarefa invalida, %d != %d !\n", request_id, completed_task->task->id);
-				free(completed_task->task);
-				replies ++;
+	if(!(sent = calloc(n, sizeof(int)))) {
+		ERROR("malloc");
+		free(ret);
+		return NULL;
+	}
+	if(targets) {
+		for(i = 0, n_targets = 0; i < n; i++) {
+			n_targets += targets[i] != 0;
+		}
+	}
+	if(!(op = qa_op_create(n, n_targets, expected_replies))) {
+		free(sent);
+		free(ret);
+		return NULL;
+	}
+	request->id = __atomic_add_fetch(&request_id, 1, __ATOMIC_RELAXED);
+
+	if(request->opcode == OP_RT_GET || request->opcode == OP_RT_GETTS ||
+	   request->opcode == QA_GET_DIGEST) {
+		hedge = qa_choose_primaries(request, targets, expected_replies, sent);
+	}
+	for(i = 0; i < n; i++) {
+		// Uma tarefa para cada servidor, com a sua copia do pedido
+		if(hedge == -1 ? (!targets || targets[i]) : sent[i]) {
+			sent[i] = 1;
+			qa_dispatch(request, op, i, deadline);
+		}
+	}
+
+	until_usec = hedge == -1 ? deadline * 1000L : qa_now_usec() + hedge;
+	while(!qa_op_finished(op)) {
+		until.tv_sec = until_usec / 1000000L;
+		until.tv_nsec = (until_usec % 1000000L) * 1000L;
+		if(sem_clockwait(&op->done, CLOCK_MONOTONIC, &until) == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(hedge == -1) {
+				break; // prazo esgotado
+			}
+		} else if(hedge == -1 || __atomic_load_n(&op->failures, __ATOMIC_ACQUIRE) == 0) {
+			continue;
+		}
+		// A maioria escolhida demorou ou falhou: o resto tambem recebe
+		for(i = 0; i < n; i++) {
+			if(!sent[i] && (!targets || targets[i])) {
+				sent[i] = 1;
+				qa_dispatch(request, op, i, deadline);
+			}
+		}
+		hedge = -1;
+		until_usec = deadline * 1000L;
+	}
+	free(sent);
+
+	// Recolhe as respostas que ja chegaram (todas, mesmo alem do quorum); as
+	// que chegarem depois encontram QA_CLOSED e sao libertadas pelos workers
+	for(i = 0; i < n; i++) {
+		if((ret[i] = __atomic_exchange_n(&op->replies[i], QA_CLOSED, __ATOMIC_ACQ_REL)) != NULL) {
+			got ++;
+		}
+	}
+	if(got < expected_replies) {
+		// Prazo esgotado, servidores a menos ou a terminar: um servidor
+		// pendurado nao prende o cliente
+		LOG_WARN("quorum_access: %d de %d respostas (%d falhas)", got, expected_replies,
+				 __atomic_load_n(&op->failures, __ATOMIC_RELAXED));
+		for(i = 0; i < n; i++) {
+			if(ret[i]) {
+				task_free_content(ret[i]);
+				free(ret[i]);
 			}
-			//free(completed_task);
 		}
+		free(ret);
+		ret = NULL;
 	}
-	clear_tasks();
+	qa_op_release(op);
 	return ret;
 }
 
+// Envia a tarefa do servidor server; se nao for possivel conta como falha
+void qa_dispatch(struct quorum_op_t *request, struct qa_op_t *op, int server, long deadline) {
+	struct task_t *task;
+
+	if(!(task = task_create(request, op, server, deadline))) {
+		__atomic_add_fetch(&op->failures, 1, __ATOMIC_ACQ_REL);
+		sem_post(&op->done);
+		return;
+	}
+	__atomic_add_fetch(&op->refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&shared_quorum->stats[server].outstanding, 1, __ATOMIC_RELAXED);
+	if(queue_add_task(server, task) == -1) {
+		// Anel cheio ate ao prazo: o servidor nao esta a acompanhar
+		__atomic_sub_fetch(&shared_quorum->stats[server].outstanding, 1, __ATOMIC_RELAXED);
+		qa_hint(task->task);
+		task_free_request(task->task);
+		add_completed_task(task, false);
+	}
+}
+
+bool qa_op_finished(struct qa_op_t *op) {
+	return __atomic_load_n(&op->pending, __ATOMIC_ACQUIRE) <= 0 ||
+		   __atomic_load_n(&op->failures, __ATOMIC_ACQUIRE) > op->max_failures;
+}
+
 /* Liberta a memoria, destroi as rtables usadas e destroi as threads.
  */
 int destroy_quorum_access() {
 	int i;
-	pthread_mutex_lock(&check_quit);
+
 	// Assim todas as threads sabem que é para terminar...
-	quit_and_cleanup = true;
-	pthread_mutex_unlock(&check_quit);
-	
+	__atomic_store_n(&quit_and_cleanup, true, __ATOMIC_RELEASE);
+	// ...e acordam para o ver. As tarefas que ainda estao nos aneis falham,
+	// o que acorda quem espera por elas
 	for(i = 0; i < shared_quorum->n_threads; i++) {
-		//pthread_cancel(shared_quorum->pool[i]);
-		//pthread_kill(shared_quorum->pool[i], SIGTERM);
-		//printf("Mandando cond_signal...\n");
-		pthread_cond_signal(&done_not_empty);
-		pthread_cond_signal(&queue_not_empty);
-		//pthread_join(shared_quorum->pool[i], NULL);
+		sem_post(&queues[i].ready);
 	}
+
 	// Clean up...
 	for(i = 0; i < shared_quorum->n_threads; i++) {
-		// Free rtable? connections[i].table
 		pthread_join(shared_quorum->pool[i], NULL);
 	}
-	task_destroy(queue_head);
-	task_destroy(done);
 	queue_destroy();
+	free(shared_quorum->stats);
 	free(shared_quorum->pool);
 	free(shared_quorum);
-	free(connections);
 	shared_quorum = NULL;
 	return 1;
 }
 
-void task_destroy(struct task_t *tasks) {
-	struct task_t *temp;
-	while(tasks) {
-		temp = tasks->next;
-		free(tasks->task);
-		free(tasks);
-		tasks = temp;
-	}
+// Liberta uma tarefa que nao chegou a ser feita, falhando-a na operacao
+void task_destroy(struct task_t *task) {
+	task_free_request(task->task);
+	add_completed_task(task, false);
 }
 
 // Funções auxiliares
+long qa_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+long qa_now_usec() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000L + now.tv_nsec / 1000L;
+}
+
+static int qa_compare_long(const void *a, const void *b) {
+	long x = *(const long *) a, y = *(const long *) b;
+	return x < y ? -1 : x > y;
+}
+
+// So o worker do servidor escreve as suas estatisticas; os clientes so as
+// lêem (as amostras nem isso)
+void qa_record_latency(int server, long usec) {
+	struct qa_stats_t *stats = &shared_quorum->stats[server];
+	long current = __atomic_load_n(&stats->latency, __ATOMIC_RELAXED);
+	long sorted[QA_LATENCY_SAMPLES];
+	int count;
+
+	__atomic_store_n(&stats->latency, current + ((usec - current) >> QA_LATENCY_SHIFT), __ATOMIC_RELAXED);
+	stats->samples[stats->n_samples++ % QA_LATENCY_SAMPLES] = usec;
+	if(stats->n_samples % QA_HEDGE_REFRESH == 0) {
+		count = stats->n_samples < QA_LATENCY_SAMPLES ? (int) stats->n_samples : QA_LATENCY_SAMPLES;
+		memcpy(sorted, stats->samples, count * sizeof(long));
+		qsort(sorted, count, sizeof(long), qa_compare_long);
+		__atomic_store_n(&stats->hedge_after, sorted[(count * QA_HEDGE_PERCENTILE) / 100], __ATOMIC_RELAXED);
+	}
+}
+
+long qa_score(int server) {
+	struct qa_stats_t *stats = &shared_quorum->stats[server];
+	return (__atomic_load_n(&stats->latency, __ATOMIC_RELAXED) + 1) *
+		   (__atomic_load_n(&stats->outstanding, __ATOMIC_RELAXED) + 1);
+}
+
+long qa_choose_primaries(struct quorum_op_t *request, const int *targets, int expected, int *chosen) {
+	int i, best, count = 0, n = shared_quorum->n_threads;
+	long score, best_score = 0, after, hedge = 0;
+
+	// O servidor que devolve o valor de uma leitura por resumo tem de estar
+	if(request->opcode == QA_GET_DIGEST) {
+		chosen[request->sender] = 1;
+		count = 1;
+		hedge = __atomic_load_n(&shared_quorum->stats[request->sender].hedge_after, __ATOMIC_RELAXED);
+	}
+	// O hedge espera pelo mais lento dos escolhidos
+	while(count < expected) {
+		best = -1;
+		for(i = 0; i < n; i++) {
+			score = qa_score(i);
+			if(!chosen[i] && (!targets || targets[i]) && rtable_available(shared_quorum->tables[i]) &&
+			   (best == -1 || score < best_score)) {
+				best = i;
+				best_score = score;
+			}
+		}
+		if(best == -1) {
+			break;
+		}
+		after = __atomic_load_n(&shared_quorum->stats[best].hedge_after, __ATOMIC_RELAXED);
+		chosen[best] = 1;
+		count ++;
+		hedge = after > hedge ? after : hedge;
+	}
+	if(count < expected) {
+		memset(chosen, 0, n * sizeof(int));
+		return -1;
+	}
+	return hedge;
+}
+
+int quorum_access_fastest(const int *targets) {
+	int i, first = -1, best = -1;
+	long score, bestScore = 0;
+
+	for(i = 0; i < shared_quorum->n_threads; i++) {
+		if(targets && !targets[i]) {
+			continue;
+		}
+		if(first == -1) {
+			first = i;
+		}
+		score = qa_score(i);
+		if(rtable_available(shared_quorum->tables[i]) && (best == -1 || score < bestScore)) {
+			best = i;
+			bestScore = score;
+		}
+	}
+	return best == -1 ? (first == -1 ? 0 : first) : best;
+}
+
+/* Passa a guardar como pistas em hints as escritas que um servidor falhar
+ * (NULL deixa de as guardar).
+ */
+int quorum_access_use_hints(struct hhandoff_t *hints) {
+	if(!shared_quorum) {
+		ERROR("quorum_access_use_hints: init_quorum_access not called");
+		return -1;
+	}
+	__atomic_store_n(&shared_quorum->hints, hints, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// Pistas
+void qa_hint_entries(int server, struct entry_t **entries) {
+	struct hhandoff_t *hints = __atomic_load_n(&shared_quorum->hints, __ATOMIC_ACQUIRE);
+	if(hints) {
+		hhandoff_add(hints, server, entries);
+	}
+}
+
+void qa_hint(struct quorum_op_t *op) {
+	struct entry_t *single[2];
+	switch(op->opcode) {
+		case OP_RT_PUT:
+		case QA_PUT_IF_NEWER:
+			single[0] = op->content.entry;
+			single[1] = NULL;
+			qa_hint_entries(op->sender, single);
+			break;
+		case QA_PUT_ENTRIES:
+			qa_hint_entries(op->sender, op->content.entries);
+			break;
+		default:
+			break;
+	}
+}
+
+struct entry_t *qa_hint_keep(struct entry_t *entry) {
+	return __atomic_load_n(&shared_quorum->hints, __ATOMIC_ACQUIRE) ? entry_dup(entry) : NULL;
+}
+
+void qa_hint_release(int server, struct entry_t *kept, bool written) {
+	struct entry_t *single[2];
+	if(kept) {
+		if(!written) {
+			single[0] = kept;
+			single[1] = NULL;
+			qa_hint_entries(server, single);
+		}
+		entry_destroy(kept);
+	}
+}
+
 // qa_table_t
 struct qa_table_t *qa_table(struct rtable_t *table, int id) {
 	struct qa_table_t *ret = malloc(sizeof(struct qa_table_t));
@@ -184,312 +403,368 @@ struct qa_table_t *qa_table(struct rtable_t *table, int id) {
 void init_thread_pool(pthread_t *pool, int n_threads, void *(*tfunc)(void*)) {
 	int i;
 	struct qa_table_t *table;
-	queue_init();
 	for(i = 0; i < n_threads; i ++) {
 		table = qa_table(shared_quorum->tables[i], i);
 		pthread_create(&shared_quorum->pool[i], NULL, tfunc, table);
 	}
 }
 
-void *qa_pipe_handler(sig_t sig) {
-	int i = 0;
-	struct rtable_t *table;
-	bool quit;
-	
-	signal(SIGPIPE, (__sighandler_t)qa_pipe_handler);
-	
-	pthread_mutex_lock(&connections_lock);
-	while(connections[i].self != pthread_self()) {
-		i++;
-	}
-	table = connections[i].table;
-	pthread_mutex_unlock(&connections_lock);
-	// Verificar se entretanto foi para sair...
-	pthread_mutex_lock(&check_quit);
-	quit = quit_and_cleanup;
-	pthread_mutex_unlock(&check_quit);
-	// Re-estabelecer ligação?
-	while(rtable_connect(table) == -1 && !quit) {
-		sleep(5);
-		// Check quit condition
-		pthread_mutex_lock(&check_quit);
-		quit = quit_and_cleanup;
-		pthread_mutex_unlock(&check_quit);
-	}
-	if(quit) {
-		// Infelizmente não encontro melhor maneira de terminar uma thread que esta a tentar recuperar uma ligação perdida.
-		pthread_exit(NULL);
-	}
-}
-
-void qa_exit_handler(void *table) {
-	if(table) {
-		struct qa_table_t *table = (struct qa_table_t *)table;
-		if(table) {
-			free(table);
-		}
-	}
-}
-
+// O worker i atende as tarefas do servidor i
 void *worker_thread_function(void *arg) {
 	char *key = NULL;
-	struct entry_t *entry;
+	struct entry_t **entries, *kept;
 	struct qa_table_t *table = (struct qa_table_t *)arg;
-	bool quit = false;
-	int i = 0;
-	
-	//pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, &old_type);
-	//pthread_cleanup_push(&qa_exit_handler, table);
-	pthread_mutex_lock(&connections_lock);
-	while(connections[i].self != 0) {
-		i ++;
-	}
-	connections[i].self = pthread_self();
-	// Associar esta rtable ao nosso pid de modo a facilitar voltarmos a ligar
-	connections[i].table = table->table;
-	table->id = i;
-	pthread_mutex_unlock(&connections_lock);
-	
-	signal(SIGPIPE, (__sighandler_t)qa_pipe_handler);
-	
-	while(rtable_connect(table->table) == -1 && !quit) {
-		// Check quit condition
-		pthread_mutex_lock(&check_quit);
-		quit = quit_and_cleanup;
-		pthread_mutex_unlock(&check_quit);
-	}
-	
-	while(!quit) {
-		// Vai buscar a nossa task
-		struct task_t *task = queue_get_task();
-		// Do something with the task...
-		// OPCODE fica + 1?
-		//printf("%d - task\n", task);
-		if(task) {
-			//printf("Got a task!\n");
-			task->task->sender = table->id;
-			switch(task->task->opcode) {
-				case OP_RT_DEL:
-					key = strdup(task->task->content.key);
-					//free(task->task->content.key);
-					if(!(key)) {
-						ERROR("strdup");
-						task->task->opcode = OP_RT_ERROR;
-						task->task->content.result = -1;
-					}
-					task->task->content.result = rtable_del(table->table, key);
-					free(key);
-					key = NULL;
-					break;
-				case OP_RT_GET:
-					key = strdup(task->task->content.key);
-					//free(task->task->content.key);
-					if(!(key)) {
-						ERROR("strdup");
-						task->task->opcode = OP_RT_ERROR;
-						task->task->content.result = -1;
-					}
-					task->task->content.value = rtable_get(table->table, key);
-					free(key);
-					key = NULL;
-					break;
-				case OP_RT_GETKEYS:
-					task->task->content.keys = rtable_get_keys(table->table);
-					break;
-				case OP_RT_PUT:
-					entry = entry_dup(task->task->content.entry);
-					task->task->content.result = rtable_put(table->table, entry);
-					//entry_destroy(entry);
-					break;
-				case OP_RT_SIZE:
-					task->task->content.result = rtable_size(table->table);
-					//printf("Tamanho obtido: %d\n", task->task->content.result);
-					break;
-				case OP_RT_GETTS:
-					key = strdup(task->task->content.key);
-					if(!(key)) {
-						ERROR("strdup");
-						task->task->opcode = OP_RT_ERROR;
-						task->task->content.result = -1;
-					}
-					//free(task->task->content.key);
-					task->task->content.timestamp = rtable_get_ts(table->table, key);
-					//printf("Timestamp %s: %ld\n", key, task->task->content.timestamp);
-					free(key);
-					key = NULL;
-					break;
-				default:
-					ERROR("bad opcode");
-					break;
-			}
-			add_completed_task(task);
-		} else {
-			quit = true;
-		}
+	struct task_t *task;
+	long remaining, start;
+	bool ok;
+
+	// Sem ligação, o network_client continua a tentar em segundo plano e os
+	// pedidos a este servidor falham logo ate la
+	if(rtable_connect(table->table) == -1) {
+		LOG_WARN("Servidor %d indisponivel", table->id);
 	}
-	
-	if(table) {
-		free(table);
+
+	while((task = queue_get_task(table->id)) != NULL) {
+		remaining = task->deadline - qa_now();
+		if(remaining <= 0 || !rtable_available(table->table)
+		   || __atomic_load_n(&quit_and_cleanup, __ATOMIC_ACQUIRE)) {
+			// quorum_access ja desistiu desta tarefa, ou o servidor esta em
+			// baixo: conta como falha, para a operacao nao esperar por ela
+			__atomic_sub_fetch(&shared_quorum->stats[table->id].outstanding, 1, __ATOMIC_RELAXED);
+			qa_hint(task->task);
+			task_free_request(task->task);
+			add_completed_task(task, false);
+			continue;
+		}
+		start = qa_now_usec();
+		// O pedido ao servidor fica com o prazo que resta a operacao
+		rtable_set_timeout(table->table, (int) remaining);
+		ok = true;
+		// A tarefa e dona do pedido: o que e enviado e libertado aqui e o
+		// conteudo passa a ser a resposta
+		switch(task->task->opcode) {
+			case OP_RT_DEL:
+				key = task->task->content.key;
+				task->task->content.result = rtable_del(table->table, key);
+				free(key);
+				break;
+			case OP_RT_GET:
+				key = task->task->content.key;
+				task->task->content.value = rtable_get(table->table, key);
+				ok = task->task->content.value != NULL;
+				free(key);
+				break;
+			case OP_RT_DIGEST:
+				key = task->task->content.key;
+				task->task->content.value = rtable_get_digest(table->table, key);
+				ok = task->task->content.value != NULL;
+				free(key);
+				break;
+			case OP_RT_GETKEYS:
+				task->task->content.keys = rtable_get_keys(table->table);
+				break;
+			case OP_RT_PUT:
+				// rtable_put() liberta a entrada: a pista, se falhar, vem
+				// de uma copia
+				kept = qa_hint_keep(task->task->content.entry);
+				task->task->content.result = rtable_put(table->table, task->task->content.entry);
+				qa_hint_release(table->id, kept, task->task->content.result != -1);
+				break;
+			case QA_PUT_IF_NEWER:
+				// Tambem liberta a entrada
+				kept = qa_hint_keep(task->task->content.entry);
+				task->task->content.timestamp = rtable_put_if_newer(table->table, task->task->content.entry);
+				ok = task->task->content.timestamp != -1;
+				qa_hint_release(table->id, kept, ok);
+				break;
+			case QA_PUT_ENTRIES:
+				// O lote nao e libertado pela rtable
+				entries = task->task->content.entries;
+				task->task->content.result = rtable_put_entries(table->table, entries);
+				ok = task->task->content.result != -1;
+				if(!ok) {
+					qa_hint_entries(table->id, entries);
+				}
+				entry_free_list(entries);
+				break;
+			case OP_RT_SIZE:
+				task->task->content.result = rtable_size(table->table);
+				break;
+			case OP_RT_GETTS:
+				key = task->task->content.key;
+				task->task->content.timestamp = rtable_get_ts(table->table, key);
+				ok = task->task->content.timestamp != -1;
+				free(key);
+				break;
+			case OP_RT_FILTER:
+				task->task->content.value = rtable_get_filter(table->table);
+				break;
+			default:
+				ERROR("bad opcode");
+				task_free_request(task->task);
+				ok = false;
+				break;
+		}
+		key = NULL;
+		// Um pedido falhado conta como um que esgotou o prazo
+		qa_record_latency(table->id, ok ? qa_now_usec() - start : QA_TIMEOUT * 1000L);
+		__atomic_sub_fetch(&shared_quorum->stats[table->id].outstanding, 1, __ATOMIC_RELAXED);
+		add_completed_task(task, ok);
 	}
 
 	// Disconnect fica para o quorum_table
-	//free(table->table->ip);
-	//free(table->table->porto);
-	//free(table->table);
-	//free(table);
-	
-	//pthread_cleanup_pop(1);
-	//pthread_setcanceltype(old_type, 0);
-	
+	free(table);
 	pthread_exit(0);
 }
 
-// Queue
-void queue_init() {
-	if(pthread_mutex_init(&queue_lock, NULL) != 0 || pthread_cond_init(&queue_not_empty, NULL) != 0
-	   || pthread_mutex_init(&done_lock, NULL) != 0 || pthread_cond_init(&done_not_empty, NULL) != 0
-	   || pthread_mutex_init(&check_quit, NULL) != 0) {
-		ERROR("queue init");
-		exit(-1);
+// Operacoes em curso
+// Cria a operacao; a referencia inicial e de quem espera
+struct qa_op_t *qa_op_create(int n, int targets, int expected_replies) {
+	struct qa_op_t *op;
+
+	if(!(op = malloc(sizeof(struct qa_op_t)))) {
+		ERROR("malloc");
+		return NULL;
+	}
+	if(!(op->replies = calloc(n, sizeof(struct quorum_op_t *)))) {
+		ERROR("malloc");
+		free(op);
+		return NULL;
 	}
+	if(sem_init(&op->done, 0, 0) != 0) {
+		ERROR("sem_init");
+		free(op->replies);
+		free(op);
+		return NULL;
+	}
+	op->pending = expected_replies;
+	op->failures = 0;
+	op->max_failures = targets - expected_replies;
+	op->refs = 1;
+	return op;
 }
 
-void queue_destroy() {
-	pthread_mutex_destroy(&queue_lock);
-	pthread_mutex_destroy(&done_lock);
-	pthread_mutex_destroy(&check_quit);
-	pthread_cond_destroy(&done_not_empty);
-	pthread_cond_destroy(&queue_not_empty);
+// Liberta uma referencia a operacao (e a operacao, com a ultima)
+void qa_op_release(struct qa_op_t *op) {
+	if(__atomic_sub_fetch(&op->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		sem_destroy(&op->done);
+		free(op->replies);
+		free(op);
+	}
 }
 
-void queue_add_task(struct task_t *task) {
-	pthread_mutex_lock(&queue_lock);
-	if(!queue_head) {
-		queue_head = task;
-	} else {
-		struct task_t *ptr = queue_head;
-		while(ptr->next) {
-			ptr = ptr->next;
+// Queue
+int queue_init(int n) {
+	int i;
+	unsigned long j;
+
+	if(!(queues = calloc(n, sizeof(struct qa_ring_t)))) {
+		ERROR("malloc");
+		return -1;
+	}
+	for(i = 0; i < n; i++) {
+		for(j = 0; j < QA_RING_SLOTS; j++) {
+			queues[i].slots[j].sequence = j;
+		}
+		if(sem_init(&queues[i].ready, 0, 0) != 0) {
+			ERROR("queue init");
+			exit(-1);
 		}
-		ptr->next = task;
 	}
-	task->next = NULL;
-	pthread_cond_signal(&queue_not_empty);
-	pthread_mutex_unlock(&queue_lock);
+	return 0;
 }
 
-struct task_t *queue_get_task() {
-	bool quit = false;
-	struct task_t *task = NULL;
-	
-	pthread_mutex_lock(&queue_lock);
-	while(!queue_head && !quit) {
-		//printf("%d waiting on task...\n", pthread_self());
-		pthread_cond_wait(&queue_not_empty, &queue_lock);
-		pthread_mutex_lock(&check_quit);
-		quit = quit_and_cleanup;
-		pthread_mutex_unlock(&check_quit);
-	}
-	if(!quit) {
-		//printf("Got a task: %d\n", queue_head);
-		task = queue_head;
-		queue_head = queue_head->next;
-	}
-	pthread_mutex_unlock(&queue_lock);
-	return task;
-}
+void queue_destroy() {
+	int i;
 
-void add_completed_task(struct task_t *task) {
-	//printf("adding a new completed task! - %d\n", pthread_self());
-	pthread_mutex_lock(&done_lock);
-	if(!done) {
-		done = task;
-	} else {
-		struct task_t *ptr = done;
-		while(ptr->next) {
-			ptr = ptr->next;
-		}
-		ptr->next = task;
+	for(i = 0; i < shared_quorum->n_threads; i++) {
+		sem_destroy(&queues[i].ready);
 	}
-	task->next = NULL;
-	pthread_cond_signal(&done_not_empty);
-	pthread_mutex_unlock(&done_lock);
+	free(queues);
+	queues = NULL;
 }
 
-struct task_t *get_completed_task() {
-	bool quit = false;
-	struct task_t *done_task = NULL;
-	pthread_mutex_lock(&done_lock);
-	while(!done && !quit) {
-		pthread_cond_wait(&done_not_empty, &done_lock);
-		pthread_mutex_lock(&check_quit);
-		quit = quit_and_cleanup;
-		pthread_mutex_unlock(&check_quit);
-	}
-	if(!quit) {
-		done_task = done;
-		done = done->next;
-		pthread_mutex_unlock(&done_lock);
+// Coloca a tarefa no anel do servidor (varios fios podem faze-lo ao mesmo
+// tempo). Com o anel cheio espera que o worker avance, ate ao prazo da tarefa.
+// Retorna 0 (OK) ou -1 (o anel nao teve espaco a tempo).
+int queue_add_task(int server, struct task_t *task) {
+	struct qa_ring_t *ring = &queues[server];
+	struct qa_slot_t *slot;
+	unsigned long pos, seq;
+
+	// Reserva uma posicao: esta livre quando a sequencia e igual a posicao
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+	for(;;) {
+		slot = &ring->slots[pos & (QA_RING_SLOTS - 1)];
+		seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if(seq == pos) {
+			if(__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 0,
+										   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if((long) (seq - pos) < 0) {
+			// A posicao ainda tem a tarefa da volta anterior: cheio
+			if(qa_now() >= task->deadline) {
+				return -1;
+			}
+			sched_yield();
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
 	}
-	return done_task;
+	slot->task = task;
+	// Publica a tarefa ao worker
+	__atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&ring->ready);
+	return 0;
 }
 
-void clear_completed_tasks() {
+// Espera por uma tarefa para o servidor (so o seu worker a chama); NULL
+// quando e para terminar e o anel ja esta vazio
+struct task_t *queue_get_task(int server) {
+	struct qa_ring_t *ring = &queues[server];
+	struct qa_slot_t *slot;
 	struct task_t *task;
-	pthread_mutex_lock(&done_lock);
-	while(done) {
-		//printf("A limpar as task_t's...\n");
-		task = done->next;
-		if(done->task) {
-			switch (done->task->opcode) {
-				case OP_RT_GET:
-					data_destroy(done->task->content.value);
-					break;
-				case OP_RT_GETKEYS:
-					table_free_keys(done->task->content.keys);
-					break;
-				default:
-					break;
+
+	for(;;) {
+		if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+			// Ha uma posicao reservada: o produtor pode ainda estar a
+			// publica-la
+			slot = &ring->slots[ring->head & (QA_RING_SLOTS - 1)];
+			while(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != ring->head + 1) {
+				sched_yield();
 			}
-			free(done->task);
+			task = slot->task;
+			__atomic_store_n(&slot->sequence, ring->head + QA_RING_SLOTS, __ATOMIC_RELEASE);
+			ring->head ++;
+			// A unidade do semaforo desta tarefa pode ainda nao ter sido
+			// consumida; acordar a mais so faz o ciclo voltar aqui
+			return task;
 		}
-		free(done);
-		done = task;
+		if(__atomic_load_n(&quit_and_cleanup, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+		while(sem_wait(&ring->ready) == -1 && errno == EINTR);
 	}
-	done = NULL;
-	pthread_mutex_unlock(&done_lock);
 }
 
-void clear_tasks() {
-	struct task_t *task;
-	pthread_mutex_lock(&queue_lock);
-	while (queue_head) {
-		task = queue_head->next;
-		free(queue_head->task);
-		free(queue_head);
-		queue_head = task;
+// Entrega a resposta (ok) ou a falha de uma tarefa a sua operacao. Sem
+// locks: cada servidor tem a sua posicao em op->replies.
+void add_completed_task(struct task_t *task, bool ok) {
+	struct quorum_op_t *reply, *expected = NULL;
+	struct qa_op_t *op;
+
+	reply = task->task;
+	op = task->op;
+	// Quem espera confere em qa_op_finished() se ja pode parar (ou, numa
+	// leitura, se tem de alargar o pedido aos restantes servidores)
+	if(ok && __atomic_compare_exchange_n(&op->replies[reply->sender], &expected, reply, 0,
+										 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		__atomic_sub_fetch(&op->pending, 1, __ATOMIC_ACQ_REL);
+		sem_post(&op->done);
+		reply = NULL;
+	} else if(expected != QA_CLOSED) {
+		__atomic_add_fetch(&op->failures, 1, __ATOMIC_ACQ_REL);
+		sem_post(&op->done);
 	}
-	queue_head = NULL;
-	pthread_mutex_unlock(&queue_lock);
+
+	// Com QA_CLOSED a resposta chegou tarde: quem a pediu ja retornou
+	if(reply) {
+		if(ok) {
+			task_free_content(reply);
+		}
+		free(reply);
+	}
+	qa_op_release(op);
+	free(task);
 }
 
 // Task
-struct task_t *task_create(struct quorum_op_t *op) {
+// Liberta o pedido de uma tarefa que nao foi (ou ja nao vai ser) feita
+void task_free_request(struct quorum_op_t *op) {
+	switch (op->opcode) {
+		case OP_RT_GET:
+		case OP_RT_DEL:
+		case OP_RT_GETTS:
+		case OP_RT_DIGEST:
+			free(op->content.key);
+			break;
+		case OP_RT_PUT:
+		case QA_PUT_IF_NEWER:
+			entry_destroy(op->content.entry);
+			break;
+		case QA_PUT_ENTRIES:
+			entry_free_list(op->content.entries);
+			break;
+		default:
+			break;
+	}
+}
+
+// Liberta o resultado de uma tarefa concluida
+void task_free_content(struct quorum_op_t *op) {
+	switch (op->opcode) {
+		case OP_RT_GET:
+		case OP_RT_FILTER:
+		case OP_RT_DIGEST:
+			data_destroy(op->content.value);
+			break;
+		case OP_RT_GETKEYS:
+			table_free_keys(op->content.keys);
+			break;
+		default:
+			break;
+	}
+}
+
+// Cria a tarefa do servidor sender da operacao owner, com uma copia do
+// pedido op: um worker atrasado pode usa-la depois de quorum_access() ter
+// retornado
+struct task_t *task_create(struct quorum_op_t *op, struct qa_op_t *owner, int sender, long deadline) {
 	struct task_t *task = NULL;
+	bool copied = true;
 	if(!(task = malloc(sizeof(struct task_t)))) {
 		ERROR("malloc");
-		task = NULL;
-	} else {
-		if(!(task->task = (struct quorum_op_t*)malloc(sizeof(struct quorum_op_t)))) {
-			ERROR("malloc");
-			free(task);
-			task = NULL;
-		} else {
-			task->task->opcode = op->opcode;
-			task->task->content = op->content;
-			task->task->id = op->id;
-			//printf("created a task with id -> %d\n", op->id);
-		}
+		return NULL;
+	}
+	if(!(task->task = (struct quorum_op_t*)malloc(sizeof(struct quorum_op_t)))) {
+		ERROR("malloc");
+		free(task);
+		return NULL;
+	}
+	task->task->opcode = op->opcode;
+	if(op->opcode == QA_GET_DIGEST) {
+		// So o servidor escolhido (em op->sender) devolve o valor
+		task->task->opcode = (sender == op->sender ? OP_RT_GET : OP_RT_DIGEST);
+	}
+	task->task->content = op->content;
+	task->task->id = op->id;
+	task->task->sender = sender;
+	task->op = owner;
+	task->deadline = deadline;
+	switch (op->opcode) {
+		case OP_RT_GET:
+		case OP_RT_DEL:
+		case OP_RT_GETTS:
+		case QA_GET_DIGEST:
+			copied = (task->task->content.key = strdup(op->content.key)) != NULL;
+			break;
+		case OP_RT_PUT:
+		case QA_PUT_IF_NEWER:
+			copied = (task->task->content.entry = entry_dup(op->content.entry)) != NULL;
+			break;
+		case QA_PUT_ENTRIES:
+			copied = (task->task->content.entries = entry_dup_list(op->content.entries)) != NULL;
+			break;
+		default:
+			break;
+	}
+	if(!copied) {
+		ERROR("task copy");
+		free(task->task);
+		free(task);
+		return NULL;
 	}
 	return task;
-}
\ No newline at end of file
+}
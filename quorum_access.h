@@ -2,17 +2,32 @@
 #define _QUORUM_ACCESS_H
 
 #include "remote_table.h"
+#include "hinted_handoff.h"
+
+/* Operacao dos workers que envia um OP_RT_PUT com CT_NEWER (put-if-newer):
+ * a resposta (content.timestamp) e o timestamp que ficou no servidor. */
+#define QA_PUT_IF_NEWER 15
+/* Leitura por resumo: o servidor indicado em sender recebe um OP_RT_GET
+ * (resposta com o valor) e os restantes um OP_RT_DIGEST (resposta com o
+ * timestamp e o resumo do valor); cada resposta guarda em opcode qual foi. */
+#define QA_GET_DIGEST 16
+/* Operacao dos workers que envia um lote de entradas (content.entries,
+ * terminado em NULL) num OP_RT_PUT com CT_ENTRIES, cada uma put-if-newer:
+ * a resposta (content.result) e quantas ficaram no servidor. */
+#define QA_PUT_ENTRIES 17
 
 /* Operacao a ser executada pelas threads atraves da rtable. */
 struct quorum_op_t {
 	int id; /* id unico da operacao (mesmo no pedido e na resposta) */
-	int sender; /* emissor da operacao, ou da resposa */
+	int sender; /* emissor da operacao, ou da resposa (num pedido
+	             * QA_GET_DIGEST, o servidor que devolve o valor) */
 	int opcode; /* mesmo usado em message_t.opcode */
 	union content_u {
 		struct entry_t *entry;
 		long timestamp;
 		char *key;
 		char **keys;
+		struct entry_t **entries;
 		struct data_t *value;
 		int result;
 	} content;
@@ -35,10 +50,38 @@ int init_quorum_access(struct rtable_t **rtable, int n);
  * posicao i correspondente a um apontador para a resposta do servidor 
  * i, ou NULL caso a resposta desse servidor não tenha sido recebida.
  * Este array deve ter pelo menos expected_replies posicoes != NULL.
+ * As leituras (OP_RT_GET, OP_RT_GETTS e QA_GET_DIGEST) vao primeiro so
+ * para os expected_replies servidores mais rapidos e menos ocupados, e para
+ * os restantes so se esses falharem ou se atrasarem (hedge); por isso podem
+ * voltar com apenas expected_replies respostas.
  */
 struct quorum_op_t **quorum_access(struct quorum_op_t *request, 
                                    int expected_replies);
 
+/* Como quorum_access(), mas o pedido so e enviado aos servidores i com
+ * targets[i] != 0 (todos, se targets for NULL); expected_replies conta so
+ * as respostas desses servidores.
+ */
+struct quorum_op_t **quorum_access_to(struct quorum_op_t *request, const int *targets,
+                                      int expected_replies);
+
+/* Devolve o indice do servidor disponivel com o menor tempo medio de
+ * resposta, pesado pelos pedidos que ainda tem por responder, entre os
+ * servidores i com targets[i] != 0 (todos, se targets for NULL), para
+ * pedidos que so precisam do valor de um servidor. Sem nenhum disponivel
+ * devolve o primeiro desses servidores.
+ */
+int quorum_access_fastest(const int *targets);
+
+/* Passa a guardar como pistas em hints (ver hhandoff_open()) as escritas
+ * (OP_RT_PUT, QA_PUT_IF_NEWER e QA_PUT_ENTRIES) que um servidor falhou ou
+ * que nao lhe chegaram a ser enviadas, mesmo depois de quorum_access() ter
+ * retornado com as respostas dos restantes. Com hints = NULL deixam de ser
+ * guardadas.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int quorum_access_use_hints(struct hhandoff_t *hints);
+
 /* Liberta a memoria, destroi as rtables usadas e destroi as threads.
  */
 int destroy_quorum_access();
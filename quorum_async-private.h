@@ -0,0 +1,243 @@
+/*
+ * File:   quorum_async-private.h
+ *
+ * Estruturas e funções do ciclo de eventos das operações assíncronas da
+ * quorum table.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#ifndef _QUORUM_ASYNC_PRIVATE_H
+#define	_QUORUM_ASYNC_PRIVATE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include "message.h"
+#include "quorum_table.h"
+#include "quorum_async.h"
+
+/* Número máximo de eventos tratados por cada epoll_wait() */
+#define QLOOP_MAX_EVENTS 64
+
+/* Intervalo entre verificações dos prazos das operações, em milissegundos */
+#define QLOOP_TICK_MS 20
+
+/* Bytes lidos de cada vez de uma ligação */
+#define QLOOP_READ_SIZE 65536
+
+/* Tamanho máximo aceite numa resposta */
+#define QLOOP_MAX_MESSAGE (64 * 1024 * 1024)
+
+/*
+ * Define uma operação assíncrona. Só o fio do ciclo mexe no seu estado até
+ * ela terminar; depois disso só o utilizador lhe mexe.
+ *
+ * struct qloop_t *loop => o ciclo que a executa
+ * int opcode => a operação pedida (OP_RT_GET, OP_RT_PUT ou OP_RT_DEL)
+ * int phase => o opcode dos pedidos em curso (OP_RT_GETTS, OP_RT_GET ou OP_RT_PUT)
+ * int round => número dos pedidos em curso (respostas a pedidos anteriores
+ *              chegam tarde e são ignoradas)
+ * int replies => respostas boas aos pedidos em curso
+ * int failures => servidores que falharam os pedidos em curso
+ * char *key => a chave
+ * int *targets => os servidores da chave (NULL se são todos)
+ * int numTargets => quantos são
+ * int needed => respostas que formam uma maioria deles
+ * struct data_t *data => num put, os dados a escrever; num get, o valor mais
+ *                        recente recebido
+ * long timestamp => o maior timestamp recebido
+ * long *seen => num get, o timestamp da resposta de cada servidor (-1 se não
+ *               respondeu), para reparar os que ficaram para trás
+ * long deadline => instante (network_now()) em que a operação falha
+ * int done => 1 quando terminou
+ * int result => 0 (ok) ou -1 (erro)
+ * struct data_t *value => o valor obtido por um get
+ * qtable_callback_f callback, void *ctx => chamada quando termina
+ * int refs => referências: o utilizador, o ciclo (até terminar) e cada
+ *             pedido à espera de resposta numa ligação
+ * struct qfuture_t *prev, *next => lista das operações em curso
+ */
+struct qfuture_t {
+    struct qloop_t *loop;
+    int opcode;
+    int phase;
+    int round;
+    int replies;
+    int failures;
+    char *key;
+    int *targets;
+    int numTargets;
+    int needed;
+    struct data_t *data;
+    long timestamp;
+    long *seen;
+    long deadline;
+    int done;
+    int result;
+    struct data_t *value;
+    qtable_callback_f callback;
+    void *ctx;
+    int refs;
+    struct qfuture_t *prev;
+    struct qfuture_t *next;
+};
+
+/*
+ * Define um pedido à espera de resposta numa ligação.
+ *
+ * struct qfuture_t *future => a operação que o enviou
+ * int round => o round da operação quando foi enviado
+ * int server => o índice do servidor da ligação
+ */
+struct qslot_t {
+    struct qfuture_t *future;
+    int round;
+    int server;
+};
+
+/*
+ * Define a ligação do ciclo a um servidor. Os pedidos de todas as operações
+ * seguem pela mesma ligação sem esperar pelas respostas, que o servidor
+ * devolve pela mesma ordem: slots guarda, por essa ordem, quem espera.
+ *
+ * struct rtable_t *table => o servidor (NULL se não foi possível abri-lo)
+ * int fd => o descritor do socket (-1 se fechada)
+ * unsigned int epoch => incrementado a cada fecho (descarta eventos antigos)
+ * int polling => 1 se o epoll também espera por EPOLLOUT
+ * char *out => pedidos por enviar, a partir de outOffset
+ * char *in => bytes recebidos que ainda não formam uma resposta
+ * struct qslot_t *slots => fila circular dos pedidos à espera
+ * long backoff, nextAttempt => espera depois de uma ligação falhada
+ */
+struct qconn_t {
+    struct rtable_t *table;
+    int fd;
+    unsigned int epoch;
+    int polling;
+    char *out;
+    int outSize;
+    int outOffset;
+    int outCapacity;
+    char *in;
+    int inSize;
+    int inCapacity;
+    struct qslot_t *slots;
+    int slotHead;
+    int slotCount;
+    int slotCapacity;
+    long backoff;
+    long nextAttempt;
+};
+
+/*
+ * Define o ciclo de eventos de uma quorum table.
+ *
+ * struct qconn_t *conns => uma ligação a cada servidor
+ * int numConns => o número de servidores
+ * int needed => respostas que formam uma maioria (com todos os servidores)
+ * struct hring_t *ring => reparte as chaves pelos servidores (NULL se todos
+ *                         têm todas)
+ * int replicas => servidores de cada chave com ring
+ * int id => identifica o cliente nos timestamps
+ * struct qtable_t *qtable => a quorum table, cuja fila repara os servidores
+ *                            atrás numa leitura
+ * int epollFd => o epoll das ligações e de wakeFd
+ * int wakeFd => eventfd que acorda o fio quando há operações novas
+ * pthread_t thread => o fio do ciclo
+ * pthread_mutex_t lock => protege submitted, stopping e o fim das operações
+ * pthread_cond_t completed => sinalizada quando uma operação termina
+ * struct qfuture_t *submitHead, *submitTail => operações por começar
+ * struct qfuture_t *inflight => operações em curso (só no fio do ciclo)
+ * int stopping => 1 quando o ciclo vai ser destruído
+ */
+struct qloop_t {
+    struct qconn_t *conns;
+    int numConns;
+    int needed;
+    struct hring_t *ring;
+    int replicas;
+    int id;
+    struct qtable_t *qtable;
+    int epollFd;
+    int wakeFd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t completed;
+    struct qfuture_t *submitHead;
+    struct qfuture_t *submitTail;
+    struct qfuture_t *inflight;
+    int stopping;
+};
+
+/* Definidas em quorum_table.c */
+long update_timestamp(long ts, int id);
+int qtable_repair_enqueue(struct qtable_t *qtable, struct entry_t *entry, int *stale);
+
+/*
+ * Fio do ciclo de eventos (arg é o qloop_t).
+ */
+void *qloop_run(void *arg);
+
+/*
+ * Começa as operações entregues por qloop_submit().
+ */
+void qloop_start_submitted(struct qloop_t *loop);
+
+/*
+ * Envia aos servidores da chave o pedido msg da fase actual de future.
+ */
+void qloop_send(struct qloop_t *loop, struct qfuture_t *future, struct message_t *msg);
+
+/*
+ * Trata a resposta msg (NULL se o servidor falhou) ao pedido slot.
+ */
+void qloop_reply(struct qloop_t *loop, struct qslot_t *slot, struct message_t *msg);
+
+/*
+ * Passa future à fase seguinte, ou termina-a, se já tem respostas
+ * suficientes (ou se já não as pode ter).
+ */
+void qloop_progress(struct qloop_t *loop, struct qfuture_t *future);
+
+/*
+ * Termina future com o resultado result: acorda quem espera e chama o
+ * callback.
+ */
+void qloop_complete(struct qloop_t *loop, struct qfuture_t *future, int result);
+
+/*
+ * Termina com erro as operações cujo prazo passou.
+ */
+void qloop_expire(struct qloop_t *loop);
+
+/*
+ * Abre a ligação conn, se o servidor não estiver em backoff.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int qconn_open(struct qloop_t *loop, struct qconn_t *conn, int index);
+
+/*
+ * Fecha a ligação conn; os pedidos à espera contam como falhas.
+ */
+void qconn_close(struct qloop_t *loop, struct qconn_t *conn);
+
+/*
+ * Lê e trata as respostas disponíveis na ligação conn.
+ * Retorna 0 (OK) ou -1 (a ligação deve ser fechada).
+ */
+int qconn_read(struct qloop_t *loop, struct qconn_t *conn);
+
+/*
+ * Envia os pedidos pendentes de conn, até o socket encher (aí o epoll passa
+ * a esperar por EPOLLOUT).
+ * Retorna 0 (OK) ou -1 (a ligação deve ser fechada).
+ */
+int qconn_flush(struct qloop_t *loop, struct qconn_t *conn, int index);
+
+/*
+ * Liberta uma referência a future (libertando-a com a última).
+ */
+void qfuture_release(struct qfuture_t *future);
+
+#endif
@@ -0,0 +1,1033 @@
+/*
+ * File:   quorum_async.c
+ *
+ * Núcleo das operações assíncronas da quorum table: um fio com um ciclo de
+ * eventos (epoll) mantém uma ligação a cada servidor e envia por ela, sem
+ * esperar pelas respostas, os pedidos de todas as operações em curso. Como
+ * cada servidor responde pela ordem dos pedidos, cada ligação guarda a fila
+ * das operações à espera. Uma operação passa pelas mesmas fases que a
+ * versão síncrona (e.g. só OP_RT_PUT, ou OP_RT_GETTS e depois OP_RT_PUT no
+ * modo estrito), avançando quando uma maioria responde a cada uma; no fim
+ * acorda quem espera pela sua future e chama o callback.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "utils.h"
+#include "data.h"
+#include "remote_table.h"
+#include "remote_table-private.h"
+#include "network_client-private.h"
+#include "quorum_async.h"
+#include "quorum_async-private.h"
+
+/* Dados do evento do eventfd no epoll (as ligações usam epoch e índice) */
+#define QLOOP_WAKE_EVENT UINT64_MAX
+
+/*
+ * Cria o ciclo de eventos das operações assíncronas sobre os n servidores
+ * de servers (as ligações usam os seus endereços e transportes) e lança o
+ * seu fio. id identifica o cliente nos timestamps. Com ring, cada operação
+ * só contacta os replicas servidores da sua chave. As reparações vão para
+ * a fila de qtable.
+ * Retorna NULL em caso de erro.
+ */
+struct qloop_t *qloop_create(struct qtable_t *qtable, struct rtable_t **servers, int n, int id,
+                             struct hring_t *ring, int replicas) {
+
+    struct qloop_t *loop;
+    struct epoll_event event;
+    pthread_condattr_t attr;
+    int i;
+
+    if(servers == NULL || n <= 0) {
+        ERROR("NULL servers or n <= 0");
+        return NULL;
+    }
+    if((loop = (struct qloop_t *) calloc(1, sizeof(struct qloop_t))) == NULL) {
+        ERROR("malloc loop");
+        return NULL;
+    }
+    if((loop->conns = (struct qconn_t *) calloc(n, sizeof(struct qconn_t))) == NULL) {
+        ERROR("malloc loop->conns");
+        free(loop);
+        return NULL;
+    }
+    loop->numConns = n;
+    loop->needed = n / 2 + 1;
+    loop->ring = ring;
+    loop->replicas = replicas;
+    loop->id = id;
+    loop->qtable = qtable;
+    for(i = 0; i < n; i++) {
+        loop->conns[i].table = servers[i];
+        loop->conns[i].fd = -1;
+    }
+
+    if((loop->epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        LOG_PERROR("epoll_create1");
+        free(loop->conns);
+        free(loop);
+        return NULL;
+    }
+    if((loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        LOG_PERROR("eventfd");
+        close(loop->epollFd);
+        free(loop->conns);
+        free(loop);
+        return NULL;
+    }
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = QLOOP_WAKE_EVENT;
+    if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event) == -1) {
+        LOG_PERROR("epoll_ctl wakeFd");
+        close(loop->wakeFd);
+        close(loop->epollFd);
+        free(loop->conns);
+        free(loop);
+        return NULL;
+    }
+
+    // Os prazos de qfuture_wait() usam o mesmo relógio que os das operações
+    pthread_mutex_init(&loop->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&loop->completed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if(pthread_create(&loop->thread, NULL, qloop_run, loop) != 0) {
+        ERROR("pthread_create qloop");
+        pthread_cond_destroy(&loop->completed);
+        pthread_mutex_destroy(&loop->lock);
+        close(loop->wakeFd);
+        close(loop->epollFd);
+        free(loop->conns);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+
+}
+
+/*
+ * Acorda o fio do ciclo.
+ */
+static void qloop_wake(struct qloop_t *loop) {
+
+    uint64_t one = 1;
+
+    if(write(loop->wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        LOG_PERROR("eventfd write");
+    }
+
+}
+
+/*
+ * Pára o fio do ciclo (as operações em curso terminam com erro, chamando os
+ * seus callbacks) e liberta-o. As futures continuam válidas até serem
+ * destruídas.
+ */
+void qloop_destroy(struct qloop_t *loop) {
+
+    int i;
+
+    if(loop == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&loop->lock);
+    loop->stopping = 1;
+    pthread_mutex_unlock(&loop->lock);
+    qloop_wake(loop);
+    pthread_join(loop->thread, NULL);
+
+    for(i = 0; i < loop->numConns; i++) {
+        free(loop->conns[i].out);
+        free(loop->conns[i].in);
+        free(loop->conns[i].slots);
+    }
+    pthread_cond_destroy(&loop->completed);
+    pthread_mutex_destroy(&loop->lock);
+    close(loop->wakeFd);
+    close(loop->epollFd);
+    free(loop->conns);
+    free(loop);
+
+}
+
+/*
+ * Cria uma future (com as referências do utilizador e do ciclo).
+ */
+static struct qfuture_t *qfuture_create(struct qloop_t *loop, int opcode, qtable_callback_f callback, void *ctx) {
+
+    struct qfuture_t *future;
+
+    if((future = (struct qfuture_t *) calloc(1, sizeof(struct qfuture_t))) == NULL) {
+        ERROR("malloc future");
+        return NULL;
+    }
+    future->loop = loop;
+    future->opcode = opcode;
+    future->callback = callback;
+    future->ctx = ctx;
+    future->refs = 2;
+    return future;
+
+}
+
+/*
+ * Entrega ao ciclo a operação opcode (OP_RT_GET, OP_RT_PUT ou OP_RT_DEL)
+ * sobre key, com uma cópia de data num OP_RT_PUT. Uma escrita com timestamp
+ * > 0 é feita numa só ronda com esse timestamp; com 0 lê primeiro os
+ * timestamps.
+ * Retorna a future da operação ou NULL em caso de erro.
+ */
+struct qfuture_t *qloop_submit(struct qloop_t *loop, int opcode, char *key, struct data_t *data,
+                               long timestamp, qtable_callback_f callback, void *ctx) {
+
+    struct qfuture_t *future;
+    int i;
+
+    if(loop == NULL || key == NULL || (opcode == OP_RT_PUT && data == NULL)) {
+        ERROR("NULL loop, key or data");
+        return NULL;
+    }
+    if((future = qfuture_create(loop, opcode, callback, ctx)) == NULL) {
+        return NULL;
+    }
+    if((future->key = strdup(key)) == NULL) {
+        ERROR("strdup key");
+        free(future);
+        return NULL;
+    }
+    // Os servidores da chave (todos sem anel)
+    future->numTargets = loop->numConns;
+    future->needed = loop->needed;
+    if(loop->ring) {
+        if((future->targets = (int *) malloc(sizeof(int) * loop->numConns)) == NULL ||
+           (future->numTargets = hring_replicas(loop->ring, key, loop->replicas, future->targets)) <= 0) {
+            ERROR("hring_replicas");
+            free(future->targets);
+            free(future->key);
+            free(future);
+            return NULL;
+        }
+        future->needed = future->numTargets / 2 + 1;
+    }
+    // Um del escreve dados vazios com um timestamp novo
+    if(opcode == OP_RT_PUT) {
+        future->data = data_dup(data);
+    }
+    else if(opcode == OP_RT_DEL) {
+        future->data = data_create(0);
+    }
+    if(opcode != OP_RT_GET && future->data == NULL) {
+        ERROR("data_dup");
+        free(future->targets);
+        free(future->key);
+        free(future);
+        return NULL;
+    }
+    // Um get guarda o que cada servidor respondeu (ver qloop_repair())
+    if(opcode == OP_RT_GET) {
+        if((future->seen = (long *) malloc(sizeof(long) * loop->numConns)) == NULL) {
+            ERROR("malloc seen");
+            free(future->targets);
+            free(future->key);
+            free(future);
+            return NULL;
+        }
+        for(i = 0; i < loop->numConns; i++) {
+            future->seen[i] = -1;
+        }
+    }
+    if(future->data) {
+        future->data->timestamp = timestamp;
+    }
+    future->deadline = network_now() + NETWORK_TIMEOUT;
+
+    pthread_mutex_lock(&loop->lock);
+    if(loop->stopping) {
+        pthread_mutex_unlock(&loop->lock);
+        ERROR("qloop stopping");
+        data_destroy(future->data);
+        free(future->seen);
+        free(future->targets);
+        free(future->key);
+        free(future);
+        return NULL;
+    }
+    if(loop->submitTail) {
+        loop->submitTail->next = future;
+    }
+    else {
+        loop->submitHead = future;
+    }
+    loop->submitTail = future;
+    pthread_mutex_unlock(&loop->lock);
+    qloop_wake(loop);
+    return future;
+
+}
+
+/*
+ * Cria uma future já terminada com o resultado result (e sem valor),
+ * chamando logo callback, para operações que não precisam dos servidores.
+ * Retorna NULL em caso de erro.
+ */
+struct qfuture_t *qloop_resolved(struct qloop_t *loop, int result, qtable_callback_f callback, void *ctx) {
+
+    struct qfuture_t *future;
+
+    if((future = qfuture_create(loop, OP_RT_GET, callback, ctx)) == NULL) {
+        return NULL;
+    }
+    future->refs = 1;
+    future->result = result;
+    future->done = 1;
+    if(callback) {
+        callback(future, ctx);
+    }
+    return future;
+
+}
+
+/*
+ * Fio do ciclo de eventos (arg é o qloop_t).
+ */
+void *qloop_run(void *arg) {
+
+    struct qloop_t *loop = (struct qloop_t *) arg;
+    struct epoll_event events[QLOOP_MAX_EVENTS];
+    struct qconn_t *conn;
+    struct qfuture_t *future;
+    int numEvents, stopping = 0, index, i;
+    long lastExpire = network_now();
+    uint64_t count;
+
+    while(!stopping) {
+        if((numEvents = epoll_wait(loop->epollFd, events, QLOOP_MAX_EVENTS, QLOOP_TICK_MS)) == -1) {
+            if(errno != EINTR) {
+                LOG_PERROR("epoll_wait");
+                break;
+            }
+            numEvents = 0;
+        }
+        for(i = 0; i < numEvents; i++) {
+            if(events[i].data.u64 == QLOOP_WAKE_EVENT) {
+                while(read(loop->wakeFd, &count, sizeof(count)) > 0);
+                qloop_start_submitted(loop);
+                continue;
+            }
+            // Um evento de uma ligação entretanto fechada (e talvez reaberta
+            // com o mesmo descritor) já não lhe diz respeito
+            index = (int) (events[i].data.u64 & 0xffffffffu);
+            conn = &loop->conns[index];
+            if(conn->fd == -1 || conn->epoch != (unsigned int) (events[i].data.u64 >> 32)) {
+                continue;
+            }
+            if((events[i].events & EPOLLIN) && qconn_read(loop, conn) == -1) {
+                qconn_close(loop, conn);
+                continue;
+            }
+            if((events[i].events & EPOLLOUT) && qconn_flush(loop, conn, index) == -1) {
+                qconn_close(loop, conn);
+                continue;
+            }
+            if(events[i].events & (EPOLLERR | EPOLLHUP)) {
+                qconn_close(loop, conn);
+            }
+        }
+
+        // Os pedidos das operações que avançaram seguem de uma vez
+        for(i = 0; i < loop->numConns; i++) {
+            conn = &loop->conns[i];
+            if(conn->fd != -1 && !conn->polling && conn->outOffset < conn->outSize &&
+               qconn_flush(loop, conn, i) == -1) {
+                qconn_close(loop, conn);
+            }
+        }
+        // Os prazos só são vistos a cada QLOOP_TICK_MS: com milhares de
+        // operações em curso, percorrê-las a cada resposta seria o custo maior
+        if(network_now() - lastExpire >= QLOOP_TICK_MS) {
+            lastExpire = network_now();
+            qloop_expire(loop);
+        }
+
+        pthread_mutex_lock(&loop->lock);
+        stopping = loop->stopping;
+        pthread_mutex_unlock(&loop->lock);
+    }
+
+    // As operações por começar e as em curso terminam com erro
+    qloop_start_submitted(loop);
+    while((future = loop->inflight) != NULL) {
+        qloop_complete(loop, future, -1);
+    }
+    for(i = 0; i < loop->numConns; i++) {
+        if(loop->conns[i].fd != -1) {
+            qconn_close(loop, &loop->conns[i]);
+        }
+    }
+    return NULL;
+
+}
+
+/*
+ * Envia o pedido OP_RT_PUT de key com data (a escrita de um put ou de um
+ * del) como put-if-newer: nunca substitui uma escrita mais recente.
+ */
+static void qloop_send_put(struct qloop_t *loop, struct qfuture_t *future) {
+
+    struct message_t msg;
+    struct entry_t entry;
+
+    entry.key = future->key;
+    entry.value = future->data;
+    msg.opcode = OP_RT_PUT;
+    msg.c_type = CT_NEWER;
+    msg.content.entry = &entry;
+    future->phase = OP_RT_PUT;
+    qloop_send(loop, future, &msg);
+
+}
+
+/*
+ * Começa as operações entregues por qloop_submit().
+ */
+void qloop_start_submitted(struct qloop_t *loop) {
+
+    struct qfuture_t *future, *next;
+    struct message_t msg;
+    int stopping;
+
+    pthread_mutex_lock(&loop->lock);
+    future = loop->submitHead;
+    loop->submitHead = loop->submitTail = NULL;
+    stopping = loop->stopping;
+    pthread_mutex_unlock(&loop->lock);
+
+    for(; future; future = next) {
+        next = future->next;
+        future->prev = NULL;
+        if((future->next = loop->inflight) != NULL) {
+            loop->inflight->prev = future;
+        }
+        loop->inflight = future;
+        if(stopping) {
+            qloop_complete(loop, future, -1);
+            continue;
+        }
+        // Uma escrita que já tem timestamp é uma só ronda
+        if(future->opcode != OP_RT_GET && future->data->timestamp > 0) {
+            qloop_send_put(loop, future);
+            continue;
+        }
+        // Um get lê o valor; um put ou um del começam pelo timestamp
+        msg.opcode = (short) (future->opcode == OP_RT_GET ? OP_RT_GET : OP_RT_GETTS);
+        msg.c_type = CT_KEY;
+        msg.content.key = future->key;
+        future->phase = msg.opcode;
+        qloop_send(loop, future, &msg);
+    }
+
+}
+
+/*
+ * Garante espaço para mais size bytes no buffer *buffer (com *capacity
+ * bytes, dos quais used ocupados).
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+static int qconn_reserve(char **buffer, int *capacity, int used, int size) {
+
+    char *grown;
+    int newCapacity = *capacity ? *capacity : QLOOP_READ_SIZE;
+
+    while(newCapacity - used < size) {
+        newCapacity *= 2;
+    }
+    if(newCapacity != *capacity) {
+        if((grown = (char *) realloc(*buffer, newCapacity)) == NULL) {
+            ERROR("realloc buffer");
+            return -1;
+        }
+        *buffer = grown;
+        *capacity = newCapacity;
+    }
+    return 0;
+
+}
+
+/*
+ * Põe future no fim da fila dos pedidos à espera de conn, a ligação ao
+ * servidor server.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+static int qconn_push(struct qconn_t *conn, int server, struct qfuture_t *future) {
+
+    struct qslot_t *slots;
+    int capacity, i;
+
+    if(conn->slotCount == conn->slotCapacity) {
+        capacity = conn->slotCapacity ? conn->slotCapacity * 2 : 64;
+        if((slots = (struct qslot_t *) malloc(sizeof(struct qslot_t) * capacity)) == NULL) {
+            ERROR("malloc slots");
+            return -1;
+        }
+        for(i = 0; i < conn->slotCount; i++) {
+            slots[i] = conn->slots[(conn->slotHead + i) % conn->slotCapacity];
+        }
+        free(conn->slots);
+        conn->slots = slots;
+        conn->slotHead = 0;
+        conn->slotCapacity = capacity;
+    }
+    conn->slots[(conn->slotHead + conn->slotCount) % conn->slotCapacity].future = future;
+    conn->slots[(conn->slotHead + conn->slotCount) % conn->slotCapacity].round = future->round;
+    conn->slots[(conn->slotHead + conn->slotCount) % conn->slotCapacity].server = server;
+    conn->slotCount++;
+    __atomic_add_fetch(&future->refs, 1, __ATOMIC_RELAXED);
+    return 0;
+
+}
+
+/*
+ * Envia a todos os servidores o pedido msg da fase actual de future.
+ */
+void qloop_send(struct qloop_t *loop, struct qfuture_t *future, struct message_t *msg) {
+
+    struct qconn_t *conn;
+    uint32_t header[2];
+    char *buffer = NULL;
+    int size, i;
+
+    future->round++;
+    future->replies = 0;
+    future->failures = 0;
+    if((size = message_to_string(msg, &buffer)) <= 0 || network_header(header, size, future->deadline) == -1) {
+        free(buffer);
+        qloop_complete(loop, future, -1);
+        return;
+    }
+
+    for(i = 0; i < loop->numConns; i++) {
+        if(future->targets && !future->targets[i]) {
+            continue;
+        }
+        conn = &loop->conns[i];
+        if(conn->fd == -1 && qconn_open(loop, conn, i) == -1) {
+            future->failures++;
+            continue;
+        }
+        if(qconn_reserve(&conn->out, &conn->outCapacity, conn->outSize, sizeof(header) + size) == -1 ||
+           qconn_push(conn, i, future) == -1) {
+            future->failures++;
+            continue;
+        }
+        memcpy(conn->out + conn->outSize, header, sizeof(header));
+        memcpy(conn->out + conn->outSize + sizeof(header), buffer, size);
+        conn->outSize += sizeof(header) + size;
+    }
+    free(buffer);
+    qloop_progress(loop, future);
+
+}
+
+/*
+ * Junta a resposta msg do servidor server às já recebidas por future.
+ * Retorna 0 (resposta boa) ou -1 (o servidor falhou o pedido).
+ */
+static int qloop_collect(struct qfuture_t *future, int server, struct message_t *msg) {
+
+    struct data_t *value;
+
+    if(msg == NULL || msg->opcode != future->phase + 1) {
+        return -1;
+    }
+    switch(future->phase) {
+    case OP_RT_GETTS:
+        if(msg->content.timestamp > future->timestamp) {
+            future->timestamp = msg->content.timestamp;
+        }
+        return 0;
+    case OP_RT_GET:
+        // Uma chave que o servidor não tem vem como "0" (1 byte) e não conta
+        if((value = msg->content.value) == NULL || value->datasize == 1) {
+            future->seen[server] = 0;
+            return 0;
+        }
+        future->seen[server] = value->timestamp;
+        if(future->data == NULL || value->timestamp > future->timestamp) {
+            data_destroy(future->data);
+            future->data = value;
+            future->timestamp = value->timestamp;
+            msg->content.value = NULL;
+        }
+        return 0;
+    case OP_RT_PUT:
+        // O servidor responde com o timestamp que ficou (o nosso ou o de
+        // uma escrita mais recente): em ambos os casos a escrita está feita
+        return msg->c_type == CT_TIMESTAMP ? 0 : -1;
+    default:
+        return msg->content.result == 0 ? 0 : -1;
+    }
+
+}
+
+/*
+ * Trata a resposta msg (NULL se o servidor falhou) ao pedido slot.
+ */
+void qloop_reply(struct qloop_t *loop, struct qslot_t *slot, struct message_t *msg) {
+
+    struct qfuture_t *future = slot->future;
+
+    // Respostas a pedidos de uma fase anterior, ou de uma operação que já
+    // terminou, chegam tarde
+    if(!future->done && slot->round == future->round) {
+        if(qloop_collect(future, slot->server, msg) == 0) {
+            future->replies++;
+        }
+        else {
+            future->failures++;
+        }
+        qloop_progress(loop, future);
+    }
+    qfuture_release(future);
+
+}
+
+/*
+ * Entrega à fila de reparações da quorum table o valor mais recente lido
+ * por future, para os servidores que responderam com um mais antigo.
+ */
+static void qloop_repair(struct qloop_t *loop, struct qfuture_t *future) {
+
+    struct entry_t latest, *entry;
+    int i, numStale = 0, *stale;
+
+    if(loop->qtable == NULL || future->data == NULL) {
+        return;
+    }
+    for(i = 0; i < loop->numConns; i++) {
+        if(future->seen[i] != -1 && future->seen[i] < future->data->timestamp) {
+            numStale++;
+        }
+    }
+    if(numStale == 0) {
+        return;
+    }
+    if((stale = (int *) calloc(loop->numConns, sizeof(int))) == NULL) {
+        ERROR("calloc stale");
+        return;
+    }
+    for(i = 0; i < loop->numConns; i++) {
+        stale[i] = future->seen[i] != -1 && future->seen[i] < future->data->timestamp;
+    }
+    latest.key = future->key;
+    latest.value = future->data;
+    if((entry = entry_dup(&latest)) == NULL) {
+        ERROR("entry_dup");
+        free(stale);
+        return;
+    }
+    qtable_repair_enqueue(loop->qtable, entry, stale);
+
+}
+
+/*
+ * Passa future à fase seguinte, ou termina-a, se já tem respostas
+ * suficientes (ou se já não as pode ter).
+ */
+void qloop_progress(struct qloop_t *loop, struct qfuture_t *future) {
+
+    if(future->done) {
+        return;
+    }
+    if(future->replies < future->needed) {
+        if(future->replies + future->failures >= future->numTargets) {
+            qloop_complete(loop, future, -1);
+        }
+        return;
+    }
+
+    switch(future->phase) {
+    case OP_RT_GETTS:
+        // Como em qtable_put(): um timestamp maior que o de todos os lidos
+        future->data->timestamp = update_timestamp(future->timestamp, loop->id);
+        qloop_send_put(loop, future);
+        break;
+    case OP_RT_GET:
+        // Como em qtable_get(): a maioria já respondeu, os servidores que
+        // ficaram para trás são reparados em segundo plano
+        qloop_repair(loop, future);
+        qloop_complete(loop, future, 0);
+        break;
+    default:
+        qloop_complete(loop, future, 0);
+    }
+
+}
+
+/*
+ * Termina future com o resultado result: acorda quem espera e chama o
+ * callback.
+ */
+void qloop_complete(struct qloop_t *loop, struct qfuture_t *future, int result) {
+
+    future->result = result;
+    // Um get devolve o valor mais recente, excepto se foi removido
+    if(result == 0 && future->opcode == OP_RT_GET && future->data && future->data->data) {
+        future->value = future->data;
+        future->data = NULL;
+    }
+
+    if(future->prev) {
+        future->prev->next = future->next;
+    }
+    else {
+        loop->inflight = future->next;
+    }
+    if(future->next) {
+        future->next->prev = future->prev;
+    }
+    future->prev = future->next = NULL;
+
+    pthread_mutex_lock(&loop->lock);
+    __atomic_store_n(&future->done, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&loop->completed);
+    pthread_mutex_unlock(&loop->lock);
+
+    if(future->callback) {
+        future->callback(future, future->ctx);
+    }
+    qfuture_release(future);
+
+}
+
+/*
+ * Termina com erro as operações cujo prazo passou.
+ */
+void qloop_expire(struct qloop_t *loop) {
+
+    struct qfuture_t *future, *next;
+    long now = network_now();
+
+    for(future = loop->inflight; future; future = next) {
+        next = future->next;
+        if(now >= future->deadline) {
+            LOG_WARN("Operação assíncrona %d sobre %s expirou (%d respostas)",
+                     future->opcode, future->key, future->replies);
+            qloop_complete(loop, future, -1);
+        }
+    }
+
+}
+
+/*
+ * Abre a ligação conn, se o servidor não estiver em backoff.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int qconn_open(struct qloop_t *loop, struct qconn_t *conn, int index) {
+
+    struct epoll_event event;
+    long now = network_now();
+    int fd;
+
+    if(conn->table == NULL || now < conn->nextAttempt) {
+        return -1;
+    }
+    // Em memória partilhada os pedidos não se podem acumular: o ciclo usa o
+    // socket Unix do mesmo servidor
+    if(conn->table->transport == RTABLE_TCP) {
+        fd = network_connect_tcp(conn->table, now + NETWORK_CONNECT_TIMEOUT);
+    }
+    else {
+        fd = network_connect_local(conn->table, now + NETWORK_CONNECT_TIMEOUT);
+    }
+    if(fd != -1) {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t) conn->epoch << 32) | (uint32_t) index;
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            LOG_PERROR("epoll_ctl qconn");
+            close(fd);
+            fd = -1;
+        }
+    }
+    if(fd == -1) {
+        conn->backoff = conn->backoff ? conn->backoff * 2 : NETWORK_BACKOFF_MIN;
+        if(conn->backoff > NETWORK_BACKOFF_MAX) {
+            conn->backoff = NETWORK_BACKOFF_MAX;
+        }
+        conn->nextAttempt = network_now() + conn->backoff;
+        return -1;
+    }
+    conn->fd = fd;
+    conn->backoff = 0;
+    conn->polling = 0;
+    return 0;
+
+}
+
+/*
+ * Fecha a ligação conn; os pedidos à espera contam como falhas.
+ */
+void qconn_close(struct qloop_t *loop, struct qconn_t *conn) {
+
+    struct qslot_t slot;
+
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->epoch++;
+    conn->outSize = conn->outOffset = 0;
+    conn->inSize = 0;
+    // As operações que falham aqui podem avançar e enviar novos pedidos: a
+    // ligação só volta a ser tentada depois do backoff
+    conn->backoff = NETWORK_BACKOFF_MIN;
+    conn->nextAttempt = network_now() + conn->backoff;
+    while(conn->slotCount > 0) {
+        slot = conn->slots[conn->slotHead];
+        conn->slotHead = (conn->slotHead + 1) % conn->slotCapacity;
+        conn->slotCount--;
+        qloop_reply(loop, &slot, NULL);
+    }
+
+}
+
+/*
+ * Lê e trata as respostas disponíveis na ligação conn.
+ * Retorna 0 (OK) ou -1 (a ligação deve ser fechada).
+ */
+int qconn_read(struct qloop_t *loop, struct qconn_t *conn) {
+
+    struct message_t *msg;
+    struct qslot_t slot;
+    ssize_t numBytes;
+    uint32_t size;
+    int offset = 0;
+    char saved;
+
+    if(qconn_reserve(&conn->in, &conn->inCapacity, conn->inSize, QLOOP_READ_SIZE + 1) == -1) {
+        return -1;
+    }
+    while((numBytes = recv(conn->fd, conn->in + conn->inSize,
+                           conn->inCapacity - conn->inSize - 1, 0)) == -1 && errno == EINTR);
+    if(numBytes == 0) {
+        LOG_WARN("Servidor %s fechou a ligação assíncrona", conn->table->ip);
+        return -1;
+    }
+    if(numBytes == -1) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        LOG_PERROR("recv qconn");
+        return -1;
+    }
+    conn->inSize += numBytes;
+
+    while(conn->inSize - offset >= (int) sizeof(uint32_t)) {
+        memcpy(&size, conn->in + offset, sizeof(size));
+        size = ntohl(size);
+        if(size == 0 || size > QLOOP_MAX_MESSAGE) {
+            ERROR("invalid reply size");
+            return -1;
+        }
+        if(conn->inSize - offset < (int) (sizeof(uint32_t) + size)) {
+            // Resposta incompleta: o buffer tem de chegar para ela
+            if(qconn_reserve(&conn->in, &conn->inCapacity, conn->inSize, sizeof(uint32_t) + size + 1) == -1) {
+                return -1;
+            }
+            break;
+        }
+        if(conn->slotCount == 0) {
+            ERROR("reply without request");
+            return -1;
+        }
+        // string_to_message() precisa da mensagem terminada em '\0'
+        offset += sizeof(uint32_t);
+        saved = conn->in[offset + size];
+        conn->in[offset + size] = '\0';
+        msg = string_to_message(conn->in + offset);
+        conn->in[offset + size] = saved;
+        offset += size;
+
+        slot = conn->slots[conn->slotHead];
+        conn->slotHead = (conn->slotHead + 1) % conn->slotCapacity;
+        conn->slotCount--;
+        qloop_reply(loop, &slot, msg);
+        if(msg) {
+            free_message(msg);
+        }
+    }
+    if(offset > 0) {
+        memmove(conn->in, conn->in + offset, conn->inSize - offset);
+        conn->inSize -= offset;
+    }
+    return 0;
+
+}
+
+/*
+ * Envia os pedidos pendentes de conn, até o socket encher (aí o epoll passa
+ * a esperar por EPOLLOUT).
+ * Retorna 0 (OK) ou -1 (a ligação deve ser fechada).
+ */
+int qconn_flush(struct qloop_t *loop, struct qconn_t *conn, int index) {
+
+    struct epoll_event event;
+    ssize_t numBytes;
+    int polling;
+
+    while(conn->outOffset < conn->outSize) {
+        numBytes = send(conn->fd, conn->out + conn->outOffset, conn->outSize - conn->outOffset, MSG_NOSIGNAL);
+        if(numBytes == -1) {
+            if(errno == EINTR) {
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            LOG_PERROR("send qconn");
+            return -1;
+        }
+        conn->outOffset += numBytes;
+    }
+    if(conn->outOffset == conn->outSize) {
+        conn->outOffset = conn->outSize = 0;
+    }
+
+    polling = conn->outSize > 0;
+    if(polling != conn->polling) {
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | (polling ? EPOLLOUT : 0);
+        event.data.u64 = ((uint64_t) conn->epoch << 32) | (uint32_t) index;
+        if(epoll_ctl(loop->epollFd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+            LOG_PERROR("epoll_ctl qconn");
+            return -1;
+        }
+        conn->polling = polling;
+    }
+    return 0;
+
+}
+
+/*
+ * Liberta uma referência a future (libertando-a com a última).
+ */
+void qfuture_release(struct qfuture_t *future) {
+
+    if(__atomic_sub_fetch(&future->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(future->key);
+        free(future->targets);
+        free(future->seen);
+        data_destroy(future->data);
+        data_destroy(future->value);
+        free(future);
+    }
+
+}
+
+/*
+ * Retorna 1 se a operação da future já terminou e 0 caso contrário.
+ */
+int qfuture_poll(struct qfuture_t *future) {
+
+    if(future == NULL) {
+        ERROR("NULL future");
+        return 0;
+    }
+    return __atomic_load_n(&future->done, __ATOMIC_ACQUIRE);
+
+}
+
+/*
+ * Espera até timeout_ms milissegundos (para sempre, se for negativo) que a
+ * operação da future termine.
+ * Retorna 0 (terminou) ou -1 (ainda não terminou, ou erro).
+ */
+int qfuture_wait(struct qfuture_t *future, int timeout_ms) {
+
+    struct qloop_t *loop;
+    struct timespec until;
+    int done;
+
+    if(future == NULL) {
+        ERROR("NULL future");
+        return -1;
+    }
+    if(__atomic_load_n(&future->done, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    loop = future->loop;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    if(timeout_ms >= 0) {
+        until.tv_sec += timeout_ms / 1000;
+        until.tv_nsec += (long) (timeout_ms % 1000) * 1000000L;
+        if(until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&loop->lock);
+    while(!(done = future->done)) {
+        if(timeout_ms < 0) {
+            pthread_cond_wait(&loop->completed, &loop->lock);
+        }
+        else if(pthread_cond_timedwait(&loop->completed, &loop->lock, &until) == ETIMEDOUT) {
+            done = future->done;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loop->lock);
+    return done ? 0 : -1;
+
+}
+
+/*
+ * Retorna o resultado da operação da future: 0 (ok) ou -1 (erro, ou ainda
+ * não terminou).
+ */
+int qfuture_result(struct qfuture_t *future) {
+
+    if(future == NULL || !__atomic_load_n(&future->done, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    return future->result;
+
+}
+
+/*
+ * Retira da future o valor obtido por um qtable_get_async() terminado, a
+ * libertar com data_destroy().
+ * Retorna NULL se a chave não existe, em caso de erro ou se o valor já foi
+ * retirado.
+ */
+struct data_t *qfuture_value(struct qfuture_t *future) {
+
+    struct data_t *value;
+
+    if(future == NULL || !__atomic_load_n(&future->done, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    value = future->value;
+    future->value = NULL;
+    return value;
+
+}
+
+/*
+ * Liberta a future. Uma operação ainda a decorrer não é cancelada (e o
+ * callback ainda é chamado).
+ */
+void qfuture_destroy(struct qfuture_t *future) {
+
+    if(future) {
+        qfuture_release(future);
+    }
+
+}
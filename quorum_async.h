@@ -0,0 +1,47 @@
+#ifndef _QUORUM_ASYNC_H
+#define _QUORUM_ASYNC_H
+
+#include "data.h"
+#include "remote_table.h"
+#include "quorum_table.h"
+#include "hash_ring.h"
+
+struct qloop_t; /* Definida em quorum_async-private.h */
+
+/*
+ * Cria o ciclo de eventos das operações assíncronas sobre os n servidores
+ * de servers (as ligações usam os seus endereços e transportes) e lança o
+ * seu fio. id identifica o cliente nos timestamps. Com ring (que continua
+ * a ser do chamador), cada operação só contacta os replicas servidores da
+ * sua chave; com NULL contacta todos. Os servidores que um get encontra
+ * atrás do valor mais recente são reparados pela fila de qtable.
+ * Retorna NULL em caso de erro.
+ */
+struct qloop_t *qloop_create(struct qtable_t *qtable, struct rtable_t **servers, int n, int id,
+                             struct hring_t *ring, int replicas);
+
+/*
+ * Pára o fio do ciclo (as operações em curso terminam com erro, chamando os
+ * seus callbacks) e liberta-o. As futures continuam válidas até serem
+ * destruídas.
+ */
+void qloop_destroy(struct qloop_t *loop);
+
+/*
+ * Entrega ao ciclo a operação opcode (OP_RT_GET, OP_RT_PUT ou OP_RT_DEL)
+ * sobre key, com uma cópia de data num OP_RT_PUT. Uma escrita com timestamp
+ * > 0 é feita numa só ronda com esse timestamp; com 0 lê primeiro os
+ * timestamps de uma maioria (modo estrito).
+ * Retorna a future da operação ou NULL em caso de erro.
+ */
+struct qfuture_t *qloop_submit(struct qloop_t *loop, int opcode, char *key, struct data_t *data,
+                               long timestamp, qtable_callback_f callback, void *ctx);
+
+/*
+ * Cria uma future já terminada com o resultado result (e sem valor),
+ * chamando logo callback, para operações que não precisam dos servidores.
+ * Retorna NULL em caso de erro.
+ */
+struct qfuture_t *qloop_resolved(struct qloop_t *loop, int result, qtable_callback_f callback, void *ctx);
+
+#endif
@@ -14,6 +14,40 @@
 #include "remote_table-private.h"
 #include "quorum_access.h"
 #include "quorum_access-private.h"
+#include "bloom.h"
+#include "quorum_async.h"
+#include "hash_ring.h"
+#include "hinted_handoff.h"
+
+/*
+ * Bits do relógio híbrido (HLC) reservados ao contador lógico: o relógio é
+ * (milissegundos << QTABLE_HLC_LOGICAL_BITS) + contador, e um timestamp é
+ * relógio * 1000 + id, como os de update_timestamp().
+ */
+#define QTABLE_HLC_LOGICAL_BITS 10
+
+/*
+ * Reparações à espera de serem enviadas, no máximo (as que não cabem ficam
+ * para a próxima leitura que encontre a divergência)
+ */
+#define QTABLE_REPAIR_MAX 1024
+
+/* Entradas enviadas, no máximo, em cada mensagem de reparação */
+#define QTABLE_REPAIR_BATCH 64
+
+/*
+ * Define uma reparação à espera: o valor mais recente de uma chave e os
+ * servidores que responderam a uma leitura com um valor mais antigo.
+ *
+ * struct entry_t *entry => a chave e o valor (com o seu timestamp)
+ * int *stale => stale[i] é 1 se o servidor i precisa do valor, ou 0
+ * struct qrepair_t *next => a reparação seguinte (uma por chave)
+ */
+struct qrepair_t {
+    struct entry_t *entry;
+    int *stale;
+    struct qrepair_t *next;
+};
 
 /*
  * Define a estrutura de uma quorum table.
@@ -22,16 +56,138 @@
  * int numServers => o numero servidores disponíveis
  * char **serversAddress => os ip's e portos dos servidores disponíveis
  * struct rtable_t **servers => a ligação às tabelas remotas de cada servidor
+ * int filterRefresh => segundos entre actualizações dos filtros (0 = não usa)
+ * time_t filterTime => instante da última actualização dos filtros
+ * struct bloom_t **filters => último filtro de chaves de cada servidor (NULL
+ *                             se não for conhecido)
+ * struct qloop_t *async => ciclo das operações assíncronas (NULL até à primeira)
+ * pthread_mutex_t asyncLock => protege a criação de async
+ * long clock => último valor do relógio híbrido (actualizado sem locks)
+ * int strict => 1 se as escritas lêem primeiro os timestamps de uma maioria
+ *               (duas rondas) em vez de usar o relógio (ver qtable_set_strict())
+ * int digestReads => 1 se os gets pedem o valor a um só servidor e aos
+ *                    restantes o resumo (ver qtable_use_digest_reads())
+ * pthread_t repairThread => fio que envia as reparações das leituras
+ * int repairRunning => 1 depois de lançado repairThread
+ * pthread_mutex_t repairLock => protege repairs, numRepairs e repairStop
+ * pthread_cond_t repairReady => sinalizada quando há reparações ou ao terminar
+ * struct qrepair_t *repairs => reparações à espera
+ * int numRepairs => quantas estão em repairs
+ * int repairStop => 1 quando o fio deve enviar as que faltam e terminar
+ * struct hring_t *ring => anel que reparte as chaves (NULL com replicação
+ *                         total, ver qtable_set_replicas())
+ * int replicas => servidores de cada chave no modo particionado
+ * struct hhandoff_t *hints => pistas das escritas que os servidores falharam
+ *                             (NULL se não são guardadas, ver qtable_use_hints())
  */
 struct qtable_t {
     int id;
     int numServers;
     char **serversAdrress;
     struct rtable_t **servers;
+    int filterRefresh;
+    time_t filterTime;
+    struct bloom_t **filters;
+    struct qloop_t *async;
+    pthread_mutex_t asyncLock;
+    long clock;
+    int strict;
+    int digestReads;
+    pthread_t repairThread;
+    int repairRunning;
+    pthread_mutex_t repairLock;
+    pthread_cond_t repairReady;
+    struct qrepair_t *repairs;
+    int numRepairs;
+    int repairStop;
+    struct hring_t *ring;
+    int replicas;
+    struct hhandoff_t *hints;
 };
 
 void qtable_free_quorum_op_t(struct quorum_op_t **ret, int n);
 
+/*
+ * Servidores responsáveis por key: no modo particionado marca-os em targets
+ * (numServers posições) e devolve targets; com replicação total devolve
+ * NULL (todos). Em quorum fica o número de respostas que forma uma maioria
+ * desses servidores.
+ */
+int *qtable_key_servers(struct qtable_t *qtable, char *key, int *targets, int *quorum);
+
+/*
+ * Junta, sem repetições e por ordem, as chaves das respostas a OP_RT_GETKEYS
+ * de n servidores (as do modo particionado). As respostas não são alteradas.
+ * Retorna NULL em caso de erro.
+ */
+char **qtable_merge_keys(struct quorum_op_t **ret, int n);
+
 long update_timestamp(long ts, int id);
 
+/*
+ * Avança o relógio híbrido (para o tempo físico, ou mais um tique lógico se
+ * este não avançou) e devolve o timestamp de uma escrita deste cliente,
+ * maior que todos os que o cliente já gerou ou viu.
+ */
+long qtable_clock(struct qtable_t *qtable);
+
+/*
+ * Garante que o relógio híbrido fica à frente do timestamp lido timestamp,
+ * para que uma escrita feita depois de uma leitura a substitua.
+ */
+void qtable_clock_observe(struct qtable_t *qtable, long timestamp);
+
+/*
+ * Leva o relógio híbrido até aos timestamps que ficaram nos servidores
+ * depois de uma escrita QA_PUT_IF_NEWER (as respostas ret).
+ */
+void qtable_observe_winners(struct qtable_t *qtable, struct quorum_op_t **ret);
+
+/*
+ * Pede a todos os servidores o seu filtro de chaves e guarda os recebidos.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int qtable_refresh_filters(struct qtable_t *qtable);
+
+/*
+ * Retorna 1 se os filtros de uma maioria dos servidores garantem que key
+ * não existe, e 0 caso contrário (ou se os filtros não estiverem activos).
+ */
+int qtable_filters_exclude(struct qtable_t *qtable, char *key);
+
+/*
+ * Leitura por resumo de key: o valor vem do servidor mais rápido e, dos
+ * restantes, só o timestamp e o resumo do valor.
+ * Retorna 0 se a maioria concorda, com o valor em *value (NULL se a chave
+ * não existe), ou -1 se é preciso uma leitura completa.
+ */
+int qtable_get_digest(struct qtable_t *qtable, char *key, struct data_t **value);
+
+/*
+ * Agenda a reparação dos servidores cujas respostas ret (de um OP_RT_GET)
+ * são mais antigas que value, o valor mais recente de key. Não espera pelo
+ * envio.
+ */
+void qtable_repair_stale(struct qtable_t *qtable, char *key, struct data_t *value,
+                         struct quorum_op_t **ret);
+
+/*
+ * Junta à fila a reparação de entry nos servidores stale (ambos passam a
+ * ser da fila). Se a chave já lá estiver as duas juntam-se: fica o valor
+ * mais recente e todos os servidores das duas.
+ * Retorna 0 (ok) ou -1 (fila cheia ou erro; entry e stale são libertados).
+ */
+int qtable_repair_enqueue(struct qtable_t *qtable, struct entry_t *entry, int *stale);
+
+/*
+ * Envia as reparações repairs, em lotes de entradas que vão para os mesmos
+ * servidores, e liberta-as.
+ */
+void qtable_repair_flush(struct qtable_t *qtable, struct qrepair_t *repairs);
+
+/*
+ * Fio das reparações (arg é a qtable): espera por reparações e envia-as.
+ */
+void *qtable_repair_run(void *arg);
+
 #endif
\ No newline at end of file
@@ -47,12 +47,29 @@ struct qtable_t *qtable_connect(const char **addresses_ports, int n, int id) {
     }*/
 	
 	qtable->numServers = n;
+	qtable->filterRefresh = 0;
+	qtable->filterTime = 0;
+	qtable->filters = NULL;
+	qtable->async = NULL;
+	pthread_mutex_init(&qtable->asyncLock, NULL);
+	qtable->clock = 0;
+	qtable->strict = 0;
+	qtable->digestReads = 0;
+	qtable->repairRunning = 0;
+	pthread_mutex_init(&qtable->repairLock, NULL);
+	pthread_cond_init(&qtable->repairReady, NULL);
+	qtable->repairs = NULL;
+	qtable->numRepairs = 0;
+	qtable->repairStop = 0;
+	qtable->ring = NULL;
+	qtable->replicas = 0;
+	qtable->hints = NULL;
 	
     // Aloca memória para cada string <ip:porto> dos servidores e copia-a
     for(i = 0; i < n; i++) {
 		
         // Verifica a cópia de cada string
-		printf("%s\n", addresses_ports[i]);
+		LOG_INFO("%s", addresses_ports[i]);
         /*if(!(qtable->serversAdrress[i] = strdup(addresses_ports[i]))) {
 		 ERROR("strdup addresses_ports");
 		 qtable_disconnect(qtable);
@@ -85,6 +102,12 @@ struct qtable_t *qtable_connect(const char **addresses_ports, int n, int id) {
 		ERROR("init_quorum_access");
 		return NULL;
 	}
+	// As leituras só agendam as reparações; é este fio que as envia
+	if(pthread_create(&qtable->repairThread, NULL, qtable_repair_run, qtable) != 0) {
+		ERROR("pthread_create");
+		return NULL;
+	}
+	qtable->repairRunning = 1;
 	qtable->id = id;
     //em caso de sucesso
     return qtable;
@@ -101,13 +124,28 @@ int qtable_disconnect(struct qtable_t *qtable) {
     int i,              // Usado em ciclos
 	falhou = 0;     // Regista a falha do fecho da liagação a uma tabela remota
 	
-	printf("A desligar a qtable...\n");
+	LOG_INFO("A desligar a qtable...");
     if(qtable == NULL) {
         ERROR("quorum_table: qtable_disconnect");
         return -1;
     }
     else {
+		// O ciclo assíncrono pára primeiro: os seus gets também juntam
+		// reparações à fila (e usa os endereços das tabelas remotas)
+		qloop_destroy(qtable->async);
+		pthread_mutex_destroy(&qtable->asyncLock);
+		// As reparações que faltam ainda são enviadas antes de parar os workers
+		if(qtable->repairRunning) {
+			pthread_mutex_lock(&qtable->repairLock);
+			qtable->repairStop = 1;
+			pthread_cond_signal(&qtable->repairReady);
+			pthread_mutex_unlock(&qtable->repairLock);
+			pthread_join(qtable->repairThread, NULL);
+		}
+		pthread_mutex_destroy(&qtable->repairLock);
+		pthread_cond_destroy(&qtable->repairReady);
 		destroy_quorum_access(); // Inclusive todas as threads, então vai ser seguro chamar o rtable_disconnect
+		hhandoff_close(qtable->hints); // Depois dos workers, que ainda lhe juntam as tarefas por enviar
         if(qtable->servers) {
             // Desliga a ligação a todas as tabelas remotas
             for(i = 0; i < qtable->numServers; i++) {
@@ -127,6 +165,14 @@ int qtable_disconnect(struct qtable_t *qtable) {
             }*/
             free(qtable->servers);
         }
+
+        // Liberta os filtros dos servidores
+        if(qtable->filters) {
+            for(i = 0; i < qtable->numServers; i++) {
+                bloom_destroy(qtable->filters[i]);
+            }
+            free(qtable->filters);
+        }
         
         // Liberta a memória do vector de <IP's:portos>
 		// Não é preciso! E o argv...
@@ -136,6 +182,7 @@ int qtable_disconnect(struct qtable_t *qtable) {
             }
             free(qtable->serversAdrress);
         }*/
+        hring_destroy(qtable->ring);
         free(qtable);
     }
 	
@@ -162,6 +209,10 @@ int qtable_put(struct qtable_t *qtable, char *key, struct data_t *data) {
         return -1;
     }
 
+    // Os servidores da chave e a sua maioria
+    int targetBuffer[qtable->numServers], quorum;
+    int *targets = qtable_key_servers(qtable, key, targetBuffer, &quorum);
+
     // Aloca memória para a operação
     struct quorum_op_t *op;
     if((op = (struct quorum_op_t *) malloc(sizeof(struct quorum_op_t)))== NULL) {
@@ -177,37 +228,43 @@ int qtable_put(struct qtable_t *qtable, char *key, struct data_t *data) {
         return -1;
     }
 
-    // Configura a operação para obter o timestamp
     op->id = 0;
     op->sender = 0;
-    op->opcode = OP_RT_GETTS;
-    op->content.key = tempKey;
-
-    // Recebe as respostas dos vários servidores
-    struct quorum_op_t **ret;
-    if((ret = quorum_access(op, (qtable->numServers/2 + 1))) == NULL) {
-        ERROR("quorum_access OP_RT_GETTS");
-        free(op);
-        free(tempKey);
-        return -1;
+    struct quorum_op_t **ret = NULL;
+    if(!qtable->strict) {
+        // Uma só ronda: o timestamp vem do relógio híbrido do cliente e os
+        // servidores ficam com a escrita mais recente
+        maxTS = qtable_clock(qtable);
     }
+    else {
+        // Configura a operação para obter o timestamp
+        op->opcode = OP_RT_GETTS;
+        op->content.key = tempKey;
 
-    // Compara os valores recebidos na resposta
-    for(i = 0; i < qtable->numServers; i++) {
-        if(ret[i]) { //&& (ret[i]->content.timestamp > maxTS)) {
-			//printf("Timestamp %d: %ld\n", i, ret[i]->content.timestamp);
-            maxTS = ret[i]->content.timestamp;
+        // Recebe as respostas dos vários servidores
+        if((ret = quorum_access_to(op, targets, quorum)) == NULL) {
+            ERROR("quorum_access OP_RT_GETTS");
+            free(op);
+            free(tempKey);
+            return -1;
+        }
+
+        // Compara os valores recebidos na resposta
+        for(i = 0; i < qtable->numServers; i++) {
+            if(ret[i] && (ret[i]->content.timestamp > maxTS)) {
+                maxTS = ret[i]->content.timestamp;
+            }
+        }
+
+        // Verifica se o maxTS foi alterado
+        if(maxTS > 0) {
+            // Incrementa o timestamp e adiciona o id do cliente
+            maxTS = update_timestamp(maxTS, qtable->id);
+        }
+        else {
+            // Inicia um novo timestamp com o id do cliene
+            maxTS = 1000 + qtable->id;
         }
-    }
-	
-	// Verifica se o maxTS foi alterado
-    if(maxTS > 0) {
-        // Incrementa o timestamp e adiciona o id do cliente
-        maxTS = update_timestamp(maxTS, qtable->id);
-    }
-    else {
-        // Inicia um novo timestamp com o id do cliene
-        maxTS = 1000 + qtable->id;
     }
 
     // Duplica a data e actualiza o timestamp
@@ -232,35 +289,31 @@ int qtable_put(struct qtable_t *qtable, char *key, struct data_t *data) {
         return -1;
     }
 
-    // Configura a operação para inserir a entrada
-    op->opcode = OP_RT_PUT;
+    // Configura a operação para inserir a entrada (se for a mais recente)
+    op->opcode = QA_PUT_IF_NEWER;
     op->content.entry = tempEntry;
 
     // Limpa a ret antes de receber as novas respostas
     qtable_free_quorum_op_t(ret, qtable->numServers);
 
     // Recebe as respostas dos vários servidores
-    if((ret = quorum_access(op, (qtable->numServers/2 + 1))) == NULL) {
+    if((ret = quorum_access_to(op, targets, quorum)) == NULL) {
         ERROR("quorum_access OP_RT_PUT");
         free(op);
-        free(tempKey);
-        qtable_free_quorum_op_t(ret, qtable->numServers);
-        data_destroy(tempData);
         entry_destroy(tempEntry);
         return -1;
     }
 
-    // Verifica as respostas
-    for(i = 0; i < qtable->numServers; i++) {
-        if(ret[i] && (ret[i]->content.result != 0)) {
-            //ERROR("invalid put");
-            free(op);
-            free(tempKey);
-            qtable_free_quorum_op_t(ret, qtable->numServers);
-            data_destroy(tempData);
-            entry_destroy(tempEntry);
-            return -1;
-			//printf("tivemos um erro.\n");
+    // Cada servidor responde com o timestamp que lá ficou: um maior que o
+    // nosso é de uma escrita concorrente mais recente, que ganha
+    qtable_observe_winners(qtable, ret);
+
+    // Os filtros em cache passam a conhecer a chave que acabámos de escrever
+    if(qtable->filters) {
+        for(i = 0; i < qtable->numServers; i++) {
+            if(qtable->filters[i]) {
+                bloom_add(qtable->filters[i], key);
+            }
         }
     }
 
@@ -275,6 +328,32 @@ int qtable_put(struct qtable_t *qtable, char *key, struct data_t *data) {
 
 }
 
+/*
+ * Como qtable_put(), mas a entrada expira (é removida pelos servidores)
+ * ttl_seconds segundos depois da escrita. Os relógios dos servidores devem
+ * estar sincronizados, pois o prazo é enviado como um instante absoluto.
+ * Devolve 0 (ok) ou -1 (problemas).
+ */
+int qtable_put_ttl(struct qtable_t *qtable, char *key, struct data_t *data, int ttl_seconds) {
+
+    int ret;
+    long previous;
+
+    // Verifica os parâmetros
+    if(qtable == NULL || key == NULL || data == NULL || ttl_seconds <= 0) {
+        ERROR("NULL qtable or key or data or invalid ttl");
+        return -1;
+    }
+
+    // O prazo viaja com a data (qtable_put() duplica-a)
+    previous = data->expires;
+    data->expires = time(NULL) + ttl_seconds;
+    ret = qtable_put(qtable, key, data);
+    data->expires = previous;
+    return ret;
+
+}
+
 /* 
  * Função para obter um elemento da tabela.
  * Em caso de erro ou elemento não existente, devolve NULL.
@@ -283,7 +362,6 @@ struct data_t *qtable_get(struct qtable_t *qtable, char *key) {
 
     int i = -1, b;              // Usado em ciclos
     long maxTS = -1;     // Regista o maior timestamp
-    int diff = -1;      // Regista uma divergência de valores
     int index = -1;          // Regista o índice de uma data com o maior timestamp
 
     // Verifica os parâmetros
@@ -292,6 +370,22 @@ struct data_t *qtable_get(struct qtable_t *qtable, char *key) {
         return NULL;
     }
 
+    // Se uma maioria dos servidores não tem a chave não vale a pena perguntar
+    if(qtable_filters_exclude(qtable, key)) {
+        return NULL;
+    }
+
+    // Os servidores da chave e a sua maioria
+    int targetBuffer[qtable->numServers], quorum;
+    int *targets = qtable_key_servers(qtable, key, targetBuffer, &quorum);
+
+    // Leitura por resumo: só se as respostas não concordarem é que o valor
+    // é pedido a todos
+    struct data_t *digested;
+    if(qtable->digestReads && qtable_get_digest(qtable, key, &digested) == 0) {
+        return digested;
+    }
+
     // Aloca memória para a operação
     struct quorum_op_t *op;
     if((op = (struct quorum_op_t *) malloc(sizeof(struct quorum_op_t)))== NULL) {
@@ -315,7 +409,7 @@ struct data_t *qtable_get(struct qtable_t *qtable, char *key) {
 
     // Recebe as respostas dos vários servidores
     struct quorum_op_t **ret;
-    if((ret = quorum_access(op, (qtable->numServers/2) + 1)) == NULL) {
+    if((ret = quorum_access_to(op, targets, quorum)) == NULL) {
         ERROR("quorum_access OP_RT_GET");
         free(op);
         free(tempKey);
@@ -328,8 +422,7 @@ struct data_t *qtable_get(struct qtable_t *qtable, char *key) {
         if(ret[i] && (ret[i]->content.value->timestamp > maxTS) && 
 		   memcmp(ret[i]->content.value, "0", 1) != 0 && ret[i]->content.value->datasize != 1) {
 			//printf("********** %ld, %ld\n", maxTS, ret[i]->content.timestamp);
-            maxTS = ret[i]->content.timestamp;
-            diff++;
+            maxTS = ret[i]->content.value->timestamp;
             index = i;
         }
     }
@@ -350,69 +443,13 @@ struct data_t *qtable_get(struct qtable_t *qtable, char *key) {
 		return NULL;
 	}
 
-	//printf("Diff: %d\n", diff);
-    // Verifica a divergência de valores na resposta
-    if(diff > 0) {
+	// As escritas seguintes deste cliente ficam à frente do que foi lido
+	qtable_clock_observe(qtable, maxTS);
 
-        // Duplica a data para ser usada na entrada a ser enviada aos servidores
-        struct data_t *tempData;
-        if((tempData = data_dup(ret[index]->content.value)) == NULL) {
-            ERROR("data_dup");
-            free(op);
-            free(tempKey);
-            qtable_free_quorum_op_t(ret, qtable->numServers);
-            data_destroy(data);
-            return NULL;
-        }
-		tempData->timestamp = maxTS;
-		//printf("TIMESTAMP: %ld\n", tempData->timestamp);
-        // Cria uma entrada nova
-        struct entry_t *tempEntry;
-        if((tempEntry = entry_create(tempKey, tempData)) == NULL) {
-            ERROR("entry_create");
-            free(op);
-            free(tempKey);
-            qtable_free_quorum_op_t(ret, qtable->numServers);
-            data_destroy(data);
-            data_destroy(tempData);
-            return NULL;
-        }
-
-        // Configura a operação para inserir a entrada
-        op->opcode = OP_RT_PUT;
-        op->content.entry = tempEntry;
-
-        // Limpa a ret antes de receber as novas respostas
-        qtable_free_quorum_op_t(ret, qtable->numServers);
-
-        // Recebe as respostas dos vários servidores
-        if((ret = quorum_access(op, (qtable->numServers/2) + 1)) == NULL) {
-            ERROR("quorum_access OP_RT_PUT");
-            free(op);
-            free(tempKey);
-            qtable_free_quorum_op_t(ret, qtable->numServers);
-            data_destroy(data);
-            data_destroy(tempData);
-            entry_destroy(tempEntry);
-            return NULL;
-        }
+    // Os servidores que responderam com um valor mais antigo são reparados
+    // em segundo plano: a leitura já tem a resposta da maioria
+    qtable_repair_stale(qtable, key, ret[index]->content.value, ret);
 
-        // Verifica as respostas
-        for(i = 0; i < qtable->numServers; i++) {
-            if(ret[i] && (ret[i]->content.result != 0)) {
-                ERROR("invalid put");
-                free(op);
-                free(tempKey);
-                qtable_free_quorum_op_t(ret, qtable->numServers);
-                data_destroy(data);
-                data_destroy(tempData);
-                entry_destroy(tempEntry);
-                return NULL;
-            }
-        }
-        //data_destroy(tempData);
-        entry_destroy(tempEntry);
-    }
 	//printf("Returning data with size: %d\n", data->datasize);
     // Em caso de sucesso
     free(op);
@@ -453,6 +490,10 @@ int qtable_del(struct qtable_t *qtable, char *key) {
 		return -1;
 	}
 	
+	// Os servidores da chave e a sua maioria
+	int targetBuffer[qtable->numServers], quorum;
+	int *targets = qtable_key_servers(qtable, key, targetBuffer, &quorum);
+	
 	// Aloca memória para a operação
 	struct quorum_op_t *op;
 	if((op = (struct quorum_op_t *) malloc(sizeof(struct quorum_op_t)))== NULL) {
@@ -468,32 +509,35 @@ int qtable_del(struct qtable_t *qtable, char *key) {
 		return -1;
 	}
 	
-	// Configura a operação para obter o timestamp
 	op->id = 0;
 	op->sender = 0;
-	op->opcode = OP_RT_GETTS;
-	op->content.key = tempKey;
-	
-	// Recebe as respostas dos vários servidores
-	struct quorum_op_t **ret;
-	if((ret = quorum_access(op, qtable->numServers/2 + 1)) == NULL) {
-		ERROR("quorum_access OP_RT_GETTS");
-		free(op);
-		free(tempKey);
-		return -1;
-	}
-	
-	// Compara os valores recebidos na resposta
-	for(i = 0; i < qtable->numServers; i++) {
-		if(ret[i] && (ret[i]->content.timestamp > maxTS)) {
-			maxTS = ret[i]->content.timestamp;
+	struct quorum_op_t **ret = NULL;
+	if(qtable->strict) {
+		// Configura a operação para obter o timestamp
+		op->opcode = OP_RT_GETTS;
+		op->content.key = tempKey;
+		
+		// Recebe as respostas dos vários servidores
+		if((ret = quorum_access_to(op, targets, quorum)) == NULL) {
+			ERROR("quorum_access OP_RT_GETTS");
+			free(op);
+			free(tempKey);
+			return -1;
+		}
+		
+		// Compara os valores recebidos na resposta
+		for(i = 0; i < qtable->numServers; i++) {
+			if(ret[i] && (ret[i]->content.timestamp > maxTS)) {
+				maxTS = ret[i]->content.timestamp;
+			}
 		}
 	}
 	
 	// Verifica se o maxTS foi alterado
 	if(maxTS >= 0) {
-		// Incrementa o timestamp e adiciona o id do cliente
-		maxTS = update_timestamp(maxTS, qtable->id);
+		// Incrementa o timestamp e adiciona o id do cliente (ou, numa só
+		// ronda, usa o relógio híbrido)
+		maxTS = qtable->strict ? update_timestamp(maxTS, qtable->id) : qtable_clock(qtable);
 		
 		// Cria uma data com o value a NULL e actualiza o timestamp
 		struct data_t *tempData;
@@ -517,37 +561,22 @@ int qtable_del(struct qtable_t *qtable, char *key) {
 			return -1;
 		}
 		
-		// Configura a operação para inserir a entrada
-		op->opcode = OP_RT_PUT;
+		// Configura a operação para inserir a entrada (se for a mais recente)
+		op->opcode = QA_PUT_IF_NEWER;
 		op->content.entry = tempEntry;
 		
 		// Limpa a ret antes de receber as novas respostas
 		qtable_free_quorum_op_t(ret, qtable->numServers);
 		
 		// Recebe as respostas dos vários servidores
-		if((ret = quorum_access(op, (qtable->numServers/2) + 1)) == NULL) {
+		if((ret = quorum_access_to(op, targets, quorum)) == NULL) {
 			ERROR("quorum_access OP_RT_PUT");
 			free(op);
-			free(tempKey);
 			qtable_free_quorum_op_t(ret, qtable->numServers);
-			data_destroy(tempData);
 			entry_destroy(tempEntry);
 			return -1;
 		}
-		
-		// Verifica as respostas
-		for(i = 0; i < qtable->numServers; i++) {
-			if(ret[i] && (ret[i]->content.result != 0)) {
-				/*ERROR("invalid put");
-				 free(op);
-				 free(tempKey);
-				 qtable_free_quorum_op_t(ret, qtable->numServers);
-				 data_destroy(tempData);
-				 entry_destroy(tempEntry);
-				 return -1;*/
-				//printf("tivemos um erro.\n");
-			}
-		}
+		qtable_observe_winners(qtable, ret);
 		
 		// Em caso de sucesso
 		free(op);
@@ -624,6 +653,10 @@ int qtable_size(struct qtable_t *qtable) {
 		}
 	}
 	result /= numReplies;
+	// No modo particionado cada servidor só tem replicas/numServers das chaves
+	if(qtable->ring) {
+		result = (int) ((long) result * qtable->numServers / qtable->replicas);
+	}
 	
 	qtable_free_quorum_op_t(ret, qtable->numServers);
 	// Em caso de sucesso
@@ -662,13 +695,30 @@ char **qtable_get_keys(struct qtable_t *qtable) {
 	op->opcode = OP_RT_GETKEYS;
 	op->content.result = 0;
 	
-	// Recebe as respostas dos vários servidores
+	// Recebe as respostas dos vários servidores. No modo particionado cada
+	// chave só está em replicas servidores: para as ver todas é preciso
+	// ouvir pelo menos numServers - replicas + 1, e juntar as suas chaves
+	int expected = qtable->numServers/2 + 1;
+	if(qtable->ring && qtable->numServers - qtable->replicas + 1 > expected) {
+		expected = qtable->numServers - qtable->replicas + 1;
+	}
 	struct quorum_op_t **ret;
-	if((ret = quorum_access(op, qtable->numServers/2 +1)) == NULL) {
+	if((ret = quorum_access(op, expected)) == NULL) {
 		ERROR("quorum_access OP_RT_GETTS");
 		free(op);
 		return NULL;
 	}
+	if(qtable->ring) {
+		char **keys = qtable_merge_keys(ret, qtable->numServers);
+		free(op);
+		for(b = 0; b < qtable->numServers; b ++) {
+			if(ret[b] && ret[b]->content.keys) {
+				qtable_free_keys(ret[b]->content.keys);
+			}
+		}
+		qtable_free_quorum_op_t(ret, qtable->numServers);
+		return keys;
+	}
 	
 	// Verifica as respostas
 	for(i = 0; i < qtable->numServers; i++) {
@@ -732,6 +782,66 @@ char **qtable_get_keys(struct qtable_t *qtable) {
 	
 }
 
+/* Ordena as chaves por strcmp() */
+static int qtable_compare_keys(const void *a, const void *b) {
+	
+	return strcmp(*(char * const *) a, *(char * const *) b);
+	
+}
+
+/*
+ * Junta, sem repetições, as chaves das respostas ret dos n servidores
+ * (ver quorum_table-private.h).
+ */
+char **qtable_merge_keys(struct quorum_op_t **ret, int n) {
+	
+	int i, j, total = 0, count = 0;
+	char **keys;
+	
+	for(i = 0; i < n; i++) {
+		if(ret[i] && ret[i]->content.keys) {
+			for(j = 0; ret[i]->content.keys[j]; j++) {
+				total++;
+			}
+		}
+	}
+	if((keys = (char **) malloc(sizeof(char *) * (total + 1))) == NULL) {
+		ERROR("malloc keys");
+		return NULL;
+	}
+	
+	// Ordenadas, as repetidas ficam seguidas
+	for(i = 0; i < n; i++) {
+		if(ret[i] && ret[i]->content.keys) {
+			for(j = 0; ret[i]->content.keys[j]; j++) {
+				keys[count++] = ret[i]->content.keys[j];
+			}
+		}
+	}
+	qsort(keys, total, sizeof(char *), qtable_compare_keys);
+	for(i = 0, count = 0; i < total; i++) {
+		if(count > 0 && strcmp(keys[count - 1], keys[i]) == 0) {
+			continue;
+		}
+		keys[count++] = keys[i];
+	}
+	keys[count] = NULL;
+	
+	// Só agora são copiadas (as respostas continuam a ser do chamador)
+	for(i = 0; i < count; i++) {
+		if((keys[i] = strdup(keys[i])) == NULL) {
+			ERROR("strdup key");
+			while(--i >= 0) {
+				free(keys[i]);
+			}
+			free(keys);
+			return NULL;
+		}
+	}
+	return keys;
+	
+}
+
 /* Desaloca a memoria alocada por qtable_get_keys().
  */
 void qtable_free_keys(char **keys) {
@@ -749,6 +859,186 @@ void qtable_free_keys(char **keys) {
 	
 }
 
+/*
+ * Cria, na primeira operação assíncrona, o ciclo de eventos que as executa.
+ * Retorna o ciclo ou NULL em caso de erro.
+ */
+static struct qloop_t *qtable_async_loop(struct qtable_t *qtable) {
+
+    struct qloop_t *loop;
+
+    pthread_mutex_lock(&qtable->asyncLock);
+    if(qtable->async == NULL) {
+        qtable->async = qloop_create(qtable, qtable->servers, qtable->numServers, qtable->id, qtable->ring, qtable->replicas);
+    }
+    loop = qtable->async;
+    pthread_mutex_unlock(&qtable->asyncLock);
+    return loop;
+
+}
+
+/*
+ * Versão assíncrona de qtable_get(): o valor fica na future (ver
+ * qfuture_value()).
+ * Retorna NULL em caso de erro.
+ */
+struct qfuture_t *qtable_get_async(struct qtable_t *qtable, char *key, qtable_callback_f callback, void *ctx) {
+
+    struct qloop_t *loop;
+
+    if(qtable == NULL || key == NULL) {
+        ERROR("NULL qtable or key");
+        return NULL;
+    }
+    if((loop = qtable_async_loop(qtable)) == NULL) {
+        return NULL;
+    }
+    // Como em qtable_get(): a chave que os filtros excluem não existe
+    if(qtable_filters_exclude(qtable, key)) {
+        return qloop_resolved(loop, 0, callback, ctx);
+    }
+    return qloop_submit(loop, OP_RT_GET, key, NULL, 0, callback, ctx);
+
+}
+
+/*
+ * Versão assíncrona de qtable_put() (data é copiado).
+ * Retorna NULL em caso de erro.
+ */
+struct qfuture_t *qtable_put_async(struct qtable_t *qtable, char *key, struct data_t *data,
+                                   qtable_callback_f callback, void *ctx) {
+
+    struct qloop_t *loop;
+
+    if(qtable == NULL || key == NULL || data == NULL) {
+        ERROR("NULL qtable or key or data");
+        return NULL;
+    }
+    if((loop = qtable_async_loop(qtable)) == NULL) {
+        return NULL;
+    }
+    // Como em qtable_put(): sem modo estrito o timestamp é do relógio
+    return qloop_submit(loop, OP_RT_PUT, key, data, qtable->strict ? 0 : qtable_clock(qtable), callback, ctx);
+
+}
+
+/*
+ * Versão assíncrona de qtable_del().
+ * Retorna NULL em caso de erro.
+ */
+struct qfuture_t *qtable_del_async(struct qtable_t *qtable, char *key, qtable_callback_f callback, void *ctx) {
+
+    struct qloop_t *loop;
+
+    if(qtable == NULL || key == NULL) {
+        ERROR("NULL qtable or key");
+        return NULL;
+    }
+    if((loop = qtable_async_loop(qtable)) == NULL) {
+        return NULL;
+    }
+    return qloop_submit(loop, OP_RT_DEL, key, NULL, qtable->strict ? 0 : qtable_clock(qtable), callback, ctx);
+
+}
+
+/*
+ * Activa (refresh_seconds > 0) ou desactiva (0) o uso dos filtros de chaves
+ * dos servidores: um qtable_get() de uma chave que os filtros de uma maioria
+ * dizem não existir devolve NULL sem contactar os servidores. Os filtros são
+ * pedidos de novo a cada refresh_seconds, pelo que uma chave escrita por
+ * outro cliente pode não ser vista durante esse intervalo.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_use_filters(struct qtable_t *qtable, int refresh_seconds) {
+	
+	int i;
+	
+	if(qtable == NULL || refresh_seconds < 0) {
+		ERROR("NULL qtable or refresh_seconds < 0");
+		return -1;
+	}
+	
+	if(refresh_seconds == 0) {
+		// Desactiva e esquece os filtros que tinhamos
+		if(qtable->filters) {
+			for(i = 0; i < qtable->numServers; i++) {
+				bloom_destroy(qtable->filters[i]);
+			}
+			free(qtable->filters);
+			qtable->filters = NULL;
+		}
+	} else if(!qtable->filters &&
+			  !(qtable->filters = (struct bloom_t **) calloc(qtable->numServers, sizeof(struct bloom_t *)))) {
+		ERROR("calloc filters");
+		return -1;
+	}
+	qtable->filterRefresh = refresh_seconds;
+	qtable->filterTime = 0;
+	return 0;
+	
+}
+
+/*
+ * Pede a todos os servidores o seu filtro de chaves e guarda os recebidos.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int qtable_refresh_filters(struct qtable_t *qtable) {
+	
+	int i;
+	struct quorum_op_t op, **ret;
+	
+	op.id = 0;
+	op.sender = 0;
+	op.opcode = OP_RT_FILTER;
+	op.content.result = 0;
+	
+	if((ret = quorum_access(&op, qtable->numServers/2 + 1)) == NULL) {
+		ERROR("quorum_access OP_RT_FILTER");
+		return -1;
+	}
+	
+	// Um servidor que não respondeu fica sem filtro (pode ter qualquer chave)
+	for(i = 0; i < qtable->numServers; i++) {
+		bloom_destroy(qtable->filters[i]);
+		qtable->filters[i] = NULL;
+		if(ret[i] && ret[i]->content.value) {
+			qtable->filters[i] = bloom_from_data(ret[i]->content.value);
+			data_destroy(ret[i]->content.value);
+		}
+	}
+	qtable_free_quorum_op_t(ret, qtable->numServers);
+	free(ret);
+	qtable->filterTime = time(NULL);
+	return 0;
+	
+}
+
+/*
+ * Retorna 1 se os filtros de uma maioria dos servidores garantem que key
+ * não existe, e 0 caso contrário (ou se os filtros não estiverem activos).
+ */
+int qtable_filters_exclude(struct qtable_t *qtable, char *key) {
+	
+	int i, absent = 0, targetBuffer[qtable->numServers], quorum, *targets;
+	
+	if(!qtable->filters || qtable->filterRefresh <= 0) {
+		return 0;
+	}
+	// No modo particionado só contam os servidores da chave
+	targets = qtable_key_servers(qtable, key, targetBuffer, &quorum);
+	if(time(NULL) - qtable->filterTime >= qtable->filterRefresh &&
+	   qtable_refresh_filters(qtable) != 0) {
+		return 0;
+	}
+	for(i = 0; i < qtable->numServers; i++) {
+		if((!targets || targets[i]) && qtable->filters[i] && !bloom_may_contain(qtable->filters[i], key)) {
+			absent++;
+		}
+	}
+	return absent >= quorum;
+	
+}
+
 void qtable_free_quorum_op_t(struct quorum_op_t **ret, int n) {
 	
     if(ret) {
@@ -763,6 +1053,389 @@ void qtable_free_quorum_op_t(struct quorum_op_t **ret, int n) {
 	
 }
 
+/*
+ * Escolhe entre escritas numa só ronda, com o relógio híbrido (strict = 0),
+ * e escritas em duas rondas, depois de ler os timestamps (strict = 1).
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_set_strict(struct qtable_t *qtable, int strict) {
+	
+	if(qtable == NULL) {
+		ERROR("NULL qtable");
+		return -1;
+	}
+	qtable->strict = strict ? 1 : 0;
+	return 0;
+	
+}
+
+/*
+ * Avança o relógio híbrido e devolve o timestamp de uma escrita (ver
+ * quorum_table-private.h). Vários fios podem usá-lo ao mesmo tempo.
+ */
+long qtable_clock(struct qtable_t *qtable) {
+	
+	struct timeval now;
+	long physical, last, next;
+	
+	gettimeofday(&now, NULL);
+	physical = (now.tv_sec * 1000L + now.tv_usec / 1000L) << QTABLE_HLC_LOGICAL_BITS;
+	last = __atomic_load_n(&qtable->clock, __ATOMIC_RELAXED);
+	do {
+		// Se o tempo físico não avançou (ou o relógio já viu um maior)
+		// conta mais um tique lógico
+		next = last + 1 > physical ? last + 1 : physical;
+	} while(!__atomic_compare_exchange_n(&qtable->clock, &last, next, 0,
+										 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return next * 1000 + qtable->id;
+	
+}
+
+/*
+ * Leva o relógio híbrido até ao timestamp lido timestamp, se este estiver à
+ * frente (e.g. escrito por um cliente com o relógio adiantado).
+ */
+void qtable_clock_observe(struct qtable_t *qtable, long timestamp) {
+	
+	long seen = timestamp / 1000,
+	last = __atomic_load_n(&qtable->clock, __ATOMIC_RELAXED);
+	
+	while(seen > last && !__atomic_compare_exchange_n(&qtable->clock, &last, seen, 0,
+													  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	
+}
+
+/*
+ * Activa ou desactiva as leituras por resumo (ver quorum_table.h).
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_use_digest_reads(struct qtable_t *qtable, int digest) {
+	
+	if(qtable == NULL) {
+		ERROR("NULL qtable");
+		return -1;
+	}
+	qtable->digestReads = digest ? 1 : 0;
+	return 0;
+	
+}
+
+/*
+ * Passa a qtable ao modo particionado, com replicas servidores por chave,
+ * ou (com 0) à replicação total (ver quorum_table.h).
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_set_replicas(struct qtable_t *qtable, int replicas) {
+	
+	struct hring_t *ring = NULL;
+	
+	if(qtable == NULL || replicas < 0 || replicas > qtable->numServers) {
+		ERROR("NULL qtable or invalid replicas");
+		return -1;
+	}
+	if(qtable->async) {
+		ERROR("qtable_set_replicas depois das operações assíncronas");
+		return -1;
+	}
+	if(replicas > 0 && replicas < qtable->numServers &&
+	   (ring = hring_create((const char **) qtable->serversAdrress, qtable->numServers, HRING_VNODES)) == NULL) {
+		ERROR("hring_create");
+		return -1;
+	}
+	hring_destroy(qtable->ring);
+	qtable->ring = ring;
+	qtable->replicas = ring ? replicas : 0;
+	return 0;
+	
+}
+
+/*
+ * Passa a guardar em dir as pistas das escritas que um servidor falhou, e
+ * a entregá-las quando ele volta (ver quorum_table.h).
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_use_hints(struct qtable_t *qtable, const char *dir) {
+	
+	struct hhandoff_t *hints;
+	
+	if(qtable == NULL || dir == NULL) {
+		ERROR("NULL qtable or NULL dir");
+		return -1;
+	}
+	if(qtable->hints) {
+		ERROR("qtable_use_hints: already called");
+		return -1;
+	}
+	if((hints = hhandoff_open(dir, qtable->serversAdrress, qtable->numServers)) == NULL) {
+		ERROR("hhandoff_open");
+		return -1;
+	}
+	qtable->hints = hints;
+	return quorum_access_use_hints(hints);
+	
+}
+
+/*
+ * Servidores responsáveis por key (ver quorum_table-private.h).
+ */
+int *qtable_key_servers(struct qtable_t *qtable, char *key, int *targets, int *quorum) {
+	
+	int count;
+	
+	if(qtable->ring && (count = hring_replicas(qtable->ring, key, qtable->replicas, targets)) > 0) {
+		*quorum = count/2 + 1;
+		return targets;
+	}
+	*quorum = qtable->numServers/2 + 1;
+	return NULL;
+	
+}
+
+/*
+ * Leitura por resumo de key (ver quorum_table-private.h).
+ * Retorna 0, com o valor em *value, ou -1 (leitura completa necessária).
+ */
+int qtable_get_digest(struct qtable_t *qtable, char *key, struct data_t **value) {
+	
+	int i, agree = 1, targetBuffer[qtable->numServers], quorum, *targets;
+	struct quorum_op_t op, **ret;
+	struct data_t *expected, *digest;
+	
+	targets = qtable_key_servers(qtable, key, targetBuffer, &quorum);
+	op.id = 0;
+	op.opcode = QA_GET_DIGEST;
+	op.sender = quorum_access_fastest(targets);
+	op.content.key = key; // quorum_access() copia-a para cada servidor
+	if((ret = quorum_access_to(&op, targets, quorum)) == NULL) {
+		return -1;
+	}
+	
+	// A maioria tem de incluir o valor e os resumos dos restantes têm de
+	// ser iguais ao dele (mesmo timestamp, mesmo conteúdo)
+	if(ret[op.sender] == NULL || (expected = data_create_digest(ret[op.sender]->content.value)) == NULL) {
+		agree = 0;
+		expected = NULL;
+	}
+	for(i = 0; agree && i < qtable->numServers; i++) {
+		if(ret[i] && i != op.sender) {
+			digest = ret[i]->content.value;
+			agree = digest->timestamp == expected->timestamp && digest->datasize == expected->datasize &&
+			memcmp(digest->data, expected->data, DATA_DIGEST_SIZE) == 0;
+		}
+	}
+	data_destroy(expected);
+	
+	if(agree) {
+		// Como em qtable_get(): "0" (1 byte) marca uma chave inexistente
+		*value = ret[op.sender]->content.value;
+		ret[op.sender]->content.value = NULL;
+		qtable_clock_observe(qtable, (*value)->timestamp);
+		if((*value)->datasize == 1) {
+			data_destroy(*value);
+			*value = NULL;
+		}
+	}
+	for(i = 0; i < qtable->numServers; i++) {
+		if(ret[i]) {
+			data_destroy(ret[i]->content.value);
+		}
+	}
+	qtable_free_quorum_op_t(ret, qtable->numServers);
+	free(ret);
+	return agree ? 0 : -1;
+	
+}
+
+/*
+ * Agenda a reparação dos servidores que responderam a uma leitura de key
+ * com um valor mais antigo que value (ver quorum_table-private.h).
+ */
+void qtable_repair_stale(struct qtable_t *qtable, char *key, struct data_t *value,
+						 struct quorum_op_t **ret) {
+	
+	int i, numStale = 0, *stale;
+	struct entry_t latest, *entry;
+	
+	for(i = 0; i < qtable->numServers; i++) {
+		if(ret[i] && ret[i]->content.value->timestamp < value->timestamp) {
+			numStale ++;
+		}
+	}
+	if(numStale == 0) {
+		return;
+	}
+	if((stale = (int *) calloc(qtable->numServers, sizeof(int))) == NULL) {
+		ERROR("calloc stale");
+		return;
+	}
+	for(i = 0; i < qtable->numServers; i++) {
+		stale[i] = ret[i] && ret[i]->content.value->timestamp < value->timestamp;
+	}
+	latest.key = key;
+	latest.value = value;
+	if((entry = entry_dup(&latest)) == NULL) {
+		ERROR("entry_dup");
+		free(stale);
+		return;
+	}
+	qtable_repair_enqueue(qtable, entry, stale);
+	
+}
+
+/*
+ * Junta a reparação de entry nos servidores stale à fila, juntando-a à da
+ * mesma chave se já lá estiver.
+ * Retorna 0 (ok) ou -1 (fila cheia ou erro).
+ */
+int qtable_repair_enqueue(struct qtable_t *qtable, struct entry_t *entry, int *stale) {
+	
+	int i;
+	struct qrepair_t *repair;
+	struct entry_t *older;
+	
+	pthread_mutex_lock(&qtable->repairLock);
+	for(repair = qtable->repairs; repair; repair = repair->next) {
+		if(strcmp(repair->entry->key, entry->key) == 0) {
+			break;
+		}
+	}
+	if(repair) {
+		// Um servidor atrás do valor mais antigo também está atrás do mais
+		// recente (e o put-if-newer nunca desfaz uma escrita mais nova)
+		for(i = 0; i < qtable->numServers; i++) {
+			repair->stale[i] |= stale[i];
+		}
+		older = entry;
+		if(entry->value->timestamp > repair->entry->value->timestamp) {
+			older = repair->entry;
+			repair->entry = entry;
+		}
+		pthread_mutex_unlock(&qtable->repairLock);
+		entry_destroy(older);
+		free(stale);
+		return 0;
+	}
+	if(qtable->numRepairs >= QTABLE_REPAIR_MAX ||
+	   (repair = (struct qrepair_t *) malloc(sizeof(struct qrepair_t))) == NULL) {
+		pthread_mutex_unlock(&qtable->repairLock);
+		LOG_WARN("quorum_table: reparação de %s descartada", entry->key);
+		entry_destroy(entry);
+		free(stale);
+		return -1;
+	}
+	repair->entry = entry;
+	repair->stale = stale;
+	repair->next = qtable->repairs;
+	qtable->repairs = repair;
+	qtable->numRepairs ++;
+	pthread_cond_signal(&qtable->repairReady);
+	pthread_mutex_unlock(&qtable->repairLock);
+	return 0;
+	
+}
+
+/*
+ * Envia as reparações repairs em lotes (uma mensagem OP_RT_PUT com
+ * CT_ENTRIES por servidor) e liberta-as.
+ */
+void qtable_repair_flush(struct qtable_t *qtable, struct qrepair_t *repairs) {
+	
+	int i, count, targets, *stale;
+	struct entry_t *batch[QTABLE_REPAIR_BATCH + 1];
+	struct qrepair_t *repair, **link, *sent;
+	struct quorum_op_t op, **ret;
+	
+	while(repairs) {
+		// O lote leva as reparações que vão para os mesmos servidores que a
+		// primeira (são estas que têm o valor mais antigo)
+		stale = repairs->stale;
+		sent = NULL;
+		count = 0;
+		for(link = &repairs; *link && count < QTABLE_REPAIR_BATCH; ) {
+			repair = *link;
+			if(memcmp(repair->stale, stale, sizeof(int) * qtable->numServers) == 0) {
+				batch[count++] = repair->entry;
+				*link = repair->next;
+				repair->next = sent;
+				sent = repair;
+			} else {
+				link = &repair->next;
+			}
+		}
+		batch[count] = NULL;
+		for(i = 0, targets = 0; i < qtable->numServers; i++) {
+			targets += stale[i];
+		}
+		
+		op.id = 0;
+		op.sender = 0;
+		op.opcode = QA_PUT_ENTRIES;
+		op.content.entries = batch;
+		if((ret = quorum_access_to(&op, stale, targets)) == NULL) {
+			// A próxima leitura que encontre a divergência volta a agendá-la
+			LOG_WARN("quorum_table: %d reparações por confirmar", count);
+		} else {
+			qtable_free_quorum_op_t(ret, qtable->numServers);
+			free(ret);
+		}
+		
+		while(sent) {
+			repair = sent;
+			sent = sent->next;
+			entry_destroy(repair->entry);
+			free(repair->stale);
+			free(repair);
+		}
+	}
+	
+}
+
+/*
+ * Fio das reparações: envia as que as leituras agendam até repairStop, e
+ * as que ainda faltarem nessa altura.
+ */
+void *qtable_repair_run(void *arg) {
+	
+	struct qtable_t *qtable = (struct qtable_t *) arg;
+	struct qrepair_t *repairs;
+	
+	pthread_mutex_lock(&qtable->repairLock);
+	while(1) {
+		while(qtable->repairs == NULL && !qtable->repairStop) {
+			pthread_cond_wait(&qtable->repairReady, &qtable->repairLock);
+		}
+		if(qtable->repairs == NULL) {
+			break;
+		}
+		// Leva a fila toda: as leituras continuam a agendar enquanto se envia
+		repairs = qtable->repairs;
+		qtable->repairs = NULL;
+		qtable->numRepairs = 0;
+		pthread_mutex_unlock(&qtable->repairLock);
+		qtable_repair_flush(qtable, repairs);
+		pthread_mutex_lock(&qtable->repairLock);
+	}
+	pthread_mutex_unlock(&qtable->repairLock);
+	return NULL;
+	
+}
+
+/*
+ * Leva o relógio híbrido até aos timestamps que ficaram nos servidores
+ * (respostas de QA_PUT_IF_NEWER em ret).
+ */
+void qtable_observe_winners(struct qtable_t *qtable, struct quorum_op_t **ret) {
+	
+	int i;
+	
+	for(i = 0; i < qtable->numServers; i++) {
+		if(ret[i]) {
+			qtable_clock_observe(qtable, ret[i]->content.timestamp);
+		}
+	}
+	
+}
+
 long update_timestamp(long ts, int id) {
 	
     long timestamp = (long) (ts / 1000);
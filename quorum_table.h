@@ -4,6 +4,14 @@
 #include "data.h"
 
 struct qtable_t; /* A definir pelo grupo em quorum_table-private.h */
+struct qfuture_t; /* Definida em quorum_async-private.h */
+
+/*
+ * Função chamada quando termina uma operação assíncrona, com o ctx dado ao
+ * pedi-la. Corre no fio que executa as operações assíncronas, pelo que não
+ * deve bloquear (nem esperar por outra future); pode pedir novas operações.
+ */
+typedef void (*qtable_callback_f)(struct qfuture_t *future, void *ctx);
 
 /*
  * Função para estabelecer uma associação com uma tabela e um array de n
@@ -29,6 +37,14 @@ int qtable_disconnect(struct qtable_t *qtable);
  */
 int qtable_put(struct qtable_t *qtable, char *key, struct data_t *data);
 
+/*
+ * Como qtable_put(), mas a entrada expira (é removida pelos servidores)
+ * ttl_seconds segundos depois da escrita. Os relógios dos servidores devem
+ * estar sincronizados, pois o prazo é enviado como um instante absoluto.
+ * Devolve 0 (ok) ou -1 (problemas).
+ */
+int qtable_put_ttl(struct qtable_t *qtable, char *key, struct data_t *data, int ttl_seconds);
+
 /*
  * Função para obter um elemento da tabela.
  * Em caso de erro ou elemento não existente, devolve NULL.
@@ -57,5 +73,108 @@ char **qtable_get_keys(struct qtable_t *rtable);
  */
 void qtable_free_keys(char **keys);
 
+/*
+ * Activa (refresh_seconds > 0) ou desactiva (0) o uso dos filtros de chaves
+ * dos servidores: um qtable_get() de uma chave que os filtros de uma maioria
+ * dizem não existir devolve NULL sem contactar os servidores. Os filtros são
+ * pedidos de novo a cada refresh_seconds, pelo que uma chave escrita por
+ * outro cliente pode não ser vista durante esse intervalo.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_use_filters(struct qtable_t *qtable, int refresh_seconds);
+
+/*
+ * Escolhe como são feitas as escritas (put e del). Por omissão (strict = 0)
+ * o timestamp é gerado pelo relógio híbrido do cliente (tempo físico,
+ * contador lógico e id) e a escrita é uma só ronda de quorum; os servidores
+ * ficam com a escrita de maior timestamp. Com strict = 1 cada escrita lê
+ * primeiro o maior timestamp de uma maioria (OP_RT_GETTS) e só depois
+ * escreve, o que não depende dos relógios dos clientes.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_set_strict(struct qtable_t *qtable, int strict);
+
+/*
+ * Activa (digest = 1) ou desactiva (0) as leituras por resumo: um
+ * qtable_get() pede o valor só ao servidor que tem respondido mais depressa
+ * e, aos restantes, o timestamp e um hash do valor. Se a maioria concordar
+ * o valor é devolvido; senão é feita a leitura completa (com reparação).
+ * Poupa a largura de banda de ler valores grandes de todos os servidores.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_use_digest_reads(struct qtable_t *qtable, int digest);
+
+/*
+ * Reparte as chaves pelos servidores (modo particionado): com 0 < replicas
+ * < n, um anel de hashing consistente (HRING_VNODES nós virtuais por
+ * servidor, posicionados pelos endereços) atribui cada chave a replicas dos
+ * n servidores, e as operações sobre uma chave só contactam esses, com
+ * quorum replicas/2 + 1. A capacidade e o débito crescem assim com o número
+ * de servidores. Com replicas = 0 (ou n) cada servidor volta a ter todas as
+ * chaves. Todos os clientes devem usar os mesmos endereços e o mesmo
+ * replicas, e a função deve ser chamada antes da primeira operação.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_set_replicas(struct qtable_t *qtable, int replicas);
+
+/*
+ * Activa as pistas (hinted handoff): uma escrita que um servidor falha (ou
+ * que não lhe chega a ser enviada) enquanto a maioria a aceita fica num
+ * ficheiro só de acrescento desse servidor na directoria dir (criada se não
+ * existir), e é-lhe entregue em lotes, como put-if-newer, quando a ligação
+ * volta; sem pistas essa escrita só chega ao servidor quando uma leitura a
+ * reparar. As pistas por entregar ao desligar ficam nos ficheiros e são
+ * entregues na próxima vez que a mesma directoria for usada, pelo que cada
+ * cliente deve ter a sua. As escritas assíncronas não deixam pistas.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int qtable_use_hints(struct qtable_t *qtable, const char *dir);
+
+/*
+ * Versões assíncronas de qtable_get(), qtable_put() e qtable_del(): retornam
+ * logo uma future, que termina quando uma maioria dos servidores responder
+ * a cada fase da operação (ou com erro, ao fim de NETWORK_TIMEOUT ms). Um só
+ * fio pode assim ter milhares de operações em curso. callback (se não for
+ * NULL) é chamada quando a operação termina, possivelmente antes de a
+ * função retornar. Os dados de qtable_put_async() são copiados.
+ * Retornam NULL em caso de erro.
+ */
+struct qfuture_t *qtable_get_async(struct qtable_t *qtable, char *key, qtable_callback_f callback, void *ctx);
+struct qfuture_t *qtable_put_async(struct qtable_t *qtable, char *key, struct data_t *data,
+                                   qtable_callback_f callback, void *ctx);
+struct qfuture_t *qtable_del_async(struct qtable_t *qtable, char *key, qtable_callback_f callback, void *ctx);
+
+/*
+ * Retorna 1 se a operação da future já terminou e 0 caso contrário.
+ */
+int qfuture_poll(struct qfuture_t *future);
+
+/*
+ * Espera até timeout_ms milissegundos (para sempre, se for negativo) que a
+ * operação da future termine.
+ * Retorna 0 (terminou) ou -1 (ainda não terminou, ou erro).
+ */
+int qfuture_wait(struct qfuture_t *future, int timeout_ms);
+
+/*
+ * Retorna o resultado da operação da future: 0 (ok) ou -1 (erro, ou ainda
+ * não terminou).
+ */
+int qfuture_result(struct qfuture_t *future);
+
+/*
+ * Retira da future o valor obtido por um qtable_get_async() terminado, a
+ * libertar com data_destroy().
+ * Retorna NULL se a chave não existe, em caso de erro ou se o valor já foi
+ * retirado.
+ */
+struct data_t *qfuture_value(struct qfuture_t *future);
+
+/*
+ * Liberta a future. Uma operação ainda a decorrer não é cancelada (e o
+ * callback ainda é chamado). As futures sobrevivem a qtable_disconnect().
+ */
+void qfuture_destroy(struct qfuture_t *future);
+
 #endif
 
@@ -10,17 +10,28 @@
 #define _REMOTE_TABLE_PRIVATE_H
 
 
+/* Transportes de uma tabela remota (escolhidos pelo endereço) */
+#define RTABLE_TCP 0  /* <hostname>:<port> */
+#define RTABLE_UNIX 1 /* unix:<caminho> */
+#define RTABLE_SHM 2  /* shm:<caminho> */
+
+struct npool_t; /* Definida em network_client-private.h */
+
 /*
  * Define a estrutura de uma tabela remota.
  *
- * int socket => o descritor do socket
- * char *ip => apontador para o ip (string)
- * char *porto => apontador para o porto (string)
+ * char *ip => apontador para o ip (string), ou o caminho do socket Unix
+ * char *porto => apontador para o porto (string), NULL fora de TCP
+ * int transport => RTABLE_TCP, RTABLE_UNIX ou RTABLE_SHM
+ * int timeout => prazo de cada pedido, em milissegundos
+ * struct npool_t *pool => as ligações ao servidor (NULL antes de rtable_connect)
  */
 struct rtable_t {
-	int socket;
 	char *ip;
 	char *porto;
+	int transport;
+	int timeout;
+	struct npool_t *pool;
 };
 
 #endif
\ No newline at end of file
@@ -25,10 +25,13 @@
 #include "network_client.h"
 #include "network_client-private.h"
 #include "table.h"
+#include "merkle.h"
 
 /*
  * Função para estabelecer uma associação com uma tabela num servidor.
- * address_port é uma string no formato <hostname>:<port>.
+ * address_port é uma string no formato <hostname>:<port> (TCP),
+ * unix:<caminho> (socket Unix) ou shm:<caminho> (memória partilhada, pedida
+ * pelo socket Unix), os dois últimos para servidores na mesma máquina.
  * Retorna NULL em caso de erro.
  */
 struct rtable_t *rtable_open(const char *address_port) {
@@ -39,35 +42,39 @@ struct rtable_t *rtable_open(const char *address_port) {
         return NULL;
     }
 
-    char *host;                     //IP ou nome da máquina
-    char *port;                     //porto
-    char *endereco;                 //uma cópia do endereço
+    char *host;                     //IP, nome da máquina ou caminho
+    char *port = NULL;              //porto (só em TCP)
+    char *separator;                //o ':' entre o host e o porto
+    int transport = RTABLE_TCP;     //o transporte indicado pelo endereço
     struct rtable_t * remoteTable;  //a tabela remota
 
-    //copia o endereço para uma variável temporária
-    if((endereco = strdup(address_port)) == NULL) {
-        ERROR("remote_table: strdup address_port");
-        return NULL;
+    //os endereços locais levam o caminho do socket Unix
+    if(strncmp(address_port, "unix:", 5) == 0) {
+        transport = RTABLE_UNIX;
+        host = strdup(address_port + 5);
     }
-
-    //guarda o endereço da máquina
-    if((host = strdup((char *) strtok(endereco, ":"))) == NULL) {
-        ERROR("remote_table: strdup host");
-        free(endereco);
-        return NULL;
+    else if(strncmp(address_port, "shm:", 4) == 0) {
+        transport = RTABLE_SHM;
+        host = strdup(address_port + 4);
     }
-
-    //guarda o porto da máquina
-    char *tempString;
-    if((tempString = strtok(NULL, ":")) == NULL) {
-        ERROR("remote_table: strtok port");
-        return NULL;
+    else {
+        //guarda o endereço e o porto da máquina (sem strtok, que não pode
+        //ser usado por vários fios ao mesmo tempo)
+        if((separator = strchr(address_port, ':')) == NULL || separator[1] == '\0') {
+            ERROR("remote_table: no port");
+            return NULL;
+        }
+        host = strndup(address_port, separator - address_port);
+        if((port = strdup(separator + 1)) == NULL) {
+            ERROR("remote_table: strdup port");
+            free(host);
+            return NULL;
+        }
     }
-
-    if((port = strdup(tempString)) == NULL) {
-        ERROR("remote_table: strdup port");
+    if(host == NULL || host[0] == '\0') {
+        ERROR("remote_table: strdup host");
         free(host);
-        free(endereco);
+        free(port);
         return NULL;
     }
 
@@ -76,15 +83,15 @@ struct rtable_t *rtable_open(const char *address_port) {
         ERROR("remote_table: malloc remoteTable");
         free(host);
         free(port);
-        free(endereco);
         return NULL;
     }
 
     //guarda o ip e o porto
     remoteTable->ip = host;
     remoteTable->porto = port;
-
-    free(endereco);
+    remoteTable->transport = transport;
+    remoteTable->timeout = NETWORK_TIMEOUT;
+    remoteTable->pool = NULL;
 
     //em caso de sucesso
     return remoteTable;
@@ -95,6 +102,31 @@ int rtable_connect(struct rtable_t *table) {
 	return network_connect(table);
 }
 
+/*
+ * Define o prazo (em milissegundos) de cada pedido à tabela remota: sem
+ * resposta nesse tempo o pedido falha.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int rtable_set_timeout(struct rtable_t *table, int timeout) {
+
+    if(table == NULL || timeout <= 0) {
+        ERROR("remote_table: invalid timeout");
+        return -1;
+    }
+    table->timeout = timeout;
+    return 0;
+
+}
+
+/*
+ * Indica se o servidor da tabela remota está disponível (tem uma ligação
+ * aberta, ou não falhou há pouco tempo).
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int rtable_available(struct rtable_t *table) {
+	return network_available(table);
+}
+
 
 /*
  * Fecha a ligação com o servidor, desaloca toda a memória local.
@@ -164,6 +196,93 @@ int rtable_put(struct rtable_t *table, struct entry_t *entry) {
 
 }
 
+/*
+ * Como rtable_put(), mas o servidor só escreve a entrada se o seu timestamp
+ * não for menor que o do valor guardado (put-if-newer).
+ * Devolve o timestamp que ficou guardado no servidor (o da entrada ou um
+ * maior) ou -1 (erro).
+ */
+long rtable_put_if_newer(struct rtable_t *table, struct entry_t *entry) {
+
+    long winner;
+
+    //verifica se table ou entry apontam para NULL
+    if(table == NULL || entry == NULL) {
+        ERROR("remote_table: NULL table or entry");
+        return -1;
+    }
+
+    //preenche os campos da mensagem
+    struct message_t msg;
+    msg.opcode = OP_RT_PUT;
+    msg.c_type = CT_NEWER;
+    msg.content.entry = entry;
+
+    //envia a mensagem e recebe a resposta
+    struct message_t *rsp;
+    if((rsp = network_send_receive(table, &msg)) == NULL) {
+        ERROR("remote_table: network_send_receive");
+        entry_destroy(entry);
+        return -1;
+    }
+
+    //verifica se a resposta é válida
+    if(rsp->opcode != (OP_RT_PUT + 1) || rsp->c_type != CT_TIMESTAMP) {
+        ERROR("remote_table: invalid message");
+        entry_destroy(entry);
+        free_message(rsp);
+        return -1;
+    }
+
+    //em caso de sucesso
+    winner = rsp->content.timestamp;
+    free_message(rsp);
+	entry_destroy(entry);
+    return winner;
+
+}
+
+/*
+ * Envia o lote entries numa só mensagem (cada entrada é um put-if-newer).
+ * Devolve quantas entradas ficaram guardadas no servidor ou -1 (erro).
+ */
+int rtable_put_entries(struct rtable_t *table, struct entry_t **entries) {
+
+    int written;
+
+    //verifica se table ou entries apontam para NULL
+    if(table == NULL || entries == NULL) {
+        ERROR("remote_table: NULL table or entries");
+        return -1;
+    }
+
+    //preenche os campos da mensagem
+    struct message_t msg;
+    msg.opcode = OP_RT_PUT;
+    msg.c_type = CT_ENTRIES;
+    msg.content.entries = entries;
+
+    //envia a mensagem e recebe a resposta
+    struct message_t *rsp;
+    if((rsp = network_send_receive(table, &msg)) == NULL) {
+        ERROR("remote_table: network_send_receive");
+        return -1;
+    }
+
+    //verifica se a resposta é válida
+    if(rsp->opcode != (OP_RT_PUT + 1) || rsp->c_type != CT_RESULT) {
+        ERROR("remote_table: invalid message");
+        free_message(rsp);
+        return -1;
+    }
+
+    //em caso de sucesso
+    written = rsp->content.result;
+    free_message(rsp);
+    return written;
+
+}
+
 /*
  * Função para obter um elemento da tabela.
  * Em caso de erro, devolve NULL.
@@ -213,6 +332,47 @@ struct data_t *rtable_get(struct rtable_t *table, char *key) {
 
 }
 
+/*
+ * Função para obter só o resumo do valor de key (ver data_create_digest()):
+ * o timestamp e um hash do conteúdo, em vez do conteúdo.
+ * Em caso de erro, devolve NULL.
+ */
+struct data_t *rtable_get_digest(struct rtable_t *table, char *key) {
+
+    //verifica se table ou key apontam para NULL
+    if(table == NULL || key == NULL) {
+        ERROR("remote_table: NULL table or key");
+        return NULL;
+    }
+
+    //preenche os campos da mensagem
+    struct message_t msg;
+    msg.opcode = OP_RT_DIGEST;
+    msg.c_type = CT_KEY;
+    msg.content.key = key;
+
+    //envia a mensagem e recebe a resposta
+    struct message_t *rsp;
+    if((rsp = network_send_receive(table, &msg)) == NULL) {
+        ERROR("remote_table: network_send_receive");
+        return NULL;
+    }
+
+    //verifica se a resposta é válida
+    if(rsp->opcode != (OP_RT_DIGEST + 1) || rsp->c_type != CT_VALUE || rsp->content.value == NULL) {
+        ERROR("remote_table: invalid message");
+        free_message(rsp);
+        return NULL;
+    }
+
+    //a resposta passa a ser de quem pediu
+    struct data_t *digest = rsp->content.value;
+    rsp->content.value = NULL;
+    free_message(rsp);
+    return digest;
+
+}
+
 /*
  * Função para remover um elemento da tabela. Vai desalocar
  * toda a memória alocada na respectiva operação rtable_put()
@@ -400,4 +560,131 @@ long rtable_get_ts(struct rtable_t *table, char *key) {
     free_message(rsp);
     return ts;
 
-}
\ No newline at end of file
+}
+
+/*
+ * Função para obter o filtro de bloom das chaves da tabela, serializado com
+ * bloom_to_data(). Em caso de erro devolve NULL.
+ */
+struct data_t *rtable_get_filter(struct rtable_t *table) {
+
+    // Verifica os parâmetros
+    if(table == NULL) {
+        ERROR("NULL table");
+        return NULL;
+    }
+
+    // Preenche os campos da mensagem
+    struct message_t msg;
+    msg.opcode = OP_RT_FILTER;
+    msg.c_type = CT_RESULT;
+    msg.content.result = 0;
+
+    // Envia a mensagem e recebe a resposta
+    struct message_t *rsp;
+    if((rsp = network_send_receive(table, &msg)) == NULL) {
+        ERROR("network_send_receive");
+        return NULL;
+    }
+
+    // Verifica se a resposta é válida
+    if(rsp->opcode != (OP_RT_FILTER + 1) || rsp->c_type != CT_VALUE) {
+        free_message(rsp);
+        return NULL;
+    }
+
+    // Em caso de sucesso ficamos com o valor da resposta
+    struct data_t *filter = rsp->content.value;
+    rsp->content.value = NULL;
+    free_message(rsp);
+    return filter;
+
+}
+
+/*
+ * Pede ao servidor o nó node da vista view da árvore de Merkle: num nó
+ * interno a resposta traz os hashes dos descendentes (CT_VALUE), numa folha
+ * as suas entradas (CT_ENTRIES).
+ * Devolve a resposta ou NULL em caso de erro.
+ */
+static struct message_t *rtable_merkle_request(struct rtable_t *table, int view, int node, short c_type) {
+
+    // Verifica os parâmetros
+    if(table == NULL) {
+        ERROR("NULL table");
+        return NULL;
+    }
+
+    // Preenche os campos da mensagem
+    struct message_t msg;
+    msg.opcode = OP_RT_MERKLE;
+    msg.c_type = CT_RESULT;
+    msg.content.result = MERKLE_REQUEST(view, node);
+
+    // Envia a mensagem e recebe a resposta
+    struct message_t *rsp;
+    if((rsp = network_send_receive(table, &msg)) == NULL) {
+        ERROR("network_send_receive");
+        return NULL;
+    }
+
+    // Verifica se a resposta é válida
+    if(rsp->opcode != (OP_RT_MERKLE + 1) || rsp->c_type != c_type) {
+        free_message(rsp);
+        return NULL;
+    }
+    return rsp;
+
+}
+
+/*
+ * Função para obter os hashes dos descendentes do nó node da vista view da
+ * árvore de Merkle da tabela. Em caso de erro devolve NULL.
+ */
+struct data_t *rtable_get_merkle(struct rtable_t *table, int view, int node) {
+
+    struct message_t *rsp;
+    struct data_t *hashes;
+
+    if((rsp = rtable_merkle_request(table, view, node, CT_VALUE)) == NULL) {
+        return NULL;
+    }
+    hashes = rsp->content.value;
+    rsp->content.value = NULL;
+    free_message(rsp);
+    return hashes;
+
+}
+
+/*
+ * Função para obter as entradas da folha leaf da vista view da árvore de
+ * Merkle da tabela. Em caso de erro devolve NULL.
+ */
+struct entry_t **rtable_get_merkle_entries(struct rtable_t *table, int view, int leaf) {
+
+    struct message_t *rsp;
+    struct entry_t **entries;
+
+    if((rsp = rtable_merkle_request(table, view, leaf, CT_ENTRIES)) == NULL) {
+        return NULL;
+    }
+    entries = rsp->content.entries;
+    rsp->content.entries = NULL;
+    free_message(rsp);
+    return entries;
+
+}
+
+/*
+ * Função para copiar o checkpoint e o log do servidor para ckp_fd e log_fd.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int rtable_sync(struct rtable_t *table, int ckp_fd, int log_fd) {
+
+    if(table == NULL || ckp_fd < 0 || log_fd < 0) {
+        ERROR("NULL table or invalid descriptors");
+        return -1;
+    }
+    return network_sync(table, ckp_fd, log_fd);
+
+}
@@ -7,6 +7,10 @@
 #define OP_RT_SIZE	40
 #define OP_RT_GETKEYS	50
 #define OP_RT_GETTS     60
+#define OP_RT_FILTER    70
+#define OP_RT_DIGEST    80
+#define OP_RT_MERKLE    90
+#define OP_RT_SYNC      95
 /* opcode da resposta a um pedido e igual a op+1 */
 
 #define OP_RT_ERROR     99
@@ -19,12 +23,28 @@ struct rtable_t; /* A definir pelo grupo em rtable-private.h */
 
 /*
  * Função para estabelecer uma associação com uma tabela num servidor.
- * address_port é uma string no formato <hostname>:<port>.
+ * address_port é uma string no formato <hostname>:<port> (TCP),
+ * unix:<caminho> (socket Unix) ou shm:<caminho> (memória partilhada, pedida
+ * pelo socket Unix), os dois últimos para servidores na mesma máquina.
  * Retorna NULL em caso de erro.
  */
 int rtable_connect(struct rtable_t *table);
 struct rtable_t *rtable_open(const char *address_port);
 
+/*
+ * Define o prazo (em milissegundos) de cada pedido à tabela remota: sem
+ * resposta nesse tempo o pedido falha.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int rtable_set_timeout(struct rtable_t *table, int timeout);
+
+/*
+ * Indica se o servidor da tabela remota está disponível (tem uma ligação
+ * aberta, ou não falhou há pouco tempo).
+ * Retorna 1 (sim) ou 0 (não).
+ */
+int rtable_available(struct rtable_t *table);
+
 /* 
  * Fecha a ligação com o servidor, desaloca toda a memória local.
  * Retorna 0 se tudo correr bem e -1 em caso de erro.
@@ -38,12 +58,34 @@ int rtable_disconnect(struct rtable_t *table);
  */
 int rtable_put(struct rtable_t *table, struct entry_t *entry);
 
+/*
+ * Como rtable_put(), mas o servidor só escreve a entrada se o seu timestamp
+ * não for menor que o do valor guardado (put-if-newer).
+ * Devolve o timestamp que ficou guardado no servidor ou -1 (erro).
+ */
+long rtable_put_if_newer(struct rtable_t *table, struct entry_t *entry);
+
+/*
+ * Envia numa só mensagem o lote entries (array terminado em NULL), em que
+ * cada entrada é escrita como em rtable_put_if_newer(). Ao contrário de
+ * rtable_put(), as entradas continuam a ser do chamador.
+ * Devolve quantas entradas ficaram guardadas no servidor ou -1 (erro).
+ */
+int rtable_put_entries(struct rtable_t *table, struct entry_t **entries);
+
 /* 
  * Função para obter um elemento da tabela.
  * Em caso de erro, devolve NULL.
  */
 struct data_t *rtable_get(struct rtable_t *table, char *key);
 
+/*
+ * Função para obter só o resumo do valor de key: um data_t com o timestamp
+ * do valor e um hash do seu conteúdo (ver data_create_digest()).
+ * Em caso de erro, devolve NULL.
+ */
+struct data_t *rtable_get_digest(struct rtable_t *table, char *key);
+
 /* 
  * Função para remover um elemento da tabela. Vai desalocar
  * toda a memória alocada na respectiva operação rtable_put()
@@ -72,4 +114,39 @@ char **rtable_get_keys(struct rtable_t *table);
  */
 long rtable_get_ts(struct rtable_t *table, char *key);
 
+/*
+ * Função para obter o filtro de bloom das chaves da tabela, serializado com
+ * bloom_to_data(). Em caso de erro devolve NULL.
+ */
+struct data_t *rtable_get_filter(struct rtable_t *table);
+
+/*
+ * Função para obter os hashes dos descendentes do nó node da vista view
+ * (MERKLE_ALL ou um servidor, ver merkle_partition()) da árvore de Merkle
+ * da tabela (ver merkle_get_hashes()), usada na anti-entropia entre
+ * servidores. Em caso de erro (e.g. o servidor não mantém a árvore ou a
+ * vista) devolve NULL.
+ */
+struct data_t *rtable_get_merkle(struct rtable_t *table, int view, int node);
+
+/*
+ * Função para obter as entradas da folha leaf da vista view da árvore de
+ * Merkle da tabela (array terminado em NULL, a libertar com
+ * entry_free_list()).
+ * Em caso de erro devolve NULL.
+ */
+struct entry_t **rtable_get_merkle_entries(struct rtable_t *table, int view, int leaf);
+
+/*
+ * Função para copiar o estado do servidor, para um servidor novo (ou que
+ * perdeu os seus ficheiros) arrancar já com os dados: o checkpoint do
+ * servidor é escrito em ckp_fd e o seu log, desde esse checkpoint, em
+ * log_fd. Os ficheiros chegam tal como estão no disco do servidor, sem
+ * passarem pela memória de nenhum dos lados. Usa uma ligação própria (não
+ * precisa de rtable_connect()), com o prazo da tabela entre cada bloco
+ * recebido.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int rtable_sync(struct rtable_t *table, int ckp_fd, int log_fd);
+
 #endif
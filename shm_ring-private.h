@@ -0,0 +1,70 @@
+/*
+ * File:   shm_ring-private.h
+ *
+ * Define a memória partilhada entre um cliente e o servidor na mesma
+ * máquina: um buffer circular de bytes em cada sentido, com um único
+ * produtor e um único consumidor.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _SHM_RING_PRIVATE_H
+#define _SHM_RING_PRIVATE_H
+
+#include <stdint.h>
+
+/* Tamanho de cada buffer circular (potência de 2) */
+#define SHM_RING_SIZE (1024 * 1024)
+
+/* Tamanho de uma linha de cache (para o produtor e o consumidor não partilharem) */
+#define SHM_CACHE_LINE 64
+
+/*
+ * Define um buffer circular de bytes na memória partilhada. head e tail
+ * crescem sempre (o tamanho ocupado é tail - head) e cada um é escrito só
+ * por um dos lados.
+ *
+ * uint32_t head => bytes lidos pelo consumidor
+ * uint32_t tail => bytes escritos pelo produtor
+ * uint32_t sleeping => 1 se o consumidor vai dormir à espera de dados
+ * uint32_t waiting => 1 se o produtor vai dormir à espera de espaço
+ * char data => conteúdo
+ */
+struct shm_ring_t {
+    uint32_t head;
+    char headPad[SHM_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t tail;
+    char tailPad[SHM_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t sleeping;
+    uint32_t waiting;
+    char flagsPad[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+    char data[SHM_RING_SIZE];
+};
+
+/*
+ * Define a zona partilhada (um memfd mapeado pelos dois processos).
+ *
+ * struct shm_ring_t requests => pedidos, do cliente para o servidor
+ * struct shm_ring_t replies => respostas, do servidor para o cliente
+ */
+struct shm_region_t {
+    struct shm_ring_t requests;
+    struct shm_ring_t replies;
+};
+
+/*
+ * Define um canal de memória partilhada, tal como visto por um dos
+ * processos. Cada lado é acordado pelo seu eventfd: o servidor (no epoll)
+ * pelo serverEvent e o cliente pelo clientEvent.
+ *
+ * struct shm_region_t *region => zona partilhada mapeada
+ * int serverEvent => eventfd escrito pelo cliente para acordar o servidor
+ * int clientEvent => eventfd escrito pelo servidor para acordar o cliente
+ */
+struct shm_channel_t {
+    struct shm_region_t *region;
+    int serverEvent;
+    int clientEvent;
+};
+
+#endif
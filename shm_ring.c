@@ -0,0 +1,284 @@
+/*
+ * File:   shm_ring.c
+ *
+ * Transporte em memória partilhada para clientes na mesma máquina que o
+ * servidor: as mensagens (no mesmo formato que no socket) passam por dois
+ * buffers circulares num memfd, e cada lado só entra no kernel para acordar
+ * o outro (eventfd) quando este está a dormir.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#define _GNU_SOURCE /* memfd_create() */
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include "utils.h"
+#include "shm_ring.h"
+#include "shm_ring-private.h"
+
+/*
+ * Cria (do lado do servidor) a zona partilhada num memfd e os dois eventfd
+ * do canal. Em *memfd fica o descritor do memfd, a enviar ao cliente com os
+ * eventfd e a fechar depois.
+ * Retorna NULL em caso de erro.
+ */
+struct shm_channel_t *shm_channel_create(int *memfd) {
+
+    struct shm_channel_t *channel;
+    int fd;
+
+    if((fd = memfd_create("table-shm", MFD_CLOEXEC)) == -1) {
+        LOG_PERROR("memfd_create");
+        return NULL;
+    }
+    if(ftruncate(fd, sizeof(struct shm_region_t)) == -1) {
+        LOG_PERROR("ftruncate shm");
+        close(fd);
+        return NULL;
+    }
+    // O cliente recebe uma cópia do descritor e mapeia a mesma memória
+    if((*memfd = dup(fd)) == -1) {
+        LOG_PERROR("dup memfd");
+        close(fd);
+        return NULL;
+    }
+    if((channel = shm_channel_attach(fd, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                                     eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))) == NULL) {
+        close(*memfd);
+        return NULL;
+    }
+    // O servidor está livre: o primeiro pedido tem de o acordar
+    channel->region->requests.sleeping = 1;
+    return channel;
+
+}
+
+/*
+ * Mapeia (do lado do cliente) a zona partilhada recebida do servidor. O
+ * canal fica dono dos três descritores, mesmo em caso de erro.
+ * Retorna NULL em caso de erro.
+ */
+struct shm_channel_t *shm_channel_attach(int memfd, int serverEvent, int clientEvent) {
+
+    struct shm_channel_t *channel;
+    void *region;
+
+    if(memfd == -1 || serverEvent == -1 || clientEvent == -1) {
+        ERROR("invalid shm descriptors");
+    }
+    else if((region = mmap(NULL, sizeof(struct shm_region_t), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, memfd, 0)) == MAP_FAILED) {
+        LOG_PERROR("mmap shm");
+    }
+    else if((channel = (struct shm_channel_t *) malloc(sizeof(struct shm_channel_t))) == NULL) {
+        ERROR("malloc channel");
+        munmap(region, sizeof(struct shm_region_t));
+    }
+    else {
+        // O mapeamento mantém a memória, o descritor já não é preciso
+        close(memfd);
+        channel->region = (struct shm_region_t *) region;
+        channel->serverEvent = serverEvent;
+        channel->clientEvent = clientEvent;
+        return channel;
+    }
+
+    if(memfd != -1) {
+        close(memfd);
+    }
+    if(serverEvent != -1) {
+        close(serverEvent);
+    }
+    if(clientEvent != -1) {
+        close(clientEvent);
+    }
+    return NULL;
+
+}
+
+/*
+ * Desfaz o mapeamento, fecha os eventfd e liberta o canal.
+ */
+void shm_channel_destroy(struct shm_channel_t *channel) {
+
+    if(channel) {
+        munmap(channel->region, sizeof(struct shm_region_t));
+        close(channel->serverEvent);
+        close(channel->clientEvent);
+        free(channel);
+    }
+
+}
+
+/*
+ * Escreve no buffer até count bytes de src (menos se não houver espaço).
+ * Retorna o número de bytes escritos.
+ */
+int shm_ring_write(struct shm_ring_t *ring, const char *src, int count) {
+
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    int start = tail & (SHM_RING_SIZE - 1), first;
+
+    if(count > (int) (SHM_RING_SIZE - (tail - head))) {
+        count = (int) (SHM_RING_SIZE - (tail - head));
+    }
+    if(count <= 0) {
+        return 0;
+    }
+    first = SHM_RING_SIZE - start;
+    if(first >= count) {
+        memcpy(ring->data + start, src, count);
+    }
+    else {
+        memcpy(ring->data + start, src, first);
+        memcpy(ring->data, src + first, count - first);
+    }
+    __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+    return count;
+
+}
+
+/*
+ * Lê do buffer até count bytes para dest.
+ * Retorna o número de bytes lidos.
+ */
+int shm_ring_read(struct shm_ring_t *ring, char *dest, int count) {
+
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    int start = head & (SHM_RING_SIZE - 1), first;
+
+    if(count > (int) (tail - head)) {
+        count = (int) (tail - head);
+    }
+    if(count <= 0) {
+        return 0;
+    }
+    first = SHM_RING_SIZE - start;
+    if(first >= count) {
+        memcpy(dest, ring->data + start, count);
+    }
+    else {
+        memcpy(dest, ring->data + start, first);
+        memcpy(dest + first, ring->data, count - first);
+    }
+    __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+    return count;
+
+}
+
+/*
+ * Acorda o outro lado do canal.
+ */
+static void shm_event_notify(int event) {
+
+    uint64_t one = 1;
+
+    if(write(event, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        LOG_PERROR("eventfd write");
+    }
+
+}
+
+/*
+ * Chamada pelo produtor depois de escrever: acorda o consumidor (eventfd
+ * event) se ele estiver a dormir.
+ */
+void shm_ring_produced(struct shm_ring_t *ring, int event) {
+
+    // A escrita de tail tem de ser visível antes da leitura de sleeping (e
+    // no consumidor o inverso), senão ambos podiam não ver o outro
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED) &&
+       __atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_ACQ_REL)) {
+        shm_event_notify(event);
+    }
+
+}
+
+/*
+ * Chamada pelo consumidor depois de ler: acorda o produtor (eventfd event)
+ * se ele estiver à espera de espaço.
+ */
+void shm_ring_consumed(struct shm_ring_t *ring, int event) {
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->waiting, __ATOMIC_RELAXED) &&
+       __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_ACQ_REL)) {
+        shm_event_notify(event);
+    }
+
+}
+
+/*
+ * Espera activamente (até spins voltas, e só com mais de um processador)
+ * que haja dados no buffer.
+ * Retorna 1 se há dados ou 0 se não chegaram.
+ */
+int shm_ring_poll(struct shm_ring_t *ring, int spins) {
+
+    static int processors = 0;
+
+    // Com um só processador o outro lado não corre enquanto este espera
+    if(processors == 0) {
+        processors = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if(processors <= 1) {
+        return 0;
+    }
+    while(spins-- > 0) {
+        if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+            return 1;
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * Anuncia que o consumidor vai dormir à espera de dados.
+ * Retorna 1 se pode dormir (o produtor vai acordá-lo) ou 0 se entretanto
+ * chegaram dados.
+ */
+int shm_ring_sleep(struct shm_ring_t *ring) {
+
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+        __atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+
+}
+
+/*
+ * Anuncia que o produtor vai dormir à espera de espaço.
+ * Retorna 1 se pode dormir (o consumidor vai acordá-lo) ou 0 se entretanto
+ * houve espaço.
+ */
+int shm_ring_wait(struct shm_ring_t *ring) {
+
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) < SHM_RING_SIZE) {
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+
+}
+
+/*
+ * Esvazia o eventfd event (não bloqueante).
+ */
+void shm_event_clear(int event) {
+
+    uint64_t count;
+
+    while(read(event, &count, sizeof(count)) > 0);
+
+}
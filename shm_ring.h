@@ -0,0 +1,88 @@
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+/*
+ * Um cabeçalho com tamanho 0, numa ligação por socket Unix, pede a passagem
+ * da ligação para memória partilhada; o servidor responde com o mesmo
+ * cabeçalho e os descritores do canal (SCM_RIGHTS).
+ */
+#define SHM_UPGRADE 0
+
+/* Número de voltas que cada lado espera activamente pelo outro antes de
+ * dormir no eventfd (um pedido ou uma resposta costuma chegar antes) */
+#define SHM_SPIN 20000
+
+struct shm_ring_t; /* Definida em shm_ring-private.h */
+struct shm_channel_t; /* Definida em shm_ring-private.h */
+
+/*
+ * Cria (do lado do servidor) a zona partilhada num memfd e os dois eventfd
+ * do canal. Em *memfd fica o descritor do memfd, a enviar ao cliente com os
+ * eventfd e a fechar depois.
+ * Retorna NULL em caso de erro.
+ */
+struct shm_channel_t *shm_channel_create(int *memfd);
+
+/*
+ * Mapeia (do lado do cliente) a zona partilhada recebida do servidor. O
+ * canal fica dono dos três descritores, mesmo em caso de erro.
+ * Retorna NULL em caso de erro.
+ */
+struct shm_channel_t *shm_channel_attach(int memfd, int serverEvent, int clientEvent);
+
+/*
+ * Desfaz o mapeamento, fecha os eventfd e liberta o canal.
+ */
+void shm_channel_destroy(struct shm_channel_t *channel);
+
+/*
+ * Escreve no buffer até count bytes de src (menos se não houver espaço).
+ * Retorna o número de bytes escritos.
+ */
+int shm_ring_write(struct shm_ring_t *ring, const char *src, int count);
+
+/*
+ * Lê do buffer até count bytes para dest.
+ * Retorna o número de bytes lidos.
+ */
+int shm_ring_read(struct shm_ring_t *ring, char *dest, int count);
+
+/*
+ * Chamada pelo produtor depois de escrever: acorda o consumidor (eventfd
+ * event) se ele estiver a dormir.
+ */
+void shm_ring_produced(struct shm_ring_t *ring, int event);
+
+/*
+ * Chamada pelo consumidor depois de ler: acorda o produtor (eventfd event)
+ * se ele estiver à espera de espaço.
+ */
+void shm_ring_consumed(struct shm_ring_t *ring, int event);
+
+/*
+ * Espera activamente (até spins voltas, e só com mais de um processador)
+ * que haja dados no buffer.
+ * Retorna 1 se há dados ou 0 se não chegaram.
+ */
+int shm_ring_poll(struct shm_ring_t *ring, int spins);
+
+/*
+ * Anuncia que o consumidor vai dormir à espera de dados.
+ * Retorna 1 se pode dormir (o produtor vai acordá-lo) ou 0 se entretanto
+ * chegaram dados.
+ */
+int shm_ring_sleep(struct shm_ring_t *ring);
+
+/*
+ * Anuncia que o produtor vai dormir à espera de espaço.
+ * Retorna 1 se pode dormir (o consumidor vai acordá-lo) ou 0 se entretanto
+ * houve espaço.
+ */
+int shm_ring_wait(struct shm_ring_t *ring);
+
+/*
+ * Esvazia o eventfd event (não bloqueante).
+ */
+void shm_event_clear(int event);
+
+#endif
@@ -10,6 +10,14 @@
 #define _TABLE_PRIVATE_H
 
 #include "list-private.h"
+#include "bloom.h"
+#include "merkle.h"
+
+/* Dimensão mínima (em chaves) do filtro de bloom de uma tabela. */
+#define TABLE_FILTER_MIN_KEYS 64
+
+/* Memória ocupada por uma entrada além da chave e dos dados. */
+#define TABLE_ENTRY_OVERHEAD (sizeof(struct node_t) + sizeof(struct entry_t) + sizeof(struct data_t))
 
 /*
  * Define a estrutura de uma tabela hash.
@@ -20,12 +28,39 @@
  * struct list_t **table => apontador para a tabela hash, que por sua vez
  *                          tem apontadores para as várias listas que guardam
  *                          as entradas
+ * struct bloom_t *filter => filtro de bloom (de contagem) das chaves presentes,
+ *                           consultado antes de percorrer a lista; NULL se não
+ *                           foi possível criá-lo
+ * int filterKeys => número de chaves para que o filtro foi dimensionado
+ * long memBytes => memória ocupada pelas entradas (chaves, dados e estruturas)
+ * long memLimit => limite de memória a partir do qual se fazem evicções
+ *                  (0 = sem limite)
+ * long numEvictions => número de entradas removidas por evicção
+ * long evictedBytes => memória libertada por evicções
+ * int clockList => lista onde está o ponteiro do algoritmo CLOCK
+ * struct node_t *clockHand => próximo nó candidato a evicção (NULL passa à
+ *                             lista seguinte)
+ * struct merkle_t *merkle => árvore de Merkle das entradas, para a
+ *                            anti-entropia entre servidores (NULL até
+ *                            table_use_merkle())
+ * struct node_t **leaves => para cada folha da árvore de Merkle, o primeiro
+ *                           nó da lista (leafNext) das suas entradas
  */
 struct table_t {
 	int hashSize;
 	int numElems;
 	int numUpdates;
 	struct list_t **table;	
+	struct bloom_t *filter;
+	int filterKeys;
+	long memBytes;
+	long memLimit;
+	long numEvictions;
+	long evictedBytes;
+	int clockList;
+	struct node_t *clockHand;
+	struct merkle_t *merkle;
+	struct node_t **leaves;
 };
 
 /*
@@ -33,4 +68,30 @@ struct table_t {
  */
 int hash(char *string, int mod);
 
+/*
+ * Recria o filtro da tabela para n_keys chaves, com todas as chaves actuais.
+ * Retorna 0 (ok) ou -1 (erro, o filtro anterior é mantido).
+ */
+int table_filter_resize(struct table_t *table, int n_keys);
+
+/*
+ * Junta node à lista da sua folha da árvore de Merkle, ou retira-o, se a
+ * tabela mantiver a árvore (table_use_merkle()).
+ */
+void table_leaf_link(struct table_t *table, struct node_t *node);
+void table_leaf_unlink(struct table_t *table, struct node_t *node);
+
+/*
+ * Devolve a memória contabilizada para a entrada (chave, dados e estruturas).
+ */
+long table_entry_bytes(struct entry_t *entry);
+
+/*
+ * Remove uma entrada escolhida pelo algoritmo CLOCK: o ponteiro percorre as
+ * listas, dando uma segunda oportunidade às entradas usadas desde a última
+ * passagem.
+ * Retorna 0 (ok) ou -1 (tabela vazia).
+ */
+int table_evict(struct table_t *table);
+
 #endif
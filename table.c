@@ -29,6 +29,22 @@ struct table_t *table_create(int n) {
         table->hashSize = n;
         table->numElems = 0;
         table->numUpdates = 0;
+
+        // Sem limite de memória até table_set_memory_limit()
+        table->memBytes = 0;
+        table->memLimit = 0;
+        table->numEvictions = 0;
+        table->evictedBytes = 0;
+        table->clockList = 0;
+        table->clockHand = NULL;
+        table->merkle = NULL;
+        table->leaves = NULL;
+
+        // Sem filtro a tabela funciona na mesma, apenas sem o atalho
+        table->filterKeys = TABLE_FILTER_MIN_KEYS;
+        if(!(table->filter = bloom_create_counting(table->filterKeys, BLOOM_BITS_PER_KEY))) {
+            ERROR("bloom_create_counting");
+        }
         
         // Reserva memória para a tabela
         // Cada índice da tabela corresponde a um apontador para uma lista
@@ -69,6 +85,9 @@ void table_destroy(struct table_t *table) {
                 list_destroy(table->table[counter]);
             }
         }
+        bloom_destroy(table->filter);
+        merkle_destroy(table->merkle);
+        free(table->leaves);
         free(table->table);
         free(table);
     }
@@ -90,16 +109,22 @@ int table_put(struct table_t *table, char *key, struct data_t *data) {
     int retVal = 0, hashValue;
     struct entry_t *tempEntry;
     struct data_t *tempData;
+    struct node_t *tempNode;
 
     if (table && key && data) {
         hashValue = hash(key, table->hashSize);
 
-        if (table->numElems > 0 && (tempEntry = list_get(table->table[hashValue], key))) {
+        if (table->numElems > 0 && (tempNode = list_get_node(table->table[hashValue], key))) {
+            tempEntry = tempNode->entry;
 
             // Já havia um elemento com a chave key na lista e com um timestamp menor
             if (tempEntry->value && (tempData = data_dup(data))) {
+                table->memBytes += tempData->datasize - tempEntry->value->datasize;
+                merkle_toggle(table->merkle, key, tempEntry->value);
+                merkle_toggle(table->merkle, key, tempData);
                 data_destroy(tempEntry->value);
                 tempEntry->value = tempData;
+                __atomic_store_n(&tempNode->referenced, 1, __ATOMIC_RELAXED);
                 table->numUpdates++;
 			} else {
                 ERROR("data_dup ou ma inicialização previa");
@@ -112,6 +137,18 @@ int table_put(struct table_t *table, char *key, struct data_t *data) {
                 if ((list_add(table->table[hashValue], tempEntry)) == 0) {
                     table->numElems++;
                     table->numUpdates++;
+                    table->memBytes += table_entry_bytes(tempEntry);
+                    __atomic_store_n(&table->table[hashValue]->tail->referenced, 1, __ATOMIC_RELAXED);
+                    merkle_toggle(table->merkle, key, tempEntry->value);
+                    table_leaf_link(table, table->table[hashValue]->tail);
+
+                    // O filtro cresce com a tabela para manter os falsos positivos
+                    if (table->numElems > table->filterKeys) {
+                        table_filter_resize(table, table->numElems * 2);
+                    }
+                    else if (table->filter) {
+                        bloom_add(table->filter, key);
+                    }
                 }
                 else {
                     ERROR("list_add");
@@ -123,6 +160,10 @@ int table_put(struct table_t *table, char *key, struct data_t *data) {
                 retVal = -1;
             }
         }
+
+        // Acima do limite saem as entradas menos usadas (nunca a última)
+        while (retVal == 0 && table->memLimit > 0 && table->memBytes > table->memLimit &&
+               table->numElems > 1 && table_evict(table) == 0);
     }
     else {
         ERROR("NULL table, key or data");
@@ -144,17 +185,25 @@ struct data_t *table_get(struct table_t *table, char *key) {
 
     struct data_t *tempData = NULL;
     struct entry_t *tempEntry = NULL;
+    struct node_t *tempNode;
     int hashValue;
 
     if (key) {
+        // O filtro responde às chaves inexistentes sem percorrer a lista
+        if (!bloom_may_contain(table->filter, key)) {
+            return NULL;
+        }
         hashValue = hash(key, table->hashSize);
 
         // Verifica se a entrada existe na tabela
-        if((tempEntry = list_get(table->table[hashValue], key))) {
+        if((tempNode = list_get_node(table->table[hashValue], key))) {
+            tempEntry = tempNode->entry;
+            __atomic_store_n(&tempNode->referenced, 1, __ATOMIC_RELAXED);
 
             // Aloca memória para a entra e copia-a
             if((tempData = data_create(tempEntry->value->datasize))) {
 				tempData->timestamp = tempEntry->value->timestamp;
+				tempData->expires = tempEntry->value->expires;
                 // Copia a data e verifica se foi bem sucedido
                 memcpy(tempData->data, tempEntry->value->data, tempEntry->value->datasize);
                 if((memcmp(tempData->data, tempEntry->value->data, tempEntry->value->datasize) != 0)) {
@@ -185,12 +234,28 @@ struct data_t *table_get(struct table_t *table, char *key) {
 int table_del(struct table_t *table, char *key) {
 
     int result = -1;
+    long bytes = 0;
+    struct node_t *tempNode;
 	if(table) {
-            result = list_remove(table->table[hash(key,table->hashSize)], key);
+            struct list_t *list = table->table[hash(key,table->hashSize)];
+            if((tempNode = list_get_node(list, key))) {
+                bytes = table_entry_bytes(tempNode->entry);
+                merkle_toggle(table->merkle, key, tempNode->entry->value);
+                table_leaf_unlink(table, tempNode);
+                // O ponteiro do CLOCK não pode ficar num nó libertado
+                if(table->clockHand == tempNode) {
+                    table->clockHand = tempNode->next;
+                }
+                result = list_remove(list, key);
+            }
 	}
     if(result == 0) {
+        table->memBytes -= bytes;
         table->numElems--;
         table->numUpdates++;
+        if(table->filter) {
+            bloom_remove(table->filter, key);
+        }
     }
     return result;
     
@@ -340,6 +405,51 @@ struct entry_t **table_get_entries(struct table_t *table) {
 
 }
 
+/*
+ * Devolve o filtro de bloom das chaves da tabela serializado com
+ * bloom_to_data(), para ser enviado aos clientes.
+ * Em caso de erro, devolve NULL.
+ */
+struct data_t *table_get_filter(struct table_t *table) {
+
+    if (table == NULL || table->filter == NULL) {
+        ERROR("NULL table or filter");
+        return NULL;
+    }
+    return bloom_to_data(table->filter);
+
+}
+
+/*
+ * Recria o filtro da tabela para n_keys chaves, com todas as chaves actuais.
+ * Retorna 0 (ok) ou -1 (erro, o filtro anterior é mantido).
+ */
+int table_filter_resize(struct table_t *table, int n_keys) {
+
+    struct bloom_t *newFilter;
+    struct node_t *node;
+    int counter;
+
+    if (n_keys < TABLE_FILTER_MIN_KEYS) {
+        n_keys = TABLE_FILTER_MIN_KEYS;
+    }
+    // Mesmo que falhe não voltamos a tentar até a tabela duplicar
+    table->filterKeys = n_keys;
+    if (!(newFilter = bloom_create_counting(n_keys, BLOOM_BITS_PER_KEY))) {
+        ERROR("bloom_create_counting");
+        return -1;
+    }
+    for (counter = 0; counter < table->hashSize; counter++) {
+        for (node = table->table[counter]->head; node; node = node->next) {
+            bloom_add(newFilter, node->entry->key);
+        }
+    }
+    bloom_destroy(table->filter);
+    table->filter = newFilter;
+    return 0;
+
+}
+
 /*
  * Liberta a memória alocada por table_get_entries().
  */
@@ -419,4 +529,230 @@ long table_get_ts(struct table_t *table, char *key) {
     data_destroy(tempData);
     return ts;
 
-}
\ No newline at end of file
+}
+
+/*
+ * Junta node à lista da sua folha da árvore de Merkle (se a tabela a tiver).
+ */
+void table_leaf_link(struct table_t *table, struct node_t *node) {
+
+    struct node_t **head;
+
+    if(table->leaves) {
+        head = &table->leaves[merkle_leaf(node->entry->key) - MERKLE_FIRST_LEAF];
+        node->leafPrev = NULL;
+        node->leafNext = *head;
+        if(*head) {
+            (*head)->leafPrev = node;
+        }
+        *head = node;
+    }
+
+}
+
+/*
+ * Retira node da lista da sua folha da árvore de Merkle.
+ */
+void table_leaf_unlink(struct table_t *table, struct node_t *node) {
+
+    if(table->leaves) {
+        if(node->leafPrev) {
+            node->leafPrev->leafNext = node->leafNext;
+        }
+        else {
+            table->leaves[merkle_leaf(node->entry->key) - MERKLE_FIRST_LEAF] = node->leafNext;
+        }
+        if(node->leafNext) {
+            node->leafNext->leafPrev = node->leafPrev;
+        }
+        node->leafPrev = node->leafNext = NULL;
+    }
+
+}
+
+/*
+ * Passa a manter uma árvore de Merkle das entradas da tabela.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int table_use_merkle(struct table_t *table, struct hring_t *ring, int replicas, int self) {
+
+    struct node_t *node;
+    int counter;
+
+    if(!table) {
+        ERROR("NULL table");
+        return -1;
+    }
+    if(table->merkle) {
+        return 0;
+    }
+    if(!(table->leaves = (struct node_t **) calloc(MERKLE_FIRST_LEAF, sizeof(struct node_t *)))) {
+        ERROR("calloc leaves");
+        return -1;
+    }
+    if(!(table->merkle = merkle_create()) ||
+       (ring && merkle_partition(table->merkle, ring, replicas, self) != 0)) {
+        ERROR("merkle_create or merkle_partition");
+        merkle_destroy(table->merkle);
+        table->merkle = NULL;
+        free(table->leaves);
+        table->leaves = NULL;
+        return -1;
+    }
+    for(counter = 0; counter < table->hashSize; counter++) {
+        for(node = table->table[counter]->head; node; node = node->next) {
+            merkle_toggle(table->merkle, node->entry->key, node->entry->value);
+            table_leaf_link(table, node);
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * Devolve os hashes dos descendentes do nó node da vista view da árvore de
+ * Merkle. Em caso de erro, devolve NULL.
+ */
+struct data_t *table_get_merkle(struct table_t *table, int view, int node) {
+
+    if(!table || !table->merkle) {
+        ERROR("NULL table or merkle");
+        return NULL;
+    }
+    return merkle_get_hashes(table->merkle, view, node);
+
+}
+
+/*
+ * Devolve cópias das entries da folha leaf da vista view da árvore de
+ * Merkle. Em caso de erro, devolve NULL.
+ */
+struct entry_t **table_get_merkle_entries(struct table_t *table, int view, int leaf) {
+
+    struct entry_t **entries;
+    struct node_t *node;
+    int count = 0;
+
+    if(!table || !table->leaves || leaf < MERKLE_FIRST_LEAF || leaf >= MERKLE_NODES) {
+        ERROR("NULL table, no merkle or invalid leaf");
+        return NULL;
+    }
+
+    // Só se percorrem os nós da folha
+    for(node = table->leaves[leaf - MERKLE_FIRST_LEAF]; node; node = node->leafNext) {
+        count += merkle_in_view(table->merkle, view, node->entry->key);
+    }
+    if(!(entries = (struct entry_t **) malloc(sizeof(struct entry_t *) * (count + 1)))) {
+        ERROR("malloc entries");
+        return NULL;
+    }
+    count = 0;
+    for(node = table->leaves[leaf - MERKLE_FIRST_LEAF]; node; node = node->leafNext) {
+        if(!merkle_in_view(table->merkle, view, node->entry->key)) {
+            continue;
+        }
+        if(!(entries[count] = entry_dup(node->entry))) {
+            ERROR("entry_dup");
+            table_free_entries(entries);
+            return NULL;
+        }
+        entries[++count] = NULL;
+    }
+    entries[count] = NULL;
+    return entries;
+
+}
+
+/*
+ * Devolve a memória contabilizada para a entrada (chave, dados e estruturas).
+ */
+long table_entry_bytes(struct entry_t *entry) {
+
+    return (long) (strlen(entry->key) + 1 + entry->value->datasize + TABLE_ENTRY_OVERHEAD);
+
+}
+
+/*
+ * Remove uma entrada escolhida pelo algoritmo CLOCK: o ponteiro percorre as
+ * listas, dando uma segunda oportunidade às entradas usadas desde a última
+ * passagem.
+ * Retorna 0 (ok) ou -1 (tabela vazia).
+ */
+int table_evict(struct table_t *table) {
+
+    char *victim;
+    long bytes, steps;
+
+    if(!table || table->numElems == 0) {
+        return -1;
+    }
+
+    // Duas voltas completas chegam: a primeira limpa todos os bits
+    for(steps = 2L * (table->numElems + table->hashSize); steps > 0; steps--) {
+        if(!table->clockHand) {
+            table->clockList = (table->clockList + 1) % table->hashSize;
+            table->clockHand = table->table[table->clockList]->head;
+            continue;
+        }
+        if(__atomic_load_n(&table->clockHand->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&table->clockHand->referenced, 0, __ATOMIC_RELAXED);
+            table->clockHand = table->clockHand->next;
+            continue;
+        }
+
+        // A chave pertence ao nó, que é libertado por table_del()
+        if(!(victim = strdup(table->clockHand->entry->key))) {
+            ERROR("strdup victim");
+            return -1;
+        }
+        bytes = table_entry_bytes(table->clockHand->entry);
+        if(table_del(table, victim) == 0) {
+            table->numEvictions++;
+            table->evictedBytes += bytes;
+        }
+        free(victim);
+        return 0;
+    }
+    return -1;
+
+}
+
+/*
+ * Define o limite de memória (em bytes) da tabela: quando as entradas
+ * ultrapassam o limite, table_put() remove as entradas menos usadas
+ * (aproximação a LRU). Um limite de 0 desactiva as evicções (por omissão).
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int table_set_memory_limit(struct table_t *table, long bytes) {
+
+    if(!table || bytes < 0) {
+        ERROR("NULL table or invalid limit");
+        return -1;
+    }
+    table->memLimit = bytes;
+    while(table->memLimit > 0 && table->memBytes > table->memLimit &&
+          table->numElems > 1 && table_evict(table) == 0);
+    return 0;
+
+}
+
+/*
+ * Devolve em *bytes a memória ocupada pelas entradas, em *evictions o número
+ * de entradas removidas por evicção desde a criação da tabela e em
+ * *evicted_bytes a memória que essas evicções libertaram.
+ */
+void table_memory_stats(struct table_t *table, long *bytes, long *evictions, long *evicted_bytes) {
+
+    if(table) {
+        if(bytes) {
+            *bytes = table->memBytes;
+        }
+        if(evictions) {
+            *evictions = table->numEvictions;
+        }
+        if(evicted_bytes) {
+            *evicted_bytes = table->evictedBytes;
+        }
+    }
+
+}
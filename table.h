@@ -4,6 +4,7 @@
 #include "data.h"
 
 struct table_t; /* A definir pelo grupo em table-private.h */
+struct hring_t; /* Definida em hash_ring-private.h */
 
 /*
  * Função para criar/inicializar uma nova tabela hash, com n linhas
@@ -78,6 +79,28 @@ struct entry_t **table_get_entries(struct table_t *table);
  */
 void table_free_entries(struct entry_t **entries);
 
+/*
+ * Devolve o filtro de bloom das chaves da tabela serializado com
+ * bloom_to_data(), para ser enviado aos clientes.
+ * Em caso de erro, devolve NULL.
+ */
+struct data_t *table_get_filter(struct table_t *table);
+
+/*
+ * Define o limite de memória (em bytes) da tabela: quando as entradas
+ * ultrapassam o limite, table_put() remove as entradas menos usadas
+ * (aproximação a LRU). Um limite de 0 desactiva as evicções (por omissão).
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int table_set_memory_limit(struct table_t *table, long bytes);
+
+/*
+ * Devolve em *bytes a memória ocupada pelas entradas, em *evictions o número
+ * de entradas removidas por evicção desde a criação da tabela e em
+ * *evicted_bytes a memória que essas evicções libertaram.
+ */
+void table_memory_stats(struct table_t *table, long *bytes, long *evictions, long *evicted_bytes);
+
 
 
 /***************** Funções aplicadas a partir do projecto 4 *****************/
@@ -88,4 +111,29 @@ void table_free_entries(struct entry_t **entries);
  */
 long table_get_ts(struct table_t *table, char *key);
 
+/*
+ * Passa a manter uma árvore de Merkle das entradas da tabela (ver merkle.h),
+ * construída com as entradas actuais e depois actualizada por table_put() e
+ * table_del(). Com ring (não NULL) a árvore mantém também as vistas dos
+ * outros servidores do anel (ver merkle_partition()), e o anel passa a
+ * pertencer-lhe. Não faz nada se a tabela já a mantém.
+ * Devolve 0 (ok) ou -1 (erro).
+ */
+int table_use_merkle(struct table_t *table, struct hring_t *ring, int replicas, int self);
+
+/*
+ * Devolve os hashes dos descendentes do nó node da vista view da árvore de
+ * Merkle (ver merkle_get_hashes()).
+ * Em caso de erro (e.g. a tabela não mantém a árvore), devolve NULL.
+ */
+struct data_t *table_get_merkle(struct table_t *table, int view, int node);
+
+/*
+ * Devolve um array de entry_t * com cópias das entries cujas chaves calham
+ * na folha leaf da vista view da árvore de Merkle, e um último elemento a
+ * NULL.
+ * Em caso de erro, devolve NULL.
+ */
+struct entry_t **table_get_merkle_entries(struct table_t *table, int view, int leaf);
+
 #endif
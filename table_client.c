@@ -7,6 +7,7 @@
  * Cada comando vai ser inserido pelo utilizador numa única linha, havendo as
  * seguintes alternativas:
  *      put <key> <data>
+ *      putttl <key> <ttl> <data>
  *      get <key>
  *      del <key>
  *      size
@@ -83,7 +84,7 @@ int main(int argc, char** argv) {
 	//printf("* Porto: %s\n", remoteTable->porto);
 
     printf("* Ligação estabelecida. Insira um dos seguintes comandos:"
-            "\n*\t- put   <key> <data>\n*\t- get   <key>"
+            "\n*\t- put   <key> <data>\n*\t- putttl <key> <ttl> <data>\n*\t- get   <key>"
             "\n*\t- del   <key>\n*\t- size"
             "\n*\t- getkeys\n*\t- quit\n********************"
             "********************************************\n");
@@ -202,6 +203,52 @@ int executeComand(struct qtable_t *remoteTable) {
 
         }
 
+        //putttl <key> <ttl> <data>
+        if(strcmp(comand, "putttl") == 0) {
+
+            //guarda a key
+            char *key;
+            if((key = strtok(NULL, " \n")) == NULL) {
+                printf("> ERRO: Comando Inválido.\n");
+                continue;
+            }
+
+            //guarda o tempo de vida (em segundos)
+            char *ttlValue;
+            int ttl;
+            if((ttlValue = strtok(NULL, " \n")) == NULL || (ttl = atoi(ttlValue)) <= 0) {
+                printf("> ERRO: Comando Inválido.\n");
+                continue;
+            }
+
+            //guarda o valor de data
+            char *dataValue;
+            if((dataValue = strtok(NULL, "\n")) == NULL) {
+                printf("> ERRO: Comando Inválido.\n");
+                continue;
+            }
+
+            //cria a data
+            struct data_t *data;
+            if((data = data_create2(strlen(dataValue) + 1, strdup(dataValue))) == NULL) {
+                perror("remote_table: data_create2 data");
+                return -1;
+            }
+
+            //insere a data com a respectiva chave e prazo
+            if(qtable_put_ttl(remoteTable, key, data, ttl) == 0) {
+                printf("> Entrada inserida (expira em %d s)\n", ttl);
+            }
+            else {
+                printf("> Erro ao inserir entrada\n");
+            }
+            data_destroy(data);
+
+            //em caso de sucesso
+            continue;
+
+        }
+
         //get <key>
         if(strcmp(comand, "get") == 0) {
 
@@ -12,22 +12,39 @@
 #include "utils.h"
 #include "message.h"
 #include "remote_table.h"
+#include "persistent_table.h"
+#include "network_server.h"
+#include "anti_entropy.h"
+#include <pthread.h>
 
-#define GARBAGE_COLLECTION_TIME 300
+// Tempo máximo (us) gasto a recolher tombstones em cada volta do ciclo
+#define GARBAGE_COLLECTION_SLICE 1000
+
+// Número máximo de reactores (-t)
+#define MAX_THREADS 64
+
+// Número máximo de outros servidores (-p)
+#define MAX_PEERS 64
 
 int shutdownServer = 1;
 int relogioLogico = 0;
 
+// Limite de memória (-m) e evicções já reportadas
+static long memLimit = 0, lastEvictions = 0;
+
 void signalHandler(sig_t sig);
-int server_send_receive(struct pollfd connection);
+int server_process(char *request, int size, long deadline, char **reply);
+void server_tick(void);
+void *server_thread(void *arg);
+int server_bootstrap(char *address, char *filename);
 
 void signalHandler(sig_t sig) {
 	signal(SIGINT, (__sighandler_t)signalHandler);
 	if(shutdownServer) {
-		printf("\nSinal apanhado, iremos desligar o servidor assim que possivel!\n");
+		LOG_INFO("Sinal apanhado, iremos desligar o servidor assim que possivel!");
 		shutdownServer = 0;
 	} else {
-		printf("OK you're the boss... But the leaks are your fault.\n");
+		LOG_INFO("OK you're the boss... But the leaks are your fault.");
 		exit(EXIT_SUCCESS);
 	}
 }
@@ -41,233 +58,327 @@ void *getInAddress(struct sockaddr *address) {
 }
 
 int main(int argc, char **argv) {
-	int socketFileDescriptor, newSocket = -1, numBytes, yes = 1, retVal, pollCounter, temp;
-	struct addrinfo hints, *serverInfo, *anAddress;
-	struct sockaddr_storage connectorAddress;
-	socklen_t socketSize;
-	struct sigaction signalAction;
-	struct pollfd ufd[10]; //
-	char addressDescription[INET6_ADDRSTRLEN], *buffer = NULL;
-	uint32_t bufferLength;
-	struct message_t *message = NULL;
+	struct nserver_t *servers[MAX_THREADS + 1];
+	pthread_t threads[MAX_THREADS + 1];
+	int option, engine = ENGINE_MEMORY, numThreads = 1, numReactors, useUring = 0, numPeers = 0, replicas = 0, i;
+	char *suffix, *localPath = NULL, *peers[MAX_PEERS], *peer, *rest, *bootstrap = NULL, *self = NULL;
+	struct aentropy_t *antiEntropy = NULL;
 	
-	if(argc != 4) {
-		fprintf(stderr, "usage: server <port> <num lists> <filename>\n");
+	// Opções: -e memory|lsm escolhe o motor de armazenamento
+	//         -m <bytes>[K|M|G] limita a memória da tabela (modo cache)
+	//         -t <n> atende os pedidos com n reactores, cada um no seu fio
+	//         -u usa io_uring na rede e no log (se o kernel o permitir)
+	//         -s <caminho> atende também clientes locais num socket Unix
+	//            (endereços unix:<caminho> e shm:<caminho>), num fio próprio
+	//         -p <ip:porto>,... sincroniza-se periodicamente com estes
+	//            servidores (anti-entropia por árvores de Merkle)
+	//         -r <n> -a <ip:porto> os clientes repartem as chaves com n
+	//            réplicas (qtable_set_replicas()) por este servidor, cujo
+	//            endereço nas suas listas é -a, e pelos de -p: só se
+	//            sincronizam as chaves que os dois servidores guardam
+	//         -b <ip:porto> sem dados locais, arranca com uma cópia do
+	//            checkpoint e do log deste servidor (OP_RT_SYNC)
+	while((option = getopt(argc, argv, "e:m:t:us:p:r:a:b:")) != -1) {
+		switch(option) {
+			case 'e':
+				if(strcmp(optarg, "memory") == 0) {
+					engine = ENGINE_MEMORY;
+				} else if(strcmp(optarg, "lsm") == 0) {
+					engine = ENGINE_LSM;
+				} else {
+					LOG_ERROR("server: motor desconhecido: %s", optarg);
+					exit(-1);
+				}
+				break;
+			case 'm':
+				memLimit = strtol(optarg, &suffix, 10);
+				switch(toupper(*suffix)) {
+					case 'G': memLimit *= 1024;
+					case 'M': memLimit *= 1024;
+					case 'K': memLimit *= 1024;
+					case '\0': break;
+					default: memLimit = -1;
+				}
+				if(memLimit <= 0) {
+					LOG_ERROR("server: limite de memoria invalido: %s", optarg);
+					exit(-1);
+				}
+				break;
+			case 't':
+				numThreads = atoi(optarg);
+				if(numThreads < 1 || numThreads > MAX_THREADS) {
+					LOG_ERROR("server: numero de fios invalido (1 a %d): %s", MAX_THREADS, optarg);
+					exit(-1);
+				}
+				break;
+			case 'u':
+				useUring = 1;
+				break;
+			case 's':
+				localPath = optarg;
+				break;
+			case 'p':
+				for(peer = strtok_r(optarg, ",", &rest); peer; peer = strtok_r(NULL, ",", &rest)) {
+					if(numPeers == MAX_PEERS) {
+						LOG_ERROR("server: demasiados servidores em -p (maximo %d)", MAX_PEERS);
+						exit(-1);
+					}
+					peers[numPeers++] = peer;
+				}
+				break;
+			case 'r':
+				replicas = atoi(optarg);
+				if(replicas < 1) {
+					LOG_ERROR("server: numero de replicas invalido: %s", optarg);
+					exit(-1);
+				}
+				break;
+			case 'a':
+				self = optarg;
+				break;
+			case 'b':
+				bootstrap = optarg;
+				break;
+			default:
+				LOG_ERROR("usage: server <port> <num lists> <filename> [-e memory|lsm] [-m bytes[K|M|G]] [-t threads] [-u] [-s socket] [-p peer,...] [-r replicas -a address] [-b peer]");
+				exit(-1);
+		}
+	}
+	if(argc - optind != 3) {
+		LOG_ERROR("usage: server <port> <num lists> <filename> [-e memory|lsm] [-m bytes[K|M|G]] [-t threads] [-u] [-s socket] [-p peer,...] [-r replicas -a address] [-b peer]");
+		exit(-1);
+	}
+	// A memtable do motor LSM já é limitada e não pode perder entradas
+	if(memLimit > 0 && engine != ENGINE_MEMORY) {
+		LOG_ERROR("server: -m apenas pode ser usado com -e memory");
 		exit(-1);
 	}
+	// A árvore de Merkle só existe com o motor em memória, e as evicções de
+	// uma cache seriam repostas pelos outros servidores a cada ronda
+	if(numPeers > 0 && (engine != ENGINE_MEMORY || memLimit > 0)) {
+		LOG_ERROR("server: -p apenas pode ser usado com -e memory e sem -m");
+		exit(-1);
+	}
+	// O anel dos clientes precisa de todos os servidores, com os mesmos nomes
+	if((replicas > 0 || self) && (replicas == 0 || !self || numPeers == 0)) {
+		LOG_ERROR("server: -r e -a usam-se juntos e com -p");
+		exit(-1);
+	}
+	// O estado copiado é o checkpoint e o log de uma tabela em memória
+	if(bootstrap && engine != ENGINE_MEMORY) {
+		LOG_ERROR("server: -b apenas pode ser usado com -e memory");
+		exit(-1);
+	}
+	argv += optind - 1;
 	
 	// Aqui montamos o tratamento de sinais
 	signal(SIGINT, (__sighandler_t)signalHandler);
 	signal(SIGPIPE, SIG_IGN);
 	
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE; // Use current IP
-	
-	if((retVal = getaddrinfo(NULL, argv[1], &hints, &serverInfo)) != 0) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(retVal));
-		return -1;
-	}
-	
-	for(anAddress = serverInfo; anAddress; anAddress = anAddress->ai_next) {
-		if((socketFileDescriptor = socket(anAddress->ai_family, anAddress->ai_socktype, anAddress->ai_protocol)) == -1) {
-			perror("server: socket");
-			continue;
-		}
-		
-		if(setsockopt(socketFileDescriptor, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-			perror("setsockopt");
-			exit(1);
+	// Um socket de escuta e um reactor epoll por fio; com mais de um, todos
+	// escutam o mesmo porto (SO_REUSEPORT) e o kernel reparte as ligações
+	for(i = 0; i < numThreads; i++) {
+		if(!(servers[i] = network_server_create(argv[1], (numThreads > 1 ? NETWORK_SHARED : 0) |
+		                                                 (useUring ? NETWORK_URING : 0)))) {
+			LOG_ERROR("server: network_server_create");
+			return -1;
 		}
-		
-		if(bind(socketFileDescriptor, anAddress->ai_addr, anAddress->ai_addrlen) == -1) {
-			close(socketFileDescriptor);
-			perror("server: bind");
-			continue;
-		}
-		
-		// Se chegamos aqui conseguimos fazer um bind com sucesso.
-		break;
 	}
-	
-	// Vamos testar a ver se conseguimos bind com sucesso...
-	if(!anAddress) {
-		fprintf(stderr, "server: failed to bind\n");
-		return -1;
+	numReactors = numThreads;
+	if(localPath) {
+		if(!(servers[numReactors] = network_server_create_local(localPath))) {
+			LOG_ERROR("server: network_server_create_local");
+			return -1;
+		}
+		numReactors++;
 	}
 	
-	freeaddrinfo(anAddress); // Ja nao precisamos
-	
-	// Por o socket a non-blocking
-	// Precisamos de error checking aqui ?
-	fcntl(socketFileDescriptor, F_SETFL, O_NONBLOCK);
-	
-	memset(ufd, 0, sizeof(ufd));
+	LOG_INFO("server: waiting..");
 	
-	ufd[0].fd = socketFileDescriptor;
-	ufd[0].events = POLLIN; //| POLLOUT;
-	for(pollCounter = 1; pollCounter < 10; pollCounter++)
-		ufd[pollCounter].fd = -1;
-	
-	// Apenas podem ficar 10 em fila ?
-	if(listen(ufd[0].fd, 10) == -1) {
-		perror("listen");
-		close(socketFileDescriptor);
+	// Um servidor sem dados copia os ficheiros de outro antes de os recuperar
+	if(bootstrap && server_bootstrap(bootstrap, argv[3]) == -1) {
+		LOG_ERROR("server: nao foi possivel copiar o estado de %s", bootstrap);
 		exit(-1);
 	}
 	
-	printf("server: waiting..\n");
-	
 	// Inicializar a tabela.
-	if(table_skel_init(atoi(argv[2]), argv[3]) == -1) {
-		perror("table_skel_init");
+	if(table_skel_init(atoi(argv[2]), argv[3], engine, memLimit, numReactors, useUring) == -1) {
+		LOG_PERROR("table_skel_init");
 		exit(-1);
 	}
 
-	time_t lastTime = time(NULL), currentTime;
-	
-	// O 0 no poll é o timeout, queremos ficar escutando.
-	while((retVal = poll(ufd, 10, 0)) != -1 && shutdownServer) {
-		// Poll!
-		if(ufd[0].revents & POLLIN) {
-			// Temos dados para ler
-			printf("Nova ligação detectada!\n");
-			socketSize = sizeof(connectorAddress);
-			if((newSocket = accept(socketFileDescriptor, (struct sockaddr*)&connectorAddress, &socketSize)) == -1) {
-				perror("accept");
-				continue;
-			} else {
-				// Adiciona o cliente a ufd
-				for(pollCounter = 1; ufd[pollCounter].fd != -1; pollCounter++);
-				ufd[pollCounter].fd = newSocket;
-				ufd[pollCounter].events = POLLIN;
-				printf("A ligação foi estabelecida com sucesso. (%d)\n", pollCounter);
-			}
-		}
-		// Agora tratamos de ufd[1].
-		for(pollCounter = 1; pollCounter < 10; pollCounter ++) {
-			if(ufd[pollCounter].revents & POLLHUP) {
-				printf("A fechar ligação %d\n", pollCounter);
-				close(ufd[pollCounter].fd);
-				ufd[pollCounter].fd = -1;
-				ufd[pollCounter].revents = -1;
-				ufd[pollCounter].events = -1;
-			}
-			else if(ufd[pollCounter].fd > 0 && ufd[pollCounter].revents & POLLIN) {
-				if(server_send_receive(ufd[pollCounter]) == -1) {
-					printf("servidor: ligacao perdida, a fechar: %d...\n", ufd[pollCounter].fd);
-					close(ufd[pollCounter].fd);
-					ufd[pollCounter].fd = -1;
-					ufd[pollCounter].revents = -1;
-					ufd[pollCounter].events = -1;
-				}
-			}
-		}
-		currentTime = time(NULL);
-		if((currentTime - lastTime) > GARBAGE_COLLECTION_TIME) {
-			printf("*** Collecting Garbage ***\n");
-			table_skel_collect();
-			lastTime = currentTime;
-		}
+	// A anti-entropia corre no seu fio, com a tabela já recuperada
+	if(numPeers > 0 && !(antiEntropy = aentropy_start(peers, numPeers, self, replicas, 0))) {
+		LOG_ERROR("server: aentropy_start");
+		exit(-1);
 	}
 
-	// Iremos encerrar o servidor ! Fecha tudo no ufd e libera tudo o que foi alocado.
-	for(pollCounter = 0; pollCounter < 10; pollCounter ++) {
-		if(ufd[pollCounter].fd > 0) {
-			close(ufd[pollCounter].fd);
+	// Os reactores extra não fazem o trabalho periódico, apenas atendem
+	for(i = 1; i < numReactors; i++) {
+		if(pthread_create(&threads[i], NULL, server_thread, servers[i]) != 0) {
+			LOG_PERROR("pthread_create");
+			exit(-1);
 		}
 	}
-	// Fechar a table_skel
-	if(table_skel_destroy() == -1) {
-		perror("table_skel_destroy");
+
+	// Atende os clientes até ser apanhado o SIGINT
+	if(network_server_run(servers[0], server_process, server_tick, &shutdownServer) == -1) {
+		LOG_ERROR("server: network_server_run");
 	}
-	if(buffer) {
-		printf("Libertando buffer...\n");
-		free(buffer);
-		buffer = NULL;
+
+	// Iremos encerrar o servidor ! Fecha todas as ligações.
+	for(i = 1; i < numReactors; i++) {
+		pthread_join(threads[i], NULL);
 	}
-	if(message) {
-		printf("Libertando mensagem...\n");
-		free_message(message);
-	}	
-	if(socketFileDescriptor) {
-		close(socketFileDescriptor);
+	for(i = 0; i < numReactors; i++) {
+		network_server_destroy(servers[i]);
 	}
-	if(newSocket > 0) {
-		close(newSocket);
+	aentropy_stop(antiEntropy);
+	// Fechar a table_skel
+	if(table_skel_destroy() == -1) {
+		LOG_PERROR("table_skel_destroy");
 	}
 	
 	return 0;
 }
 
-int server_send_receive(struct pollfd connection) {
-	int numBytes, temp, retVal = -1, bufferSize;
-	uint32_t bufferLength;
-	char *buffer;
+/*
+ * Descodifica o pedido, executa-o na tabela e codifica a resposta em *reply.
+ * Um pedido cujo prazo (deadline) já passou não é executado: a resposta é
+ * um erro.
+ * Retorna o tamanho da resposta ou -1 em caso de erro.
+ */
+int server_process(char *request, int size, long deadline, char **reply) {
+	int numBytes;
 	struct message_t *message;
 	
-	// Primeiro lemos o tamanho da mensagem
-	if((numBytes = (int)read(connection.fd, &bufferLength, sizeof(uint32_t))) > 0) {
-		// Recebemos o tamanho do buffer que o cliente vai enviar
-		temp = (int)ntohl(bufferLength);
-		//printf("Tamanho recebido: %d -> %d\n", bufferLength, temp);
-		if(!(buffer = (char*)malloc(temp + 1))) {
-			perror("malloc");
-			exit(EXIT_FAILURE);
+	*reply = NULL;
+	if(deadline && network_server_now() > deadline) {
+		// O cliente ja desistiu: responde logo com um erro, sem fazer o trabalho
+		LOG_DEBUG("pedido expirado, descartado");
+		if(!(message = (struct message_t*)malloc(sizeof(struct message_t)))) {
+			LOG_PERROR("malloc message!");
+			return -1;
 		}
-		if((numBytes = (int)read(connection.fd, buffer, temp)) < temp) {
-			// Perdemos a ligação a meio do envio... Retry aqui
-			perror("read buffer");
-			free(buffer);
-			//printf("buffer lido < numBytes... Ignorando...\n");
-		} else {
-			buffer[numBytes] = '\0';
-			if(!(message = string_to_message(buffer))) {
-				perror("string_to_message");
-				// Recebemos uma mensagem invalida, mandamos de volta uma mensagem de erro.
-				printf("servidor recebeu uma mensagem invalida...\n");
-				printf("criando mensagem de erro para enviar de volta...\n");
-				// Criar mensagem de erro.
-				if(!(message = (struct message_t*)malloc(sizeof(struct message_t)))) {
-					perror("malloc message!");
-					exit(EXIT_FAILURE);
-				}
-				message->opcode = OP_RT_ERROR;
-				message->c_type = CT_RESULT;
-				message->content.result = -1;
-				free(buffer);
-				if((numBytes = message_to_string(message, &buffer)) <= 0) {
-					perror("message_to_string...\n");
-					exit(EXIT_FAILURE);
-				}
-			} else {
-				printf("Mensagem %d: %hd %hd\n", relogioLogico, message->opcode, message->c_type);
-				relogioLogico ++;
-				// Mensagem é valida, invoke
-				invoke(message);
-				free(buffer);
-				if((numBytes = message_to_string(message, &buffer)) <= 0) {
-					perror("message_to_string...\n");
-					exit(EXIT_FAILURE);
-				}
-				free_message(message);
-			}
-			bufferLength = htonl(numBytes);
-			if(write(connection.fd, &bufferLength, sizeof(bufferLength)) == -1) {
-				perror("write bufferLength");
-			} else {
-				if(write(connection.fd, buffer, numBytes) == -1) {
-					perror("write buffer");
-				} else {
-					//printf("Resposta: %s ... ", buffer);
-					printf("Resposta enviada com sucesso.\n");
-				}
-				free(buffer);
+		message->opcode = OP_RT_ERROR;
+		message->c_type = CT_RESULT;
+		message->content.result = -1;
+	} else if(!(message = string_to_message(request))) {
+		LOG_PERROR("string_to_message");
+		// Recebemos uma mensagem invalida, mandamos de volta uma mensagem de erro.
+		LOG_DEBUG("servidor recebeu uma mensagem invalida...");
+		LOG_DEBUG("criando mensagem de erro para enviar de volta...");
+		// Criar mensagem de erro.
+		if(!(message = (struct message_t*)malloc(sizeof(struct message_t)))) {
+			LOG_PERROR("malloc message!");
+			return -1;
+		}
+		message->opcode = OP_RT_ERROR;
+		message->c_type = CT_RESULT;
+		message->content.result = -1;
+	} else {
+		__sync_fetch_and_add(&relogioLogico, 1);
+		LOG_DEBUG("Mensagem %d: %hd %hd", relogioLogico, message->opcode, message->c_type);
+		// Mensagem é valida, invoke
+		invoke(message);
+	}
+	if((numBytes = message_to_string(message, reply)) <= 0) {
+		LOG_PERROR("message_to_string...");
+		numBytes = -1;
+	}
+	free_message(message);
+	return numBytes;
+}
+
+/*
+ * Ciclo de um reactor extra (-t ou -s): atende as ligações que lhe couberem até ser
+ * apanhado o SIGINT.
+ */
+void *server_thread(void *arg) {
+	if(network_server_run((struct nserver_t*)arg, server_process, NULL, &shutdownServer) == -1) {
+		LOG_ERROR("server: network_server_run");
+	}
+	return NULL;
+}
+
+/*
+ * Trabalho periódico do servidor, feito entre pedidos: temporizadores das
+ * chaves com prazo, contadores de evicções e recolha de lixo.
+ */
+void server_tick(void) {
+	int collected;
+	long memBytes, evictions, evictedBytes;
+	
+	// Remove as chaves cujo prazo passou (roda de temporizadores)
+	if((collected = table_skel_expire()) > 0) {
+		LOG_INFO("*** Expired %d keys ***", collected);
+	}
+	// Evicções feitas pelos últimos pedidos (apenas com -m)
+	if(memLimit > 0 && table_skel_memory_stats(&memBytes, &evictions, &evictedBytes) == 0 &&
+	   evictions != lastEvictions) {
+		LOG_INFO("*** Evicted %ld keys (%ld bytes in use, %ld evicted) ***",
+		       evictions - lastEvictions, memBytes, evictedBytes);
+		lastEvictions = evictions;
+	}
+	// Recolhe um pouco do lixo entre pedidos
+	if((collected = table_skel_collect(GARBAGE_COLLECTION_SLICE)) > 0) {
+		LOG_INFO("*** Collected %d deleted keys ***", collected);
+	}
+}
+
+/*
+ * Se ainda não há checkpoint nem log locais (filename.ckp e filename.log),
+ * copia-os do servidor address: chegam para ficheiros temporários, que só
+ * passam a ser os da tabela quando estiverem completos. A recuperação
+ * normal (table_skel_init()) carrega-os depois.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int server_bootstrap(char *address, char *filename) {
+	char ckpName[PATH_MAX], logName[PATH_MAX], ckpTemp[PATH_MAX], logTemp[PATH_MAX];
+	struct rtable_t *peer;
+	struct stat info;
+	int ckpFd = -1, logFd = -1, fileOk = -2, ret = -1;
+	
+	snprintf(ckpName, sizeof(ckpName), "%s.ckp", filename);
+	snprintf(logName, sizeof(logName), "%s.log", filename);
+	snprintf(ckpTemp, sizeof(ckpTemp), "%s.ckp.sync", filename);
+	snprintf(logTemp, sizeof(logTemp), "%s.log.sync", filename);
+	if((stat(ckpName, &info) == 0 && info.st_size > 0) || (stat(logName, &info) == 0 && info.st_size > 0)) {
+		LOG_INFO("server: ja existem dados locais, -b ignorado");
+		return 0;
+	}
+	
+	if(!(peer = rtable_open(address))) {
+		LOG_ERROR("server: endereco invalido: %s", address);
+		return -1;
+	}
+	if((ckpFd = open(ckpTemp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1 ||
+	   (logFd = open(logTemp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1) {
+		LOG_PERROR("open");
+	} else if(rtable_sync(peer, ckpFd, logFd) == 0) {
+		// O log copiado acaba onde o outro servidor ia a escrever: leva a
+		// marca de fim de um log fechado, e só então os dois passam a valer
+		if(write(logFd, &fileOk, sizeof(int)) == sizeof(int) && fsync(ckpFd) == 0 && fsync(logFd) == 0 &&
+		   fstat(ckpFd, &info) == 0) {
+			// Um checkpoint vazio (o outro servidor ainda não o tinha) não é usado
+			if(info.st_size == 0 ? unlink(ckpTemp) == 0 : rename(ckpTemp, ckpName) == 0) {
+				ret = rename(logTemp, logName);
 			}
-			//free(buffer);
-			retVal = 0;
 		}
+		if(ret == -1) {
+			LOG_PERROR("server: bootstrap");
+		}
+	}
+	if(ckpFd != -1) {
+		close(ckpFd);
+	}
+	if(logFd != -1) {
+		close(logFd);
+	}
+	if(ret == -1) {
+		unlink(ckpTemp);
+		unlink(logTemp);
 	}
-	return retVal;
+	rtable_disconnect(peer);
+	return ret;
 }
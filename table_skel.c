@@ -13,6 +13,9 @@
 #include "table_skel.h"
 #include "utils.h"
 #include "persistent_table.h"
+#include "merkle.h"
+#include "network_server.h"
+#include <pthread.h>
 
 /*
  * MAX_LOG_SIZE: Tamanho máximo que o ficheiro log pode ter.
@@ -21,15 +24,28 @@
 
 static struct ptable_t *sharedPtable = NULL;
 
+/*
+ * Leituras (get, getts, size, getkeys, filter, merkle, sync) partilham a
+ * tabela; escritas e o trabalho periódico (prazos, recolha de lixo) têm-na
+ * em exclusivo.
+ */
+static pthread_rwlock_t sharedLock = PTHREAD_RWLOCK_INITIALIZER;
+
 /*
  * Inicia o skeleton da tabela.
  * O main() do servidor deve chamar este método antes de usar a
  * funço invoke(). O parâmetro n_lists define o número de listas a serem
  * usadas pela tabela mantida no servidor. O parâmetro filename corresponde ao
- * nome a ser usado nos ficheiros de log e checkpoint.
+ * nome a ser usado nos ficheiros de log e checkpoint. O parâmetro engine
+ * escolhe o motor de armazenamento (ENGINE_MEMORY ou ENGINE_LSM). O parâmetro
+ * mem_limit limita a memória (em bytes) da tabela com ENGINE_MEMORY, fazendo
+ * evicção das entradas menos usadas (0 = sem limite). O parâmetro threads
+ * indica quantos fios vão chamar invoke() em simultâneo; com mais de um, o
+ * log passa a ser escrito em lotes (group commit). Com use_uring o log é
+ * escrito através de um io_uring, se disponível.
  * Retorna 0 (OK) ou -1 (erro, por exemplo OUT OF MEMORY).
  */
-int table_skel_init(int n_lists, char *filename) {
+int table_skel_init(int n_lists, char *filename, int engine, long mem_limit, int threads, int use_uring) {
 
     //verifica a validade dos parâmetros
     if(n_lists <= 0 || filename == NULL) {
@@ -44,6 +60,11 @@ int table_skel_init(int n_lists, char *filename) {
             ERROR("table_skel: table_create");
             return -1;
         }
+        if(mem_limit > 0 && table_set_memory_limit(sharedTable, mem_limit) != 0) {
+            ERROR("table_skel: table_set_memory_limit");
+            table_destroy(sharedTable);
+            return -1;
+        }
 
         //cria e verifica um novo persistence_manager
         struct pmanager_t *sharedPmanager;
@@ -54,12 +75,20 @@ int table_skel_init(int n_lists, char *filename) {
         }
 
         //cria e verifica um persistent_table
-        if((sharedPtable = ptable_open(sharedTable, sharedPmanager)) == NULL) {
+        if((sharedPtable = ptable_open_engine(sharedTable, sharedPmanager, engine, filename)) == NULL) {
             ERROR("table_skel: ptable_open");
             table_destroy(sharedTable);
             pmanager_destroy(sharedPmanager);
             return -1;
         }
+
+        //com vários fios as escritas no log são agrupadas
+        if(threads > 1) {
+            pmanager_group_commit(sharedPmanager);
+        }
+        if(use_uring && pmanager_use_uring(sharedPmanager) != 0) {
+            LOG_WARN("table_skel: io_uring indisponivel, o log usa write()");
+        }
 		
 		// Garbage collection
 		ptable_collect_garbage(sharedPtable);
@@ -84,6 +113,96 @@ int table_skel_destroy() {
     
 }
 
+/*
+ * Escreve entry (com sharedLock de escrita): sempre, ou com newer só se não
+ * for mais antiga que o valor guardado.
+ * Devolve o timestamp que fica guardado (0 sem newer) ou -1 (erro).
+ */
+static long table_skel_put(struct entry_t *entry, int newer) {
+
+    if(newer) {
+        return ptable_put_if_newer(sharedPtable, entry->key, entry->value);
+    }
+    return ptable_put(sharedPtable, entry->key, entry->value) == 0 ? 0 : -1;
+
+}
+
+/*
+ * Escreve um lote de entradas (com sharedLock de escrita), cada uma só se
+ * não for mais antiga que o valor guardado.
+ * Devolve quantas ficaram guardadas ou -1 (erro).
+ */
+static int table_skel_put_entries(struct entry_t **entries) {
+
+    int i, written = 0;
+    long winner;
+
+    for(i = 0; entries[i]; i++) {
+        if((winner = table_skel_put(entries[i], 1)) == -1) {
+            // Sem espaço de log: guarda o estado da tabela e tenta de novo
+            if(ptable_checkpoint(sharedPtable) != 0) {
+                ERROR("persistent_table: ptable_checkpoint");
+            }
+            if((winner = table_skel_put(entries[i], 1)) == -1) {
+                return -1;
+            }
+        }
+        if(winner == entries[i]->value->timestamp) {
+            written ++;
+        }
+    }
+    return written;
+
+}
+
+/*
+ * Junta à resposta em preparação o checkpoint e o log da tabela (com
+ * sharedLock, que impede escritas e a rotação do log enquanto são medidos;
+ * depois, os descritores abertos continuam a ver os mesmos ficheiros).
+ * Devolve os dois tamanhos, em 8 bytes cada (big-endian), ou NULL (erro).
+ */
+static struct data_t *table_skel_snapshot() {
+
+    struct data_t *sizes;
+    unsigned char *out;
+    int ckpFd, logFd, b;
+    long ckpSize, logSize;
+
+    if(ptable_snapshot(sharedPtable, &ckpFd, &ckpSize, &logFd, &logSize) != 0) {
+        return NULL;
+    }
+    if((sizes = data_create(16)) == NULL) {
+        ERROR("data_create");
+        if(ckpFd != -1) {
+            close(ckpFd);
+        }
+        if(logFd != -1) {
+            close(logFd);
+        }
+        return NULL;
+    }
+    out = (unsigned char *) sizes->data;
+    for(b = 0; b < 8; b++) {
+        out[b] = (unsigned char) (ckpSize >> (56 - 8 * b));
+        out[8 + b] = (unsigned char) (logSize >> (56 - 8 * b));
+    }
+
+    // O reactor fica com cada descritor que lhe é passado, mesmo que falhe
+    if(ckpFd != -1 && network_server_sendfile(ckpFd, 0, ckpSize) != 0) {
+        if(logFd != -1) {
+            close(logFd);
+        }
+        data_destroy(sizes);
+        return NULL;
+    }
+    if(logFd != -1 && network_server_sendfile(logFd, 0, logSize) != 0) {
+        data_destroy(sizes);
+        return NULL;
+    }
+    return sizes;
+
+}
+
 /* 
  * Executar uma função (indicada pelo opcode na msg) e retorna o resultado na
  * própria struct msg.
@@ -91,11 +210,20 @@ int table_skel_destroy() {
  */
 int invoke(struct message_t *msg) {
 
-    int retVal = 0;
+    int retVal = 0, exclusive, newer, view, node;
+    long winner;
     char *key;
     struct entry_t *entry;
+    struct data_t *value;
 
     if(sharedPtable && msg) {
+        exclusive = (msg->opcode == OP_RT_PUT || msg->opcode == OP_RT_DEL);
+        if(exclusive) {
+            pthread_rwlock_wrlock(&sharedLock);
+        }
+        else {
+            pthread_rwlock_rdlock(&sharedLock);
+        }
         switch (msg->opcode) {
             case OP_RT_GET:
                 // table_get: (struct table_t* char*) -> (struct data_t*)
@@ -121,41 +249,77 @@ int invoke(struct message_t *msg) {
                 }
             break;
 
+            case OP_RT_DIGEST:
+                // Como OP_RT_GET, mas responde só com o timestamp e o resumo
+                // do valor (ver data_create_digest())
+                if(msg->content.key) {
+                    key = msg->content.key;
+                    value = ptable_get(sharedPtable, key);
+                    if((msg->content.value = data_create_digest(value))) {
+                        msg->opcode ++;
+                        msg->c_type = CT_VALUE;
+                    }
+                    else {
+                        msg->opcode = OP_RT_ERROR;
+                        msg->c_type = CT_RESULT;
+                        msg->content.result = -1;
+                    }
+                    data_destroy(value);
+                    free(key);
+                }
+                else {
+                    msg->opcode = OP_RT_ERROR;
+                    msg->c_type = CT_RESULT;
+                    msg->content.result = -1;
+                }
+            break;
+
             case OP_RT_PUT:
                 // table_put: (struct table_t* char* struct data_t*) -> (int)
-                if(msg->content.entry) {
-                    entry = msg->content.entry;
-                    if((retVal = ptable_put(sharedPtable, entry->key, entry->value)) != -1) {
-                        msg->content.result = retVal;
+                // Com CT_NEWER só escreve se a entrada não for mais antiga que
+                // a guardada (o lock de escrita torna a comparação atómica) e
+                // responde com o timestamp que ficou; com CT_ENTRIES faz o
+                // mesmo a um lote e responde com quantas entradas escreveu
+                if(msg->c_type == CT_ENTRIES && msg->content.entries) {
+                    retVal = table_skel_put_entries(msg->content.entries);
+                    entry_free_list(msg->content.entries);
+                    if(retVal != -1) {
                         msg->opcode ++;
                         msg->c_type = CT_RESULT;
+                        msg->content.result = retVal;
                     }
                     else {
+                        msg->opcode = OP_RT_ERROR;
+                        msg->c_type = CT_RESULT;
+                        msg->content.result = -1;
+                    }
+                }
+                else if(msg->content.entry) {
+                    entry = msg->content.entry;
+                    newer = (msg->c_type == CT_NEWER);
+                    if((winner = table_skel_put(entry, newer)) == -1) {
 						// Deu erro pq ficamos sem espaço de log.
-						//cria um ficheiro temporário com o estado da tabela
-						if(pmanager_store_table(sharedPtable->pmanager, sharedPtable->table) < 0) {
-							ERROR("persistent_table: pmanager_store_table");
-							msg->opcode = OP_RT_ERROR;
-							msg->c_type = CT_RESULT;
-							msg->content.result = -1;
-						}
-						
-						//cria um ficheiro temporário com o estado da tabela
-						if(pmanager_rotate_log(sharedPtable->pmanager) != 0) {
-							ERROR("persistent_table: pmanager_rotate_log");
-							msg->opcode = OP_RT_ERROR;
-							msg->c_type = CT_RESULT;
-							msg->content.result = -1;
-						}
-						if((retVal = ptable_put(sharedPtable, entry->key, entry->value)) != -1) {
-							msg->content.result = retVal;
-							msg->opcode ++;
-							msg->c_type = CT_RESULT;
-						} else {
-							msg->opcode = OP_RT_ERROR;
-							msg->c_type = CT_RESULT;
-							msg->content.result = -1;
+						//guarda o estado da tabela e limpa o log
+						if(ptable_checkpoint(sharedPtable) != 0) {
+							ERROR("persistent_table: ptable_checkpoint");
 						}
+						winner = table_skel_put(entry, newer);
+                    }
+                    if(winner != -1) {
+                        msg->opcode ++;
+                        if(newer) {
+                            msg->c_type = CT_TIMESTAMP;
+                            msg->content.timestamp = winner;
+                        }
+                        else {
+                            msg->c_type = CT_RESULT;
+                            msg->content.result = 0;
+                        }
+                    }
+                    else {
+                        msg->opcode = OP_RT_ERROR;
+                        msg->c_type = CT_RESULT;
+                        msg->content.result = -1;
                     }
                     entry_destroy(entry);
                 }
@@ -230,6 +394,57 @@ int invoke(struct message_t *msg) {
 				free(key);
             break;
 
+            case OP_RT_FILTER:
+                // ptable_get_filter: (struct ptable_t*) -> (struct data_t*)
+                if((msg->content.value = ptable_get_filter(sharedPtable))) {
+                    msg->opcode ++;
+                    msg->c_type = CT_VALUE;
+                }
+                else {
+                    msg->opcode = OP_RT_ERROR;
+                    msg->c_type = CT_RESULT;
+                    msg->content.result = -1;
+                }
+            break;
+
+            case OP_RT_MERKLE:
+                // Um nó interno da árvore de Merkle responde com os hashes
+                // dos descendentes, uma folha com as suas entradas; o pedido
+                // traz também a vista (ver MERKLE_REQUEST())
+                view = MERKLE_REQUEST_VIEW(msg->content.result);
+                node = MERKLE_REQUEST_NODE(msg->content.result);
+                if(node >= MERKLE_FIRST_LEAF &&
+                   (msg->content.entries = ptable_get_merkle_entries(sharedPtable, view, node))) {
+                    msg->opcode ++;
+                    msg->c_type = CT_ENTRIES;
+                }
+                else if(node < MERKLE_FIRST_LEAF &&
+                        (msg->content.value = ptable_get_merkle(sharedPtable, view, node))) {
+                    msg->opcode ++;
+                    msg->c_type = CT_VALUE;
+                }
+                else {
+                    msg->opcode = OP_RT_ERROR;
+                    msg->c_type = CT_RESULT;
+                    msg->content.result = -1;
+                }
+            break;
+
+            case OP_RT_SYNC:
+                // Um servidor a arrancar pede o estado completo: a resposta
+                // leva os tamanhos do checkpoint e do log, que a seguem
+                // pelo socket sem passarem pela memória (sendfile)
+                if((msg->content.value = table_skel_snapshot())) {
+                    msg->opcode ++;
+                    msg->c_type = CT_VALUE;
+                }
+                else {
+                    msg->opcode = OP_RT_ERROR;
+                    msg->c_type = CT_RESULT;
+                    msg->content.result = -1;
+                }
+            break;
+
             default:
                 ERROR("opcode");
                 msg->opcode = OP_RT_ERROR;
@@ -237,6 +452,15 @@ int invoke(struct message_t *msg) {
                 msg->content.result = -1;
             break;
         }
+        pthread_rwlock_unlock(&sharedLock);
+
+        //a resposta a uma escrita só segue depois de a operação estar no log,
+        //mas a espera é feita sem o lock para os lotes juntarem vários fios
+        if(exclusive && ptable_sync(sharedPtable) != 0 && msg->opcode != OP_RT_ERROR) {
+            msg->opcode = OP_RT_ERROR;
+            msg->c_type = CT_RESULT;
+            msg->content.result = -1;
+        }
     }
     else {
         ERROR("NULL sharedPtable");
@@ -245,6 +469,110 @@ int invoke(struct message_t *msg) {
     return retVal;
 }
 
-void table_skel_collect() {
-	ptable_collect_garbage(sharedPtable);
-}
\ No newline at end of file
+/*
+ * Remove os valores apagados já expirados, durante no máximo budget_usec
+ * microsegundos.
+ * Retorna o número de entradas removidas ou -1 em caso de erro.
+ */
+int table_skel_collect(long budget_usec) {
+	int collected, due;
+	// Só se pede o trinco de escrita se houver tombstones expirados
+	pthread_rwlock_rdlock(&sharedLock);
+	due = ptable_tombstones_due(sharedPtable);
+	pthread_rwlock_unlock(&sharedLock);
+	if(!due) {
+		return 0;
+	}
+	pthread_rwlock_wrlock(&sharedLock);
+	collected = ptable_collect_tombstones(sharedPtable, budget_usec);
+	pthread_rwlock_unlock(&sharedLock);
+	ptable_sync(sharedPtable);
+	return collected;
+}
+
+/*
+ * Remove as chaves cujo prazo já passou.
+ * Retorna o número de chaves removidas ou -1 em caso de erro.
+ */
+int table_skel_expire() {
+	int expired, due;
+	// Só se pede o trinco de escrita se a roda tiver prazos a disparar
+	pthread_rwlock_rdlock(&sharedLock);
+	due = ptable_expire_due(sharedPtable);
+	pthread_rwlock_unlock(&sharedLock);
+	if(!due) {
+		return 0;
+	}
+	pthread_rwlock_wrlock(&sharedLock);
+	expired = ptable_expire_keys(sharedPtable);
+	pthread_rwlock_unlock(&sharedLock);
+	ptable_sync(sharedPtable);
+	return expired;
+}
+
+/*
+ * Devolve a memória ocupada pela tabela e os contadores de evicções (ver
+ * table_memory_stats()).
+ * Retorna 0 (ok) ou -1 (tabela sem contabilidade, e.g. motor LSM).
+ */
+int table_skel_memory_stats(long *bytes, long *evictions, long *evicted_bytes) {
+	if(!sharedPtable || !sharedPtable->table) {
+		return -1;
+	}
+	pthread_rwlock_rdlock(&sharedLock);
+	table_memory_stats(sharedPtable->table, bytes, evictions, evicted_bytes);
+	pthread_rwlock_unlock(&sharedLock);
+	return 0;
+}
+
+/*
+ * Passa a manter a árvore de Merkle da tabela.
+ * Retorna 0 (OK) ou -1 (erro).
+ */
+int table_skel_use_merkle(struct hring_t *ring, int replicas, int self) {
+	int retVal;
+	pthread_rwlock_wrlock(&sharedLock);
+	retVal = ptable_use_merkle(sharedPtable, ring, replicas, self);
+	pthread_rwlock_unlock(&sharedLock);
+	return retVal;
+}
+
+/*
+ * Devolve os hashes dos descendentes do nó node da vista view da árvore de
+ * Merkle. Em caso de erro devolve NULL.
+ */
+struct data_t *table_skel_get_merkle(int view, int node) {
+	struct data_t *hashes;
+	pthread_rwlock_rdlock(&sharedLock);
+	hashes = ptable_get_merkle(sharedPtable, view, node);
+	pthread_rwlock_unlock(&sharedLock);
+	return hashes;
+}
+
+/*
+ * Devolve cópias das entradas da folha leaf da vista view da árvore de
+ * Merkle. Em caso de erro devolve NULL.
+ */
+struct entry_t **table_skel_get_merkle_entries(int view, int leaf) {
+	struct entry_t **entries;
+	pthread_rwlock_rdlock(&sharedLock);
+	entries = ptable_get_merkle_entries(sharedPtable, view, leaf);
+	pthread_rwlock_unlock(&sharedLock);
+	return entries;
+}
+
+/*
+ * Escreve o lote entries, cada entrada só se não for mais antiga que o
+ * valor guardado.
+ * Retorna quantas entradas ficaram guardadas ou -1 em caso de erro.
+ */
+int table_skel_apply(struct entry_t **entries) {
+	int written;
+	pthread_rwlock_wrlock(&sharedLock);
+	written = table_skel_put_entries(entries);
+	pthread_rwlock_unlock(&sharedLock);
+	if(ptable_sync(sharedPtable) != 0) {
+		return -1;
+	}
+	return written;
+}
@@ -3,15 +3,23 @@
 
 #include "message.h"
 
+struct hring_t; /* Definida em hash_ring-private.h */
+
 /*
  * Inicia o skeleton da tabela.
  * O main() do servidor deve chamar este método antes de usar a
  * funço invoke(). O parâmetro n_lists define o número de listas a serem
  * usadas pela tabela mantida no servidor. O parâmetro filename corresponde ao
- * nome a ser usado nos ficheiros de log e checkpoint.
+ * nome a ser usado nos ficheiros de log e checkpoint. O parâmetro engine
+ * escolhe o motor de armazenamento (ENGINE_MEMORY ou ENGINE_LSM). O parâmetro
+ * mem_limit limita a memória (em bytes) da tabela com ENGINE_MEMORY, fazendo
+ * evicção das entradas menos usadas (0 = sem limite). O parâmetro threads
+ * indica quantos fios vão chamar invoke() em simultâneo; com mais de um, o
+ * log passa a ser escrito em lotes (group commit). Com use_uring o log é
+ * escrito através de um io_uring, se disponível.
  * Retorna 0 (OK) ou -1 (erro, por exemplo OUT OF MEMORY).
  */
-int table_skel_init(int n_lists, char *filename);
+int table_skel_init(int n_lists, char *filename, int engine, long mem_limit, int threads, int use_uring);
 
 /*
  * Serve para libertar toda a memória alocada pela função anterior.
@@ -20,11 +28,57 @@ int table_skel_destroy();
 
 /*
  * Executar uma função (indicada pelo opcode na msg) e retorna o resultado na
- * própria struct msg.
+ * própria struct msg. Pode ser chamada por vários fios ao mesmo tempo.
  * Retorna 0 (OK) ou -1 (erro, por exemplo, tabela nao inicializada).
  */
 int invoke(struct message_t *msg);
 
-void table_skel_collect();
+/*
+ * Remove os valores apagados já expirados, durante no máximo budget_usec
+ * microsegundos.
+ * Retorna o número de entradas removidas ou -1 em caso de erro.
+ */
+int table_skel_collect(long budget_usec);
+
+/*
+ * Remove as chaves cujo prazo já passou.
+ * Retorna o número de chaves removidas ou -1 em caso de erro.
+ */
+int table_skel_expire();
+
+/*
+ * Devolve a memória ocupada pela tabela e os contadores de evicções (ver
+ * table_memory_stats()).
+ * Retorna 0 (ok) ou -1 (tabela sem contabilidade, e.g. motor LSM).
+ */
+int table_skel_memory_stats(long *bytes, long *evictions, long *evicted_bytes);
+
+/*
+ * Passa a manter a árvore de Merkle da tabela (ver ptable_use_merkle()), que
+ * os outros servidores pedem com OP_RT_MERKLE para a anti-entropia. Com as
+ * chaves repartidas, ring (ou NULL), replicas e self definem as vistas dos
+ * outros servidores (ver merkle_partition()).
+ * Retorna 0 (OK) ou -1 (erro, e.g. motor LSM).
+ */
+int table_skel_use_merkle(struct hring_t *ring, int replicas, int self);
+
+/*
+ * Devolve os hashes dos descendentes do nó node da vista view da árvore de
+ * Merkle da tabela (ver merkle_get_hashes()). Em caso de erro devolve NULL.
+ */
+struct data_t *table_skel_get_merkle(int view, int node);
+
+/*
+ * Devolve cópias das entradas da folha leaf da vista view da árvore de
+ * Merkle da tabela. Em caso de erro devolve NULL.
+ */
+struct entry_t **table_skel_get_merkle_entries(int view, int leaf);
+
+/*
+ * Escreve o lote entries (array terminado em NULL), cada entrada só se não
+ * for mais antiga que o valor guardado (como um OP_RT_PUT com CT_ENTRIES).
+ * Retorna quantas entradas ficaram guardadas ou -1 em caso de erro.
+ */
+int table_skel_apply(struct entry_t **entries);
 
 #endif
\ No newline at end of file
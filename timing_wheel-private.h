@@ -0,0 +1,55 @@
+/*
+ * File:   timing_wheel-private.h
+ *
+ * Define a estrutura de uma roda de temporizadores hierárquica.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _TIMING_WHEEL_PRIVATE_H
+#define _TIMING_WHEEL_PRIVATE_H
+
+/*
+ * Cada nível tem TWHEEL_SLOTS posições; uma posição do nível n cobre
+ * TWHEEL_SLOTS^n segundos. Com 4 níveis de 64 posições a roda cobre ~194
+ * dias; prazos mais longos ficam no último nível e voltam a ser colocados
+ * quando essa posição é esvaziada.
+ */
+#define TWHEEL_BITS 6
+#define TWHEEL_SLOTS (1 << TWHEEL_BITS)
+#define TWHEEL_MASK (TWHEEL_SLOTS - 1)
+#define TWHEEL_LEVELS 4
+
+/*
+ * Define um temporizador.
+ *
+ * char *key => cópia da chave a expirar
+ * long expires => instante em que dispara
+ * struct twheel_timer_t *next => próximo temporizador da mesma posição
+ */
+struct twheel_timer_t {
+    char *key;
+    long expires;
+    struct twheel_timer_t *next;
+};
+
+/*
+ * Define a estrutura da roda.
+ *
+ * long now => último segundo já processado
+ * int num_timers => número de temporizadores pendentes
+ * struct twheel_timer_t *slots => listas de temporizadores de cada posição
+ *                                 de cada nível
+ */
+struct twheel_t {
+    long now;
+    int num_timers;
+    struct twheel_timer_t *slots[TWHEEL_LEVELS][TWHEEL_SLOTS];
+};
+
+/*
+ * Coloca o temporizador na posição certa face ao relógio actual da roda.
+ */
+void twheel_place(struct twheel_t *wheel, struct twheel_timer_t *timer);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ * File:   timing_wheel.c
+ *
+ * Implementação de uma roda de temporizadores hierárquica, usada para expirar
+ * chaves com prazo sem percorrer a tabela.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include "utils.h"
+#include "timing_wheel.h"
+#include "timing_wheel-private.h"
+
+/*
+ * Cria uma roda de temporizadores hierárquica com granularidade de um
+ * segundo, cujo relógio começa em now (segundos desde a época).
+ * Retorna NULL em caso de erro.
+ */
+struct twheel_t *twheel_create(long now) {
+
+    struct twheel_t *wheel;
+
+    if((wheel = (struct twheel_t *) calloc(1, sizeof(struct twheel_t))) == NULL) {
+        ERROR("calloc wheel");
+        return NULL;
+    }
+    wheel->now = now;
+    return wheel;
+
+}
+
+/*
+ * Liberta toda a memória da roda (os temporizadores pendentes não disparam).
+ */
+void twheel_destroy(struct twheel_t *wheel) {
+
+    struct twheel_timer_t *timer, *next;
+    int level, slot;
+
+    if(wheel) {
+        for(level = 0; level < TWHEEL_LEVELS; level++) {
+            for(slot = 0; slot < TWHEEL_SLOTS; slot++) {
+                for(timer = wheel->slots[level][slot]; timer; timer = next) {
+                    next = timer->next;
+                    free(timer->key);
+                    free(timer);
+                }
+            }
+        }
+        free(wheel);
+    }
+
+}
+
+/*
+ * Coloca o temporizador na posição certa face ao relógio actual da roda.
+ */
+void twheel_place(struct twheel_t *wheel, struct twheel_timer_t *timer) {
+
+    // O próximo segundo a processar é wheel->now + 1
+    long base = wheel->now + 1, target = timer->expires, delta;
+    int level, slot;
+
+    // Um prazo já passado dispara no próximo segundo
+    if(target < base) {
+        target = base;
+    }
+    delta = target - base;
+    if(delta >= (1L << (TWHEEL_LEVELS * TWHEEL_BITS))) {
+        // Fora do alcance: fica na última posição que a roda ainda cobre
+        target = base + (1L << (TWHEEL_LEVELS * TWHEEL_BITS)) - 1;
+        delta = target - base;
+    }
+
+    // O nível é o primeiro cuja amplitude cobre o tempo que falta
+    for(level = 0; level < TWHEEL_LEVELS - 1; level++) {
+        if(delta < (1L << ((level + 1) * TWHEEL_BITS))) {
+            break;
+        }
+    }
+    slot = (int) ((target >> (level * TWHEEL_BITS)) & TWHEEL_MASK);
+
+    timer->next = wheel->slots[level][slot];
+    wheel->slots[level][slot] = timer;
+
+}
+
+/*
+ * Regista um temporizador para key (a chave é *COPIADA*) que dispara quando
+ * o relógio da roda chegar a expires. Um prazo já passado dispara no próximo
+ * segundo. Custo O(1).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int twheel_add(struct twheel_t *wheel, char *key, long expires) {
+
+    struct twheel_timer_t *timer;
+
+    if(wheel == NULL || key == NULL) {
+        ERROR("NULL wheel or key");
+        return -1;
+    }
+    if((timer = (struct twheel_timer_t *) malloc(sizeof(struct twheel_timer_t))) == NULL) {
+        ERROR("malloc timer");
+        return -1;
+    }
+    if((timer->key = strdup(key)) == NULL) {
+        ERROR("strdup key");
+        free(timer);
+        return -1;
+    }
+    timer->expires = expires;
+
+    twheel_place(wheel, timer);
+    wheel->num_timers++;
+    return 0;
+
+}
+
+/*
+ * Avança o relógio da roda até now, chamando expire para cada temporizador
+ * que dispara. Cada temporizador é tratado um número constante de vezes
+ * (uma por nível), independentemente do número de chaves da tabela.
+ * Retorna o número de temporizadores disparados ou -1 em caso de erro.
+ */
+int twheel_advance(struct twheel_t *wheel, long now, twheel_expire_f expire, void *arg) {
+
+    struct twheel_timer_t *timer, *next;
+    long tick;
+    int level, slot, fired = 0;
+
+    if(wheel == NULL || expire == NULL) {
+        ERROR("NULL wheel or expire");
+        return -1;
+    }
+
+    while(wheel->now < now) {
+        tick = wheel->now + 1;
+
+        // Quando um nível dá a volta, a posição seguinte do nível acima
+        // desce para os níveis inferiores
+        for(level = 1; level < TWHEEL_LEVELS; level++) {
+            if((tick & ((1L << (level * TWHEEL_BITS)) - 1)) != 0) {
+                break;
+            }
+            slot = (int) ((tick >> (level * TWHEEL_BITS)) & TWHEEL_MASK);
+            timer = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            for(; timer; timer = next) {
+                next = timer->next;
+                twheel_place(wheel, timer);
+            }
+        }
+
+        // A lista é retirada da roda antes de chamar expire
+        slot = (int) (tick & TWHEEL_MASK);
+        timer = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->now = tick;
+        for(; timer; timer = next) {
+            next = timer->next;
+            if(timer->expires > tick) {
+                // Prazo para lá do alcance da roda: volta a ser colocado
+                twheel_place(wheel, timer);
+                continue;
+            }
+            expire(timer->key, timer->expires, arg);
+            free(timer->key);
+            free(timer);
+            wheel->num_timers--;
+            fired++;
+        }
+    }
+    return fired;
+
+}
+
+/*
+ * Indica se twheel_advance(wheel, now, ...) teria algum temporizador a
+ * disparar, sem alterar a roda.
+ * Retorna 1 (sim), 0 (não) ou -1 (erro).
+ */
+int twheel_due(struct twheel_t *wheel, long now) {
+
+    long tick;
+    int level;
+
+    if(wheel == NULL) {
+        ERROR("NULL wheel");
+        return -1;
+    }
+    if(now - wheel->now >= TWHEEL_SLOTS) {
+        return 1;
+    }
+    if(wheel->num_timers == 0) {
+        return 0;
+    }
+    for(tick = wheel->now + 1; tick <= now; tick++) {
+        if(wheel->slots[0][tick & TWHEEL_MASK]) {
+            return 1;
+        }
+        // Nas voltas do primeiro nível desce a posição seguinte do nível acima
+        for(level = 1; level < TWHEEL_LEVELS; level++) {
+            if((tick & ((1L << (level * TWHEEL_BITS)) - 1)) != 0) {
+                break;
+            }
+            if(wheel->slots[level][(tick >> (level * TWHEEL_BITS)) & TWHEEL_MASK]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+
+}
+
+/*
+ * Devolve o número de temporizadores pendentes.
+ */
+int twheel_size(struct twheel_t *wheel) {
+
+    return wheel ? wheel->num_timers : -1;
+
+}
@@ -0,0 +1,55 @@
+#ifndef _TIMING_WHEEL_H
+#define _TIMING_WHEEL_H
+
+struct twheel_t; /* Definida em timing_wheel-private.h */
+
+/*
+ * Função chamada por twheel_advance() para cada chave cujo prazo passou.
+ * expires é o prazo com que a chave foi registada e arg o argumento passado
+ * a twheel_advance().
+ */
+typedef void (*twheel_expire_f)(char *key, long expires, void *arg);
+
+/*
+ * Cria uma roda de temporizadores hierárquica com granularidade de um
+ * segundo, cujo relógio começa em now (segundos desde a época).
+ * Retorna NULL em caso de erro.
+ */
+struct twheel_t *twheel_create(long now);
+
+/*
+ * Liberta toda a memória da roda (os temporizadores pendentes não disparam).
+ */
+void twheel_destroy(struct twheel_t *wheel);
+
+/*
+ * Regista um temporizador para key (a chave é *COPIADA*) que dispara quando
+ * o relógio da roda chegar a expires. Um prazo já passado dispara no próximo
+ * segundo. Custo O(1).
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int twheel_add(struct twheel_t *wheel, char *key, long expires);
+
+/*
+ * Avança o relógio da roda até now, chamando expire para cada temporizador
+ * que dispara. Cada temporizador é tratado um número constante de vezes
+ * (uma por nível), independentemente do número de chaves da tabela.
+ * Retorna o número de temporizadores disparados ou -1 em caso de erro.
+ */
+int twheel_advance(struct twheel_t *wheel, long now, twheel_expire_f expire, void *arg);
+
+/*
+ * Indica se twheel_advance(wheel, now, ...) teria algum temporizador a
+ * disparar, sem alterar a roda (basta um trinco de leitura). Só olha para as
+ * posições entre o relógio da roda e now; se o relógio estiver atrasado uma
+ * volta inteira do primeiro nível responde 1, para que a roda avance.
+ * Retorna 1 (sim), 0 (não) ou -1 (erro).
+ */
+int twheel_due(struct twheel_t *wheel, long now);
+
+/*
+ * Devolve o número de temporizadores pendentes.
+ */
+int twheel_size(struct twheel_t *wheel);
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * File:   uring-private.h
+ *
+ * Define a estrutura de um io_uring usado sem liburing: os anéis de
+ * submissão e de conclusão partilhados com o kernel e o grupo de buffers
+ * registado para as leituras.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+#ifndef _URING_PRIVATE_H
+#define _URING_PRIVATE_H
+
+#include <linux/io_uring.h>
+
+/*
+ * Define o io_uring.
+ *
+ * int fd => descritor devolvido por io_uring_setup()
+ * void *sqMap, *cqMap => zonas mapeadas dos anéis (iguais com
+ *                        IORING_FEAT_SINGLE_MMAP)
+ * size_t sqMapSize, cqMapSize => tamanho das zonas mapeadas
+ * unsigned *sqHead, *sqTail, *sqMask, *sqArray => campos do anel de submissão
+ * struct io_uring_sqe *sqes => posições de submissão
+ * size_t sqesSize => tamanho mapeado de sqes
+ * unsigned sqeTail => próxima posição a preparar (ainda não publicada)
+ * unsigned sqeHead => primeira posição preparada e não submetida
+ * unsigned *cqHead, *cqTail, *cqMask => campos do anel de conclusão
+ * struct io_uring_cqe *cqes => conclusões
+ * struct io_uring_buf_ring *bufRing => anel do grupo de buffers registado
+ * char *buffers => memória dos buffers do grupo
+ * int bufCount, bufSize => número e tamanho dos buffers do grupo
+ * int bufGroup => identificador do grupo
+ */
+struct uring_t {
+    int fd;
+    void *sqMap;
+    void *cqMap;
+    size_t sqMapSize;
+    size_t cqMapSize;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned sqeTail;
+    unsigned sqeHead;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *bufRing;
+    char *buffers;
+    int bufCount;
+    int bufSize;
+    int bufGroup;
+};
+
+#endif
@@ -0,0 +1,270 @@
+/*
+ * File:   uring.c
+ *
+ * Acesso mínimo ao io_uring do Linux através das chamadas ao sistema, usado
+ * pelo servidor para juntar várias operações de rede e de log numa única
+ * entrada no kernel.
+ *
+ * Author: sd001 > Bruno Neves, n.º 31614
+ *               > Vasco Orey,  n.º 32550
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "utils.h"
+#include "uring.h"
+#include "uring-private.h"
+
+/*
+ * Cria um io_uring com pelo menos entries posições de submissão, usando
+ * directamente as chamadas ao sistema (sem liburing).
+ * Retorna NULL em caso de erro (e.g., kernel sem io_uring ou io_uring
+ * desactivado), caso em que o chamador deve usar as chamadas clássicas.
+ */
+struct uring_t *uring_create(unsigned entries) {
+
+    struct io_uring_params params;
+    struct uring_t *ring;
+    char *sq, *cq;
+
+    if((ring = (struct uring_t *) calloc(1, sizeof(struct uring_t))) == NULL) {
+        ERROR("calloc ring");
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CLAMP;
+    if((ring->fd = (int) syscall(__NR_io_uring_setup, entries, &params)) == -1) {
+        // Sem io_uring não é um erro: o servidor usa epoll/write()
+        free(ring);
+        return NULL;
+    }
+
+    ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cqMapSize > ring->sqMapSize) {
+            ring->sqMapSize = ring->cqMapSize;
+        }
+        ring->cqMapSize = ring->sqMapSize;
+    }
+
+    ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sqMap == MAP_FAILED) {
+        LOG_PERROR("mmap sq");
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqMap = ring->sqMap;
+    }
+    else if((ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        LOG_PERROR("mmap cq");
+        munmap(ring->sqMap, ring->sqMapSize);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    if((ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, ring->fd,
+                                                  IORING_OFF_SQES)) == MAP_FAILED) {
+        LOG_PERROR("mmap sqes");
+        if(ring->cqMap != ring->sqMap) {
+            munmap(ring->cqMap, ring->cqMapSize);
+        }
+        munmap(ring->sqMap, ring->sqMapSize);
+        close(ring->fd);
+        free(ring);
+        return NULL;
+    }
+
+    sq = (char *) ring->sqMap;
+    ring->sqHead = (unsigned *) (sq + params.sq_off.head);
+    ring->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *) (sq + params.sq_off.array);
+    cq = (char *) ring->cqMap;
+    ring->cqHead = (unsigned *) (cq + params.cq_off.head);
+    ring->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->sqeTail = ring->sqeHead = *ring->sqTail;
+    return ring;
+
+}
+
+/*
+ * Liberta o io_uring (as operações pendentes são canceladas pelo kernel).
+ */
+void uring_destroy(struct uring_t *ring) {
+
+    if(ring) {
+        if(ring->bufRing) {
+            munmap(ring->bufRing, ring->bufCount * sizeof(struct io_uring_buf));
+            free(ring->buffers);
+        }
+        munmap(ring->sqes, ring->sqesSize);
+        if(ring->cqMap != ring->sqMap) {
+            munmap(ring->cqMap, ring->cqMapSize);
+        }
+        munmap(ring->sqMap, ring->sqMapSize);
+        close(ring->fd);
+        free(ring);
+    }
+
+}
+
+/*
+ * Devolve a próxima posição de submissão, já limpa, ou NULL se estiverem
+ * todas ocupadas (é preciso chamar uring_submit() primeiro).
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring) {
+
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+    if(ring->sqeTail - head > *ring->sqMask) {
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sqeTail & *ring->sqMask];
+    ring->sqeTail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+
+}
+
+/*
+ * Submete as operações preparadas e espera até haver pelo menos wait_nr
+ * conclusões (0 = não espera).
+ * Retorna o número de operações submetidas ou -1 em caso de erro (errno).
+ */
+int uring_submit(struct uring_t *ring, unsigned wait_nr) {
+
+    unsigned tail = *ring->sqTail, toSubmit = ring->sqeTail - ring->sqeHead;
+    int ret;
+
+    // Publica as posições preparadas (o array é a identidade)
+    for(; ring->sqeHead != ring->sqeTail; ring->sqeHead++, tail++) {
+        ring->sqArray[tail & *ring->sqMask] = ring->sqeHead & *ring->sqMask;
+    }
+    __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+
+    // Um sinal a meio da espera não perde nada: o que ainda não foi
+    // consumido pelo kernel volta a ser submetido
+    do {
+        ret = (int) syscall(__NR_io_uring_enter, ring->fd, toSubmit, wait_nr,
+                            wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        toSubmit = tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    } while(ret == -1 && errno == EINTR);
+    return ret;
+
+}
+
+/*
+ * Devolve a próxima conclusão por tratar ou NULL se não houver nenhuma.
+ * Depois de tratada deve ser chamada uring_cqe_seen().
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring) {
+
+    unsigned head = *ring->cqHead;
+
+    if(head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & *ring->cqMask];
+
+}
+
+/*
+ * Marca como tratada a conclusão devolvida por uring_peek_cqe().
+ */
+void uring_cqe_seen(struct uring_t *ring) {
+
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+
+}
+
+/*
+ * Regista no kernel um grupo bgid de count buffers (count potência de 2) de
+ * size bytes cada, de onde as leituras com IOSQE_BUFFER_SELECT escolhem o
+ * buffer a usar.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int uring_register_buffers(struct uring_t *ring, int bgid, int count, int size) {
+
+    struct io_uring_buf_reg reg;
+    int bid;
+
+    if(ring == NULL || ring->bufRing || count <= 0 || (count & (count - 1)) != 0) {
+        ERROR("invalid ring or buffer count");
+        return -1;
+    }
+
+    // O anel tem de estar alinhado à página: vem de mmap()
+    ring->bufRing = (struct io_uring_buf_ring *) mmap(NULL, count * sizeof(struct io_uring_buf),
+                                                       PROT_READ | PROT_WRITE,
+                                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->bufRing == MAP_FAILED) {
+        LOG_PERROR("mmap buffer ring");
+        ring->bufRing = NULL;
+        return -1;
+    }
+    if((ring->buffers = (char *) malloc((size_t) count * size)) == NULL) {
+        ERROR("malloc buffers");
+        munmap(ring->bufRing, count * sizeof(struct io_uring_buf));
+        ring->bufRing = NULL;
+        return -1;
+    }
+    ring->bufCount = count;
+    ring->bufSize = size;
+    ring->bufGroup = bgid;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->bufRing;
+    reg.ring_entries = count;
+    reg.bgid = bgid;
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        // Kernel anterior ao 5.19: sem grupos de buffers
+        munmap(ring->bufRing, count * sizeof(struct io_uring_buf));
+        free(ring->buffers);
+        ring->bufRing = NULL;
+        ring->buffers = NULL;
+        return -1;
+    }
+
+    ring->bufRing->tail = 0;
+    for(bid = 0; bid < count; bid++) {
+        uring_recycle_buffer(ring, bid);
+    }
+    return 0;
+
+}
+
+/*
+ * Devolve o endereço do buffer bid do grupo registado.
+ */
+char *uring_buffer(struct uring_t *ring, int bid) {
+
+    return ring->buffers + (size_t) bid * ring->bufSize;
+
+}
+
+/*
+ * Devolve o buffer bid ao grupo registado, depois de usado.
+ */
+void uring_recycle_buffer(struct uring_t *ring, int bid) {
+
+    unsigned short tail = ring->bufRing->tail;
+    struct io_uring_buf *buf = &ring->bufRing->bufs[tail & (ring->bufCount - 1)];
+
+    buf->addr = (unsigned long) uring_buffer(ring, bid);
+    buf->len = ring->bufSize;
+    buf->bid = bid;
+    __atomic_store_n(&ring->bufRing->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+
+}
@@ -0,0 +1,63 @@
+#ifndef _URING_H
+#define _URING_H
+
+#include <linux/io_uring.h>
+
+struct uring_t; /* Definida em uring-private.h */
+
+/*
+ * Cria um io_uring com pelo menos entries posições de submissão, usando
+ * directamente as chamadas ao sistema (sem liburing).
+ * Retorna NULL em caso de erro (e.g., kernel sem io_uring ou io_uring
+ * desactivado), caso em que o chamador deve usar as chamadas clássicas.
+ */
+struct uring_t *uring_create(unsigned entries);
+
+/*
+ * Liberta o io_uring (as operações pendentes são canceladas pelo kernel).
+ */
+void uring_destroy(struct uring_t *ring);
+
+/*
+ * Devolve a próxima posição de submissão, já limpa, ou NULL se estiverem
+ * todas ocupadas (é preciso chamar uring_submit() primeiro).
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring);
+
+/*
+ * Submete as operações preparadas e espera até haver pelo menos wait_nr
+ * conclusões (0 = não espera).
+ * Retorna o número de operações submetidas ou -1 em caso de erro (errno).
+ */
+int uring_submit(struct uring_t *ring, unsigned wait_nr);
+
+/*
+ * Devolve a próxima conclusão por tratar ou NULL se não houver nenhuma.
+ * Depois de tratada deve ser chamada uring_cqe_seen().
+ */
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring);
+
+/*
+ * Marca como tratada a conclusão devolvida por uring_peek_cqe().
+ */
+void uring_cqe_seen(struct uring_t *ring);
+
+/*
+ * Regista no kernel um grupo bgid de count buffers (count potência de 2) de
+ * size bytes cada, de onde as leituras com IOSQE_BUFFER_SELECT escolhem o
+ * buffer a usar.
+ * Retorna 0 (ok) ou -1 (erro).
+ */
+int uring_register_buffers(struct uring_t *ring, int bgid, int count, int size);
+
+/*
+ * Devolve o endereço do buffer bid do grupo registado.
+ */
+char *uring_buffer(struct uring_t *ring, int bid);
+
+/*
+ * Devolve o buffer bid ao grupo registado, depois de usado.
+ */
+void uring_recycle_buffer(struct uring_t *ring, int bid);
+
+#endif
@@ -32,10 +32,11 @@
 
 #include <assert.h>
 
-// Para usar: ERROR("Malloc"); ira fazer um fprintf da linha e func que chamaram, com a string "Malloc"
-// Trocar comentarios para entregar o projecto sem que as nossas mensagens de erro para debug sejam impressas.
-#define ERROR(a) fprintf( stderr, "%s : %d : "#a"\n", __FUNCTION__, __LINE__)
-//#define ERROR(a)
+#include "logger.h"
+
+// Para usar: ERROR("Malloc"); ira registar no logger (nivel ERROR) a linha e func que chamaram, com a string "Malloc"
+// Compilar com -DLOG_LEVEL=-1 para entregar o projecto sem que as nossas mensagens de erro para debug sejam impressas.
+#define ERROR(a) LOG_ERROR("%s : %d : "#a, __FUNCTION__, __LINE__)
 
 #define PRINT_LATENCIES 0
 #define ZERO "MA=="